@@ -0,0 +1,182 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "arq.h"
+#include "print.h"
+
+_ARQ_CONFIG::_ARQ_CONFIG() : enable(false), deadline_ms(ARQ_DEADLINE_MSEC), port(0), all(false) {}
+
+// deadline=ms,port=N,proto=udp|all
+bool arq_parse_option(ARQ_CONFIG& conf, char *subopts) {
+	enum { OPT_DEADLINE, OPT_PORT, OPT_PROTO };
+	char *const	tokens[] = {
+		(char*)"deadline", (char*)"port", (char*)"proto", NULL
+	};
+	char	*value;
+
+	conf.enable = true;
+	while (*subopts != '\0') {
+		const int	opt = getsubopt(&subopts, tokens, &value);
+
+		if (opt < 0 || value == NULL) {
+			print_error("invalid ARQ option : %s\n", value ? value : "(null)");
+			return false;
+		}
+		switch (opt) {
+		case OPT_DEADLINE:	conf.deadline_ms = strtoul(value, NULL, 10); break;
+		case OPT_PORT:		conf.port = (uint16_t)strtoul(value, NULL, 10); break;
+		case OPT_PROTO:
+			if      (strcmp(value, "udp") == 0) { conf.all = false; }
+			else if (strcmp(value, "all") == 0) { conf.all = true; }
+			else {
+				print_error("invalid ARQ protocol : %s\n", value);
+				return false;
+			}
+			break;
+		}
+	}
+	return true;
+}
+
+/*
+ * 送信側
+ */
+static_assert((ARQ_STORE_SIZE & (ARQ_STORE_SIZE - 1)) == 0, "ARQ_STORE_SIZE must be a power of two");
+
+arq_store::arq_store() :
+	entries(new ARQ_ENTRY[ARQ_STORE_SIZE]), stored(0), resent(0), expired(0), unknown(0) {
+	for (uint32_t i = 0; i < ARQ_STORE_SIZE; i++) { entries[i].sent_ns = 0; }
+}
+
+void arq_store::push(uint32_t seq_all, const uint8_t *data, uint16_t length, uint64_t now_ns, uint64_t deadline_ns) {
+	ARQ_ENTRY&	e = entries[seq_all & (ARQ_STORE_SIZE - 1)];
+
+	e.sent_ns		= now_ns;
+	e.deadline_ns	= deadline_ns;
+	e.resent_ns		= 0;
+	e.seq_all		= seq_all;
+	e.length		= length;
+	memcpy(e.data, data, length);
+	stored++;
+}
+
+ARQ_ENTRY* arq_store::find(uint32_t seq_all) {
+	ARQ_ENTRY&	e = entries[seq_all & (ARQ_STORE_SIZE - 1)];
+
+	if (e.sent_ns == 0 || e.seq_all != seq_all) { return nullptr; }
+	return &e;
+}
+
+/*
+ * 受信側
+ */
+arq_tracker::arq_tracker() :
+	next_seq(0), started(false), active_until_ns(0), reorder_ns(ARQ_REORDER_MIN_NS),
+	detected(0), nacked(0), repaired(0), given_up(0) {}
+
+void arq_tracker::_Reset(uint32_t seq) {
+	for (const auto& g : gaps) {
+		if (!g.filled) { given_up++; }
+	}
+	gaps.clear();
+	next_seq = seq + 1;
+	started = true;
+}
+
+void arq_tracker::OnRecv(uint32_t seq, bool arq_frame, uint64_t now) {
+	if (arq_frame) { active_until_ns = now + ARQ_ACTIVE_NS; }
+
+	// 相手が ARQ を使っていない間は次の seq_all を追いかけるだけ
+	if (!started || now > active_until_ns) {
+		if (!gaps.empty()) { _Reset(seq); }
+		next_seq = seq + 1;
+		started = true;
+		return;
+	}
+	const int32_t	d = (int32_t)(seq - next_seq);
+
+	if (d > ARQ_MAX_GAP || d < -(int32_t)SEQ_WINDOW_SIZE) {
+		_Reset(seq);
+		return;
+	}
+	if (d >= 0) {
+		for (uint32_t s = next_seq; s != seq; s++) {
+			gaps.push_back({ s, 0, false, now, 0 });
+		}
+		detected += d;
+		next_seq = seq + 1;
+
+		while (gaps.size() > ARQ_MAX_TRACKED) {
+			if (!gaps.front().filled) { given_up++; }
+			gaps.pop_front();
+		}
+		return;
+	}
+	// 遅れて届いたか、送り直されたパケットで抜けが埋まった
+	auto it = std::lower_bound(gaps.begin(), gaps.end(), seq,
+		[](const ARQ_GAP& g, uint32_t s) { return (int32_t)(g.seq - s) < 0; }
+	);
+	if (it == gaps.end() || it->seq != seq || it->filled) { return; }
+
+	it->filled = true;
+	if (it->nacks > 0) {
+		repaired++;
+	}
+	else {
+		// NACK せずに埋まった = 経路間の順序入れ替わり。待ち時間の見積もりに使う（最大値をゆっくり忘れる）
+		const uint64_t	delay = now - it->detected_ns;
+		reorder_ns = (delay > reorder_ns - reorder_ns / 64) ? delay : reorder_ns - reorder_ns / 64;
+	}
+	while (!gaps.empty() && gaps.front().filled) { gaps.pop_front(); }
+}
+
+uint64_t arq_tracker::ReorderWait() const {
+	const uint64_t	w = reorder_ns + reorder_ns / 4;
+
+	if (w < ARQ_REORDER_MIN_NS) { return ARQ_REORDER_MIN_NS; }
+	if (w > ARQ_REORDER_MAX_NS) { return ARQ_REORDER_MAX_NS; }
+	return w;
+}
+
+// NACK すべき抜けを連続する範囲にまとめて ranges に書き、範囲の数を返す
+int arq_tracker::CollectNacks(uint64_t now, NACK_RANGE *ranges, int max_ranges) {
+	const uint64_t	wait = this->ReorderWait();
+	int		n = 0;
+
+	for (auto& g : gaps) {
+		if (g.filled || g.nacks >= ARQ_MAX_NACKS) { continue; }
+		if (now - g.detected_ns < wait) { break; }	// 後ろはもっと新しい
+		if (g.nacks > 0 && now - g.nacked_ns < ARQ_NACK_INTERVAL_NS) { continue; }
+
+		if (n > 0 && ranges[n - 1].start + ranges[n - 1].count == g.seq) {
+			ranges[n - 1].count++;
+		}
+		else if (n < max_ranges) {
+			ranges[n].start = g.seq;
+			ranges[n].count = 1;
+			n++;
+		}
+		else {
+			break;
+		}
+		g.nacks++;
+		g.nacked_ns = now;
+		nacked++;
+	}
+
+	// 最後の NACK からも埋まらなかったものは諦める
+	while (!gaps.empty()) {
+		const ARQ_GAP&	g = gaps.front();
+
+		if (g.filled) { gaps.pop_front(); continue; }
+		if (g.nacks >= ARQ_MAX_NACKS && now - g.nacked_ns >= ARQ_NACK_INTERVAL_NS) {
+			given_up++;
+			gaps.pop_front();
+			continue;
+		}
+		break;
+	}
+	return n;
+}
@@ -0,0 +1,115 @@
+#ifndef	__ARQ_H__
+#define	__ARQ_H__
+
+#include <stdint.h>
+#include <deque>
+#include <memory>
+
+#include "mpudpdef.h"
+
+/*
+ * 選択的再送（ARQ）
+ * 送信側は対象のパケット（既定では UDP 全部）に TUN_FLAG_ARQ を付けて送り、
+ * 直近 ARQ_STORE_SIZE 個を seq_all で引ける形で控えておく。
+ * 受信側は TUN_FLAG_ARQ 付きのパケットが流れている間 seq_all の抜けを監視し、
+ * 経路間の順序の入れ替わりを待っても埋まらない抜けを NACK の範囲にまとめて MODE_CONTROL のフレームで送り返す。
+ * 送信側は NACK されたパケットのうち期限（deadline）内のものだけを、その時点で最も速い経路で送り直す。
+ * seq_all は ARQ の対象外のパケットと共通なので対象外のパケットの抜けも NACK されるが、送信側が無視する。
+ */
+typedef struct _ARQ_CONFIG {
+	bool		enable;
+	uint32_t	deadline_ms;	// 送信からこれ以上経ったパケットは送り直さない
+	uint16_t	port;			// 0 以外なら、送信元か宛先がこのポートの UDP だけを対象にする
+	bool		all;			// UDP に限らず全部を対象にする
+
+	_ARQ_CONFIG();
+} ARQ_CONFIG;
+
+bool arq_parse_option(ARQ_CONFIG& conf, char *subopts);
+
+/*
+ * MODE_CONTROL フレームのペイロード
+ * CONTROL_HEADER の後ろに type ごとの本体が count 個続く
+ */
+typedef enum _CONTROL_TYPE {
+	CTRL_NACK = 1,	// 本体は NACK_RANGE
+	CTRL_OWD  = 2,	// 本体は OWD_REPORT（owd.h）。届いた経路の送信方向についての報告
+	CTRL_FEEDBACK = 3	// 本体は FEEDBACK_REPORT（feedback.h）。届いた経路の受信報告
+} CONTROL_TYPE;
+
+typedef struct _CONTROL_HEADER {
+	uint8_t		type;
+	uint8_t		count;
+	uint16_t	rsvd;
+} CONTROL_HEADER;
+
+typedef struct _NACK_RANGE {
+	uint32_t	start;	// seq_all
+	uint32_t	count;
+} NACK_RANGE;
+
+#define	ARQ_MAX_RANGES	255		// count が uint8_t なので。これで BUFSIZE にも収まる
+
+static_assert(sizeof(CONTROL_HEADER) + ARQ_MAX_RANGES * sizeof(NACK_RANGE) <= BUFSIZE, "NACK frame exceeds BUFSIZE");
+
+typedef struct _ARQ_ENTRY {
+	uint64_t	sent_ns;		// 0 なら空き
+	uint64_t	deadline_ns;
+	uint64_t	resent_ns;		// 最後に送り直した時刻
+	uint32_t	seq_all;
+	uint16_t	length;
+	uint8_t		data[BUFSIZE];
+} ARQ_ENTRY;
+
+// 送信側：送ったパケットの控え（seq_all でダイレクトマップ、古いものから上書き）
+class arq_store {
+private:
+	std::unique_ptr<ARQ_ENTRY[]>	entries;
+
+public:
+	uint64_t	stored;		// 控えたパケット数
+	uint64_t	resent;		// 送り直したパケット数
+	uint64_t	expired;	// 期限切れで送り直さなかった数
+	uint64_t	unknown;	// 控えていない（対象外か上書き済み）パケットへの NACK
+
+	arq_store();
+
+	void push(uint32_t seq_all, const uint8_t *data, uint16_t length, uint64_t now_ns, uint64_t deadline_ns);
+	ARQ_ENTRY* find(uint32_t seq_all);
+};
+
+typedef struct _ARQ_GAP {
+	uint32_t	seq;
+	uint8_t		nacks;		// NACK を送った回数
+	bool		filled;
+	uint64_t	detected_ns;
+	uint64_t	nacked_ns;
+} ARQ_GAP;
+
+// 受信側：seq_all の抜けの監視
+class arq_tracker {
+private:
+	std::deque<ARQ_GAP>	gaps;	// seq の昇順
+	uint32_t	next_seq;		// 次に来るはずの seq_all
+	bool		started;
+	uint64_t	active_until_ns;	// TUN_FLAG_ARQ 付きのパケットを最後に見てから ARQ_ACTIVE_NS の間だけ監視する
+	uint64_t	reorder_ns;		// 観測した順序入れ替わりの遅れ（抜けが NACK なしで埋まるまでの時間）
+
+	void _Reset(uint32_t seq);
+
+public:
+	uint64_t	detected;	// 見つけた抜けの数
+	uint64_t	nacked;		// NACK したパケット数（同じパケットの再 NACK も数える）
+	uint64_t	repaired;	// NACK した後に埋まった数
+	uint64_t	given_up;	// 埋まらないまま諦めた数
+
+	arq_tracker();
+
+	void OnRecv(uint32_t seq_all, bool arq_frame, uint64_t now_ns);
+	int CollectNacks(uint64_t now_ns, NACK_RANGE *ranges, int max_ranges);
+
+	inline bool Pending() const { return !gaps.empty(); }
+	uint64_t ReorderWait() const;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#!/bin/bash
+# 転送遅延のベンチマーク（root で実行）
+# ネットワーク名前空間 lb_cli / lb_srv を veth ２本でつなぎ、トンネル越しに latbench.out で往復時間を測る。
+# 既定の動作と、低遅延モードのオプションを付けた場合を続けて測って比べる。
+#   ./bench_latency.sh [クライアントのオプション] [サーバーのオプション]
+#   例）./bench_latency.sh "-L cpus=2:3:4,busy_poll=50,spin" "-L cpus=5:6:7,busy_poll=50,spin"
+# COUNT / INTERVAL_US / SIZE で計測の回数・間隔・パケット長を変えられる
+cd "$(dirname "$0")"
+
+CLI_OPTS=${1:-"-L busy_poll=50,spin"}
+SRV_OPTS=${2:-$CLI_OPTS}
+COUNT=${COUNT:-20000}
+INTERVAL_US=${INTERVAL_US:-500}
+SIZE=${SIZE:-64}
+
+make -s mpudp.out latbench.out || exit 1
+
+cleanup() {
+	ip netns pids lb_cli 2>/dev/null | xargs -r kill 2>/dev/null
+	ip netns pids lb_srv 2>/dev/null | xargs -r kill 2>/dev/null
+	ip netns del lb_cli 2>/dev/null
+	ip netns del lb_srv 2>/dev/null
+}
+trap cleanup EXIT
+cleanup
+
+ip netns add lb_cli; ip netns add lb_srv
+ip link add c0 netns lb_cli type veth peer name s0 netns lb_srv
+ip link add c1 netns lb_cli type veth peer name s1 netns lb_srv
+ip -n lb_cli addr add 10.0.1.2/24 dev c0; ip -n lb_cli addr add 10.0.2.2/24 dev c1
+ip -n lb_srv addr add 10.0.1.1/24 dev s0; ip -n lb_srv addr add 10.0.2.1/24 dev s1
+for n in lb_cli lb_srv; do
+	ip -n $n link set lo up
+	ip netns exec $n sysctl -qw net.ipv4.conf.all.rp_filter=0 net.ipv4.conf.default.rp_filter=0
+done
+ip -n lb_cli link set c0 up; ip -n lb_cli link set c1 up; ip -n lb_srv link set s0 up; ip -n lb_srv link set s1 up
+ip -n lb_cli route add 10.0.1.1/32 dev c1 metric 100
+ip -n lb_srv route replace 10.0.2.0/24 dev s1 src 10.0.1.1
+ip -n lb_srv tuntap add tun_test mode tun; ip -n lb_srv addr add 10.255.0.1/24 dev tun_test; ip -n lb_srv link set tun_test up
+ip -n lb_cli tuntap add tun_test mode tun; ip -n lb_cli addr add 10.255.0.2/24 dev tun_test; ip -n lb_cli link set tun_test up
+
+ip netns exec lb_srv ./latbench.out -s &
+
+run() {
+	local label=$1 cli=$2 srv=$3
+
+	ip netns exec lb_srv ./mpudp.out -s $srv >/tmp/lb_srv.log 2>&1 &
+	local spid=$!
+	sleep 0.3
+	ip netns exec lb_cli ./mpudp.out -a 10.0.1.1 -i c0 -i c1 $cli >/tmp/lb_cli.log 2>&1 &
+	local cpid=$!
+	sleep 1.5
+	printf "%-12s " "$label"
+	ip netns exec lb_cli ./latbench.out -c 10.255.0.1 -n $COUNT -i $INTERVAL_US -l $SIZE
+	kill $cpid $spid; wait $cpid $spid 2>/dev/null
+}
+
+echo "count = $COUNT, interval = ${INTERVAL_US}us, size = $SIZE bytes"
+run "default" "" ""
+run "low latency" "$CLI_OPTS" "$SRV_OPTS"
+echo "(low latency : client $CLI_OPTS / server $SRV_OPTS)"
@@ -0,0 +1,83 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "print.h"
+#include "budget.h"
+
+bool budget_parse_option(BUDGET_CONFIG& conf, char *subopts) {
+	enum { OPT_DEV, OPT_COST, OPT_RATE, OPT_QUOTA };
+	char *const	tokens[] = {
+		(char*)"dev", (char*)"cost", (char*)"rate", (char*)"quota", NULL
+	};
+	char	*value;
+
+	while (*subopts != '\0') {
+		const int	opt = getsubopt(&subopts, tokens, &value);
+
+		if (opt < 0 || value == NULL) {
+			print_error("invalid path cost option : %s\n", value ? value : "(null)");
+			return false;
+		}
+		switch (opt) {
+		case OPT_DEV:	conf.dev = value; break;
+		case OPT_COST:	conf.cost = strtoul(value, NULL, 10); break;
+		case OPT_RATE:	conf.rate = (uint64_t)(strtod(value, NULL) * 1000 * 1000 / 8); break;
+		case OPT_QUOTA:	conf.quota = strtoull(value, NULL, 10) * 1000 * 1000; break;
+		}
+	}
+	if (conf.dev.empty()) {
+		print_error("path cost option needs dev=\n");
+		return false;
+	}
+	return true;
+}
+
+_PATH_BUDGET::_PATH_BUDGET(const BUDGET_CONFIG& c) : conf(c), used(0), probed(0), tokens(0), refill_ns(0) {
+	tokens = this->_Burst();
+}
+
+double _PATH_BUDGET::_Burst() const {
+	const double	burst = (double)conf.rate * BUDGET_BURST_NS / 1e9;
+	return (burst > BUDGET_MIN_BURST) ? burst : BUDGET_MIN_BURST;
+}
+
+// 呼び出し側の時刻が前後しても（読んだ時刻と送る時刻など）、同じ時間を二度数えない
+void _PATH_BUDGET::_Refill(uint64_t now_ns) {
+	if (refill_ns != 0 && now_ns <= refill_ns) { return; }
+	if (refill_ns != 0) {
+		tokens += (double)(now_ns - refill_ns) * conf.rate / 1e9;
+		if (tokens > this->_Burst()) { tokens = this->_Burst(); }
+	}
+	refill_ns = now_ns;
+}
+
+bool _PATH_BUDGET::Allow(uint64_t now_ns, uint32_t len) {
+	if (this->Exhausted()) { return false; }
+	if (conf.rate == 0) { return true; }
+
+	this->_Refill(now_ns);
+	return tokens >= len + PATH_UDP_OVERHEAD;
+}
+
+uint64_t _PATH_BUDGET::ReadyTime(uint64_t now_ns, uint32_t len) {
+	const uint32_t	wire = len + PATH_UDP_OVERHEAD;
+
+	if (this->Exhausted()) { return UINT64_MAX; }
+	if (conf.rate == 0) { return now_ns; }
+
+	this->_Refill(now_ns);
+	if (tokens >= wire) { return now_ns; }
+	return now_ns + (uint64_t)((wire - tokens) * 1e9 / conf.rate) + 1;
+}
+
+bool _PATH_BUDGET::OnSend(uint64_t now_ns, uint32_t len) {
+	const uint32_t	wire = len + PATH_UDP_OVERHEAD;
+	const bool		was = this->Exhausted();
+
+	used += wire;
+	if (conf.rate != 0) {
+		this->_Refill(now_ns);
+		tokens -= wire;	// 送り直しなどで前借りした分は、次に貯まるまで待たせる
+	}
+	return !was && this->Exhausted();
+}
@@ -0,0 +1,58 @@
+#ifndef	__BUDGET_H__
+#define	__BUDGET_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#include "mpudpdef.h"
+
+/*
+ * 経路ごとの費用と送信量の上限（-C、クライアントのみ）
+ * 従量課金の回線（LTE / 5G の月間データ量など）は、安い回線が埋まったときのあふれ分と、
+ * 安い回線がキューイングしているときの遅延に効くパケット（ip_is_critical）にだけ使う。
+ *   dev   : 対象のデバイス（サーバーの接続先が複数あれば、そのデバイスの経路すべてで上限を共有する）
+ *   cost  : 費用の重み（0 = 定額）。送信側は送れる経路のうち cost の小さいものから使う
+ *   rate  : 送信レートの上限 Mbps（トークンバケット。0 = なし）
+ *   quota : 送信量の上限 MB（使い切ったらその経路には流さない。0 = なし）
+ * 例）-C dev=wwan0,cost=10,rate=20,quota=2000
+ * 送信量は経路上のバイト数（TUN_HEADER と IP / UDP のヘッダ込み）で数え、エコースレッドのプローブも含める。
+ * プロセスを起動し直すと 0 から数え直す。
+ */
+typedef struct _BUDGET_CONFIG {
+	std::string	dev;
+	uint32_t	cost;
+	uint64_t	rate;		// bytes/s（0 = 上限なし）
+	uint64_t	quota;		// bytes（0 = 上限なし）
+
+	_BUDGET_CONFIG() : cost(0), rate(0), quota(0) {}
+} BUDGET_CONFIG;
+
+bool budget_parse_option(BUDGET_CONFIG& conf, char *subopts);
+
+// 経路（デバイス）の上限の消費状況。OnProbe 以外はメインループのスレッドだけが触ること
+// len は TUN_HEADER 込みのフレーム長。IP / UDP のヘッダ（PATH_UDP_OVERHEAD）はこちらで足す
+typedef struct _PATH_BUDGET {
+	BUDGET_CONFIG	conf;
+	uint64_t	used;			// 送ったバイト数（データ）
+	std::atomic<uint64_t>	probed;	// 送ったバイト数（プローブ。エコースレッドが足す）
+	double		tokens;			// トークンバケット（bytes、上限は BUDGET_BURST_NS 分）
+	uint64_t	refill_ns;
+
+	explicit _PATH_BUDGET(const BUDGET_CONFIG& c);
+
+	inline uint64_t Used() const { return used + probed.load(std::memory_order_relaxed); }
+	inline bool Exhausted() const { return conf.quota != 0 && this->Used() >= conf.quota; }
+	inline uint64_t Remaining() const { return (conf.quota == 0) ? UINT64_MAX : Exhausted() ? 0 : conf.quota - this->Used(); }
+
+	bool Allow(uint64_t now_ns, uint32_t len);			// 今 len バイト送ってよいか
+	uint64_t ReadyTime(uint64_t now_ns, uint32_t len);	// 送ってよくなる時刻（送信量を使い切っていれば UINT64_MAX）
+	bool OnSend(uint64_t now_ns, uint32_t len);			// 送信量をちょうど使い切ったら true
+	inline void OnProbe(uint32_t len) { probed.fetch_add(len + PATH_UDP_OVERHEAD, std::memory_order_relaxed); }	// レートの上限には数えない
+
+private:
+	void _Refill(uint64_t now_ns);
+	double _Burst() const;
+} PATH_BUDGET;
+
+#endif
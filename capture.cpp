@@ -0,0 +1,317 @@
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <new>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mpudpdef.h"
+#include "capture.h"
+#include "print.h"
+#include "network.h"
+
+std::atomic<bool>	_global_fCapture(false);
+uint32_t	_capture_sample = 1;
+
+_CAPTURE_CONFIG::_CAPTURE_CONFIG() :
+	sample(CAPTURE_SAMPLE), ring_slots(CAPTURE_RING_SLOTS),
+	snaplen(CAPTURE_SNAPLEN), limit(CAPTURE_FILE_LIMIT) {}
+
+// リングの１スロット。data は snaplen バイト分後ろに続く
+typedef struct _CAPTURE_SLOT {
+	std::atomic<uint64_t>	seq;	// Vyukov の bounded queue 方式
+	uint64_t	ts_ns;		// CLOCK_REALTIME
+	uint32_t	caplen;
+	uint32_t	origlen;
+	int32_t		path;
+	uint32_t	seq_all;
+	uint32_t	seq_dev;
+	uint8_t		iface;
+	uint8_t		dir;
+	uint8_t		data[];
+} CAPTURE_SLOT;
+
+static uint8_t	*_cap_slots = nullptr;
+static size_t	_cap_stride = 0;
+static uint64_t	_cap_mask = 0;
+static uint32_t	_cap_snaplen = 0;
+
+alignas(64) static std::atomic<uint64_t>	_cap_enq(0);
+alignas(64) static std::atomic<uint64_t>	_cap_dropped(0);
+
+static int		_cap_fd = -1;
+static uint8_t	*_cap_map = nullptr;
+static uint64_t	_cap_limit = 0;
+static std::atomic<uint64_t>	_cap_written(0);
+
+static inline CAPTURE_SLOT* _cap_slot(uint64_t pos) {
+	return (CAPTURE_SLOT*)(_cap_slots + (pos & _cap_mask) * _cap_stride);
+}
+
+static uint32_t _round_pow2(uint32_t n) {
+	uint32_t	p = 1;
+	while (p < n) { p <<= 1; }
+	return p;
+}
+
+bool capture_parse_option(CAPTURE_CONFIG& conf, char *subopts) {
+	enum { OPT_SAMPLE, OPT_RING, OPT_SNAPLEN, OPT_LIMIT };
+	char *const	tokens[] = {
+		(char*)"sample", (char*)"ring", (char*)"snaplen", (char*)"limit", NULL
+	};
+	char	*value;
+
+	while (*subopts != '\0') {
+		const int	opt = getsubopt(&subopts, tokens, &value);
+
+		if (opt < 0 || value == NULL) {
+			print_error("invalid capture option : %s\n", value ? value : "(null)");
+			return false;
+		}
+		const unsigned long long	n = strtoull(value, NULL, 10);
+		switch (opt) {
+		case OPT_SAMPLE:	conf.sample = (n > 0) ? n : 1; break;
+		case OPT_RING:		conf.ring_slots = (n > 0) ? n : 1; break;
+		case OPT_SNAPLEN:	conf.snaplen = n; break;
+		case OPT_LIMIT:		conf.limit = n * 1024 * 1024; break;	// MiB 単位
+		}
+	}
+	return true;
+}
+
+/*
+ * pcapng のブロック組み立て
+ */
+static inline uint32_t _pad4(uint32_t n) { return (n + 3) & ~3U; }
+
+// 書き込み先に余裕がなければ false（以降は書かない）
+static bool _cap_write(const void *p, uint32_t n) {
+	const uint64_t	w = _cap_written.load(std::memory_order_relaxed);
+
+	if (w + n > _cap_limit) { return false; }
+	memcpy(_cap_map + w, p, n);
+	_cap_written.store(w + n, std::memory_order_release);
+	return true;
+}
+
+static uint32_t _opt(uint8_t *p, uint16_t code, const void *val, uint16_t len) {
+	memcpy(p, &code, 2);
+	memcpy(p + 2, &len, 2);
+	memcpy(p + 4, val, len);
+	memset(p + 4 + len, 0, _pad4(len) - len);
+	return 4 + _pad4(len);
+}
+
+static bool _cap_write_headers() {
+	uint8_t		blk[256];
+	uint32_t	n, total;
+
+	// Section Header Block
+	const uint32_t	shb[] = { 0x0A0D0D0A, 28, 0x1A2B3C4D, 0x00000001, 0xFFFFFFFF, 0xFFFFFFFF, 28 };
+	if (!_cap_write(shb, sizeof(shb))) { return false; }
+
+	// Interface Description Block ×２（if_tsresol = 9 でナノ秒）
+	const struct { uint16_t linktype; const char *name; } ifs[] = {
+		{ 101, "tun" }, { 147, "mpudp" }
+	};
+	for (const auto& i : ifs) {
+		const uint8_t	tsresol = 9;
+		const uint32_t	type = 1;
+		const uint16_t	rsvd = 0;
+		const uint32_t	snap = _cap_snaplen;
+
+		n = 8;
+		memcpy(blk + n, &i.linktype, 2); n += 2;
+		memcpy(blk + n, &rsvd, 2); n += 2;
+		memcpy(blk + n, &snap, 4); n += 4;
+		n += _opt(blk + n, 2, i.name, strlen(i.name));	// if_name
+		n += _opt(blk + n, 9, &tsresol, 1);				// if_tsresol
+		n += _opt(blk + n, 0, NULL, 0);					// opt_endofopt
+		total = n + 4;
+		memcpy(blk, &type, 4);
+		memcpy(blk + 4, &total, 4);
+		memcpy(blk + n, &total, 4);
+		if (!_cap_write(blk, total)) { return false; }
+	}
+	return true;
+}
+
+// Enhanced Packet Block
+static bool _cap_write_epb(const CAPTURE_SLOT *s) {
+	uint8_t		opts[128];
+	char		comment[80];
+	uint32_t	nopt = 0;
+
+	const uint32_t	flags = s->dir;
+	const int		clen = snprintf(comment, sizeof(comment),
+		"path=%d seq_all=%u seq_dev=%u", s->path, s->seq_all, s->seq_dev);
+
+	nopt += _opt(opts + nopt, 1, comment, (uint16_t)clen);	// opt_comment
+	nopt += _opt(opts + nopt, 2, &flags, 4);				// epb_flags
+	nopt += _opt(opts + nopt, 0, NULL, 0);
+
+	const uint32_t	total = 28 + _pad4(s->caplen) + nopt + 4;
+	if (_cap_written.load(std::memory_order_relaxed) + total > _cap_limit) { return false; }
+
+	const uint32_t	hdr[7] = {
+		6, total, s->iface,
+		(uint32_t)(s->ts_ns >> 32), (uint32_t)(s->ts_ns & 0xFFFFFFFF),
+		s->caplen, s->origlen
+	};
+	const uint8_t	zero[4] = { 0, 0, 0, 0 };
+
+	_cap_write(hdr, sizeof(hdr));
+	_cap_write(s->data, s->caplen);
+	_cap_write(zero, _pad4(s->caplen) - s->caplen);
+	_cap_write(opts, nopt);
+	_cap_write(&total, 4);
+	return true;
+}
+
+// 終了時には実際に書いた長さまでファイルを切り詰める（ftruncate はシグナルハンドラから呼んでよい）
+static void _cap_on_exit_signal(int sig) {
+	if (_cap_fd != -1) { ftruncate(_cap_fd, _cap_written.load()); }
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+static void _cap_on_exit() {
+	if (_cap_fd != -1) { ftruncate(_cap_fd, _cap_written.load()); }
+}
+
+bool capture_open(const CAPTURE_CONFIG& conf) {
+	const uint32_t	slots = _round_pow2(conf.ring_slots);
+
+	_cap_snaplen = conf.snaplen;
+	_cap_limit = conf.limit;
+	_cap_stride = (sizeof(CAPTURE_SLOT) + _cap_snaplen + 63) & ~(size_t)63;
+	_cap_mask = slots - 1;
+
+	if ((_cap_fd = open(conf.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open()");
+		print_error("Couldn't open capture file - %s\n", conf.path.c_str());
+		return false;
+	}
+	if (ftruncate(_cap_fd, _cap_limit) < 0) {
+		perror("ftruncate()");
+		print_error("errno = %d\n", errno);
+		return false;
+	}
+	_cap_map = (uint8_t*)mmap(NULL, _cap_limit, PROT_READ | PROT_WRITE, MAP_SHARED, _cap_fd, 0);
+	if (_cap_map == MAP_FAILED) {
+		perror("mmap()");
+		print_error("errno = %d\n", errno);
+		return false;
+	}
+	if (!_cap_write_headers()) {
+		print_error("capture file limit is too small\n");
+		return false;
+	}
+
+	_cap_slots = (uint8_t*)aligned_alloc(64, _cap_stride * slots);
+	if (_cap_slots == nullptr) {
+		perror("aligned_alloc()");
+		print_error("Couldn't allocate the capture ring (%u slots)\n", slots);
+		return false;
+	}
+	for (uint64_t i = 0; i < slots; i++) {
+		new (&_cap_slot(i)->seq) std::atomic<uint64_t>(i);
+	}
+	atexit(_cap_on_exit);
+	signal(SIGINT,  _cap_on_exit_signal);
+	signal(SIGTERM, _cap_on_exit_signal);
+
+	std::thread([](){
+		uint64_t	deq = 0;
+		uint64_t	reported = 0;
+		bool		full = false;
+		timespec	idle = { 0, 1000 * 1000 };
+		sigset_t	set;
+
+		sigemptyset(&set);
+		sigaddset(&set, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+		while (true) {
+			CAPTURE_SLOT	*s = _cap_slot(deq);
+
+			if (s->seq.load(std::memory_order_acquire) != deq + 1) {
+				const uint64_t	d = _cap_dropped.load(std::memory_order_relaxed);
+				if (d != reported) {
+					pdebug("[CAPTURE] %llu packets dropped\n", (unsigned long long)(d - reported));
+					reported = d;
+				}
+				nanosleep(&idle, NULL);
+				continue;
+			}
+			if (!full && !_cap_write_epb(s)) {
+				print_error("[CAPTURE] file size limit reached, capture stopped\n");
+				full = true;
+				_global_fCapture.store(false, std::memory_order_relaxed);
+			}
+			s->seq.store(deq + _cap_mask + 1, std::memory_order_release);
+			deq++;
+		}
+	}).detach();
+
+	_capture_sample = conf.sample;
+	_global_fCapture.store(true, std::memory_order_release);
+	pdebug("capture started : %s (sample = 1/%u, ring = %u slots, snaplen = %u)\n",
+		conf.path.c_str(), conf.sample, slots, conf.snaplen);
+	return true;
+}
+
+void capture_packet(uint8_t iface, uint8_t dir, const void *data, uint32_t len,
+	int32_t path, uint32_t seq_all, uint32_t seq_dev) {
+	const iovec	iov = { (void*)data, len };
+	capture_packetv(iface, dir, &iov, 1, path, seq_all, seq_dev);
+}
+
+void capture_packetv(uint8_t iface, uint8_t dir, const iovec *iov, int iovcnt,
+	int32_t path, uint32_t seq_all, uint32_t seq_dev) {
+	uint32_t	len = 0;
+	for (int i = 0; i < iovcnt; i++) { len += iov[i].iov_len; }
+
+	uint64_t	pos = _cap_enq.load(std::memory_order_relaxed);
+	CAPTURE_SLOT	*s;
+
+	while (true) {
+		s = _cap_slot(pos);
+		const int64_t	diff = (int64_t)(s->seq.load(std::memory_order_acquire) - pos);
+
+		if (diff == 0) {
+			if (_cap_enq.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) { break; }
+		}
+		else if (diff < 0) {
+			// リングが一杯
+			_cap_dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		else {
+			pos = _cap_enq.load(std::memory_order_relaxed);
+		}
+	}
+	timespec	ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	s->ts_ns	= (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	s->caplen	= (len < _cap_snaplen) ? len : _cap_snaplen;
+	s->origlen	= len;
+	s->path		= path;
+	s->seq_all	= seq_all;
+	s->seq_dev	= seq_dev;
+	s->iface	= iface;
+	s->dir		= dir;
+	uint32_t	off = 0;
+	for (int i = 0; i < iovcnt && off < s->caplen; i++) {
+		const uint32_t	n = (iov[i].iov_len < s->caplen - off) ? iov[i].iov_len : s->caplen - off;
+		memcpy(s->data + off, iov[i].iov_base, n);
+		off += n;
+	}
+
+	s->seq.store(pos + 1, std::memory_order_release);
+}
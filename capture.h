@@ -0,0 +1,61 @@
+#ifndef	__CAPTURE_H__
+#define	__CAPTURE_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+#include <sys/uio.h>
+
+/*
+ * pcapng キャプチャ
+ * TUN から読んだ内側の IP パケットと、TUN_HEADER 付きでネットワークに流れるフレームの両方を
+ * １つの pcapng ファイルに記録する（インターフェース 0 = tun, 1 = mpudp）。
+ * 各パケットには方向と経路（device_id）、seq_all / seq_dev をコメントとして付ける。
+ *
+ * データパス側はパケットを固定長スロットのロックフリーリングへコピーするだけで、
+ * pcapng ブロックの組み立てと mmap したファイルへの書き出しは別スレッドが行う。
+ * リングが埋まったら、またはファイルサイズの上限に達したらパケットは捨てる（データパスは待たない）。
+ * サンプリングは seq_all 単位で行うので、同じパケットの両側（tun / mpudp）は揃って記録される。
+ */
+#define	CAPTURE_IF_TUN		0	// LINKTYPE_RAW
+#define	CAPTURE_IF_MPUDP	1	// LINKTYPE_USER0（TUN_HEADER + IP パケット）
+
+#define	CAPTURE_DIR_IN		1	// epb_flags の inbound
+#define	CAPTURE_DIR_OUT		2	// epb_flags の outbound
+
+typedef struct _CAPTURE_CONFIG {
+	std::string	path;
+	uint32_t	sample;		// seq_all が sample の倍数のパケットだけ記録する（1 = 全部）
+	uint32_t	ring_slots;	// リングのスロット数
+	uint32_t	snaplen;	// １パケットあたりに記録する最大バイト数
+	uint64_t	limit;		// ファイルサイズの上限（バイト）
+
+	_CAPTURE_CONFIG();
+} CAPTURE_CONFIG;
+
+bool capture_parse_option(CAPTURE_CONFIG& conf, char *subopts);
+bool capture_open(const CAPTURE_CONFIG& conf);
+void capture_packet(uint8_t iface, uint8_t dir, const void *data, uint32_t len,
+	int32_t path, uint32_t seq_all, uint32_t seq_dev);
+void capture_packetv(uint8_t iface, uint8_t dir, const iovec *iov, int iovcnt,
+	int32_t path, uint32_t seq_all, uint32_t seq_dev);	// ヘッダとペイロードが別々のバッファにあるフレーム用
+
+extern std::atomic<bool>	_global_fCapture;	// 書き出しスレッドが止めることもあるので atomic
+extern uint32_t	_capture_sample;
+
+inline void capture_tap(uint8_t iface, uint8_t dir, const void *data, uint32_t len,
+	int32_t path, uint32_t seq_all, uint32_t seq_dev) {
+	if (!_global_fCapture.load(std::memory_order_relaxed)) { return; }
+	if (_capture_sample > 1 && seq_all % _capture_sample != 0) { return; }
+	capture_packet(iface, dir, data, len, path, seq_all, seq_dev);
+}
+
+inline void capture_tapv(uint8_t iface, uint8_t dir, const iovec *iov, int iovcnt,
+	int32_t path, uint32_t seq_all, uint32_t seq_dev) {
+	if (!_global_fCapture.load(std::memory_order_relaxed)) { return; }
+	if (_capture_sample > 1 && seq_all % _capture_sample != 0) { return; }
+	capture_packetv(iface, dir, iov, iovcnt, path, seq_all, seq_dev);
+}
+
+#endif
@@ -1,10 +1,17 @@
 #include <algorithm>
+#include <random>
 
 #include <sys/types.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <net/if.h>
 #include <netdb.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 
 #include "ringbuf.h"
 #include "print.h"
+#include "trace.h"
 #include "mpudp.h"
 
 bool MPUDPTunnelClient::_GetAddressInfo(const std::string& dst_addr, const int dst_port, addrinfo **result) {
@@ -56,40 +63,393 @@ bool MPUDPTunnelClient::_SetupSocket(int& sock_fd, const addrinfo& ai, const std
 	return true;
 }
 
+// _SetupSocket に渡す接続先（to は使い終わるまで残しておくこと）
+static addrinfo udp_addrinfo(const sockaddr_in& to) {
+	addrinfo	ai;
+
+	memset(&ai, 0, sizeof(ai));
+	ai.ai_family	= AF_INET;
+	ai.ai_socktype	= SOCK_DGRAM;
+	ai.ai_addr		= (sockaddr*)&to;
+	ai.ai_addrlen	= sizeof(to);
+	return ai;
+}
+
+// -M：全経路で使うソケット。接続せず、デバイスにも縛らない（-U で引き継いだら _TakePath が開いてある）
+bool MPUDPTunnelClient::_OpenSharedSocket() {
+	sockaddr_in	local;
+	socklen_t	szaddr = sizeof(local);
+	int			optval = 1;
+
+	if (sock_shared != -1) { return true; }
+	if ((sock_shared = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket()");
+		print_error("Couldn't create the shared socket\n");
+		print_error("errno = %d\n", errno);
+		return false;
+	}
+	// 届いたデバイス（ipi_ifindex）で経路を引く
+	if (setsockopt(sock_shared, IPPROTO_IP, IP_PKTINFO, &optval, sizeof(optval)) < 0) {
+		perror("setsockopt()");
+		print_error("Couldn't set value of IP_PKTINFO\n");
+		return false;
+	}
+	memset(&local, 0, sizeof(local));
+	local.sin_family		= AF_INET;
+	local.sin_addr.s_addr	= htonl(INADDR_ANY);
+	local.sin_port			= htons(0);
+	if (bind(sock_shared, (sockaddr*)&local, sizeof(local)) < 0) {
+		perror("bind()");
+		print_error("errno = %d\n", errno);
+		return false;
+	}
+	lowlat_busy_poll(lowlat, sock_shared, "shared");
+	getsockname(sock_shared, (sockaddr*)&local, &szaddr);
+	pdebug("shared socket: fd: %d, port: %d\n", sock_shared, ntohs(local.sin_port));
+	return true;
+}
+
+// -M：経路に振るデバイスID。データのフレームの TUN_HEADER::device_id は８ビットなので 1..SHARED_DEVICE_ID_MAX から、
+// 他の経路のIDと、このプロセスで開いている fd の番号（経路ごとのソケットならデバイスIDになる番号）を避けて選ぶ
+int32_t MPUDPTunnelClient::_NewDeviceId(const SOCKET_PACK& self) {
+	for (int i = 0; i < SHARED_DEVICE_ID_MAX; i++) {
+		const int32_t	id = next_device_id;
+
+		next_device_id = (next_device_id % SHARED_DEVICE_ID_MAX) + 1;
+		if (std::any_of(socks.begin(), socks.end(), [&](const SOCKET_PACK& s) { return &s != &self && s.device_id == id; })) { continue; }
+		if (fcntl(id, F_GETFD) != -1) { continue; }
+		return id;
+	}
+	print_error("no device id left for the shared socket\n");
+	return next_device_id;
+}
+
+// 経路のデータ用ソケットを作る（起動時と、リンクが戻ったときに呼ぶ）。接続先は s.remote_addr
+bool MPUDPTunnelClient::_OpenPath(SOCKET_PACK& s) {
+	const addrinfo	ai = udp_addrinfo(s.remote_addr);
+	socklen_t	szaddr = sizeof(s.local_addr);
+	int			fd = -1;
+
+	// -M：共有ソケットを借り、デバイスと送信元アドレスはフレームごとに指定する。付け直すたびに新しいデバイスIDにする
+	if (sock_shared != -1) {
+		in_addr	addr;
+		int		ifindex;
+
+		if (!nl_link_addr(s.dev_name, addr, ifindex)) {
+			print_error("eth[%s]: no IPv4 address\n", s.eth_name.c_str());
+			return false;
+		}
+		getsockname(sock_shared, (sockaddr*)&(s.local_addr), &szaddr);
+		s.sock_fd = sock_shared;
+		s.device_id = this->_NewDeviceId(s);
+		s.local_addr.sin_addr = addr;
+		s.ifindex = ifindex;
+		s.pin_src = true;
+		pdebug("eth[%s]: shared socket, device_id: %d, local addr: %s, ifindex: %d\n",
+			s.eth_name.c_str(), s.device_id, inet_ntoa(s.local_addr.sin_addr), s.ifindex);
+		return true;
+	}
+
+	// 使用する実デバイスにソケットを割り当てる
+	// ソケットの作成とオプションの設定
+	if (!this->_SetupSocket(fd, ai, s.dev_name)) {
+		if (fd != -1) { close(fd); }
+		return false;
+	}
+	s.sock_fd = fd;
+
+	// ローカル側で使用するポートの割当
+	s.local_addr.sin_family			= AF_INET;
+	s.local_addr.sin_addr.s_addr	= htonl(INADDR_ANY);
+	s.local_addr.sin_port			= htons(0);
+	bind(s.sock_fd, (sockaddr*)&(s.local_addr), sizeof(s.local_addr));
+
+	// ICMP の到達不能などをエラーキューで受け取り、経路断の検知に使う
+	const int	recverr = 1;
+	if (setsockopt(s.sock_fd, IPPROTO_IP, IP_RECVERR, &recverr, sizeof(recverr)) < 0) {
+		perror("setsockopt()");
+		print_error("Couldn't set value of IP_RECVERR - %s\n", s.eth_name.c_str());
+	}
+	lowlat_busy_poll(lowlat, s.sock_fd, s.eth_name.c_str());
+	getsockname(s.sock_fd, (sockaddr*)&(s.local_addr), &szaddr);	// bind() によって使用ポートが割り当てられたので情報を取得
+
+	// -X：このポート宛てのフレームを XSK で受け取り、XSK で送る（使えなければソケットのまま）
+	if (xdp_conf.enable) {
+		std::unique_ptr<xdp_port>	xdp(new xdp_port);
+
+		if (xdp->open(xdp_conf, s.dev_name, s.sock_fd, s.local_addr, s.remote_addr)) { s.xdp = std::move(xdp); }
+		else { print_error("eth[%s]: AF_XDP is not available - using the UDP socket\n", s.eth_name.c_str()); }
+	}
+
+	pdebug("eth[%s]: fd: %d, local addr: %s, port: %d\n",
+		s.eth_name.c_str(),
+		s.sock_fd,
+		inet_ntoa(s.local_addr.sin_addr),
+		ntohs(s.local_addr.sin_port)
+	);
+	return true;
+}
+
+/*
+ * セッションの開始時に、サーバーの待ち受けアドレスの一覧を管理プレーン（PORT_PING）で問い合わせる
+ * 使えるデバイスすべてから送り、最初に返ってきた答えを使う。
+ * 返事がない（古いサーバー）か一覧が空（-e なし）なら primary（-a のアドレス）だけ。primary は一覧になくても必ず先頭に置く
+ */
+void MPUDPTunnelClient::_QueryEndpoints(const sockaddr_in& primary, std::vector<sockaddr_in>& endpoints) {
+	sockaddr_in		to = primary;
+	const addrinfo	ai = udp_addrinfo(to);
+	std::vector<int>	fds;
+	ENDPOINT_PACKET		req, ans;
+	bool		answered = false;
+	fd_set		rfds;
+	timeval		tv;
+
+	to.sin_port = htons(PORT_PING);
+	endpoints.assign(1, primary);
+
+	for (const auto& s : this->socks) {
+		int	fd = -1;
+
+		if (sock_nl != -1 && !nl_link_ready(s.dev_name)) { continue; }
+		if (this->_SetupSocket(fd, ai, s.dev_name)) { fds.push_back(fd); }
+		else if (fd != -1) { close(fd); }
+	}
+	for (int t = 0; t < ENDPOINT_QUERY_TRIES && !answered && !fds.empty(); t++) {
+		const uint64_t	deadline = monotonic_ns() + (uint64_t)ENDPOINT_QUERY_TIMEOUT_MSEC * 1000 * 1000;
+		int				max_fd = -1;
+
+		for (const int fd : fds) {
+			if (send(fd, &req, sizeof(req), 0) < 0) { perror("send(endpoint query)"); }
+			max_fd = max(max_fd, fd);
+		}
+		while (!answered) {
+			const uint64_t	now = monotonic_ns();
+			if (now >= deadline) { break; }
+
+			tv.tv_sec  = (deadline - now) / 1000000000ULL;
+			tv.tv_usec = ((deadline - now) % 1000000000ULL) / 1000;
+			FD_ZERO(&rfds);
+			for (const int fd : fds) { FD_SET(fd, &rfds); }
+			if (select(max_fd + 1, &rfds, NULL, NULL, &tv) <= 0) { continue; }
+
+			for (const int fd : fds) {
+				if (!FD_ISSET(fd, &rfds) || recv(fd, &ans, sizeof(ans), MSG_DONTWAIT) != (ssize_t)sizeof(ans)) { continue; }
+				if (strncmp(ans.header.signature, SIGNATURE_MANAGEMENT, sizeof(ans.header.signature)) != 0 ||
+					strncmp(ans.signature, SIGNATURE_ENDPOINTS, sizeof(ans.signature)) != 0 || ans.count > MAX_SERVER_ENDPOINTS) {
+					continue;
+				}
+				answered = true;
+				break;
+			}
+		}
+	}
+	for (const int fd : fds) { close(fd); }
+
+	if (!answered) {
+		print_info("server endpoints: no answer - using %s only\n", inet_ntoa(primary.sin_addr));
+		return;
+	}
+	for (uint32_t i = 0; i < ans.count; i++) {
+		sockaddr_in	e = primary;
+
+		if (ans.addrs[i] == primary.sin_addr.s_addr) { continue; }
+		e.sin_addr.s_addr = ans.addrs[i];
+		endpoints.push_back(e);
+	}
+	for (const auto& e : endpoints) { print_info("server endpoint: %s\n", inet_ntoa(e.sin_addr)); }
+}
+
 bool MPUDPTunnelClient::Start(const std::string& tun_name, const std::string& addr, const int port) {
 	addrinfo	*ai;
-	socklen_t	szaddr;
+	sockaddr_in	primary;
+	std::vector<sockaddr_in>	endpoints;
 
-	if (!this->SetTunDevice(tun_name.c_str())) { return false; }
 	if (!this->_GetAddressInfo(addr, port, &ai)) { return false; }
+	if (!lowlat_resolve_cpus(lowlat, socks.empty() ? "" : socks.front().dev_name)) { return false; }	// 最初の経路のデバイスのノード
+
+	primary = *(sockaddr_in *)ai->ai_addr;
+	freeaddrinfo(ai);
+
+	// リンクの監視ができれば、今は使えないデバイスも後から付け足せる
+	if ((sock_nl = nl_open_link_monitor()) < 0) {
+		print_error("link monitor is not available - paths are fixed\n");
+	}
 
-	szaddr = ai->ai_addrlen;
+	/*
+	 * サーバーに待ち受けアドレスが複数あれば、デバイスごとにそのすべてへの経路を張る（デバイス × 接続先）
+	 * 下りはサーバーが全経路に流すので、サーバー側の回線の分まで帯域を足し合わせられる。
+	 * socks の要素数は起動後に変えられないので、接続先は起動時の一覧で決める
+	 */
+	this->_QueryEndpoints(primary, endpoints);
+	if (shared && endpoints.size() > 1) {
+		print_info("shared socket: using only the primary endpoint %s\n", inet_ntoa(primary.sin_addr));
+		endpoints.resize(1);
+	}
+	if (endpoints.size() > 1) {
+		std::vector<SOCKET_PACK>	mesh;
+
+		for (const auto& d : this->socks) {
+			for (const auto& e : endpoints) {
+				SOCKET_PACK	s;
+
+				s.eth_name = d.dev_name + ">" + inet_ntoa(e.sin_addr);
+				s.dev_name = d.dev_name;
+				s.remote_addr = e;
+				s.rescue.reset(new RESCUE_RING);
+				mesh.emplace_back(std::move(s));
+			}
+		}
+		this->socks = std::move(mesh);
+	}
+	else {
+		for (auto& s : this->socks) { s.remote_addr = primary; }
+	}
+	// 費用と上限（-C）は同じデバイスの経路で共有する
+	for (const auto& c : budget_confs) {
+		auto	b = std::make_shared<PATH_BUDGET>(c);
+
+		for (auto& s : this->socks) {
+			if (s.dev_name == c.dev) { s.budget = b; }
+		}
+		if (b.use_count() == 1) {
+			print_error("path cost: no such device - %s\n", c.dev.c_str());
+			return false;
+		}
+		budgets.push_back(b);
+	}
+	if ((echo_wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		perror("eventfd()");
+		print_error("errno = %d\n", errno);
+		return false;
+	}
+	if (shared && xdp_conf.enable) {
+		print_error("AF_XDP is not used with the shared socket\n");
+		xdp_conf.enable = false;
+	}
+	if (shared) {
+		std::random_device	rd;
+		next_device_id = (int32_t)(rd() % SHARED_DEVICE_ID_MAX) + 1;
+	}
+	// -U：時間のかかる準備（接続先の問い合わせ）を済ませてから、動いているプロセスの TUN と経路を引き継ぐ
+	if (!this->_TakeOver(tun_name, false)) { return false; }
+	if (taken) {
+		for (auto& s : this->socks) { this->_TakePath(s); }
+	}
+	if (shared && !this->_OpenSharedSocket()) { return false; }
 
 	for (auto& s : this->socks) {
-		// 使用する実デバイスにソケットを割り当てる
-		// ソケットの作成とオプションの設定
-		if (!this->_SetupSocket(s.sock_fd, *ai, s.eth_name)) {
-			freeaddrinfo(ai);
+		if (s.sock_fd != -1) {
+			this->_NotifyEcho(s);
+			continue;
+		}
+		if (sock_nl != -1 && !nl_link_ready(s.dev_name)) {
+			print_info("eth[%s]: link is not ready, waiting for it\n", s.eth_name.c_str());
+		}
+		else if (!this->_OpenPath(s) && sock_nl == -1) {
 			return false;
 		}
-		s.remote_addr = *(sockaddr_in *)ai->ai_addr;
+		if (s.sock_fd == -1) {
+			s.path_up = false;
+			s.metrics->MarkDown();
+			continue;
+		}
+		this->_NotifyEcho(s);
+	}
+	// 経路ごとにソケットがあるので、RX は読んだソケットで経路がわかる（並びは socks と同じ）
+	// -M なら共有ソケット１つだけを読み、届いたデバイスで経路を引く
+	for (auto& s : this->socks) {
+		const int	i = this->_PathIndex(s);
 
-		// ローカル側で使用するポートの割当
-		s.local_addr.sin_family			= ai->ai_family;
-		s.local_addr.sin_addr.s_addr	= htonl(INADDR_ANY);
-		s.local_addr.sin_port			= htons(0);
-		bind(s.sock_fd, (sockaddr*)&(s.local_addr), sizeof(s.local_addr));
-		getsockname(s.sock_fd, (sockaddr*)&(s.local_addr), &szaddr);	// bind() によって使用ポートが割り当てられたので情報を取得
+		this->rx_paths.emplace_back(s.eth_name, i, s.remote_addr, -1);
+		this->rx_paths.back().metrics = s.metrics;
+		this->rx_paths.back().ifindex = s.ifindex;
+		if (!shared) { this->rx_sources.emplace_back(new RX_SOURCE(s.eth_name, i, s.sock_fd, s.xdp.get())); }
+	}
+	if (shared) { this->rx_sources.emplace_back(new RX_SOURCE("shared", -1, sock_shared, nullptr)); }
+	qos.Setup(qos_conf, this->_TunReadSize());
+	if (!this->_UpgradeReady()) { return false; }
+	if (!this->_StartPipeline()) { return false; }
 
-		pdebug("eth[%s]: fd: %d, local addr: %s, port: %d\n",
-			s.eth_name.c_str(),
-			s.sock_fd,
-			inet_ntoa(s.local_addr.sin_addr),
-			ntohs(s.local_addr.sin_port)
-		);
+	this->th_echo = this->_StartEchoThread();
+	return true;
+}
+
+// 経路ごとにソケットがあれば読んだソケットで、-M なら届いたデバイスで経路を引く（RX スレッド）
+RX_PATH* MPUDPTunnelClient::_RxPath(int source, const RX_FRAME& f) {
+	return shared ? this->_RxSharedPath(f) : &rx_paths[source];
+}
+
+// どの経路でもないデバイスに届いたら、デバイスが作り直されて番号が変わったのかもしれないので引き直す
+// 経路はデバイスごとに１つ（-M ではサーバーの接続先を１つにする）なので、名前はデバイス名
+RX_PATH* MPUDPTunnelClient::_RxSharedPath(const RX_FRAME& f) {
+	for (int retry = 0; retry < 2; retry++) {
+		for (auto& p : rx_paths) {
+			if (p.ifindex == f.ifindex && f.ifindex != 0) { return &p; }
+		}
+		if (retry > 0 || f.rx_ns - rx_ifindex_ns < SHARED_IFINDEX_REFRESH_NS) { break; }
+		rx_ifindex_ns = f.rx_ns;
+		for (auto& p : rx_paths) { p.ifindex = if_nametoindex(p.name.c_str()); }
+	}
+	return nullptr;
+}
+
+// 名前と接続先が同じ経路があれば、そのソケットと状態で始める（なければ普通に開く）
+bool MPUDPTunnelClient::_TakePath(SOCKET_PACK& s) {
+	for (uint32_t i = 0; i < taken->npaths; i++) {
+		const UPGRADE_PATH&	p = taken->paths[i];
+
+		if (s.eth_name != p.name || !is_same_addr(s.remote_addr, p.remote_addr)) { continue; }
+		if (p.shared != (shared ? 1 : 0)) { return false; }	// -M の有無が変わったら開き直す
+
+		// -M の経路は共有ソケット１つを一緒に渡される。デバイスIDも引き継ぐ（サーバーから見て同じ経路のまま）
+		if (p.shared && sock_shared == -1) { sock_shared = this->_TakeFd(p.fd_index); }
+
+		const int	fd = p.shared ? sock_shared : this->_TakeFd(p.fd_index);
+
+		if (fd == -1) { return false; }
+		s.sock_fd = fd;
+		upgrade_restore_path(s, p, monotonic_ns());
+		if (p.shared) {
+			s.device_id = (p.device_id >= 1 && p.device_id <= SHARED_DEVICE_ID_MAX) ? p.device_id : this->_NewDeviceId(s);
+		}
+		if (!s.path_up) { s.metrics->MarkDown(); }
+		pdebug("eth[%s]: taken over, fd: %d, seq_dev = %u\n", s.eth_name.c_str(), s.sock_fd, s.seq_dev);
+		return true;
+	}
+	return false;
+}
+
+// -U：fd は TUN の後ろに、開いている経路のソケットを並べる（AF_XDP の経路は渡せない。-M なら共有ソケット１つ）
+bool MPUDPTunnelClient::_Snapshot(UPGRADE_STATE& st, std::vector<int>& fds) {
+	int		shared_index = -1;
+
+	for (const auto& s : this->socks) {
+		if (s.sock_fd == -1) { continue; }
+		if (s.xdp) {
+			print_error("upgrade: eth[%s] uses AF_XDP - can not hand over\n", s.eth_name.c_str());
+			return false;
+		}
+		if (st.npaths >= UPGRADE_MAX_PATHS) {
+			print_error("upgrade: too many paths - eth[%s] and later are not handed over\n", s.eth_name.c_str());
+			break;
+		}
+		UPGRADE_PATH&	p = st.paths[st.npaths++];
+
+		upgrade_save_path(p, s);
+		p.shared = shared;
+		if (shared) {
+			if (shared_index == -1) {
+				shared_index = fds.size();
+				fds.push_back(sock_shared);
+			}
+			p.fd_index = shared_index;
+			p.device_id = s.device_id;
+		}
+		else {
+			p.fd_index = fds.size();
+			fds.push_back(s.sock_fd);
+		}
 	}
-	this->th_echo = this->_StartEchoThread(addr);
-	freeaddrinfo(ai);
 	return true;
 }
 
@@ -97,289 +457,791 @@ void MPUDPTunnelClient::AddDevice(const std::string& device_name) {
 	SOCKET_PACK	s;
 
 	s.eth_name = device_name;
+	s.dev_name = device_name;
+	s.rescue.reset(new RESCUE_RING);
 	this->socks.emplace_back(std::move(s));
 	return;
 }
 
-// １秒おきに各ソケットにECHOパケットを流す（およそラムダ関数で処理する長さではない）
-// dst_addr はコピーの方がよい。スレッド間では時間の流れが違うので別スレッドの dst_addr の値を保証できないから。
+// エコー用ソケットでカーネルのタイムスタンプを有効にする
+// ハードウェアのタイムスタンプは、NIC 側で有効になっていれば（SIOCSHWTSTAMP）付いてくる
+static bool enable_timestamping(int fd) {
+	const int	flags =
+		SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+		SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+
+	return setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == 0;
+}
+
+static inline uint64_t ts2ns(const timespec& ts) {
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// 受信したメッセージの SCM_TIMESTAMPING を取り出す（ts[0] がソフトウェア、ts[2] がハードウェア）
+static void get_timestamps(msghdr& msg, PROBE_TS& ts) {
+	ts = { 0, 0 };
+	for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_TIMESTAMPING) { continue; }
+
+		scm_timestamping	t;
+		memcpy(&t, CMSG_DATA(c), sizeof(t));
+		ts.sw_ns = ts2ns(t.ts[0]);
+		ts.hw_ns = ts2ns(t.ts[2]);
+	}
+}
+
+/*
+ * プローブの RTT
+ * 送受信ともにカーネルのタイムスタンプがあればその差を使う（select の待ちやスレッドの切り替えを含まない）。
+ * ハードウェアのタイムスタンプは NIC ごとに時計が違うので、同じ経路で送受信したときだけ使う。
+ * カーネルのタイムスタンプは CLOCK_REALTIME なので、時計が飛んだときに備えて
+ * ユーザー空間で測った monotonic の RTT（必ずこれより長い）を超えるものは捨て、monotonic の方を使う。
+ */
+static uint64_t probe_rtt_ns(const PROBE_TS& tx, const PROBE_TS& rx, bool same_path, uint64_t user_rtt_ns, bool& kernel) {
+	int64_t	k = 0;
+
+	if (same_path && tx.hw_ns != 0 && rx.hw_ns != 0) { k = (int64_t)(rx.hw_ns - tx.hw_ns); }
+	else if (tx.sw_ns != 0 && rx.sw_ns != 0)        { k = (int64_t)(rx.sw_ns - tx.sw_ns); }
+
+	kernel = (k > 0 && (uint64_t)k <= user_rtt_ns);
+	return kernel ? (uint64_t)k : user_rtt_ns;
+}
+
+/*
+ * 各ソケットに定期的にECHOパケットを流す（およそラムダ関数で処理する長さではない）
+ * プローブの間隔は経路ごとに変える
+ * - プローブを失った、落ちている、損失や RTT の揺らぎが大きい経路は PROBE_FAST_INTERVAL_MSEC おき
+ * - データが流れていない（受信がない）経路は、ほかに手がかりがないので PROBE_IDLE_INTERVAL_MSEC おき
+ * - データを受信している経路はそれ自体が生きている証拠なので PROBE_INTERVAL_MSEC おき
+ * タイムアウトは srtt + 4 * rttvar（PATH_METRICS::ProbeTimeout、間隔は ProbeInterval）
+ * PATH_DOWN_LOST_PROBES 回続けて失ったら経路断として PATH_METRICS::state を落とし、応答が返れば戻す
+ * 時刻はすべて monotonic_ns（RTT はカーネルのタイムスタンプがあればそちら、probe_rtt_ns を参照）
+ */
+// プローブの送り先は経路ごと（経路の接続先の PORT_PING）。経路の出し入れと一緒に ECHO_UPDATE で受け取る
 // this（インスタンスのアドレスを指す）はプログラム終了まで同じはずなので（コピーとかしない限り）そのままでよい。
-std::unique_ptr<std::thread> MPUDPTunnelClient::_StartEchoThread(const std::string& dst_addr) {
+std::unique_ptr<std::thread> MPUDPTunnelClient::_StartEchoThread() {
 #define	perror_th(s)				perror("[ECHO_THREAD] " s)
 #define	print_error_th(format, ...)	print_error(("[ECHO_THREAD] " format), ## __VA_ARGS__)
 #define	pdebug_th(format, ...)		pdebug("[ECHO_THREAD] " format, ## __VA_ARGS__)
 
-	return std::unique_ptr<std::thread>(new std::thread([dst_addr, this](){
-		using namespace std::chrono;
-
+	return std::unique_ptr<std::thread>(new std::thread([this](){
 		std::unique_ptr<ECHO_PACKET>	buf(new ECHO_PACKET);
-		std::vector<ECHO_SOCKETS>		echo_socks((std::size_t)this->socks.size());
+		std::vector<ECHO_SOCKETS>		echo_socks;
+		std::vector<ECHO_UPDATE>		updates;
 
 		ringbuf<decltype(buf->header.seq),32>	already_recvd_seq(-1);
 
-		addrinfo	*ai;
 		sockaddr_in	addr;
 		ssize_t		n;
 		int64_t		echo_seq = 0;
-		socklen_t	addr_len = sizeof(addr);
 
-		timeval	tv = { 0, 1000 };	// 最初は1ミリ秒後に強制的にタイムアウトさせてECHOを送る
+		uint8_t		cbuf[512];
+		iovec		iov;
+		msghdr		msg;
+		PROBE_TS	rx_ts;
+
+		timeval	tv;
 		fd_set	rfds;
 		int		max_fd = -1;
 		int		selret;
 
-		system_clock::time_point	now_time;
+		uint64_t	now_ns, next_event;
 
-		this->_GetAddressInfo(dst_addr, PORT_PING, &ai);
+		// サーバーが同じクライアントの経路をまとめて、プローブへの応答をそれらにだけ返すための識別子
+		std::random_device	rd;
+		uint32_t	client_id;
+		while ((client_id = rd()) == 0) {}
 
-		for (size_t i = 0; i < this->socks.size(); i++) {
-			// if false == 親スレッドに異常通知、終了
-			this->_SetupSocket(echo_socks[i].echo_sock, *ai, socks[i].eth_name);
-			echo_socks[i].device_id = socks[i].sock_fd;
-			max_fd = max(max_fd, echo_socks[i].echo_sock);
-			pdebug_th("echo_sockfd = %d, sock_fd = %d\n", echo_socks[i].echo_sock, socks[i].sock_fd);
+		// -T：プローブの結果を経路トレースに記録する（落ちている間は損失率 1000 で記録する）
+		auto record_trace = [this](const ECHO_SOCKETS& e, uint64_t now, int64_t rtt_us) {
+			const PATH_METRICS&	m = *e.metrics;
+			const uint32_t		rate = m.rate_kbps.load(std::memory_order_relaxed);
 
-			echo_socks[i].recvd_count = 0;
-			echo_socks[i].rtt_avg = microseconds().min();
-			echo_socks[i].rtt_max = microseconds().min();
-			echo_socks[i].status.fill({ system_clock::now(), -1 });
-		}
-		while (true) {
-			FD_ZERO(&rfds);
-			for (auto& e : echo_socks) { FD_SET(e.echo_sock, &rfds); }
+			if (!this->ptrace.is_open()) { return; }
+			this->ptrace.record(now, e.eth_name, rtt_us,
+				m.IsUp() ? (int32_t)m.loss_permille.load(std::memory_order_relaxed) : 1000,
+				(rate == 0) ? PATH_TRACE_KEEP : rate
+			);
+		};
+		auto prepare_msg = [&](void *data, size_t len) {
+			iov = { data, len };
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_name		= &addr;
+			msg.msg_namelen		= sizeof(addr);
+			msg.msg_iov			= &iov;
+			msg.msg_iovlen		= 1;
+			msg.msg_control		= cbuf;
+			msg.msg_controllen	= sizeof(cbuf);
+		};
+		// エラーキューに戻ってきた送信タイムスタンプを、送ったプローブの記録に付ける
+		// 送ったパケットのコピー（ヘッダ付き）が返ってくるので、末尾の ECHO_PACKET の seq で突き合わせる
+		auto drain_tx_timestamps = [&](ECHO_SOCKETS& e) {
+			uint8_t		data[256];
+			PROBE_TS	ts;
+			ECHO_PACKET	sent;
 
-			selret = select(max_fd + 1, &rfds, NULL, NULL, &tv);
+			while (true) {
+				prepare_msg(data, sizeof(data));
+				if ((n = recvmsg(e.echo_sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)) < 0) { break; }
 
-			if (selret < 0) {
-				// 異常発生
-				if (errno == EINTR) continue;
+				bool	is_tx = false;
+				for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+					if (c->cmsg_level != IPPROTO_IP || c->cmsg_type != IP_RECVERR) { continue; }
 
-				perror_th("select : ");
-				exit(1);
+					const sock_extended_err	*ee = (const sock_extended_err*)CMSG_DATA(c);
+					is_tx = (ee->ee_origin == SO_EE_ORIGIN_TIMESTAMPING && ee->ee_info == SCM_TSTAMP_SND);
+				}
+				if (!is_tx || (msg.msg_flags & MSG_TRUNC) || n < (ssize_t)sizeof(ECHO_PACKET)) { continue; }
+
+				memcpy(&sent, data + n - sizeof(ECHO_PACKET), sizeof(ECHO_PACKET));
+				if (strncmp(sent.signature, SIGNATURE_ECHO, sizeof(sent.signature)) != 0) { continue; }
+
+				get_timestamps(msg, ts);
+				for (auto& s : e.status) {
+					if (s.seq == sent.header.seq) { s.tx_ts = ts; break; }
+				}
 			}
-			if (selret == 0) {
-				// タイムアウト
-				for (auto& e : echo_socks) {
+		};
+
+		// メインループからの経路の出し入れを反映する（付け直した経路はエコー用のソケットも作り直す）
+		auto apply_updates = [&]() {
+			uint64_t	dummy;
+
+			if (read(this->echo_wake, &dummy, sizeof(dummy)) < 0 && errno != EAGAIN) { perror_th("read(eventfd) : "); }
+			{
+				std::lock_guard<std::mutex>	lock(this->echo_mtx);
+				updates.swap(this->echo_updates);
+			}
+			for (const auto& u : updates) {
+				auto	it = std::find_if(echo_socks.begin(), echo_socks.end(),
+					[&u](const ECHO_SOCKETS& e) { return e.eth_name == u.eth_name; }
+				);
+				if (it != echo_socks.end()) {
+					close(it->echo_sock);
+					echo_socks.erase(it);
+				}
+				if (u.device_id == -1) {
+					pdebug_th("eth[%s]: echo socket closed\n", u.eth_name.c_str());
+					continue;
+				}
+				ECHO_SOCKETS	e;
+
+				e.server = u.server;
+				e.server.sin_port = htons(PORT_PING);
+				if (!this->_SetupSocket(e.echo_sock, udp_addrinfo(e.server), u.dev_name)) {
+					if (e.echo_sock != -1) { close(e.echo_sock); }
+					continue;	// データ用のソケットが作れたのに失敗するなら、次のリンクの変化を待つしかない
+				}
+				e.kernel_ts = enable_timestamping(e.echo_sock);
+				if (!e.kernel_ts) {
+					perror_th("setsockopt(SO_TIMESTAMPING) : ");
+					print_error_th("eth[%s]: kernel timestamps are not available, using user space clock\n", u.eth_name.c_str());
+				}
+				e.eth_name = u.eth_name;
+				e.device_id = u.device_id;
+				e.metrics = u.metrics;
+				e.budget = u.budget;
+				pdebug_th("echo_sockfd = %d, device_id = %d\n", e.echo_sock, e.device_id);
+
+				e.status.fill({ 0, -1, { 0, 0 } });
+				e.next_probe = monotonic_ns();
+				e.lost_in_row = 0;
+				echo_socks.emplace_back(std::move(e));
+			}
+			updates.clear();
+
+			max_fd = this->echo_wake;
+			for (const auto& e : echo_socks) { max_fd = max(max_fd, e.echo_sock); }
+		};
+
+		this->_BlockSignals();
+		lowlat_pin_thread(lowlat, THREAD_ECHO, "echo");
+		apply_updates();
+
+		while (true) {
+			now_ns = monotonic_ns();
+			next_event = now_ns + (uint64_t)PROBE_INTERVAL_MSEC * 1000 * 1000;
+
+			for (auto& e : echo_socks) {
+				const uint64_t	timeout = e.metrics->ProbeTimeout();
+
+				// 送信したプローブのタイムアウトを監視
+				for (auto& s : e.status) {
+					if (s.seq == -1) { continue; }
+					if (now_ns - s.sent_ns < timeout) {
+						next_event = std::min(next_event, s.sent_ns + timeout);
+						continue;
+					}
+					pdebug_th(
+						"ECHO PACKET TIMEOUT : sock_fd = %d, "
+						"device_id = %d, seq = %d\n",
+						e.echo_sock, e.device_id, s.seq
+					);
+					already_recvd_seq.push(s.seq);
+					e.metrics->OnProbeLost();
+					s.seq = -1;
+					e.next_probe = now_ns;	// すぐに次のプローブで確かめる
+
+					if (++e.lost_in_row >= PATH_DOWN_LOST_PROBES && e.metrics->MarkDown()) {
+						print_error_th("PATH DOWN : device_id = %d, %u probes lost\n", e.device_id, e.lost_in_row);
+					}
+					record_trace(e, now_ns, PATH_TRACE_KEEP);
+				}
+				if (now_ns >= e.next_probe) {
 					buf->header.device_id = e.device_id;
 					buf->header.seq = echo_seq;
-					buf->tm_start = system_clock::now();
+					buf->tx_ns = now_ns;
+					buf->client_id = client_id;
 
-					n = sendto(e.echo_sock, buf.get(), sizeof(ECHO_PACKET), 0, ai->ai_addr, sizeof(*ai->ai_addr));
+					n = sendto(e.echo_sock, buf.get(), sizeof(ECHO_PACKET), 0, (sockaddr*)&e.server, sizeof(e.server));
 
 					if (n < 0) {
+						// 回線落ち。データの振り替えはメインループが state を見て行う
 						perror_th("sendto : ");
-						// 回線落ち、パケットの振り替え処理へ
-						continue;
-					}
-					std::for_each(e.status.begin(), e.status.end(),
-						[&already_recvd_seq, &e](CONNECT_STATUS& s) {
-							// タイムアウトを 950ms に設定（selectが１秒でタイムアウトしたときに確実に真にするため）
-							// 送信したパケットのタイムアウトを監視
-							if (s.seq != -1 &&
-								duration_cast<milliseconds>(system_clock::now() - s.ping_sent_time).count() >= PING_TIMEOUT_MSEC) {
-								pdebug_th(
-									"ECHO PACKET TIMEOUT : sock_fd = %d, "
-									"device_id = %d, seq = %d\n",
-									e.echo_sock, e.device_id, s.seq
-								);
-								already_recvd_seq.push(s.seq);
-								s.ping_sent_time = system_clock::time_point().min();	// オーバーヘッドありそうなんだけど…
-								s.seq = -1;
-							}
+						e.lost_in_row++;
+						e.metrics->OnProbeLost();
+						if (is_path_error(errno) && e.metrics->MarkDown()) {
+							print_error_th("PATH DOWN : device_id = %d, errno = %d\n", e.device_id, errno);
 						}
-					);
-					e.status.push({ buf->tm_start, echo_seq });
+						record_trace(e, now_ns, PATH_TRACE_KEEP);
+					}
+					else {
+						e.status.push({ now_ns, echo_seq, { 0, 0 } });
+						if (e.budget) { e.budget->OnProbe(sizeof(ECHO_PACKET)); }	// 従量課金の回線ならプローブも送信量に入る
+					}
 					echo_seq++;
+
+					const uint32_t	interval = e.metrics->ProbeInterval(now_ns, e.lost_in_row);
+					e.metrics->probe_interval_ms.store(interval, std::memory_order_relaxed);
+					e.next_probe = now_ns + (uint64_t)interval * 1000 * 1000;
 				}
-				now_time = system_clock::now();
-				tv.tv_sec  = 1;
-				tv.tv_usec = 0;
-				continue;
+				next_event = std::min(next_event, e.next_probe);
+			}
+			now_ns = monotonic_ns();
+			const uint64_t	wait_us = (next_event > now_ns) ? (next_event - now_ns) / 1000 : 0;
+			tv.tv_sec  = wait_us / 1000000;
+			tv.tv_usec = wait_us % 1000000;
+
+			FD_ZERO(&rfds);
+			FD_SET(this->echo_wake, &rfds);
+			for (auto& e : echo_socks) { FD_SET(e.echo_sock, &rfds); }
+
+			selret = select(max_fd + 1, &rfds, NULL, NULL, &tv);
+
+			if (selret < 0) {
+				// 異常発生
+				if (errno == EINTR) continue;
+
+				perror_th("select : ");
+				exit(1);
+			}
+			if (selret == 0) { continue; }	// タイムアウト。プローブの送信とタイムアウト監視へ
+			if (FD_ISSET(this->echo_wake, &rfds)) {
+				apply_updates();
+				continue;	// echo_socks が変わったので rfds は使えない
 			}
+
 			for (auto& e : echo_socks) {
-				if (FD_ISSET(e.echo_sock, &rfds)) {
-					n = recvfrom(
-						e.echo_sock, buf.get(), sizeof(ECHO_PACKET),
-						MSG_WAITALL, (sockaddr*)&addr, &addr_len
-					);
-					if (n < 0) {
-						perror_th("recvfrom : ");
-						// errno == CONNECTION_REFUSED ?
-						// 回線落ち、パケット振り替え処理へ
-						continue;
-					}
-					if (strncmp(buf->header.signature, SIGNATURE_MANAGEMENT, sizeof(buf->header.signature)) != 0) {
-						pdebug_th("signature is not valid\n");
-						continue;
-					}
-					if (strncmp(buf->signature, SIGNATURE_ECHO, sizeof(buf->signature)) != 0) {
-						pdebug_th("signature is not valid\n");
-						continue;
-					}
-					const auto ars_it = std::find(already_recvd_seq.begin(), already_recvd_seq.end(), buf->header.seq);
-					if (ars_it != already_recvd_seq.end()) {
-						pdebug_th(
-							"sock_fd = %d, device_id = %d, seq = %d, "
-							"packet is already received. skip.\n",
-							e.echo_sock, buf->header.device_id, buf->header.seq
-						);
-						continue;
-					}
-					// 行きと帰りではパケットの経路が異なる
-					// d is device
-					const auto d = std::find_if(echo_socks.begin(), echo_socks.end(),
-						[&buf](const ECHO_SOCKETS& e) { return e.device_id == buf->header.device_id; }
-					);
-					if (d == echo_socks.end()) { continue; }
+				if (!FD_ISSET(e.echo_sock, &rfds)) { continue; }
 
-					auto diff_us = duration_cast<microseconds>(system_clock::now() - buf->tm_start);
+				// 送信タイムスタンプだけで起きることもある
+				if (e.kernel_ts) { drain_tx_timestamps(e); }
 
-					d->rtt_max = max(d->rtt_max, diff_us);
-					d->rtt_avg = (d->rtt_avg * d->recvd_count + diff_us) / (d->recvd_count + 1);
-					d->score = diff_us.count() / (double)d->rtt_max.count();
-					d->recvd_count++;
-					already_recvd_seq.push(buf->header.seq);
+				prepare_msg(buf.get(), sizeof(ECHO_PACKET));
+				n = recvmsg(e.echo_sock, &msg, MSG_DONTWAIT);
+				now_ns = monotonic_ns();
 
-					const auto sts_it = std::find_if(d->status.begin(), d->status.end(),
-						[&buf](const CONNECT_STATUS& c) { return c.seq == buf->header.seq; }
-					);
-					if (sts_it != d->status.end()) {
-						sts_it->ping_sent_time = system_clock::now();
-						sts_it->seq = -1;
-					}
+				if (n < 0) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK) { continue; }
+					perror_th("recvmsg : ");
+					// errno == CONNECTION_REFUSED ?
+					// プローブのタイムアウトとして扱われる
+					continue;
+				}
+				if (n != sizeof(ECHO_PACKET)) {
+					pdebug_th("invalid echo packet size : %zd\n", n);
+					continue;
+				}
+				if (strncmp(buf->header.signature, SIGNATURE_MANAGEMENT, sizeof(buf->header.signature)) != 0) {
+					pdebug_th("signature is not valid\n");
+					continue;
+				}
+				if (strncmp(buf->signature, SIGNATURE_ECHO, sizeof(buf->signature)) != 0) {
+					pdebug_th("signature is not valid\n");
+					continue;
+				}
+				get_timestamps(msg, rx_ts);
+
+				const auto ars_it = std::find(already_recvd_seq.begin(), already_recvd_seq.end(), buf->header.seq);
+				if (ars_it != already_recvd_seq.end()) {
 					pdebug_th(
-						"ECHO PACKET RECVD: sock_fd = %d, device_id = %d, seq = %d, "
-						"RTT = %d.%dms, max = %d.%dms, avg = %d.%dms, score = %.3f\n",
-						e.echo_sock, buf->header.device_id, buf->header.seq,
-						  diff_us.count() / 1000,   diff_us.count() % 1000,
-						d->rtt_max.count() / 1000, d->rtt_max.count() % 1000,
-						d->rtt_avg.count() / 1000, d->rtt_avg.count() % 1000,
-						d->score
+						"sock_fd = %d, device_id = %d, seq = %d, "
+						"packet is already received. skip.\n",
+						e.echo_sock, buf->header.device_id, buf->header.seq
 					);
+					continue;
+				}
+				// 行きと帰りではパケットの経路が異なる
+				// d is device
+				const auto d = std::find_if(echo_socks.begin(), echo_socks.end(),
+					[&buf](const ECHO_SOCKETS& e) { return e.device_id == buf->header.device_id; }
+				);
+				if (d == echo_socks.end()) { continue; }
+
+				// 送った経路の送信タイムスタンプがまだ読まれていなければ先に読む
+				if (d->kernel_ts && &*d != &e) { drain_tx_timestamps(*d); }
+
+				const auto sts_it = std::find_if(d->status.begin(), d->status.end(),
+					[&buf](const CONNECT_STATUS& c) { return c.seq == buf->header.seq; }
+				);
+				const PROBE_TS	tx_ts = (sts_it != d->status.end()) ? sts_it->tx_ts : PROBE_TS{ 0, 0 };
+				const uint64_t	user_rtt = now_ns - buf->tx_ns;	// tx_ns は自分が入れた monotonic_ns がそのまま返ってくる
+				bool			kernel;
+				const uint64_t	rtt_ns = probe_rtt_ns(tx_ts, rx_ts, &*d == &e, user_rtt, kernel);
+
+				d->metrics->OnRttSample((uint32_t)(rtt_ns / 1000));
+				if (kernel) { d->metrics->rtt_kernel_samples.fetch_add(1, std::memory_order_relaxed); }
+				already_recvd_seq.push(buf->header.seq);
+
+				d->lost_in_row = 0;
+				d->metrics->last_ok_ns.store(now_ns, std::memory_order_relaxed);
+				if (d->metrics->MarkUp()) {
+					print_info("[ECHO_THREAD] PATH UP : device_id = %d\n", d->device_id);
 				}
+				record_trace(*d, now_ns, rtt_ns / 1000);
+				if (sts_it != d->status.end()) {
+					sts_it->seq = -1;
+				}
+				pdebug_th(
+					"ECHO PACKET RECVD: sock_fd = %d, device_id = %d, seq = %d, "
+					"RTT = %lluus (%s, user %lluus), srtt = %uus, rttvar = %uus\n",
+					e.echo_sock, buf->header.device_id, buf->header.seq,
+					(unsigned long long)rtt_ns / 1000, kernel ? "kernel" : "user", (unsigned long long)user_rtt / 1000,
+					d->metrics->srtt_us.load(), d->metrics->rttvar_us.load()
+				);
 			}
-			auto usec = duration_cast<microseconds>(system_clock::now() - now_time).count();
-			tv.tv_sec  = 0;
-			tv.tv_usec = (suseconds_t)(1 * 1000 * 1000 - usec);
 		}
-		freeaddrinfo(ai);
 	}));
 #undef	perror_th
 #undef	print_error_th
 #undef	pdebug_th
 }
 
+void MPUDPTunnelClient::PrintStats() {
+	MPUDPTunnel::PrintStats();
+
+	for (const auto& s : this->socks) {
+		std::string	label = "RTT [" + s.eth_name + "]";
+		print_histogram(label.c_str(), s.metrics->rtt.snapshot(), "us");
+	}
+	print_info("transmit mode = %s, duplicated %llu / %llu packets\n",
+		mode2str(sched.mode), (unsigned long long)sched.duplicated, (unsigned long long)sched.packets);
+	for (const auto& b : budgets) {
+		char	cap[32] = "none", left[32] = "unlimited";
+
+		if (b->conf.rate != 0) { snprintf(cap, sizeof(cap), "%.2fMbps", b->conf.rate * 8 / 1e6); }
+		if (b->conf.quota != 0) { snprintf(left, sizeof(left), "%.2fMB", b->Remaining() / 1e6); }
+		print_info("COST [%s] cost = %u, rate cap = %s, used = %.2fMB (probes %.1fkB), remaining = %s%s\n",
+			b->conf.dev.c_str(), b->conf.cost, cap, b->Used() / 1e6, b->probed.load(std::memory_order_relaxed) / 1e3,
+			left, b->Exhausted() ? " (exhausted)" : "");
+	}
+	if (stripe.enable) {
+		print_info("stripe: %llu / %llu packets split (larger than %u bytes, chunks up to %u bytes)\n",
+			(unsigned long long)sched.striped, (unsigned long long)sched.packets, stripe.min, stripe.ChunkMax());
+	}
+	if (!budgets.empty()) {
+		print_info("metered paths carried %llu / %llu packets\n", (unsigned long long)sched.metered, (unsigned long long)sched.packets);
+	}
+	if (sched.flow_pinning) {
+		print_info("flow pinning: %zu active flows, flowlet gap = %lluus, switched %llu, forced %llu\n",
+			sched.flows.active(monotonic_ns(), FLOW_EXPIRE_NS), (unsigned long long)sched.flowlet_ns / 1000,
+			(unsigned long long)sched.flow_switches, (unsigned long long)sched.flow_forced);
+	}
+	for (const auto& s : this->socks) {
+		print_info(
+			"PATH [%s] %s srtt = %uus, rttvar = %uus, loss = %u.%u%%, down %u times, "
+			"probe every %ums, kernel timestamps %u / %u\n",
+			s.eth_name.c_str(), (s.sock_fd == -1) ? "DETACHED" : s.path_up ? "UP" : "DOWN",
+			s.metrics->srtt_us.load(), s.metrics->rttvar_us.load(),
+			s.metrics->loss_permille.load() / 10, s.metrics->loss_permille.load() % 10,
+			s.metrics->down_count.load(), s.metrics->probe_interval_ms.load(),
+			s.metrics->rtt_kernel_samples.load(), s.metrics->rtt_samples.load()
+		);
+	}
+	for (const auto& s : this->socks) {
+		if (!s.xdp) { continue; }
+		print_info("XDP [%s] %s/%s rx %llu, tx %llu, via socket %llu, tx ring full %llu\n",
+			s.eth_name.c_str(), s.xdp->is_zerocopy() ? "zero-copy" : "copy", s.xdp->is_skb_mode() ? "generic" : "native",
+			(unsigned long long)s.xdp->rx_frames.load(), (unsigned long long)s.xdp->tx_frames,
+			(unsigned long long)s.xdp->tx_via_sock, (unsigned long long)s.xdp->tx_ring_full);
+	}
+	if (qos.Enabled()) { qos.PrintStats(); }
+	print_info("rescued %llu packets from failed paths\n", (unsigned long long)rescued);
+	if (sock_nl != -1) {
+		print_info("link monitor: detached %llu times, attached %llu times\n",
+			(unsigned long long)detached, (unsigned long long)attached);
+	}
+	for (const auto& s : this->socks) {
+		print_info(
+			"CC  [%s] %s btl_bw = %.2fMbps, pacing = %.2fMbps, cwnd = %llu bytes, min_rtt = %uus\n",
+			s.eth_name.c_str(), (s.cc.state == CC_STARTUP) ? "STARTUP" : "PROBE",
+			s.cc.btl_bw * 8 / 1e6, s.cc.pacing_rate * 8 / 1e6,
+			(unsigned long long)s.cc.cwnd, s.cc.min_rtt_us
+		);
+	}
+}
+
+// 経路の状態（エコースレッドが書く）の変化を拾い、落ちた経路の送信済みパケットを送り直す
+// 計測値の輻輳制御への反映はスケジューラが行う
+void MPUDPTunnelClient::_PollMetrics(uint64_t now) {
+	for (auto& s : this->socks) {
+		const bool	up = s.sock_fd != -1 && s.metrics->IsUp();
+
+		if (!sched.SetPathUp(s, up)) { continue; }
+		if (!up) {
+			this->_RescuePath(s);
+		}
+		else {
+			print_info("eth[%s]: path is back\n", s.eth_name.c_str());
+		}
+	}
+	sched.OnMetrics(now);
+	for (auto& s : this->socks) {
+		s.metrics->rate_kbps.store((uint32_t)(s.cc.btl_bw * 8 / 1000), std::memory_order_relaxed);
+	}
+}
+
+SOCKET_PACK* MPUDPTunnelClient::_RepairPath(SOCKET_PACK *from) {
+	return sched.RepairPath(from);
+}
+
+void MPUDPTunnelClient::_OnRepairSent(SOCKET_PACK& s, uint64_t now, uint32_t wire_len) {
+	sched.Charge(s, now, wire_len);
+}
+
+void MPUDPTunnelClient::_OnOwdReport(SOCKET_PACK& s, uint64_t now) {
+	s.cc.OnOwdReport(now, s.owd_tx.qdelay_us, s.owd_tx.trend_us);
+}
+
+void MPUDPTunnelClient::_OnFeedback(SOCKET_PACK& s, uint64_t now) {
+	s.cc.OnFeedback(now, s.fb.interval_loss, s.fb.delivery_rate);
+}
+
+// 経路断を示すエラーを受けたら、エコースレッドの判断を待たずにすぐ経路を外す
+// 戻ったかどうかはエコースレッドのプローブが判断する
+void MPUDPTunnelClient::_OnPathError(SOCKET_PACK& s, int err) {
+	if (s.metrics->MarkDown()) {
+		print_error("eth[%s]: path is down (errno = %d)\n", s.eth_name.c_str(), err);
+	}
+	if (sched.SetPathUp(s, false)) { this->_RescuePath(s); }
+}
+
+// _sendto が記録した送信エラーを確認する
+void MPUDPTunnelClient::_CheckSendErrors() {
+	for (auto& s : this->socks) {
+		if (s.send_errno == 0) { continue; }
+
+		const int	err = s.send_errno;
+		s.send_errno = 0;
+		if (is_path_error(err)) { this->_OnPathError(s, err); }
+	}
+}
+
+/*
+ * 落ちた経路に送ったパケットのうち、最後に経路が生きていると確認できた時点（プローブの応答）より後に
+ * 送ったものを、生き残った経路のうち最も安く速い経路で送り直す（ただし RESCUE_WINDOW_NS より古いものは諦める）。
+ * 届いていたかどうかはわからないので、重複は受信側の seq_window に任せる。
+ * 内側の TCP が再送タイムアウトで何秒も止まるよりは、多少の重複の方がずっと安い。
+ */
+void MPUDPTunnelClient::_RescuePath(SOCKET_PACK& failed) {
+	SOCKET_PACK	*alt = nullptr;
+	uint32_t	n = 0;
+
+	for (auto& s : this->socks) {
+		if (&s == &failed || !s.path_up || !sched.Usable(s)) { continue; }
+		if (alt == nullptr || path_cost(s) < path_cost(*alt) ||
+			(path_cost(s) == path_cost(*alt) && path_score(s) < path_score(*alt))) {
+			alt = &s;
+		}
+	}
+	if (alt == nullptr || !failed.rescue) {
+		print_error("eth[%s]: no surviving path\n", failed.eth_name.c_str());
+		return;
+	}
+	const uint64_t	now = monotonic_ns();
+	const uint64_t	srtt_ns = (uint64_t)failed.metrics->srtt_us.load(std::memory_order_relaxed) * 1000;
+	const uint64_t	last_ok = failed.metrics->last_ok_ns.load(std::memory_order_relaxed);
+	uint64_t		since = (now > RESCUE_WINDOW_NS) ? now - RESCUE_WINDOW_NS : 0;
+
+	// 応答が返ってきたプローブの片道分だけさかのぼる
+	if (last_ok > srtt_ns / 2 && last_ok - srtt_ns / 2 > since) { since = last_ok - srtt_ns / 2; }
+
+	// 古い順に送る
+	for (uint32_t i = 0; i < RESCUE_RING_SIZE; i++) {
+		const RESCUE_ENTRY&	e = failed.rescue->entries[(failed.rescue->head + i) % RESCUE_RING_SIZE];
+
+		uint16_t		len;
+		const uint8_t	*data;
+
+		// 送った場所がもう次のパケットに使われていれば諦める
+		if (e.sent_ns == 0 || e.sent_ns < since || (data = this->GetSentData(e.seq_all, len)) == nullptr) { continue; }
+		this->Resend(*alt, e.seq_all, data, len);
+		sched.Charge(*alt, now, sizeof(TUN_HEADER) + len);
+		n++;
+	}
+	failed.rescue->clear();
+	rescued += n;
+	print_info("eth[%s]: rescued %u packets via %s\n", failed.eth_name.c_str(), n, alt->eth_name.c_str());
+}
+
+// エコースレッドに経路の出し入れを伝える（エコー用のソケットはエコースレッドが作り直す）
+void MPUDPTunnelClient::_NotifyEcho(const SOCKET_PACK& s) {
+	const uint64_t	one = 1;
+
+	{
+		std::lock_guard<std::mutex>	lock(echo_mtx);
+		echo_updates.push_back({ s.eth_name, s.dev_name, s.remote_addr, (s.sock_fd == -1) ? -1 : s.DeviceId(), s.metrics, s.budget });
+	}
+	if (write(echo_wake, &one, sizeof(one)) < 0) {
+		perror("write(eventfd)");
+	}
+}
+
+/*
+ * 経路を付け直す：データ用のソケットを作り直してスケジューラに戻す
+ * 経路の状態は落ちたままにしておき、エコースレッドのプローブに応答があった時点で _PollMetrics が使い始める
+ * 輻輳制御は前の接続の見積もりが当てにならないので初期化する
+ */
+void MPUDPTunnelClient::_AttachPath(SOCKET_PACK& s) {
+	if (s.sock_fd != -1 || !nl_link_ready(s.dev_name)) { return; }
+	if (!this->_OpenPath(s)) { return; }
+
+	s.cc = PATH_CC();
+	s.send_errno = 0;
+	s.metrics->MarkDown();
+	if (sock_shared == -1) { this->_SetSourceFd(this->_PathIndex(s), s.sock_fd, s.xdp.get()); }
+	attached++;
+	print_info("eth[%s]: path attached (fd = %d, local addr: %s)\n",
+		s.eth_name.c_str(), s.sock_fd, inet_ntoa(s.local_addr.sin_addr));
+	this->_NotifyEcho(s);
+}
+
+// 経路を外す：送信済みのパケットを他の経路で送り直してからソケットを閉じる（閉じるのは RX が読まなくなってから）
+void MPUDPTunnelClient::_DetachPath(SOCKET_PACK& s, const char *reason) {
+	if (s.sock_fd == -1) { return; }
+
+	s.metrics->MarkDown();
+	if (sched.SetPathUp(s, false)) { this->_RescuePath(s); }
+	// -M の経路は共有ソケットを借りているだけなので閉じない
+	if (sock_shared == -1) { this->_RetireFd(this->_PathIndex(s), s.sock_fd, std::move(s.xdp)); }
+	s.sock_fd = -1;
+	detached++;
+	print_info("eth[%s]: path detached (%s)\n", s.eth_name.c_str(), reason);
+	this->_NotifyEcho(s);
+}
+
+/*
+ * rtnetlink のイベントで経路を出し入れする
+ * リンクが落ちた（キャリアが消えた、デバイスが消えた）ら外し、戻ってアドレスが付いたら付け直す。
+ * 送信元に使っていたアドレスが外れたら、connect した UDP ソケットはそのアドレスのままなので作り直す。
+ */
+void MPUDPTunnelClient::_OnLinkEvents() {
+	std::vector<LINK_EVENT>	events;
+
+	if (nl_read_events(sock_nl, events) < 0) {
+		// イベントを取りこぼしたので、今の状態から見直す
+		for (auto& s : this->socks) {
+			if (s.sock_fd != -1 && !nl_link_ready(s.dev_name)) { this->_DetachPath(s, "link lost"); }
+			else { this->_AttachPath(s); }
+		}
+	}
+	// サーバーの接続先が複数なら、１つのデバイスに経路が接続先の数だけある
+	for (const auto& ev : events) {
+		for (auto& s : this->socks) {
+			if (s.dev_name != ev.ifname) { continue; }
+
+			switch (ev.type) {
+			case LINK_EV_UP:
+			case LINK_EV_ADDR_ADD:
+				this->_AttachPath(s);
+				break;
+			case LINK_EV_DOWN:
+				this->_DetachPath(s, "link down");
+				break;
+			case LINK_EV_ADDR_DEL:
+				if (s.sock_fd != -1 && s.local_addr.sin_addr.s_addr == ev.addr.s_addr) {
+					this->_DetachPath(s, "address removed");
+					this->_AttachPath(s);	// 別のアドレスが残っていればすぐに付け直せる
+				}
+				break;
+			}
+		}
+	}
+}
+
 /*
- * クライアントモード送受ループ
- * クライアントモードモードでは、socks の各要素はそれぞれの eth デバイスに割り当てられたソケット
- * イテレータを走査してデータを受信する
+ * クライアントモード送信ループ（TX スレッド）
+ * クライアントモードでは、socks の各要素はそれぞれの eth デバイスに割り当てられたソケット
+ * 受信は RX スレッド（pipeline.cpp）が行い、制御フレームや経路のエラーは RX からの依頼として受け取る
  */
 bool MPUDPTunnelClient::MainLoop() {
 	fd_set	rfds;
 	int		max_fd = -1;
 
-	auto socks_it = socks.begin();
-	auto phead = this->GetHeader();
-	auto pdata = this->GetDataPtr();
+	uint8_t	*ptx = this->GetTxDataPtr();	// TUN から読んだパケット（送るたびに次の場所に変わる）
 
-	uint32_t	nread, nwrite;
+	uint32_t	nread;
 	uint32_t	tun_seq = 0;
+	uint64_t	t_start;
+	uint64_t	now, wait_ns = 0, nl_checked_ns = 0;
+	timeval		tv;
+	bool		tun_ready, tun_wanted, tun_readable, nl_readable;
+	uint8_t		cls;			// -Q：キューから出したパケットのクラス
+	bool		held = false;	// ptx のパケットを、送れる経路が空くまで持っている
+	bool		held_urgent = false;
+	uint64_t	held_ns = 0;
 
-	/*
-	 * 受信済みのパケット番号を記録する場所
-	 * MODE_STABLE で送信されたパケットは全部の経路に同じものを流して冗長化するので、
-	 * 受信側で「すでに受信した」パケットは廃棄する必要がある。
-	 * このバッファは溢れた場合、古いものから自動的に削除される仕組み。
-	 */
-	ringbuf<decltype(GetHeader()->seq_all), 32>	seq_rec(-1);
+	std::vector<SOCKET_PACK*>	paths(max(socks.size(), (size_t)2));	// sched.Select が選んだ経路
+	SOCKET_PACK	*chunk_paths[STRIPE_MAX_CHUNKS];	// -S：sched.Stripe が分けた断片ごとの経路と長さ
+	uint16_t	chunk_lens[STRIPE_MAX_CHUNKS];
+	int			n;
 
-	std::for_each(
-		socks.begin(), socks.end(),
-		[&max_fd](const SOCKET_PACK& x){ max_fd = max(x.sock_fd, max_fd); }
-	);
-	max_fd = max(this->sock_tun, max_fd);
+	sched.paths_up = std::count_if(socks.begin(), socks.end(), [](const SOCKET_PACK& s) { return s.path_up; });
+
+	// TUN から読んだ（-Q ならキューから出した）ptx の nread バイトを経路に流す
+	// 読む前の確認（Ready）は長さを知らずに PATH_NOMINAL_PACKET で見ているので、実際のフレーム長（分割するなら断片１つ分）で
+	// 送れる経路がなければ送らずに持っておき（held）、送れるようになるまで TUN から読まない（wait_ns はその待ち時間）
+	// 確認と経路の選択は同じ長さと時刻で行う（ずれると、確認で通ったのに選べる経路がないことがある）
+	auto forward = [&](uint64_t t_read, bool urgent) {
+		const uint32_t	wire_len = this->_Striping(nread) ?
+			sizeof(TUN_HEADER) + sizeof(STRIPE_HEADER) + stripe.ChunkMax() : sizeof(TUN_HEADER) + nread;
+		const uint64_t	t_send = monotonic_ns();
+
+		held = !sched.Ready(t_send, wait_ns, wire_len);
+		if (held) {
+			held_ns = t_read;
+			held_urgent = urgent;
+			return;
+		}
+		this->_ArqOnTunRead(t_read, nread);
+		if (this->_Striping(nread)) {
+			n = sched.Stripe(t_send, stripe, nread, chunk_paths, chunk_lens);
+			if (n > 0) { this->SendStriped(chunk_paths, chunk_lens, n, nread); }
+			sched.OnStriped(t_send, chunk_paths, chunk_lens, n);
+			this->_CheckSendErrors();
+			hist_tx.record(monotonic_ns() - t_read);
+			return;
+		}
+		n = sched.Select(t_send, ptx, nread, paths.data(), urgent);
+		if (n > 1 || (n > 0 && sched.mode == MODE_STABLE)) {
+			this->SendToDevices(paths.data(), n, nread);	// 複製
+		}
+		else if (n == 1) {
+			this->SendTo(*paths[0], nread);
+		}
+		sched.OnSent(t_send, paths.data(), n, nread);
+		this->_CheckSendErrors();
+		hist_tx.record(monotonic_ns() - t_read);
+	};
 
 	while (true) {
+		if (_global_fDumpStats) {
+			_global_fDumpStats = 0;
+			this->DumpStats();
+		}
 
-		// 初期化と使用するソケットのシステム側への通知
-		FD_ZERO(&rfds);
-		FD_SET(this->sock_tun, &rfds);
-		for (const auto& s : this->socks) { FD_SET(s.sock_fd, &rfds); }
+		now = monotonic_ns();
+		this->_TxDrainPipe();
+		this->_PollMetrics(now);
 
-		// データを受信するまで待機
-		if (select(max_fd + 1, &rfds, NULL, NULL, NULL) < 0) {
-			if (errno == EINTR) continue;
+		// 送信できる経路がない間は TUN から読まない（パケットは TUN のキューに溜まる）
+		// -Q なら、輻輳制御やレートの上限で待っているだけの間は読んでクラスごとのキューに溜める（経路が空いたら優先度の高いものから送る）
+		// 使える経路が１つもない（wait_ns == UINT64_MAX）ならキューにも溜めない。溜めても送れず、TUN のキューで落ちるのと変わらない
+		if (held) { forward(held_ns, held_urgent); }
+		tun_ready = !held && sched.Ready(now, wait_ns);
+		for (int k = 0; tun_ready && qos.Enabled() && !qos.Empty() && k < QOS_DRAIN_BATCH; k++) {
+			ptx = this->GetTxDataPtr();
+			nread = qos.Pop(now, ptx, cls);
+			forward(now, cls == QOS_RT);
+			now = monotonic_ns();
+			tun_ready = !held && sched.Ready(now, wait_ns);
+		}
+		tun_wanted = !held && (tun_ready || (qos.Enabled() && wait_ns != UINT64_MAX));	// 持っているパケットを上書きしない
+		if (tun_ready) { wait_ns = (qos.Enabled() && !qos.Empty()) ? 0 : UINT64_MAX; }
 
-			perror("select()");
-			print_error("errno = %d\n", errno);
-			return false;
+		if (lowlat.spin) {
+			// -L spin：眠らずに TUN を読みに行く（リンクの監視は時々見る）
+			tun_readable = tun_wanted;
+			nl_readable = (this->sock_nl != -1 && now - nl_checked_ns >= LOWLAT_SPIN_CHECK_NS);
+			if (nl_readable) { nl_checked_ns = now; }
+			this->_PollUpgrade(now);
 		}
-		if (FD_ISSET(this->sock_tun, &rfds)) {
+		else {
+			if (this->_TxSleepBegin()) { wait_ns = 0; }	// RX からの依頼が来ていれば待たない
+			tv.tv_sec  = wait_ns / 1000000000ULL;
+			tv.tv_usec = (wait_ns % 1000000000ULL) / 1000;
+
+			// 初期化と使用するソケットのシステム側への通知
+			FD_ZERO(&rfds);
+			max_fd = max(max(this->sock_tun, this->sock_nl), this->_TxWakeFd());
+			if (tun_wanted) { FD_SET(this->sock_tun, &rfds); }
+			if (this->sock_nl != -1) { FD_SET(this->sock_nl, &rfds); }
+			FD_SET(this->_TxWakeFd(), &rfds);
+			if (this->_UpgradeFd() != -1) {
+				FD_SET(this->_UpgradeFd(), &rfds);
+				max_fd = max(max_fd, this->_UpgradeFd());
+			}
+
+			// データを受信するまで待機
+			if (select(max_fd + 1, &rfds, NULL, NULL, (wait_ns == UINT64_MAX) ? NULL : &tv) < 0) {
+				this->_TxSleepEnd(false);
+				if (errno == EINTR) continue;
+
+				perror("select()");
+				print_error("errno = %d\n", errno);
+				return false;
+			}
+			this->_TxSleepEnd(FD_ISSET(this->_TxWakeFd(), &rfds));
+			tun_readable = FD_ISSET(this->sock_tun, &rfds);
+			nl_readable = (this->sock_nl != -1 && FD_ISSET(this->sock_nl, &rfds));
+			if (this->_UpgradeFd() != -1 && FD_ISSET(this->_UpgradeFd(), &rfds)) { this->_OnUpgradeRequest(); }
+		}
+		if (nl_readable) {
+			this->_OnLinkEvents();
+		}
+		if (tun_readable) {
 			/* 
 			 * TUN デバイス側からデータを受信
 			 * ここに書き込まれるデータは生のIPパケット
 			 * ETH デバイスを選定してデータを書き込む（ネットワーク側に流す）
 			 */
 			try {
-				pdebug("\n===== TUN DEVICE RECEIVED DATA =====\n");
-				std::lock_guard<std::mutex>	lock(buf_mtx);	// try の間はバッファを占有
-
-				// this->data_buf にデータを書き込んでおくと勝手に運んでくれる
-				nread = tun_eread(sock_tun, pdata, BUFSIZE);
-				pdebug_tunrecv(tun_seq, nread, pdata);
+				// 送信用のペイロード位置に直接読む。経路ごとのヘッダは送るときに付く
+				ptx = this->GetTxDataPtr();
+				nread = lowlat.spin ? tun_nbread(sock_tun, ptx, this->_TunReadSize()) : tun_eread(sock_tun, ptx, this->_TunReadSize());
+				if (nread == 0) {
+					cpu_relax();
+					continue;
+				}
+				t_start = monotonic_ns();
+				trace_debug(TEV_TUN_RECV, tun_seq, nread, 0, 0, 0, 0, ptx, nread);
+				capture_tap(CAPTURE_IF_TUN, CAPTURE_DIR_OUT, ptx, nread, -1, this->GetSeq(), 0);
 				tun_seq++;
 
-				// ラウンドロビンでデータを送る
-				// ここにパケットを効率よく分散する機構を組み込む
-				nwrite = this->SendTo(*socks_it, nread);
-				pdebug("packet was sent to eth device = %s: %lu bytes\n", socks_it->eth_name.c_str(), nwrite);
-
-				socks_it++;
-				if (socks_it == socks.cend()) { socks_it = socks.begin(); }
+				if (qos.Enabled()) {
+					qos.Push(t_start, ptx, nread);
+				}
+				else {
+					forward(t_start, false);
+				}
 			} catch (std::exception& e) {
 				perror("eread / sendto");
 				print_error("errno = %d\n", errno);
 				print_error("%s - the data will be discarded. Continue.\n", e.what());
 			}
 		}
-		for (auto& s : this->socks) {
-			if (FD_ISSET(s.sock_fd, &rfds)) {
-				/* 
-				 * ETH デバイス側からデータを受信
-				 * パケットサイズがMTUを超える場合、パケットは複数に分割される
-				 * この分割、また受信時の再合成の処理はより低いレイヤー（ネットワーク層）で行われるので、
-				 * UDPのレイヤでは特に考えなくて良い。ただし、パケットが遅れて到着する可能性はあるので、
-				 * 送信したバイト数を読み切るまで待機する処理が必要（ここでは readn が行う）
-				 */
-				try {
-					pdebug("\n===== ETH DEVICE [%s] RECEIVED DATA =====\n", s.eth_name.c_str());
-					std::lock_guard<std::mutex>	lock(buf_mtx);	// try の間はバッファを占有
-					sockaddr_in	addr_from;
-
-					nread = this->RecvFrom(s, &addr_from);
-
-					pdebug_ethrecv(phead->seq_all, nread, (uint8_t*)phead, addr_from);
-
-					if (phead->mode == MODE_STABLE) {
-						const auto it = std::find(seq_rec.begin(), seq_rec.end(), phead->seq_all);
-
-						pdebug("seq = %d\n", phead->seq_all);
-
-						if (it != seq_rec.end()) {
-							pdebug("packet was already received: skip.\n");
-							continue;
-						}
-						seq_rec.push(phead->seq_all);
-					}
-					nwrite = tun_ewrite(sock_tun, pdata, phead->length);
-					pdebug("packet was sent to tun seq=%d : write %lu bytes\n", phead->seq_all, nwrite);
-				}
-				catch (std::exception &e) {
-					perror("recvfrom / ewrite");
-					pdebug("errno = %d\n", errno);
-					print_error("%s - the data will be discarded. Continue.\n", e.what());
-				}
-			}
+		else if (lowlat.spin) {
+			cpu_relax();
 		}
 	}
 	this->th_echo->join();
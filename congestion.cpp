@@ -0,0 +1,136 @@
+#include "mpudpdef.h"
+#include "congestion.h"
+
+_PATH_CC::_PATH_CC() :
+	state(CC_STARTUP), btl_bw(CC_INIT_RATE), inflight(0),
+	last_drain_ns(0), next_send_ns(0), min_rtt_us(0), min_rtt_stamp_ns(0), rtt_seen(0),
+	sample_start_ns(0), sample_bytes(0), sample_limited(false), owd_qdelay_us(0), last_cut_ns(0) {
+	_Update();
+}
+
+void _PATH_CC::_Update() {
+	const uint64_t	rtt_us = (min_rtt_us > 0) ? min_rtt_us : 100 * 1000;	// RTT 未計測の間は 100ms とみなす
+
+	if (btl_bw < CC_MIN_RATE) { btl_bw = CC_MIN_RATE; }
+	if (btl_bw > CC_MAX_RATE) { btl_bw = CC_MAX_RATE; }
+
+	pacing_rate = btl_bw * 5 / 4;
+	// BDP の２倍に、許容するキューイング遅延分を足す（RTT が極端に小さい経路でバーストが詰まらないように）
+	cwnd = btl_bw * (2 * rtt_us + CC_QDELAY_TARGET_US) / 1000000;
+	if (cwnd < CC_MIN_CWND) { cwnd = CC_MIN_CWND; }
+}
+
+void _PATH_CC::Restore(uint64_t now_ns, CC_STATE st, uint64_t bw, uint32_t rtt_us) {
+	state = st;
+	btl_bw = bw;
+	min_rtt_us = rtt_us;
+	min_rtt_stamp_ns = now_ns;
+	_Update();
+}
+
+void _PATH_CC::_Drain(uint64_t now_ns) {
+	if (last_drain_ns != 0 && now_ns > last_drain_ns) {
+		inflight -= (double)(now_ns - last_drain_ns) * btl_bw / 1e9;
+		if (inflight < 0) { inflight = 0; }
+	}
+	last_drain_ns = now_ns;
+}
+
+bool _PATH_CC::CanSend(uint64_t now_ns, uint32_t len) {
+	_Drain(now_ns);
+	return now_ns >= next_send_ns && inflight + len <= cwnd;
+}
+
+bool _PATH_CC::WithinCwnd(uint64_t now_ns, uint32_t len) {
+	_Drain(now_ns);
+	return inflight + len <= cwnd;
+}
+
+uint64_t _PATH_CC::ReadyTime(uint64_t now_ns, uint32_t len) {
+	uint64_t	t = (next_send_ns > now_ns) ? next_send_ns : now_ns;
+
+	_Drain(now_ns);
+	if (inflight + len > cwnd) {
+		const uint64_t	t_cwnd = now_ns + (uint64_t)((inflight + len - cwnd) * 1e9 / btl_bw);
+		if (t_cwnd > t) { t = t_cwnd; }
+	}
+	return t;
+}
+
+void _PATH_CC::OnSend(uint64_t now_ns, uint32_t len) {
+	uint64_t	base = (now_ns > CC_PACING_BURST_NS) ? now_ns - CC_PACING_BURST_NS : 0;
+
+	_Drain(now_ns);
+	inflight += len;
+	if (next_send_ns > base) { base = next_send_ns; }
+	next_send_ns = base + (uint64_t)len * 1000000000ULL / pacing_rate;
+
+	if (sample_start_ns == 0) { sample_start_ns = now_ns; }
+	sample_bytes += len;
+}
+
+uint32_t _PATH_CC::_Target() const {
+	return (min_rtt_us / 4 > CC_QDELAY_TARGET_US) ? min_rtt_us / 4 : CC_QDELAY_TARGET_US;
+}
+
+// 混雑：送れていたレート（アプリ側律速ならそもそもの推定値）の９割まで落としてキューを吐かせる
+// 下げた効果が見えるまで（min_rtt と報告１回分）は、同じ混雑で重ねて下げない
+void _PATH_CC::_Cut(uint64_t now_ns) {
+	const uint64_t	holdoff = (uint64_t)min_rtt_us * 1000 + OWD_REPORT_NS;
+	const uint64_t	elapsed = (sample_start_ns != 0 && now_ns > sample_start_ns) ? now_ns - sample_start_ns : 0;
+	const uint64_t	rate = (elapsed > 0) ? sample_bytes * 1000000000ULL / elapsed : 0;
+
+	if (last_cut_ns != 0 && now_ns - last_cut_ns < holdoff) { return; }
+
+	const uint64_t	base = (sample_limited && rate > 0 && rate < btl_bw) ? rate : btl_bw;
+	btl_bw = base * 9 / 10;
+	state = CC_PROBE;
+	last_cut_ns = now_ns;
+}
+
+void _PATH_CC::OnRttSample(uint64_t now_ns, uint32_t rtt_us) {
+	// min_rtt は一定時間ごとに取り直す（経路が変わったときに古い値を引きずらないため）
+	if (min_rtt_us == 0 || rtt_us <= min_rtt_us || now_ns - min_rtt_stamp_ns > CC_MINRTT_WINDOW_NS) {
+		min_rtt_us = rtt_us;
+		min_rtt_stamp_ns = now_ns;
+	}
+	const uint32_t	qdelay_us = rtt_us - min_rtt_us;
+
+	if (qdelay_us > this->_Target()) {
+		this->_Cut(now_ns);
+	}
+	else if (sample_limited && owd_qdelay_us <= (int32_t)this->_Target()) {
+		// 帯域を使い切っていたのに遅延が伸びていない = まだ余裕がある
+		btl_bw = (state == CC_STARTUP) ? btl_bw * 2 : btl_bw * 5 / 4;
+	}
+	_Update();
+
+	sample_start_ns = now_ns;
+	sample_bytes = 0;
+	sample_limited = false;
+}
+
+// 片道遅延は往復より早く（送信方向のキューだけを）見られる。伸び続けている間だけ下げ、増やすのは RTT サンプルに任せる
+void _PATH_CC::OnOwdReport(uint64_t now_ns, int32_t qdelay_us, int32_t trend_us) {
+	owd_qdelay_us = qdelay_us;
+	if (qdelay_us <= (int32_t)this->_Target() || trend_us <= 0) { return; }
+
+	this->_Cut(now_ns);
+	_Update();
+}
+
+// 帯域を使い切っていて、キューが溜まったまま送った分が届いていない = ボトルネックのキューから溢れている
+// キューが伸びきって片道遅延が横ばいになると OnOwdReport では下げられないので、その分をここで拾う
+// キューが溜まっていない損失（無線のランダムな損失など）では下げない
+void _PATH_CC::OnFeedback(uint64_t now_ns, uint32_t loss_permille, uint64_t delivery_rate) {
+	const uint64_t	holdoff = (uint64_t)min_rtt_us * 1000 + OWD_REPORT_NS;
+
+	if (loss_permille < CC_LOSS_PERMILLE || !sample_limited || delivery_rate == 0 || delivery_rate >= btl_bw) { return; }
+	if (owd_qdelay_us <= (int32_t)this->_Target()) { return; }
+	if (last_cut_ns != 0 && now_ns - last_cut_ns < holdoff) { return; }
+
+	btl_bw = delivery_rate;
+	state = CC_PROBE;
+	last_cut_ns = now_ns;
+	_Update();
+}
@@ -0,0 +1,66 @@
+#ifndef	__CONGESTION_H__
+#define	__CONGESTION_H__
+
+#include <stdint.h>
+
+typedef enum _CC_STATE {
+	CC_STARTUP,		// 遅延が伸びるまで推定帯域を倍々で増やす
+	CC_PROBE		// 遅延を見ながら少しずつ増やし、混雑したら実測レートまで落とす
+} CC_STATE;
+
+/*
+ * 経路ごとの遅延ベース輻輳制御（BBR 風）とユーザ空間ペーサー
+ * 推定ボトルネック帯域 btl_bw から
+ *   pacing_rate = 1.25 * btl_bw（これより速くは送らない）
+ *   cwnd        = btl_bw * (2 * min_rtt + 許容キューイング遅延)
+ * を決め、経路内の滞留量（inflight）は btl_bw で排出される流体として見積もる。
+ * btl_bw はエコーの RTT サンプルごとに、キューイング遅延（RTT - min_rtt）と
+ * その区間にこちらが送ったレート（送信レート。届いたかどうかは見ない）を見て更新する。
+ * 受信側から片道遅延の報告（数ミリ秒ごと）が届けば、プローブを待たずにそれで混雑を判断して下げる。
+ * キューが溜まったまま受信報告（feedback.h）の区間の損失が CC_LOSS_PERMILLE を超えていれば、受信側に実際に届いたレートまで下げる。
+ * メインループのスレッドだけが触ること。
+ */
+typedef struct _PATH_CC {
+	CC_STATE	state;
+	uint64_t	btl_bw;			// bytes/s
+	uint64_t	pacing_rate;	// bytes/s
+	uint64_t	cwnd;			// bytes
+	double		inflight;		// bytes
+	uint64_t	last_drain_ns;
+	uint64_t	next_send_ns;
+
+	uint32_t	min_rtt_us;
+	uint64_t	min_rtt_stamp_ns;
+	uint32_t	rtt_seen;		// 処理済みの RTT サンプル数（PATH_METRICS::rtt_samples と比べる）
+
+	// 送信レートのサンプル区間（こちらが送った量。受信側に届いたレートは受信報告の delivery_rate）
+	uint64_t	sample_start_ns;
+	uint64_t	sample_bytes;
+	bool		sample_limited;	// 区間中に輻輳制御で送信を止めたことがあるか（= 帯域を使い切っていたか）
+
+	int32_t		owd_qdelay_us;	// 最新の片道遅延の報告（これが目標を超えている間は増やさない）
+	uint64_t	last_cut_ns;	// 最後に混雑で btl_bw を下げた時刻
+
+	_PATH_CC();
+
+	bool CanSend(uint64_t now_ns, uint32_t len);
+	bool WithinCwnd(uint64_t now_ns, uint32_t len);		// ペーシングは無視して cwnd だけ見る
+	uint64_t ReadyTime(uint64_t now_ns, uint32_t len);	// 送信可能になる時刻
+	void OnSend(uint64_t now_ns, uint32_t len);
+	void OnRttSample(uint64_t now_ns, uint32_t rtt_us);
+	void OnOwdReport(uint64_t now_ns, int32_t qdelay_us, int32_t trend_us);	// 受信側から報告された送信方向のキューイング遅延
+	void OnFeedback(uint64_t now_ns, uint32_t loss_permille, uint64_t delivery_rate);	// 受信報告の区間の損失率と配送レート
+
+	inline void SetLimited() { sample_limited = true; }
+
+	// 別のプロセスから引き継いだ推定値で始める（-U）。滞留とペーシングは空から
+	void Restore(uint64_t now_ns, CC_STATE st, uint64_t bw, uint32_t rtt_us);
+
+private:
+	void _Drain(uint64_t now_ns);
+	void _Update();
+	uint32_t _Target() const;
+	void _Cut(uint64_t now_ns);
+} PATH_CC;
+
+#endif
@@ -0,0 +1,283 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "print.h"
+#include "downlink.h"
+
+static const char	*mode_names[] = { "dup", "single", "weighted", "latency" };
+static const char	*dup_names[QOS_CLASSES + 1] = { "none", "rt", "interactive", "default", "all" };
+
+const char* downlink_mode_name(uint8_t mode) {
+	return (mode <= DOWNLINK_LATENCY) ? mode_names[mode] : "?";
+}
+
+bool downlink_parse_option(DOWNLINK_CONFIG& conf, char *subopts) {
+	enum { OPT_MODE, OPT_DUP };
+	char *const	tokens[] = {
+		(char*)"mode", (char*)"dup", NULL
+	};
+	char	*value;
+
+	while (*subopts != '\0') {
+		const int	opt = getsubopt(&subopts, tokens, &value);
+
+		if (opt < 0 || value == NULL) {
+			print_error("invalid downlink option : %s\n", value ? value : "(null)");
+			return false;
+		}
+		switch (opt) {
+		case OPT_MODE: {
+			const auto	it = std::find_if(std::begin(mode_names), std::end(mode_names),
+				[value](const char *n) { return strcmp(n, value) == 0; });
+
+			if (it == std::end(mode_names)) {
+				print_error("unknown downlink mode - %s\n", value);
+				return false;
+			}
+			conf.mode = it - std::begin(mode_names);
+			break;
+		}
+
+		case OPT_DUP: {
+			const auto	it = std::find_if(std::begin(dup_names), std::end(dup_names),
+				[value](const char *n) { return strcmp(n, value) == 0; });
+
+			if (it == std::end(dup_names)) {
+				print_error("unknown downlink duplication class - %s\n", value);
+				return false;
+			}
+			conf.dup_classes = it - std::begin(dup_names);
+			break;
+		}
+		}
+	}
+	return true;
+}
+
+// single の経路の良さ（小さいほど良い）。RTT は受信報告から求めたものを使う
+// 自分の流したパケットで伸びたキューや揺らぎで行き来しないよう、平滑値ではなく最小値（輻輳制御の min_rtt）で比べ、
+// 損失は、落ちた分を送り直すまでにもう１往復かかるとして足す
+static inline uint64_t downlink_score(const SOCKET_PACK& s) {
+	const uint32_t	rtt = s.cc.min_rtt_us;
+
+	if (s.fb.srtt_us == 0 || rtt == 0) { return UINT32_MAX; }	// まだ報告のない経路は後回し
+	return (uint64_t)rtt + (uint64_t)s.fb.srtt_us * s.fb.loss_permille / 1000;
+}
+
+void downlink_scheduler::OnFeedback(SOCKET_PACK& s, uint64_t now) {
+	if (s.fb.rtt_us != 0) { s.cc.OnRttSample(now, s.fb.rtt_us); }
+	s.cc.OnFeedback(now, s.fb.interval_loss, s.fb.delivery_rate);
+}
+
+void downlink_scheduler::OnOwdReport(SOCKET_PACK& s, uint64_t now) {
+	s.cc.OnOwdReport(now, s.owd_tx.qdelay_us, s.owd_tx.trend_us);
+}
+
+// socks を client_id でまとめ直し、クライアントごとに落ちていない経路があるかを数える
+void downlink_scheduler::_Group() {
+	if (!grouped) {
+		clients.clear();
+		for (const auto& s : this->socks) {
+			const uint32_t	id = s.client_id;
+
+			if (std::none_of(clients.begin(), clients.end(), [id](const DOWNLINK_CLIENT& c) { return c.client_id == id; })) {
+				clients.push_back({ id, -1, false });
+			}
+		}
+		grouped = true;
+	}
+	for (auto& c : clients) { c.any_up = false; }
+	for (const auto& s : this->socks) {
+		if (!s.path_up) { continue; }
+		for (auto& c : clients) {
+			if (c.client_id == s.client_id) { c.any_up = true; }
+		}
+	}
+}
+
+void downlink_scheduler::Refresh(uint64_t now) {
+	if (now - refreshed_ns < SERVER_PATH_CHECK_NS) { return; }
+	refreshed_ns = now;
+
+	// 報告が途絶えた（その経路に送っていない）なら、古い値で経路を避けたり増速を止めたりしない
+	for (auto& s : this->socks) {
+		if (s.owd_tx_ns != 0 && now - s.owd_tx_ns > OWD_STALE_NS) {
+			s.owd_tx = { 0, 0, 0 };
+			s.owd_tx_ns = 0;
+			s.cc.owd_qdelay_us = 0;
+		}
+		if (s.fb.last_ns != 0 && now - s.fb.last_ns > FEEDBACK_STALE_NS) { s.fb.Expire(); }
+	}
+	if (conf.mode != DOWNLINK_SINGLE) { return; }
+
+	this->_Group();
+	for (auto& c : clients) { this->_RefreshPrimary(now, c); }
+}
+
+// 今の経路より十分に良い経路が現れたときだけ移す（報告ごとに揺れて行き来しないように）
+void downlink_scheduler::_RefreshPrimary(uint64_t now, DOWNLINK_CLIENT& c) {
+	int		best = -1;
+
+	for (size_t i = 0; i < socks.size(); i++) {
+		if (!this->_Usable(socks[i], c)) { continue; }
+		if (best < 0 || downlink_score(socks[i]) < downlink_score(socks[best])) { best = i; }
+	}
+	if (best < 0 || best == c.primary) { return; }
+	if (c.primary >= 0 && c.primary < (int)socks.size() && this->_Usable(socks[c.primary], c)) {
+		const uint64_t	cur = downlink_score(socks[c.primary]), cand = downlink_score(socks[best]);
+
+		if (cand * 100 >= cur * DOWNLINK_SWITCH_PERCENT || cur - cand < DOWNLINK_SWITCH_MIN_US) { return; }
+	}
+	if (c.primary >= 0) { switches++; }
+	c.primary = best;
+	pdebug("downlink: primary path of client %08x is %s:%d\n",
+		c.client_id, inet_ntoa(socks[best].remote_addr.sin_addr), ntohs(socks[best].remote_addr.sin_port));
+}
+
+// 宛先のクライアントがわからないので、どのクライアントにも送れるようになるまで読まない
+bool downlink_scheduler::Ready(uint64_t now, uint64_t& wait_ns) {
+	uint64_t	ready = 0;
+
+	if (!this->_Gated()) { return true; }
+	this->_Group();
+	for (const auto& c : clients) {
+		uint64_t	t_client = UINT64_MAX;
+
+		for (auto& s : this->socks) {
+			if (!this->_Usable(s, c)) { continue; }
+			if (s.cc.CanSend(now, PATH_NOMINAL_PACKET)) {
+				t_client = 0;
+				break;
+			}
+			const uint64_t	t = s.cc.ReadyTime(now, PATH_NOMINAL_PACKET);
+			if (t < t_client) { t_client = t; }
+		}
+		if (t_client == 0 || t_client == UINT64_MAX) { continue; }	// 送れる（経路がまだないなら読んで捨てる）
+
+		// 輻輳制御で止まっている経路は帯域を使い切っている
+		for (auto& s : this->socks) {
+			if (s.client_id == c.client_id) { s.cc.SetLimited(); }
+		}
+		if (t_client > ready) { ready = t_client; }
+	}
+	if (ready == 0) { return true; }
+
+	wait_ns = (ready > now) ? ready - now : 0;
+	return false;
+}
+
+// weighted はペーシング上もっとも余裕のある（次の送信予定時刻が早い）経路、
+// latency は推定帯域で排出した残り（inflight）に片道の見込みを足した、届くまでの時間が最も短い経路
+SOCKET_PACK* downlink_scheduler::_Pick(uint64_t now, uint32_t len, DOWNLINK_CLIENT& c) {
+	SOCKET_PACK	*best = nullptr;
+	double		best_t = 0;
+
+	if (conf.mode == DOWNLINK_SINGLE) {
+		if (c.primary < 0 || c.primary >= (int)socks.size() || !this->_Usable(socks[c.primary], c)) {
+			this->_RefreshPrimary(now, c);
+		}
+		return (c.primary >= 0 && c.primary < (int)socks.size() && socks[c.primary].client_id == c.client_id) ? &socks[c.primary] : nullptr;
+	}
+	for (auto& s : this->socks) {
+		if (!this->_Usable(s, c) || !s.cc.CanSend(now, len)) { continue; }
+
+		if (conf.mode == DOWNLINK_WEIGHTED) {
+			if (best == nullptr || s.cc.next_send_ns < best->cc.next_send_ns) { best = &s; }
+			continue;
+		}
+		const uint32_t	srtt = (s.fb.srtt_us != 0) ? s.fb.srtt_us : 100 * 1000;	// 報告のない経路は 100ms とみなす
+		const int32_t	owd  = s.owd_tx.qdelay_us;
+		const double	t = (s.cc.inflight + len) / s.cc.btl_bw + (srtt / 2 + ((owd > 0) ? owd : 0)) / 1e6;
+
+		if (best == nullptr || t < best_t) {
+			best = &s;
+			best_t = t;
+		}
+	}
+	if (best != nullptr) { return best; }
+
+	// 読む前に確認しているので通常はありえないが、送れる経路がなければ最も早く送れるようになる経路
+	for (auto& s : this->socks) {
+		if (!this->_Usable(s, c)) { continue; }
+		if (best == nullptr || s.cc.ReadyTime(now, len) < best->cc.ReadyTime(now, len)) { best = &s; }
+	}
+	return best;
+}
+
+int downlink_scheduler::Select(uint64_t now, const uint8_t *pkt, uint16_t data_len, SOCKET_PACK **paths) {
+	int		n = 0;
+
+	this->Refresh(now);
+	this->_Group();
+	selected = clients.size();
+
+	if (conf.dup_classes > 0 && qos_classify(qos, pkt, data_len) < conf.dup_classes) {
+		for (const auto& c : clients) {
+			for (auto& s : this->socks) {
+				if (this->_Usable(s, c)) { paths[n++] = &s; }
+			}
+		}
+		return n;
+	}
+	for (auto& c : clients) {
+		SOCKET_PACK	*p = this->_Pick(now, sizeof(TUN_HEADER) + data_len, c);
+
+		if (p != nullptr) { paths[n++] = p; }
+	}
+	return n;
+}
+
+// single は輻輳制御で止めないので、止めていたはずの送信は「帯域を使い切っていた」として見積もりを上げる材料にする
+void downlink_scheduler::OnSent(uint64_t now, SOCKET_PACK* const *paths, int n, uint16_t data_len) {
+	const uint32_t	wire_len = sizeof(TUN_HEADER) + data_len;
+
+	for (int i = 0; i < n; i++) {
+		if (!this->_Gated() && !paths[i]->cc.CanSend(now, wire_len)) { paths[i]->cc.SetLimited(); }
+		paths[i]->cc.OnSend(now, wire_len);
+	}
+	packets++;
+	if (n > selected) { duplicated++; }
+}
+
+// weighted と latency は輻輳制御の cwnd に余裕のある経路だけ（なければそのクライアントの使える経路すべて）
+int downlink_scheduler::Stripe(uint64_t now, const STRIPE_CONFIG& conf, uint16_t data_len, SOCKET_PACK **paths, uint16_t *lens) {
+	const uint32_t	chunk = sizeof(TUN_HEADER) + sizeof(STRIPE_HEADER) + conf.ChunkMax();
+	int				total = 0;
+
+	this->Refresh(now);
+	this->_Group();
+	for (const auto& c : clients) {
+		SOCKET_PACK	*cands[STRIPE_MAX_CHUNKS];
+		int			n = 0;
+
+		for (auto& s : this->socks) {
+			if (n < STRIPE_MAX_CHUNKS && this->_Usable(s, c) && (!this->_Gated() || s.cc.WithinCwnd(now, chunk))) { cands[n++] = &s; }
+		}
+		if (n == 0) {
+			for (auto& s : this->socks) {
+				if (n < STRIPE_MAX_CHUNKS && this->_Usable(s, c)) { cands[n++] = &s; }
+			}
+		}
+		total += stripe_plan(conf, cands, n, data_len, paths + total, lens + total);
+	}
+	return total;
+}
+
+void downlink_scheduler::OnStriped(uint64_t now, SOCKET_PACK* const *paths, const uint16_t *lens, int n) {
+	for (int i = 0; i < n; i++) { paths[i]->cc.OnSend(now, sizeof(TUN_HEADER) + sizeof(STRIPE_HEADER) + lens[i]); }
+	packets++;
+	striped++;
+}
+
+void downlink_scheduler::PrintStats() const {
+	print_info("downlink: mode %s, duplicate %s, %llu packets, duplicated %llu, striped %llu, path switches %llu\n",
+		downlink_mode_name(conf.mode), dup_names[conf.dup_classes],
+		(unsigned long long)packets, (unsigned long long)duplicated, (unsigned long long)striped, (unsigned long long)switches);
+	for (const auto& s : socks) {
+		print_info("DL  [%s:%d] client %08x %s btl_bw = %.2fMbps, srtt = %uus, loss = %u.%u%%\n",
+			inet_ntoa(s.remote_addr.sin_addr), ntohs(s.remote_addr.sin_port), s.client_id, s.path_up ? "UP" : "DOWN",
+			s.cc.btl_bw * 8 / 1e6, s.fb.srtt_us, s.fb.loss_permille / 10, s.fb.loss_permille % 10);
+	}
+}
@@ -0,0 +1,115 @@
+#ifndef	__DOWNLINK_H__
+#define	__DOWNLINK_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "mpudpdef.h"
+#include "network.h"
+#include "qos.h"
+#include "stripe.h"
+
+/*
+ * サーバーの下り（サーバー → クライアント）の経路選択（-D、サーバーの TX スレッド）
+ * 既定（mode=dup）はこれまでどおり全経路に複製する。下りの量が経路数倍になり、最も遅い経路に足を引かれるので、
+ * 経路を選んで１本にだけ流す方針も選べる。
+ *   single   : 最も良い経路１本（大きく良い経路が現れるか、落ちるまで変えない）。流量は内側の TCP などに任せる
+ *   weighted : 輻輳制御とペーシングの許す経路に送る（クライアントの MODE_SPEED と同じく、経路の推定帯域に比例する）
+ *   latency  : 輻輳制御の許す経路のうち、届くまでの見込み（RTT の半分 + 片道遅延の報告 + 推定帯域で排出した残り）が最も短い経路
+ * サーバーはプローブを送らないので、経路の計測はクライアントから届く報告だけを使う。
+ *   受信報告（CTRL_FEEDBACK）：RTT（LSR / DLSR と同じやり方）、損失率、揺らぎ
+ *   片道遅延の報告（CTRL_OWD）：送信方向のキューイング遅延
+ * これらを経路ごとの輻輳制御（PATH_CC）に入れて帯域を見積もる。weighted と latency では、クライアントと同じく
+ * 送れる経路がない間は TUN から読まない（Ready）。
+ * dup= で指定したクラス（qos.h の DSCP による区分）までは、方針によらず全経路に複製する。
+ * -S の大きなパケットは、方針によらず使える経路すべてに分けて流す（複製はしない、stripe.h）。
+ * 複数のクライアントがつながっているときは、経路を client_id でまとめ、クライアントごとにその経路から選ぶ
+ * （TUN のパケットの宛先がどのクライアントかはわからないので、これまでどおりどのクライアントにも１つずつ送る）。
+ * 例）-D mode=latency,dup=rt
+ */
+typedef enum _DOWNLINK_MODE {
+	DOWNLINK_DUP = 0,
+	DOWNLINK_SINGLE,
+	DOWNLINK_WEIGHTED,
+	DOWNLINK_LATENCY
+} DOWNLINK_MODE;
+
+typedef struct _DOWNLINK_CONFIG {
+	uint8_t		mode;
+	uint8_t		dup_classes;	// QOS_CLASS_ID がこれより小さいクラスは複製する（0 = 複製しない、QOS_CLASSES = 全部）
+
+	_DOWNLINK_CONFIG() : mode(DOWNLINK_DUP), dup_classes(0) {}
+} DOWNLINK_CONFIG;
+
+// 経路をまとめたクライアント（SOCKET_PACK::client_id、0 = わからない経路）
+typedef struct _DOWNLINK_CLIENT {
+	uint32_t	client_id;
+	int			primary;	// single の経路（socks の位置、-1 = まだ選んでいない）
+	bool		any_up;		// 落ちていない経路がある（全部落ちていたら全部使う）
+} DOWNLINK_CLIENT;
+
+bool downlink_parse_option(DOWNLINK_CONFIG& conf, char *subopts);
+const char* downlink_mode_name(uint8_t mode);
+
+class downlink_scheduler {
+private:
+	std::vector<SOCKET_PACK>&	socks;
+	DOWNLINK_CONFIG	conf;
+	QOS_CONFIG		qos;		// dup= のクラス分け（DSCP だけ見る）
+	std::vector<DOWNLINK_CLIENT>	clients;
+	bool			grouped;	// clients が socks に合っている（経路が変わったら作り直す）
+	int				selected;	// Select でクライアントごとに選んだ経路の数（これより多く送ったら複製）
+	uint64_t		refreshed_ns;
+
+	bool _Usable(const SOCKET_PACK& s, const DOWNLINK_CLIENT& c) const {
+		return s.sock_fd != -1 && s.client_id == c.client_id && (s.path_up || !c.any_up);
+	}
+	inline bool _Gated() const { return conf.mode == DOWNLINK_WEIGHTED || conf.mode == DOWNLINK_LATENCY; }
+	void _Group();
+	void _RefreshPrimary(uint64_t now, DOWNLINK_CLIENT& c);
+	SOCKET_PACK* _Pick(uint64_t now, uint32_t len, DOWNLINK_CLIENT& c);
+
+public:
+	uint64_t	packets;
+	uint64_t	duplicated;
+	uint64_t	switches;		// single で経路を変えた回数
+	uint64_t	striped;		// 分割して流したパケット数
+
+	explicit downlink_scheduler(std::vector<SOCKET_PACK>& s) :
+		socks(s), grouped(false), selected(0), refreshed_ns(0), packets(0), duplicated(0), switches(0), striped(0) {}
+
+	inline void Setup(const DOWNLINK_CONFIG& c) { conf = c; }
+	inline bool Duplicating() const { return conf.mode == DOWNLINK_DUP; }
+
+	// socks を足したり消したり、経路の client_id が変わったら（位置で覚えている single の経路を選び直す）
+	inline void OnPathsChanged() { grouped = false; }
+
+	// 経路をまとめたクライアントの数（Stripe に渡す場所の大きさを決める）
+	inline int Clients() { this->_Group(); return clients.size(); }
+
+	// 報告が届いたら、その経路の輻輳制御に入れる
+	void OnFeedback(SOCKET_PACK& s, uint64_t now);
+	void OnOwdReport(SOCKET_PACK& s, uint64_t now);
+
+	// 古い報告を捨て、single の経路を見直す（SERVER_PATH_CHECK_NS ごと）
+	void Refresh(uint64_t now);
+
+	// TUN から読んでよいか（どのクライアントにも送れる経路があるか）。
+	// だめなら、どのクライアントにもどれかの経路が送信可能になるまでの待ち時間を wait_ns に返す
+	bool Ready(uint64_t now, uint64_t& wait_ns);
+
+	// pkt を流す経路を paths（socks.size() 個分）に並べ、その数を返す。クライアントの数より多ければ複製
+	int Select(uint64_t now, const uint8_t *pkt, uint16_t data_len, SOCKET_PACK **paths);
+
+	// Select で選んだ経路に送ったあとで
+	void OnSent(uint64_t now, SOCKET_PACK* const *paths, int n, uint16_t data_len);
+
+	// data_len バイトを分割して流す断片ごとの経路と長さを paths、lens（STRIPE_MAX_CHUNKS * Clients() 個分）に並べ、断片の数を返す
+	// クライアントごとに断片の長さの合計が data_len になる組を続けて並べる（SendStriped はそれを組ごとに送る）
+	int Stripe(uint64_t now, const STRIPE_CONFIG& conf, uint16_t data_len, SOCKET_PACK **paths, uint16_t *lens);
+	void OnStriped(uint64_t now, SOCKET_PACK* const *paths, const uint16_t *lens, int n);
+
+	void PrintStats() const;
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef	__FEEDBACK_H__
+#define	__FEEDBACK_H__
+
+#include <stdint.h>
+
+#include "mpudpdef.h"
+
+/*
+ * 受信側からの経路ごとの受信報告（RTCP の受信レポート風）
+ * 送信側は経路ごとに TUN_HEADER::seq_dev を振る（制御フレームも含む）。受信側はそれを見て経路ごとに
+ * 損失・順序の入れ替わり・到着間隔の揺らぎ（RFC 3550 の interarrival jitter）・届いたバイト数を数え、
+ * FEEDBACK_REPORT_NS ごとに CTRL_FEEDBACK のフレームで同じ経路に送り返す。
+ * 値は累積で送るので、報告が落ちても次の報告との差で区間の値がわかる。
+ * 送信側（PATH_FEEDBACK）は前の報告との差から区間の損失率と、受信側で計った配送レートを求める。
+ * RTCP の LSR / DLSR と同じく、最後に受け取ったフレームの tx_us と受け取ってからの経過時間も返すので、
+ * 送信側は自分の時計だけで RTT がわかる（プローブを送らないサーバーも、データの経路の RTT を知れる）。
+ */
+typedef struct _FEEDBACK_REPORT {
+	uint32_t	expected;	// 最初に受け取った seq_dev から最大の seq_dev までの数
+	uint32_t	received;	// 受け取ったフレーム数
+	uint32_t	reordered;	// 最大の seq_dev より前の seq_dev で届いたフレーム数
+	uint32_t	jitter_us;
+	uint64_t	bytes;		// 受け取ったバイト数（TUN_HEADER 込み）
+	uint32_t	rx_us;		// 報告を作った時刻（受信側の monotonic、マイクロ秒の下位 32 ビット）
+	uint32_t	epoch;		// 数え直すたびに変わる（送信側の seq_dev が飛んだとき）
+	uint32_t	echo_tx_us;	// 最後に受け取ったフレームの tx_us（送信側の時計）
+	uint32_t	echo_hold_us;	// それを受け取ってから報告を作るまでの時間
+} FEEDBACK_REPORT;
+
+// 受信側（RX_PATH ごと）。RX スレッドだけが触る
+typedef struct _FEEDBACK_ESTIMATOR {
+	uint32_t	base;			// 最初に受け取った seq_dev
+	uint32_t	highest;
+	uint32_t	received;
+	uint32_t	reordered;
+	uint64_t	bytes;
+	int32_t		transit_us;		// 前のフレームの「受信時刻 - tx_us」
+	uint32_t	jitter16;		// jitter（マイクロ秒）の 16 倍（RFC 3550 の 1/16 の EWMA を整数で）
+	uint32_t	epoch;
+	uint32_t	last_tx_us;		// 最後に受け取ったフレームの tx_us
+	uint64_t	last_rx_ns;		// 　　　〃　　　　　　　　受け取った時刻
+
+	// 報告の送信
+	uint32_t	reported;		// 最後に報告したときの received
+	uint64_t	reported_ns;
+
+	_FEEDBACK_ESTIMATOR() :
+		base(0), highest(0), received(0), reordered(0), bytes(0), transit_us(0), jitter16(0), epoch(0),
+		last_tx_us(0), last_rx_ns(0), reported(0), reported_ns(0) {}
+
+	inline uint32_t Expected() const { return (received == 0) ? 0 : highest - base + 1; }
+	inline uint32_t Lost() const { return (Expected() > received) ? Expected() - received : 0; }
+
+	inline void OnFrame(uint32_t seq_dev, uint32_t len, uint32_t tx_us, uint64_t now_ns) {
+		const int32_t	d = (int32_t)(seq_dev - highest);
+		const int32_t	transit = (int32_t)((uint32_t)(now_ns / 1000) - tx_us);
+
+		// 初めてか、送信側が数え直した（経路を付け直した、相手が起動し直したなど）
+		if (received == 0 || d > FEEDBACK_RESET_GAP || d < -FEEDBACK_RESET_GAP) {
+			if (received != 0) { epoch++; }
+			base = highest = seq_dev;
+			received = reordered = 0;
+			bytes = 0;
+			jitter16 = 0;
+			reported = 0;
+		}
+		else if (d > 0) {
+			highest = seq_dev;
+		}
+		else if (d < 0) {
+			reordered++;
+		}
+		if (received > 0) {
+			const int32_t	diff = transit - transit_us;
+			const uint32_t	a = (uint32_t)((diff < 0) ? -diff : diff);
+
+			jitter16 = jitter16 + a - (jitter16 + 8) / 16;
+		}
+		transit_us = transit;
+		last_tx_us = tx_us;
+		last_rx_ns = now_ns;
+		received++;
+		bytes += len;
+	}
+
+	// 新しいフレームがあり、前の報告から FEEDBACK_REPORT_NS 経っていれば報告を作る
+	inline bool TakeReport(uint64_t now_ns, FEEDBACK_REPORT& r) {
+		if (received == reported || now_ns - reported_ns < FEEDBACK_REPORT_NS) { return false; }
+		reported = received;
+		reported_ns = now_ns;
+		r = { this->Expected(), received, reordered, jitter16 / 16, bytes, (uint32_t)(now_ns / 1000), epoch,
+			last_tx_us, (uint32_t)((now_ns - last_rx_ns) / 1000) };
+		return true;
+	}
+} FEEDBACK_ESTIMATOR;
+
+// 送信側（SOCKET_PACK ごと）。メインループのスレッドだけが触る
+typedef struct _PATH_FEEDBACK {
+	FEEDBACK_REPORT	last;		// 前の報告
+	uint64_t	last_ns;		// 受け取った時刻（0 = まだない）
+	uint32_t	interval_loss;	// 直近の区間の損失率（‰）
+	uint32_t	loss_permille;	// その EWMA 1/4（経路の選択に使う）
+	uint32_t	reorder_permille;
+	uint32_t	jitter_us;
+	uint64_t	delivery_rate;	// 直近の区間に受信側に届いたレート bytes/s
+	uint32_t	rtt_us;			// 報告から求めた直近の RTT（0 = まだない）
+	uint32_t	srtt_us;		// その平滑値（RFC 6298 と同じ 1/8、1/4）
+	uint32_t	rttvar_us;
+	uint32_t	reports;
+
+	_PATH_FEEDBACK() :
+		last(), last_ns(0), interval_loss(0), loss_permille(0), reorder_permille(0), jitter_us(0), delivery_rate(0),
+		rtt_us(0), srtt_us(0), rttvar_us(0), reports(0) {}
+
+	// 前の報告との差から区間の値を求める。値を求めたら true
+	// 数え直した（epoch が変わった、受信側が起動し直した）あとの最初の報告は、数え直してからの分を０からの差で数える
+	// （配送レートは区間の長さがわからないので求めない）。報告が途絶えたあと（Expire）は基準にするだけ
+	// RTT は報告ごとに求まる（受信側の保持時間を引くので、報告の間隔には左右されない）
+	inline bool OnReport(const FEEDBACK_REPORT& r, uint64_t now_ns) {
+		const bool		restart = (reports == 0 || r.epoch != last.epoch || (int32_t)(r.expected - last.expected) < 0);
+		const int32_t	rtt = (int32_t)((uint32_t)(now_ns / 1000) - r.echo_tx_us - r.echo_hold_us);
+		const bool		apply = restart ? r.expected != 0 : (last_ns != 0 && r.expected != last.expected);
+
+		reports++;
+		jitter_us = r.jitter_us;
+		if (r.echo_tx_us != 0 && rtt > 0) {
+			const uint32_t	d = ((uint32_t)rtt > srtt_us) ? rtt - srtt_us : srtt_us - rtt;
+
+			rtt_us = rtt;
+			rttvar_us = (srtt_us == 0) ? rtt / 2 : (rttvar_us * 3 + d) / 4;
+			srtt_us = (srtt_us == 0) ? rtt : (srtt_us * 7 + rtt) / 8;
+		}
+		if (apply) {
+			const FEEDBACK_REPORT	base = restart ? FEEDBACK_REPORT() : last;
+			const uint32_t	dexp  = r.expected - base.expected;
+			const uint32_t	drecv = r.received - base.received;
+			const uint32_t	dreo  = r.reordered - base.reordered;
+			const uint32_t	dus   = r.rx_us - base.rx_us;
+
+			interval_loss = (dexp > drecv) ? (uint32_t)((uint64_t)(dexp - drecv) * 1000 / dexp) : 0;
+			loss_permille = (loss_permille * 3 + interval_loss) / 4;
+			reorder_permille = (drecv > 0) ? (uint32_t)((uint64_t)dreo * 1000 / drecv) : 0;
+			delivery_rate = (!restart && dus > 0) ? (r.bytes - base.bytes) * 1000000 / dus : 0;
+		}
+		last = r;
+		last_ns = now_ns;
+		return apply;
+	}
+
+	// 報告が途絶えたら古い値は使わない（次の報告は基準にするだけ）
+	inline void Expire() {
+		last_ns = 0;
+		interval_loss = loss_permille = reorder_permille = jitter_us = 0;
+		delivery_rate = 0;
+		rtt_us = srtt_us = rttvar_us = 0;
+	}
+} PATH_FEEDBACK;
+
+#endif
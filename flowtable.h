@@ -0,0 +1,61 @@
+#ifndef	__FLOWTABLE_H__
+#define	__FLOWTABLE_H__
+
+#include <array>
+#include <cstdint>
+
+#include "ippacket.h"
+
+// フローの識別（５タプル、ポートが読めないときは３タプル）を 32bit に潰す
+inline uint32_t flow_hash(const IP_INFO& info) {
+	uint64_t	h = ((uint64_t)info.saddr << 32) ^ info.daddr;
+
+	h ^= ((uint64_t)info.proto << 32) | ((uint32_t)info.sport << 16) | info.dport;
+	// murmur3 の fmix64
+	h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return (uint32_t)h | 1;		// 0 は空きエントリの印
+}
+
+typedef struct _FLOW_ENTRY {
+	uint32_t	hash;
+	uint16_t	path;		// socks のインデックス
+	uint64_t	last_ns;	// 最後にパケットが通った時刻
+} FLOW_ENTRY;
+
+/*
+ * フロー → 経路の対応表（ダイレクトマップ）
+ * 衝突したら上書きする。古いエントリは参照されたときに時刻を見て捨てる（掃除はしない）
+ * のでエージングの手間はかからない。衝突で上書きされたフローは単に新しいフローレットとして扱われる。
+ */
+template<std::size_t N>
+class flow_table {
+	static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+private:
+	std::array<FLOW_ENTRY, N>	entries;
+
+public:
+	flow_table() { entries.fill({ 0, 0, 0 }); }
+
+	// 生きているエントリがあればそれを、なければ空にしたエントリを返す
+	inline FLOW_ENTRY& lookup(uint32_t hash, uint64_t now_ns, uint64_t expire_ns) {
+		FLOW_ENTRY&	e = entries[hash & (N - 1)];
+
+		if (e.hash != hash || now_ns - e.last_ns > expire_ns) {
+			e.hash = 0;
+		}
+		return e;
+	}
+
+	std::size_t active(uint64_t now_ns, uint64_t expire_ns) const {
+		std::size_t	n = 0;
+		for (const auto& e : entries) {
+			if (e.hash != 0 && now_ns - e.last_ns <= expire_ns) { n++; }
+		}
+		return n;
+	}
+};
+
+#endif
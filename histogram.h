@@ -0,0 +1,103 @@
+#ifndef	__HISTOGRAM_H__
+#define	__HISTOGRAM_H__
+
+#include <atomic>
+#include <array>
+#include <cstdint>
+
+// 百分位点のスナップショット（単位は記録時のものに従う）
+typedef struct _HISTOGRAM_SNAPSHOT {
+	uint64_t	count;
+	uint64_t	p50;
+	uint64_t	p90;
+	uint64_t	p99;
+	uint64_t	p999;
+	uint64_t	max;
+} HISTOGRAM_SNAPSHOT;
+
+/*
+ * 対数バケットのヒストグラム（HDR Histogram 風）
+ * 値を２の冪ごとの区間に分け、各区間をさらに 2^SUB_BITS 個に等分して数える。
+ * 相対誤差はおよそ 1/2^SUB_BITS（SUB_BITS = 5 で約３％）。
+ * 書き込みは単一スレッドから行う前提で、relaxed な load/store だけで済ませている（lock 命令を使わない）。
+ * 読み出し（snapshot）は別スレッドから呼んでも構わない。
+ */
+class latency_histogram {
+private:
+	static constexpr int		SUB_BITS	= 5;
+	static constexpr int		RANGE_BITS	= 48;	// これ以上の値は最大バケットに丸める
+	static constexpr uint64_t	SUB_COUNT	= 1ULL << SUB_BITS;
+	static constexpr std::size_t	N		= (RANGE_BITS - SUB_BITS + 1) << SUB_BITS;
+
+	std::array<std::atomic<uint64_t>, N>	buckets;
+	std::atomic<uint64_t>	total;
+	std::atomic<uint64_t>	vmax;
+
+	static inline std::size_t index_of(uint64_t v) {
+		if (v >= (1ULL << RANGE_BITS)) { v = (1ULL << RANGE_BITS) - 1; }
+		if (v < SUB_COUNT) { return (std::size_t)v; }
+
+		const int	msb   = 63 - __builtin_clzll(v);
+		const int	shift = msb - SUB_BITS;
+
+		return ((std::size_t)(shift + 1) << SUB_BITS) | (std::size_t)((v >> shift) - SUB_COUNT);
+	}
+
+	// バケットに入る値の上限
+	static inline uint64_t upper_of(std::size_t i) {
+		if (i < SUB_COUNT) { return i; }
+
+		const int	shift = (int)(i >> SUB_BITS) - 1;
+		const uint64_t	mant = (i & (SUB_COUNT - 1)) + SUB_COUNT;
+
+		return ((mant + 1) << shift) - 1;
+	}
+
+	template<class A>
+	static inline void bump(A& a, uint64_t n = 1) {
+		a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+public:
+	latency_histogram() : total(0), vmax(0) {
+		for (auto& b : buckets) { b.store(0, std::memory_order_relaxed); }
+	}
+	latency_histogram(const latency_histogram&) = delete;
+	latency_histogram& operator=(const latency_histogram&) = delete;
+
+	inline void record(uint64_t v) {
+		bump(buckets[index_of(v)]);
+		bump(total);
+		if (v > vmax.load(std::memory_order_relaxed)) { vmax.store(v, std::memory_order_relaxed); }
+	}
+
+	HISTOGRAM_SNAPSHOT snapshot() const {
+		HISTOGRAM_SNAPSHOT	snap = { 0, 0, 0, 0, 0, 0 };
+		const double	q[4] = { 0.50, 0.90, 0.99, 0.999 };
+		uint64_t	*p[4] = { &snap.p50, &snap.p90, &snap.p99, &snap.p999 };
+		uint64_t	sum = 0;
+		int		k = 0;
+
+		// total とバケットは別々に読むので、合計はバケットを読んだ結果から作る
+		std::array<uint64_t, N>	c;
+		for (std::size_t i = 0; i < N; i++) {
+			c[i] = buckets[i].load(std::memory_order_relaxed);
+			snap.count += c[i];
+		}
+		snap.max = vmax.load(std::memory_order_relaxed);
+		if (snap.count == 0) { return snap; }
+
+		for (std::size_t i = 0; i < N && k < 4; i++) {
+			sum += c[i];
+			while (k < 4 && sum >= (uint64_t)(q[k] * snap.count + 0.5)) {
+				*p[k] = (upper_of(i) < snap.max) ? upper_of(i) : snap.max;
+				k++;
+			}
+		}
+		return snap;
+	}
+
+	inline uint64_t count() const { return total.load(std::memory_order_relaxed); }
+};
+
+#endif
@@ -0,0 +1,87 @@
+#include <string.h>
+#include <netinet/in.h>
+
+#include "mpudpdef.h"
+#include "ippacket.h"
+
+#define	TCP_FIN	0x01
+#define	TCP_SYN	0x02
+#define	TCP_RST	0x04
+#define	TCP_ACK	0x10
+
+bool ip_parse(const uint8_t *buf, uint32_t len, IP_INFO& info) {
+	memset(&info, 0, sizeof(info));
+
+	if (len < 20) { return false; }
+	info.version = buf[0] >> 4;
+	if (info.version != 4) { return false; }	// IPv4 only
+
+	const uint32_t	ihl = (buf[0] & 0x0F) * 4;
+	const uint16_t	frag = (buf[6] << 8) | buf[7];
+
+	if (ihl < 20 || ihl > len) { return false; }
+
+	info.dscp		= buf[1] >> 2;
+	info.total_len	= (buf[2] << 8) | buf[3];
+	if (info.total_len < ihl) { return false; }	// 壊れている（L4 の長さが負になる）
+
+	info.proto		= buf[9];
+	memcpy(&info.saddr, buf + 12, 4);
+	memcpy(&info.daddr, buf + 16, 4);
+	info.fragment	= (frag & 0x3FFF) != 0;	// MF またはオフセットあり
+
+	if (info.fragment) { return true; }
+
+	const uint8_t	*l4 = buf + ihl;
+	const uint32_t	l4len = ((info.total_len < len) ? info.total_len : len) - ihl;
+
+	if (info.proto == IPPROTO_TCP && l4len >= 20) {
+		const uint32_t	doff = (l4[12] >> 4) * 4;
+
+		info.sport = (l4[0] << 8) | l4[1];
+		info.dport = (l4[2] << 8) | l4[3];
+		info.tcp_flags = l4[13];
+		info.payload_len = (l4len > doff) ? l4len - doff : 0;
+	}
+	else if (info.proto == IPPROTO_UDP && l4len >= 8) {
+		info.sport = (l4[0] << 8) | l4[1];
+		info.dport = (l4[2] << 8) | l4[3];
+		info.payload_len = l4len - 8;
+	}
+	return true;
+}
+
+// 接続の確立・終了、純粋な ACK、DNS、小さな UDP（VoIP や制御系）
+// どれも帯域はほとんど食わないが、落ちると上位層の再送タイマ分だけ待たされる
+bool ip_is_critical(const IP_INFO& info) {
+	if (info.proto == IPPROTO_TCP) {
+		if (info.tcp_flags & (TCP_SYN | TCP_FIN | TCP_RST)) { return true; }
+		if ((info.tcp_flags & TCP_ACK) && info.payload_len == 0) { return true; }
+		return false;
+	}
+	if (info.proto == IPPROTO_UDP) {
+		if (info.sport == 53 || info.dport == 53) { return true; }
+		if (info.total_len <= DUP_SMALL_UDP_BYTES) { return true; }
+		return false;
+	}
+	return info.proto == IPPROTO_ICMP;
+}
+
+// RFC 1071。16 ビットごとの１の補数和をメモリ上の並びのまま足すので、結果もネットワークバイトオーダーのまま
+uint16_t ip_checksum(const void *hdr, uint32_t len) {
+	const uint8_t	*p = (const uint8_t*)hdr;
+	uint32_t		sum = 0;
+	uint16_t		w;
+
+	for (; len > 1; p += 2, len -= 2) {
+		memcpy(&w, p, sizeof(w));
+		sum += w;
+	}
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, p, 1);
+		sum += w;
+	}
+	while (sum >> 16) { sum = (sum & 0xFFFF) + (sum >> 16); }
+	return (uint16_t)~sum;
+}
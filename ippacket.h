@@ -0,0 +1,25 @@
+#ifndef	__IPPACKET_H__
+#define	__IPPACKET_H__
+
+#include <stdint.h>
+
+// TUN から読んだ内側の IPv4 パケットを覗いて得られる情報
+typedef struct _IP_INFO {
+	uint8_t		version;
+	uint8_t		proto;		// IPPROTO_*
+	uint8_t		dscp;
+	uint8_t		tcp_flags;	// TCP のときだけ
+	uint32_t	saddr;		// ネットワークバイトオーダのまま
+	uint32_t	daddr;
+	uint16_t	sport;		// ホストバイトオーダ（TCP/UDP のときだけ）
+	uint16_t	dport;
+	uint16_t	total_len;	// IP ヘッダ込み
+	uint16_t	payload_len;	// L4 ペイロード長（TCP/UDP のときだけ）
+	bool		fragment;	// フラグメント（先頭も含む）。フラグメント同士を揃えるためポートは読まない
+} IP_INFO;
+
+bool ip_parse(const uint8_t *buf, uint32_t len, IP_INFO& info);
+bool ip_is_critical(const IP_INFO& info);	// 失うと高くつく小さなパケットか
+uint16_t ip_checksum(const void *hdr, uint32_t len);	// IP ヘッダのチェックサム（check を 0 にして計算し、そのまま書き込める値）
+
+#endif
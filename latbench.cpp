@@ -0,0 +1,144 @@
+/*
+ * 転送遅延のベンチマーク（UDP の ping-pong）
+ * トンネルの両端の TUN アドレス間で往復時間を測り、百分位点を表示する。-L の効果を見るのに使う（bench_latency.sh）
+ *   エコー側 : latbench.out -s [-p port]
+ *   計測側   : latbench.out -c addr [-p port] [-n count] [-i interval_us] [-l size] [-w warmup]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "histogram.h"
+
+#define	LATBENCH_PORT	7800
+#define	LATBENCH_MAX	1400
+
+typedef struct _LATBENCH_PACKET {
+	uint64_t	seq;
+	uint64_t	sent_ns;
+} LATBENCH_PACKET;
+
+static inline uint64_t now_ns() {
+	timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int echo_server(int port) {
+	uint8_t		buf[LATBENCH_MAX];
+	sockaddr_in	addr;
+	socklen_t	len;
+	int			fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family			= AF_INET;
+	addr.sin_addr.s_addr	= htonl(INADDR_ANY);
+	addr.sin_port			= htons(port);
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 || bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("socket / bind");
+		return 1;
+	}
+	while (true) {
+		len = sizeof(addr);
+		const ssize_t	n = recvfrom(fd, buf, sizeof(buf), 0, (sockaddr*)&addr, &len);
+		if (n < 0) { perror("recvfrom"); continue; }
+		if (sendto(fd, buf, n, 0, (sockaddr*)&addr, len) < 0) { perror("sendto"); }
+	}
+	return 0;
+}
+
+static int ping_client(const char *dst, int port, uint64_t count, uint64_t interval_us, int size, uint64_t warmup) {
+	uint8_t		buf[LATBENCH_MAX];
+	sockaddr_in	addr;
+	latency_histogram	hist;
+	uint64_t	lost = 0;
+	int			fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family	= AF_INET;
+	addr.sin_port	= htons(port);
+	if (inet_pton(AF_INET, dst, &addr.sin_addr) != 1) {
+		fprintf(stderr, "invalid address : %s\n", dst);
+		return 1;
+	}
+	if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("socket / connect");
+		return 1;
+	}
+	memset(buf, 0xA5, sizeof(buf));
+
+	for (uint64_t i = 0; i < warmup + count; i++) {
+		LATBENCH_PACKET	p = { i, now_ns() };
+		const uint64_t	next = p.sent_ns + interval_us * 1000;
+
+		memcpy(buf, &p, sizeof(p));
+		if (send(fd, buf, size, 0) < 0) { perror("send"); }
+
+		// 自分の番号の応答を待つ（遅れて届いた前の応答は読み捨てる）
+		while (true) {
+			pollfd	pfd = { fd, POLLIN, 0 };
+			const int	left_ms = (int)((p.sent_ns + 1000000000ULL - now_ns()) / 1000000);
+
+			if (left_ms <= 0 || poll(&pfd, 1, left_ms) <= 0) {
+				if (i >= warmup) { lost++; }
+				break;
+			}
+			if (recv(fd, buf, sizeof(buf), 0) < (ssize_t)sizeof(p)) { continue; }
+
+			LATBENCH_PACKET	r;
+			memcpy(&r, buf, sizeof(r));
+			if (r.seq != i) { continue; }
+			if (i >= warmup) { hist.record(now_ns() - r.sent_ns); }
+			break;
+		}
+		while (now_ns() < next) {
+			const uint64_t	w = next - now_ns();
+			const timespec	ts = { 0, (long)((w > 50000) ? w - 50000 : 0) };	// 最後の 50us だけ回って間隔を揃える
+			if (ts.tv_nsec > 0) { nanosleep(&ts, NULL); }
+		}
+	}
+	const HISTOGRAM_SNAPSHOT	s = hist.snapshot();
+	printf("rtt n=%llu lost=%llu p50=%.1fus p90=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+		(unsigned long long)s.count, (unsigned long long)lost,
+		s.p50 / 1000.0, s.p90 / 1000.0, s.p99 / 1000.0, s.p999 / 1000.0, s.max / 1000.0);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	const char	*dst = NULL;
+	bool		server = false;
+	int			port = LATBENCH_PORT;
+	int			size = 64;
+	uint64_t	count = 10000, interval_us = 1000, warmup = 500;
+	int			option;
+
+	while ((option = getopt(argc, argv, "sc:p:n:i:l:w:")) > 0) {
+		switch (option) {
+		case 's': server = true; break;
+		case 'c': dst = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'n': count = strtoull(optarg, NULL, 10); break;
+		case 'i': interval_us = strtoull(optarg, NULL, 10); break;
+		case 'l': size = atoi(optarg); break;
+		case 'w': warmup = strtoull(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s -s [-p port] | -c addr [-p port] [-n count] [-i interval_us] [-l size] [-w warmup]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (size < (int)sizeof(LATBENCH_PACKET)) { size = sizeof(LATBENCH_PACKET); }
+	if (size > LATBENCH_MAX) { size = LATBENCH_MAX; }
+
+	if (server) { return echo_server(port); }
+	if (dst == NULL) {
+		fprintf(stderr, "destination address not specified\n");
+		return 1;
+	}
+	return ping_client(dst, port, count, interval_us, size, warmup);
+}
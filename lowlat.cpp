@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include <fstream>
+
+#include "lowlat.h"
+#include "print.h"
+
+// 古いヘッダにはないことがある（Linux 5.11）
+#ifndef	SO_PREFER_BUSY_POLL
+#define	SO_PREFER_BUSY_POLL	69
+#endif
+#ifndef	SO_BUSY_POLL_BUDGET
+#define	SO_BUSY_POLL_BUDGET	70
+#endif
+
+_LOWLAT_CONFIG::_LOWLAT_CONFIG() : node(LOWLAT_NODE_NONE), busy_poll_us(0), busy_budget(0), spin(false) {}
+
+// "0-3,8,10-11" 形式（sysfs の cpulist）。-L の cpus= ではカンマの代わりに ':' で区切る
+static bool parse_cpulist(const std::string& list, std::vector<int>& cpus) {
+	const char	*p = list.c_str();
+
+	while (*p != '\0' && *p != '\n') {
+		char	*end;
+		const long	first = strtol(p, &end, 10);
+		long		last = first;
+
+		if (end == p || first < 0) { return false; }
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if (end == p || last < first) { return false; }
+		}
+		for (long c = first; c <= last; c++) { cpus.push_back((int)c); }
+		p = end;
+		if (*p == ',' || *p == ':') { p++; }
+	}
+	return !cpus.empty();
+}
+
+static bool read_line(const std::string& path, std::string& line) {
+	std::ifstream	f(path);
+	return (bool)std::getline(f, line);
+}
+
+// cpus=2:3:4,node=0|auto,busy_poll=us,budget=N,spin
+bool lowlat_parse_option(LOWLAT_CONFIG& conf, char *subopts) {
+	enum { OPT_CPUS, OPT_NODE, OPT_BUSY_POLL, OPT_BUDGET, OPT_SPIN };
+	char *const	tokens[] = {
+		(char*)"cpus", (char*)"node", (char*)"busy_poll", (char*)"budget", (char*)"spin", NULL
+	};
+	char	*value;
+
+	while (*subopts != '\0') {
+		const int	opt = getsubopt(&subopts, tokens, &value);
+
+		if (opt < 0 || (value == NULL && opt != OPT_SPIN)) {
+			print_error("invalid low latency option : %s\n", value ? value : "(null)");
+			return false;
+		}
+		switch (opt) {
+		case OPT_CPUS:
+			conf.cpus.clear();
+			if (!parse_cpulist(value, conf.cpus)) {
+				print_error("invalid cpu list : %s\n", value);
+				return false;
+			}
+			break;
+		case OPT_NODE:
+			conf.node = (strcmp(value, "auto") == 0) ? LOWLAT_NODE_AUTO : (int)strtol(value, NULL, 10);
+			break;
+		case OPT_BUSY_POLL:	conf.busy_poll_us = strtoul(value, NULL, 10); break;
+		case OPT_BUDGET:	conf.busy_budget = strtoul(value, NULL, 10); break;
+		case OPT_SPIN:		conf.spin = true; break;
+		}
+	}
+	return true;
+}
+
+/*
+ * NUMA ノードのコアを cpus に並べる。auto ならデバイス（NIC）がつながっているノードを使い、
+ * わからなければ（仮想デバイスや NUMA のない機械）オンラインの全コアを使う。
+ * 割り当ての始めに来る TX / RX がデバイスと同じノードに載るので、受信バッファもそのノードのメモリに取られる。
+ */
+bool lowlat_resolve_cpus(LOWLAT_CONFIG& conf, const std::string& dev_name) {
+	std::string	line;
+	int			node = conf.node;
+
+	if (!conf.cpus.empty() || node == LOWLAT_NODE_NONE) { return true; }
+	if (node == LOWLAT_NODE_AUTO) {
+		node = -1;
+		if (!dev_name.empty() && read_line("/sys/class/net/" + dev_name + "/device/numa_node", line)) {
+			node = atoi(line.c_str());
+		}
+	}
+	const std::string	path = (node >= 0) ?
+		"/sys/devices/system/node/node" + std::to_string(node) + "/cpulist" : "/sys/devices/system/cpu/online";
+
+	if (!read_line(path, line) || !parse_cpulist(line, conf.cpus)) {
+		print_error("Couldn't read cpu list - %s\n", path.c_str());
+		return false;
+	}
+	pdebug("low latency: node %d, cpus %s\n", node, line.c_str());
+	return true;
+}
+
+void lowlat_pin_thread(const LOWLAT_CONFIG& conf, int slot, const char *name) {
+	cpu_set_t	set;
+
+	if (conf.cpus.empty()) { return; }
+
+	// 足りなければ最初から使い回す（spin のときは同じコアで回し合うことになるので警告する）
+	const int	cpu = conf.cpus[slot % conf.cpus.size()];
+	if (conf.spin && slot >= (int)conf.cpus.size()) {
+		print_error("low latency: %s shares cpu %d with another spinning thread\n", name, cpu);
+	}
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if ((errno = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0) {
+		perror("pthread_setaffinity_np()");
+		print_error("Couldn't pin %s to cpu %d\n", name, cpu);
+		return;
+	}
+	pdebug("low latency: %s pinned to cpu %d\n", name, cpu);
+}
+
+// 値がシステムの net.core.busy_read を超えると CAP_NET_ADMIN が要る
+void lowlat_busy_poll(const LOWLAT_CONFIG& conf, int fd, const char *name) {
+	const int	us = conf.busy_poll_us;
+	const int	prefer = 1;
+	const int	budget = conf.busy_budget;
+
+	if (us == 0) { return; }
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0) {
+		perror("setsockopt()");
+		print_error("Couldn't set value of SO_BUSY_POLL - %s\n", name);
+		return;
+	}
+	if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0) {
+		perror("setsockopt()");
+		print_error("Couldn't set value of SO_PREFER_BUSY_POLL - %s\n", name);
+	}
+	if (budget > 0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) < 0) {
+		perror("setsockopt()");
+		print_error("Couldn't set value of SO_BUSY_POLL_BUDGET - %s\n", name);
+	}
+}
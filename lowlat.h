@@ -0,0 +1,61 @@
+#ifndef	__LOWLAT_H__
+#define	__LOWLAT_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "mpudpdef.h"
+
+/*
+ * 低遅延モード（-L）
+ * CPU 効率よりも転送遅延の小ささと安定を優先する設定をまとめたもの。
+ *   cpus      : スレッドを固定するコア。TX（メインループ）、RX、エコー、-P の受信スレッドの順に割り当てる
+ *   node      : cpus がなければ、この NUMA ノードのコアから順に割り当てる（auto なら経路のデバイスがつながるノード）
+ *   busy_poll : 経路のソケットに SO_BUSY_POLL（マイクロ秒）と SO_PREFER_BUSY_POLL を付ける
+ *   spin      : select で眠らず、TUN とソケットを非ブロッキングで読み続ける（コアを１つずつ占有する）
+ * 例）-L cpus=2:3:4,busy_poll=50,spin
+ */
+typedef enum _THREAD_SLOT {
+	THREAD_TX = 0,
+	THREAD_RX,
+	THREAD_ECHO,
+	THREAD_RX_SOURCE	// -P の受信スレッド（経路ごとに +1）
+} THREAD_SLOT;
+
+typedef struct _LOWLAT_CONFIG {
+	std::vector<int>	cpus;		// 空なら固定しない
+	int			node;			// LOWLAT_NODE_NONE / LOWLAT_NODE_AUTO / ノード番号
+	uint32_t	busy_poll_us;	// 0 なら設定しない
+	uint32_t	busy_budget;	// SO_BUSY_POLL_BUDGET（0 ならカーネルの既定）
+	bool		spin;
+
+	_LOWLAT_CONFIG();
+
+	inline bool enabled() const { return !cpus.empty() || busy_poll_us > 0 || spin; }
+} LOWLAT_CONFIG;
+
+#define	LOWLAT_NODE_NONE	(-1)
+#define	LOWLAT_NODE_AUTO	(-2)
+
+bool lowlat_parse_option(LOWLAT_CONFIG& conf, char *subopts);
+
+// node の指定を cpus に展開する（dev_name は auto のときにノードを調べるデバイス）
+bool lowlat_resolve_cpus(LOWLAT_CONFIG& conf, const std::string& dev_name);
+
+// 呼んだスレッドを slot に割り当てたコアに固定する（cpus が空なら何もしない）
+void lowlat_pin_thread(const LOWLAT_CONFIG& conf, int slot, const char *name);
+
+// ソケットに busy poll を設定する（busy_poll_us が 0 なら何もしない）
+void lowlat_busy_poll(const LOWLAT_CONFIG& conf, int fd, const char *name);
+
+// spin のときの空回りの間に入れる（ハイパースレッドの相方と電力のため）
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+#endif
@@ -11,6 +11,9 @@
 #include "print.h"
 #include "network.h"
 #include "ringbuf.h"
+#include "trace.h"
+#include "capture.h"
+#include "arq.h"
 
 #include "mpudp.h"
 
@@ -18,6 +21,9 @@
 #define	MODE_CLIENT	1
 
 bool _global_fDebug;
+volatile sig_atomic_t	_global_fDumpStats;
+
+static void on_sigusr1(int) { _global_fDumpStats = 1; }
 
 unsigned long hash(void* buf, int size) {
 	unsigned long	h = 5361;
@@ -32,6 +38,14 @@ int main(int argc, char* argv[]) {
 	int	mode = MODE_CLIENT;
 
 	_global_fDebug = false;
+	_global_fDumpStats = 0;
+
+	// SIGUSR1 でレイテンシ統計を表示する（select を EINTR で起こしたいので SA_RESTART は付けない）
+	struct sigaction	sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_sigusr1;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
 
 	/* 
 	 * socks :
@@ -40,9 +54,24 @@ int main(int argc, char* argv[]) {
 	 */
 	std::vector<std::string>	device;
 	std::string	dst_addr;
+	CAPTURE_CONFIG	capture;
+	ARQ_CONFIG	arq;
+	TRANSMIT_MODE	tx_mode = MODE_SPEED;
+	bool		flow_pinning = false;
+	bool		rx_threads = false;
+	LOWLAT_CONFIG	lowlat;
+	XDP_CONFIG	xdp;
+	std::string	path_trace;
+	std::vector<std::string>	endpoints;
+	std::vector<BUDGET_CONFIG>	budgets;
+	QOS_CONFIG	qos;
+	DOWNLINK_CONFIG	downlink;
+	STRIPE_CONFIG	stripe;
+	std::string	upgrade;
+	bool		shared_socket = false;
 
 	//while ((option = getopt(argc, argv, "d:t:sc:")) > 0) {
-	while ((option = getopt(argc, argv, "i:a:ds")) > 0) {
+	while ((option = getopt(argc, argv, "i:a:dsw:W:m:FR:PL:X:T:e:C:Q:D:S:U:M")) > 0) {
 		switch (option) {
 		case 'i':
 			device.emplace_back(optarg); break;
@@ -58,8 +87,97 @@ int main(int argc, char* argv[]) {
 
 		case 'a':
 			dst_addr = optarg; break;
+
+		case 'w':
+			capture.path = optarg; break;
+
+		case 'F':
+			flow_pinning = true; break;
+
+		case 'm':
+			// クライアントの送信方針 speed / stable / adaptive
+			if      (strcmp(optarg, "speed")    == 0) { tx_mode = MODE_SPEED; }
+			else if (strcmp(optarg, "stable")   == 0) { tx_mode = MODE_STABLE; }
+			else if (strcmp(optarg, "adaptive") == 0) { tx_mode = MODE_ADAPTIVE; }
+			else {
+				print_error("unknown transmit mode - %s\n", optarg);
+				exit(1);
+			}
+			break;
+
+		case 'W':
+			// sample=N,ring=N,snaplen=N,limit=MiB
+			if (!capture_parse_option(capture, optarg)) { exit(1); }
+			break;
+
+		case 'R':
+			// 選択的再送 deadline=ms,port=N,proto=udp|all
+			if (!arq_parse_option(arq, optarg)) { exit(1); }
+			break;
+
+		case 'P':
+			// 経路のソケットごとに受信スレッドを立てる
+			rx_threads = true; break;
+
+		case 'L':
+			// 低遅延モード cpus=2:3:4,node=N|auto,busy_poll=us,budget=N,spin
+			if (!lowlat_parse_option(lowlat, optarg)) { exit(1); }
+			break;
+
+		case 'X':
+			// 経路を AF_XDP で送受信する（クライアントのみ） mode=auto|copy|zerocopy,attach=auto|drv|skb,queue=N
+			if (!xdp_parse_option(xdp, optarg)) { exit(1); }
+			break;
+
+		case 'T':
+			// エコースレッドの計測（RTT・損失率・帯域）を経路トレースとして記録する（クライアントのみ、mpsim.out で再生できる）
+			path_trace = optarg; break;
+
+		case 'e':
+			// クライアントに知らせる待ち受けアドレス（サーバーのみ、複数回指定できる。auto = 全インターフェースの IPv4 アドレス）
+			// クライアントは自分の経路（デバイス）ごとに、そのすべてへの経路を張る
+			endpoints.emplace_back(optarg); break;
+
+		case 'C': {
+			// 経路（デバイス）ごとの費用と上限（クライアントのみ、複数回指定できる） dev=name,cost=N,rate=Mbps,quota=MB
+			BUDGET_CONFIG	b;
+			if (!budget_parse_option(b, optarg)) { exit(1); }
+			budgets.push_back(b);
+			break;
+		}
+
+		case 'Q':
+			// 内側のパケットを DSCP とポートでクラスに分けて優先制御する（クライアントのみ）
+			// sched=drr|strict,depth=N,rt=port[-port],interactive=..,default=..,bulk=..
+			if (!qos_parse_option(qos, optarg)) { exit(1); }
+			break;
+
+		case 'D':
+			// 下りの経路選択（サーバーのみ） mode=dup|single|weighted|latency,dup=none|rt|interactive|default|all
+			if (!downlink_parse_option(downlink, optarg)) { exit(1); }
+			break;
+
+		case 'S':
+			// 大きな内側のパケットを断片に分けて複数の経路に同時に流す（TUN_BUFSIZE まで読む） mtu=N,min=N
+			// 受信側は -S によらず組み立てるので、片側だけに付けてもよい
+			if (!stripe_parse_option(stripe, optarg)) { exit(1); }
+			break;
+
+		case 'U':
+			// 無停止の入れ替え：path で動いているプロセスがあれば、TUN・ソケット・状態を引き継いで終わらせる
+			// 誰もいなければ普通に起動し、次のプロセスを path で待つ
+			upgrade = optarg;
+			break;
+
+		case 'M':
+			// 全経路で１つのソケットを使う（クライアントのみ）。送るデバイスはフレームごとに IP_PKTINFO で指定する
+			shared_socket = true;
+			break;
 		}
 	}
+	if (_global_fDebug) { trace_start(); }
+	if (capture.path.length() > 0 && !capture_open(capture)) { exit(1); }
+
 	char	tun_name[64] = "tun_test";		// データを受け取る tun デバイス
 	const int	dst_port = PORT_MAIN;
 
@@ -78,20 +196,39 @@ int main(int argc, char* argv[]) {
 			print_error("destination address not specified\n");
 			exit(1);
 		}
-		auto client = std::unique_ptr<MPUDPTunnelClient>(new MPUDPTunnelClient(BUFSIZE));
+		auto client = std::unique_ptr<MPUDPTunnelClient>(new MPUDPTunnelClient(TUN_BUFSIZE));
 
 		if (!client) { exit(1); }
 
 		for (auto& d : device) { client->AddDevice(d); }
+		client->SetTransmitMode(tx_mode);
+		client->SetFlowPinning(flow_pinning);
+		client->SetArq(arq);
+		client->SetRxThreads(rx_threads);
+		client->SetLowLatency(lowlat);
+		client->SetXdp(xdp);
+		client->SetSharedSocket(shared_socket);
+		for (auto& b : budgets) { client->SetPathBudget(b); }
+		client->SetQos(qos);
+		client->SetStripe(stripe);
+		client->SetUpgrade(upgrade);
+		if (path_trace.length() > 0 && !client->SetPathTrace(path_trace)) { exit(1); }
 		
 		if (!client->Connect(tun_name, dst_addr, dst_port)) { exit(1); };
 		if (!client->MainLoop()) { exit(1); }
 	}
 	else {
 		// サーバーモード
-		auto server = std::unique_ptr<MPUDPTunnelServer>(new MPUDPTunnelServer(BUFSIZE));
+		auto server = std::unique_ptr<MPUDPTunnelServer>(new MPUDPTunnelServer(TUN_BUFSIZE));
 
 		if (!server) { exit(1); }
+		server->SetArq(arq);
+		server->SetRxThreads(rx_threads);
+		server->SetLowLatency(lowlat);
+		for (auto& e : endpoints) { server->AddEndpoint(e); }
+		server->SetDownlink(downlink);
+		server->SetStripe(stripe);
+		server->SetUpgrade(upgrade);
 		if (!server->Listen(tun_name, dst_port)) { exit(1); }
 		if (!server->MainLoop()) { exit(1); }
 	}
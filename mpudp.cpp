@@ -1,18 +1,31 @@
+#include <algorithm>
+
+#include <fcntl.h>
+#include <linux/errqueue.h>
+
 #include "mpudp.h"
 
 MPUDPTunnel::MPUDPTunnel(uint32_t szbuf) :
-	seq(0), tun_buf(new uint8_t[szbuf + sizeof(TUN_HEADER)]), sock_tun(-1) {
+	seq(0), tx_slot_size(szbuf), mode_flags(0),
+	upgrade_listen_fd(-1), upgrade_conn(-1), upgrade_polled_ns(0),
+	rx_threads(false), rx_dump(false), pipe_dropped(0), rx_hold(0), sock_tun(-1) {
 	//this->socks.reserve(10);
-	this->data_buf = this->tun_buf.get() + sizeof(TUN_HEADER);
+	rx_sessions.emplace_back(new RX_SESSION(0));
 }
 
 MPUDPTunnel::~MPUDPTunnel() {
 	if (th_echo->joinable()) {
 		th_echo->join();
 	}
+	if (th_rx && th_rx->joinable()) {
+		th_rx->join();
+	}
 	if (sock_tun != -1) {
 		close(sock_tun);
 	}
+	if (upgrade_listen_fd != -1) {
+		close(upgrade_listen_fd);
+	}
 	socks.clear();
 } 
 
@@ -25,87 +38,542 @@ bool MPUDPTunnel::SetTunDevice(const char *tun_name) {
 	return true;
 }
 
-ssize_t MPUDPTunnel::_sendto(SOCKET_PACK& s, uint16_t data_len) {
-	ssize_t	nwrite = 0;
-
-	try {
-		nwrite = sendto(
-			s.sock_fd, tun_buf.get(), sizeof(TUN_HEADER) + data_len, 0,
-			(sockaddr*)&(s.remote_addr), sizeof(s.remote_addr)
-		);
-		if (nwrite < 0) { throw std::runtime_error("sendto returned an invalid value"); }
-		pdebug(
-			"packet was sent to : %s:%d\n",
-			inet_ntoa(s.remote_addr.sin_addr), ntohs(s.remote_addr.sin_port)
-		);
-		s.seq_dev++;
-		
-	} catch(std::exception& e) {
-		perror("sendto");
-		print_error("%s : %d\n", e.what(), errno);
-		nwrite = -1;
+/*
+ * 無停止の入れ替え（-U、upgrade.h）
+ * 新：-U の path で旧が待っていれば、TUN と状態を受け取る。誰もいなければ普通に TUN を開く
+ * 旧が TUN を持っている間は開けない（EBUSY）ので、その場合は -U を付けて起動する
+ */
+bool MPUDPTunnel::_TakeOver(const std::string& tun_name, bool server) {
+	int		fds[UPGRADE_MAX_FDS], nfds;
+
+	if (upgrade_path.empty() || (upgrade_conn = upgrade_connect(upgrade_path)) < 0) {
+		return this->SetTunDevice(tun_name.c_str());
+	}
+	print_info("upgrade: taking over from the running process (%s)\n", upgrade_path.c_str());
+	taken.reset(new UPGRADE_STATE);
+	if (!upgrade_recv(upgrade_conn, *taken, fds, nfds)) { return false; }
+	taken_fds.assign(fds, fds + nfds);
+	received_fds = taken_fds;
+	if (taken->server != (server ? 1 : 0) || nfds < 1) {
+		print_error("upgrade: the running process is not a %s\n", server ? "server" : "client");
+		return false;
+	}
+	this->sock_tun = this->_TakeFd(0);
+	this->seq = taken->seq;
+	for (uint32_t i = 0; i < taken->nsessions; i++) {
+		RX_SESSION	*ss = this->_RxSession(taken->sessions[i].client_id);
+
+		ss->seq_rec = taken->sessions[i].seq_rec;
+		ss->last_rx_ns = monotonic_ns();
+	}
+
+	// 旧が -L spin で動いていた（O_NONBLOCK はファイルに付くので引き継がれる）
+	if (!lowlat.spin && fcntl(sock_tun, F_SETFL, fcntl(sock_tun, F_GETFL) & ~O_NONBLOCK) < 0) {
+		perror("fcntl(O_NONBLOCK)");
+		return false;
+	}
+	pdebug("upgrade: seq_all = %u, %u receive sessions, %u paths, %d fds\n", taken->seq, taken->nsessions, taken->npaths, nfds);
+	return true;
+}
+
+int MPUDPTunnel::_TakeFd(int index) {
+	if (index < 0 || index >= (int)taken_fds.size()) { return -1; }
+
+	const int	fd = taken_fds[index];
+
+	taken_fds[index] = -1;
+	return fd;
+}
+
+/*
+ * ACK を返せなければ、旧は ACK を待ちきれずに元に戻して続けるので、受け取った TUN とソケットを使ってはいけない
+ * 使い始めたもの（sock_tun や経路のソケット）も含めて全部閉じて起動をやめる（呼び出し側はそのまま終了する）
+ * 旧と同時に読まないように、RX スレッドとエコースレッドを動かす前に呼ぶこと
+ */
+bool MPUDPTunnel::_UpgradeReady() {
+	if (upgrade_conn != -1) {
+		const bool	acked = upgrade_ack(upgrade_conn);
+
+		// 使わなかった（経路の設定が変わった）ソケットは閉じる
+		for (int fd : acked ? taken_fds : received_fds) {
+			if (fd != -1) { close(fd); }
+		}
+		close(upgrade_conn);
+		upgrade_conn = -1;
+		taken_fds.clear();
+		received_fds.clear();
+		if (!acked) {
+			print_error("upgrade: could not acknowledge the running process, it keeps running\n");
+			taken.reset();
+			return false;
+		}
+		print_info("upgrade: took over %u paths, seq_all = %u\n", taken->npaths, taken->seq);
+		taken.reset();
+	}
+	if (!upgrade_path.empty() && (upgrade_listen_fd = upgrade_listen(upgrade_path)) < 0) {
+		print_error("upgrade: can not wait for the next process - %s\n", upgrade_path.c_str());
+	}
+	return true;
+}
+
+/*
+ * 旧：RX を止めてから（読みかけのフレームは処理させる）TUN と経路のソケットを渡す
+ * TX はこの間 TUN を読まないので、送るものも止まる。ACK が来なければ元に戻して続ける
+ */
+void MPUDPTunnel::_OnUpgradeRequest() {
+	const int	conn = accept4(upgrade_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+	if (conn < 0) { return; }
+	print_info("upgrade: a new process is taking over\n");
+
+	std::vector<std::pair<int, xdp_port*>>	saved;
+	std::unique_ptr<UPGRADE_STATE>			st(new UPGRADE_STATE);
+	std::vector<int>	fds(1, sock_tun);
+	const uint64_t		deadline = monotonic_ns() + UPGRADE_QUIESCE_NS;
+	bool				ok = false;
+
+	for (size_t i = 0; i < rx_sources.size(); i++) {
+		saved.emplace_back(rx_sources[i]->fd.load(std::memory_order_relaxed), rx_sources[i]->xdp.load(std::memory_order_relaxed));
+		this->_SetSourceFd(i, -1, nullptr);
+	}
+	// -P：受信スレッドが読むのをやめてから、RX にそれまでのフレームを処理させて止める
+	auto sources_quiet = [this]() {
+		return !rx_threads || std::all_of(rx_sources.begin(), rx_sources.end(), [](const std::unique_ptr<RX_SOURCE>& s) {
+			return s->seen.load(std::memory_order_acquire) == s->gen.load(std::memory_order_relaxed);
+		});
+	};
+	while (!sources_quiet() && monotonic_ns() < deadline) { usleep(100); }
+	rx_hold.store(1, std::memory_order_release);
+	rx_wake.kick();
+	while (!this->_RxQuiet() && monotonic_ns() < deadline) { usleep(100); }
+
+	if (!sources_quiet() || !this->_RxQuiet()) {
+		print_error("upgrade: the receiver did not stop\n");
+	}
+	else {
+		// RX は止まっている。サーバーはクライアントごとに分かれているので、それぞれを client_id と一緒に渡す
+		// 上限を超えたら、最近受信したものから
+		std::vector<const RX_SESSION*>	order;
+
+		for (const auto& ss : rx_sessions) { order.push_back(ss.get()); }
+		std::sort(order.begin(), order.end(), [](const RX_SESSION *a, const RX_SESSION *b) { return a->last_rx_ns > b->last_rx_ns; });
+		if (order.size() > UPGRADE_MAX_SESSIONS) {
+			print_error("upgrade: %zu receive sessions, handing over the latest %d\n", order.size(), UPGRADE_MAX_SESSIONS);
+			order.resize(UPGRADE_MAX_SESSIONS);
+		}
+		st->seq = this->seq;
+		for (const RX_SESSION *ss : order) {
+			st->sessions[st->nsessions].client_id = ss->client_id;
+			st->sessions[st->nsessions].seq_rec = ss->seq_rec;
+			st->nsessions++;
+		}
+		ok = this->_Snapshot(*st, fds) && upgrade_send(conn, *st, fds.data(), fds.size()) && upgrade_wait_ack(conn);
+	}
+	if (ok) {
+		print_info("upgrade: handed over to the new process (seq_all = %u) - exiting\n", this->seq);
+		fflush(stdout);
+		fflush(stderr);
+		_exit(0);
+	}
+	print_error("upgrade: the new process did not take over - continuing\n");
+	close(conn);
+	for (size_t i = 0; i < rx_sources.size(); i++) { this->_SetSourceFd(i, saved[i].first, saved[i].second); }
+	rx_hold.store(0, std::memory_order_release);
+}
+
+void MPUDPTunnel::_BlockSignals() {
+	sigset_t	set;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+void MPUDPTunnel::PrintStats() {
+	print_info("===== STATS =====\n");
+	print_histogram("tun read -> SendTo", hist_tx.snapshot(), "ns");
+
+	if (arq_tx) {
+		print_info("ARQ sender: stored %llu, resent %llu, expired %llu, not stored %llu\n",
+			(unsigned long long)arq_tx->stored, (unsigned long long)arq_tx->resent,
+			(unsigned long long)arq_tx->expired, (unsigned long long)arq_tx->unknown);
+	}
+	for (const auto& s : socks) {
+		if (s.send_dropped == 0) { continue; }
+		print_info("SEND [%s]: %llu frames dropped (socket buffer full)\n",
+			s.eth_name.empty() ? inet_ntoa(s.remote_addr.sin_addr) : s.eth_name.c_str(), (unsigned long long)s.send_dropped);
+	}
+	// 片道遅延は基準（最小値）からの伸びだけ。tx は相手から報告された方向（rx は RX スレッドが表示する）
+	for (const auto& s : socks) {
+		if (s.owd_tx_ns == 0) { continue; }
+		print_info("OWD [%s]: tx qdelay %dus, trend %+dus (%u samples)\n",
+			s.eth_name.empty() ? inet_ntoa(s.remote_addr.sin_addr) : s.eth_name.c_str(),
+			s.owd_tx.qdelay_us, s.owd_tx.trend_us, s.owd_tx.samples);
+	}
+	// 受信報告も相手から見た（こちらが送った方向の）値
+	for (const auto& s : socks) {
+		if (s.fb.reports == 0) { continue; }
+		print_info("FB  [%s]: tx loss %u.%u%%, reorder %u.%u%%, jitter %uus, srtt %uus, delivered %.2fMbps (%u reports)\n",
+			s.eth_name.empty() ? inet_ntoa(s.remote_addr.sin_addr) : s.eth_name.c_str(),
+			s.fb.loss_permille / 10, s.fb.loss_permille % 10, s.fb.reorder_permille / 10, s.fb.reorder_permille % 10,
+			s.fb.jitter_us, s.fb.srtt_us, s.fb.delivery_rate * 8 / 1e6, s.fb.reports);
+	}
+}
+
+void MPUDPTunnel::SetArq(const ARQ_CONFIG& conf) {
+	arq_conf = conf;
+	if (conf.enable) { arq_tx.reset(new arq_store); }
+}
+
+void MPUDPTunnel::_ArqOnTunRead(uint64_t now, uint16_t data_len) {
+	IP_INFO	info;
+
+	mode_flags = 0;
+	if (!arq_tx || data_len > BUFSIZE) { return; }	// -S の大きなパケットは控えに収まらない
+	if (!arq_conf.all) {
+		if (!ip_parse(this->GetTxDataPtr(), data_len, info) || info.proto != IPPROTO_UDP) { return; }
+		if (arq_conf.port != 0 && info.sport != arq_conf.port && info.dport != arq_conf.port) { return; }
+	}
+	mode_flags = TUN_FLAG_ARQ;
+	arq_tx->push(this->seq, this->GetTxDataPtr(), data_len, now, now + (uint64_t)arq_conf.deadline_ms * 1000 * 1000);
+}
+
+void MPUDPTunnel::_ArqOnRecv(RX_SESSION& ss, const TUN_HEADER *phead, uint64_t now) {
+	ss.arq_rx.OnRecv(phead->seq_all, (phead->mode & TUN_FLAG_ARQ) != 0, now);
+}
+
+void MPUDPTunnel::_OnControl(SOCKET_PACK *from, const TUN_HEADER *phead, const uint8_t *payload, uint64_t now) {
+	CONTROL_HEADER		ctrl;
+
+	if (phead->length < sizeof(ctrl)) { return; }
+	memcpy(&ctrl, payload, sizeof(ctrl));
+
+	switch (ctrl.type) {
+	case CTRL_NACK:
+		this->_ArqOnNack(from, phead, payload, now);
+		break;
+
+	case CTRL_OWD:
+		if (from == nullptr || phead->length < sizeof(ctrl) + sizeof(OWD_REPORT)) { break; }
+		memcpy(&from->owd_tx, payload + sizeof(ctrl), sizeof(OWD_REPORT));
+		from->owd_tx_ns = now;
+		trace_debug(TEV_OWD_REPORT, from->sock_fd, from->owd_tx.qdelay_us, from->owd_tx.trend_us, from->owd_tx.samples);
+		this->_OnOwdReport(*from, now);
+		break;
+
+	case CTRL_FEEDBACK: {
+		FEEDBACK_REPORT	r;
+
+		if (from == nullptr || phead->length < sizeof(ctrl) + sizeof(r)) { break; }
+		memcpy(&r, payload + sizeof(ctrl), sizeof(r));
+		if (from->fb.OnReport(r, now)) { this->_OnFeedback(*from, now); }
+		break;
+	}
+	}
+}
+
+// 受信したフレームの tx_us から片道遅延のサンプルを取り、OWD_REPORT_NS ごとに同じ経路で送り返す（送るのは TX）
+void MPUDPTunnel::_OwdOnRecv(RX_PATH& path, const TUN_HEADER *phead, uint64_t now) {
+	uint8_t				payload[sizeof(CONTROL_HEADER) + sizeof(OWD_REPORT)];
+	const CONTROL_HEADER	ctrl = { CTRL_OWD, 1, 0 };
+	OWD_REPORT			r;
+
+	path.owd.OnSample((uint32_t)(now / 1000) - phead->tx_us, now);
+	if (!path.owd.TakeReport(now, r)) { return; }
+
+	memcpy(payload, &ctrl, sizeof(ctrl));
+	memcpy(payload + sizeof(ctrl), &r, sizeof(r));
+	this->_Post(PIPE_SEND, path.path, &path.addr, 0, payload, sizeof(payload));
+}
+
+// seq_dev から経路ごとの損失・順序・揺らぎを数え、FEEDBACK_REPORT_NS ごとに同じ経路で送り返す（送るのは TX）
+void MPUDPTunnel::_FeedbackOnRecv(RX_PATH& path, const TUN_HEADER *phead, uint32_t len, uint64_t now) {
+	uint8_t				payload[sizeof(CONTROL_HEADER) + sizeof(FEEDBACK_REPORT)];
+	const CONTROL_HEADER	ctrl = { CTRL_FEEDBACK, 1, 0 };
+	FEEDBACK_REPORT		r;
+
+	path.fb.OnFrame(phead->seq_dev, len, phead->tx_us, now);
+	if (!path.fb.TakeReport(now, r)) { return; }
+
+	memcpy(payload, &ctrl, sizeof(ctrl));
+	memcpy(payload + sizeof(ctrl), &r, sizeof(r));
+	this->_Post(PIPE_SEND, path.path, &path.addr, 0, payload, sizeof(payload));
+}
+
+void MPUDPTunnel::_ArqOnNack(SOCKET_PACK *from, const TUN_HEADER *phead, const uint8_t *payload, uint64_t now) {
+	CONTROL_HEADER		ctrl;
+	NACK_RANGE			ranges[ARQ_MAX_RANGES];
+
+	if (!arq_tx) { return; }
+	memcpy(&ctrl, payload, sizeof(ctrl));
+
+	const int	n = (ctrl.count * sizeof(NACK_RANGE) <= phead->length - sizeof(ctrl)) ?
+		ctrl.count : (phead->length - sizeof(ctrl)) / sizeof(NACK_RANGE);
+	memcpy(ranges, payload + sizeof(ctrl), n * sizeof(NACK_RANGE));
+
+	uint32_t	budget = ARQ_STORE_SIZE;	// 壊れた NACK で延々と送り続けないように
+
+	for (int i = 0; i < n; i++) {
+		trace_debug(TEV_ARQ_NACK, ranges[i].start, ranges[i].count);
+
+		for (uint32_t k = 0; k < ranges[i].count && budget > 0; k++, budget--) {
+			ARQ_ENTRY	*e = arq_tx->find(ranges[i].start + k);
+
+			if (e == nullptr) { arq_tx->unknown++; continue; }
+			if (now > e->deadline_ns) { arq_tx->expired++; continue; }
+			// 全経路から届いた同じ NACK に何度も応えない
+			if (e->resent_ns != 0 && now - e->resent_ns < ARQ_NACK_INTERVAL_NS / 2) { continue; }
+
+			SOCKET_PACK	*path = this->_RepairPath(from);
+			if (path == nullptr) { return; }
+
+			this->Resend(*path, e->seq_all, e->data, e->length);
+			this->_OnRepairSent(*path, now, sizeof(TUN_HEADER) + e->length);
+			trace_debug(TEV_ARQ_RESEND, e->seq_all, path->sock_fd);
+			e->resent_ns = now;
+			arq_tx->resent++;
+		}
+	}
+}
+
+// 抜けをまとめて NACK する。落ちていない全経路に流す（小さいので、どれか１つ届けばよい。送るのは TX）
+// NACK は抜けを見つけた相手の経路にだけ送る（サーバーは他のクライアントに送らない）
+void MPUDPTunnel::_ArqPoll(uint64_t now) {
+	uint8_t			payload[sizeof(CONTROL_HEADER) + ARQ_MAX_RANGES * sizeof(NACK_RANGE)];
+	CONTROL_HEADER	ctrl = { CTRL_NACK, 0, 0 };
+
+	for (auto& ss : rx_sessions) {
+		if (!ss->arq_rx.Pending() || now - ss->arq_polled_ns < ARQ_POLL_NS) { continue; }
+		ss->arq_polled_ns = now;
+
+		const int	n = ss->arq_rx.CollectNacks(now, (NACK_RANGE*)(payload + sizeof(ctrl)), ARQ_MAX_RANGES);
+		if (n == 0) { continue; }
+
+		ctrl.count = (uint8_t)n;
+		memcpy(payload, &ctrl, sizeof(ctrl));
+		this->_Post(PIPE_SEND_ALL, -1, nullptr, ss->client_id, payload, sizeof(ctrl) + n * sizeof(NACK_RANGE));
+	}
+}
+
+uint64_t MPUDPTunnel::_ArqWait(uint64_t now) const {
+	uint64_t	wait_ns = UINT64_MAX;
+
+	for (const auto& ss : rx_sessions) {
+		if (!ss->arq_rx.Pending()) { continue; }
+
+		const uint64_t	next = ss->arq_polled_ns + ARQ_POLL_NS;
+		const uint64_t	w = (next > now) ? next - now : 0;
+		if (w < wait_ns) { wait_ns = w; }
+	}
+	return wait_ns;
+}
+
+// 受信できるデータがないことを確認してから呼ぶ必要はない（エラーがなければすぐ戻る）
+int MPUDPTunnel::_DrainErrors(int sock_fd, const std::string& name) {
+	uint8_t		cbuf[512];
+	uint8_t		dummy[64];
+	iovec		iov = { dummy, sizeof(dummy) };
+	msghdr		msg;
+	int			path_err = 0;
+
+	while (true) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov			= &iov;
+		msg.msg_iovlen		= 1;
+		msg.msg_control		= cbuf;
+		msg.msg_controllen	= sizeof(cbuf);
+
+		if (recvmsg(sock_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) { break; }
+
+		for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+			if (c->cmsg_level != IPPROTO_IP || c->cmsg_type != IP_RECVERR) { continue; }
+
+			const sock_extended_err	*ee = (const sock_extended_err*)CMSG_DATA(c);
+			pdebug("eth[%s]: error queue : errno = %u, origin = %u, type = %u, code = %u\n",
+				name.c_str(), ee->ee_errno, ee->ee_origin, ee->ee_type, ee->ee_code);
+			if (is_path_error(ee->ee_errno)) { path_err = ee->ee_errno; }
+		}
+	}
+	return path_err;
+}
+
+/*
+ * paths[0..n) に同じペイロードを送る。TUN_HEADER は経路ごとにスタック上で組み立て、
+ * ペイロードは iovec で参照するだけなのでコピーしない。prefix があればペイロードの前に並べる（MODE_STRIPE の STRIPE_HEADER）
+ * 同じソケットへ続けて送るフレーム（サーバー側は全経路が１つのソケット）は sendmmsg １回にまとめる。
+ * -X の経路は sendmmsg の代わりに XSK の TX リングに積む。
+ * 成功したフレームのうち最大の送信バイト数を返す（全部失敗なら -1、送り先がなければ 0）
+ */
+ssize_t MPUDPTunnel::_SendFrames(SOCKET_PACK* const *paths, int n, uint8_t mode, uint32_t seq_all, const uint8_t *payload, uint16_t len,
+		const void *prefix, uint16_t prefix_len) {
+	TUN_HEADER	heads[SEND_BATCH_MAX];
+	iovec		iovs[SEND_BATCH_MAX][3];
+	mmsghdr		msgs[SEND_BATCH_MAX];
+	alignas(cmsghdr) uint8_t	ctrls[SEND_BATCH_MAX][CMSG_SPACE(sizeof(in_pktinfo))];
+	ssize_t		nwrite = (n > 0) ? -1 : 0;
+	const int	niov = (prefix != nullptr) ? 3 : 2;
+
+	const uint64_t	now = monotonic_ns();
+
+	for (int base = 0; base < n; base += SEND_BATCH_MAX) {
+		const int	m = (n - base < SEND_BATCH_MAX) ? n - base : SEND_BATCH_MAX;
+
+		for (int i = 0; i < m; i++) {
+			SOCKET_PACK&	s = *paths[base + i];
+
+			// 送信に失敗したものも控えておく（経路断なら別経路で送り直される）
+			// 断片は MODE_STABLE で送り直しても受信側で組み立てられないので控えない
+			if (s.rescue && (mode & TUN_MODE_MASK) != MODE_CONTROL && (mode & TUN_MODE_MASK) != MODE_STRIPE) {
+				s.rescue->push(now, seq_all);
+			}
+			heads[i].mode		= mode;
+			heads[i].device_id	= s.DeviceId();
+			heads[i].length		= prefix_len + len;
+			heads[i].seq_all	= seq_all;
+			heads[i].seq_dev	= s.seq_dev;
+			heads[i].tx_us		= (uint32_t)(now / 1000);
+
+			iovs[i][0] = { &heads[i], sizeof(TUN_HEADER) };
+			iovs[i][1] = { (void*)prefix, prefix_len };
+			iovs[i][niov - 1] = { (void*)payload, len };
+
+			memset(&msgs[i], 0, sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name	= &s.remote_addr;
+			msgs[i].msg_hdr.msg_namelen	= sizeof(s.remote_addr);
+			msgs[i].msg_hdr.msg_iov		= iovs[i];
+			msgs[i].msg_hdr.msg_iovlen	= niov;
+			if (s.pin_src) { set_pktinfo(msgs[i].msg_hdr, ctrls[i], sizeof(ctrls[i]), s.local_addr.sin_addr, s.ifindex); }
+		}
+
+		// 同じソケット宛てが続く区間ごとに送る。途中で失敗したらそのフレームだけ飛ばして続ける
+		for (int i = 0; i < m; ) {
+			const int	fd = paths[base + i]->sock_fd;
+			int			run = 1;
+
+			while (i + run < m && paths[base + i + run]->sock_fd == fd) { run++; }
+
+			xdp_port	*xdp = paths[base + i]->xdp.get();
+			int			wake_errno = 0;
+			const int	sent = (xdp != nullptr) ? xdp->send(&msgs[i], run, wake_errno) : sendmmsg(fd, &msgs[i], run, MSG_DONTWAIT);
+
+			if (wake_errno != 0) { paths[base + i]->send_errno = wake_errno; }	// -X：積んだが送り出せなかった（経路断）
+
+			// 先頭のフレームが送れなかった（errno はこの呼び出しのもの）。そのフレームだけ飛ばす
+			if (sent <= 0) {
+				SOCKET_PACK&	s = *paths[base + i];
+
+				s.send_errno = errno;
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					s.send_dropped++;	// 送信バッファが一杯（待たずに捨てる。数は統計に出す）
+				}
+				else {
+					perror("sendmmsg");
+					print_error("sendmmsg returned an invalid value : %d\n", errno);
+				}
+				i++;
+				continue;
+			}
+			for (int k = 0; k < sent; k++) {
+				SOCKET_PACK&	s = *paths[base + i + k];
+				const ssize_t	w = msgs[i + k].msg_len;
+
+				capture_tapv(CAPTURE_IF_MPUDP, CAPTURE_DIR_OUT, iovs[i + k], niov, s.DeviceId(), seq_all, s.seq_dev);
+				trace_debug(TEV_ETH_SEND, s.DeviceId(), w,
+					s.remote_addr.sin_addr.s_addr, ntohs(s.remote_addr.sin_port), seq_all, s.seq_dev
+				);
+				s.seq_dev++;
+				if (w > nwrite) { nwrite = w; }
+			}
+			// 途中までしか送れなかったら、残りはもう一度送ってみる（失敗すれば次の呼び出しが -1 と errno を返す）
+			i += sent;
+		}
 	}
 	return nwrite;
 }
 
 // data_len はペイロード長
 ssize_t MPUDPTunnel::SendTo(SOCKET_PACK& s, uint16_t data_len) {
-	TUN_HEADER	*phead = (TUN_HEADER*)tun_buf.get();
-	ssize_t		nwrite = 0;
+	SOCKET_PACK	*path = &s;
+	ssize_t		nwrite;
 
-	phead->device_id = s.sock_fd;
-	phead->length = data_len;
-	phead->seq_all = this->seq;
-	phead->seq_dev = s.seq_dev;
-	phead->mode = MODE_SPEED;
-
-	nwrite = this->_sendto(s, data_len);
-	this->seq++;
+	nwrite = this->_SendFrames(&path, 1, MODE_SPEED | mode_flags, this->seq, this->GetTxDataPtr(), data_len);
+	this->_TxSent(data_len);
 	return nwrite;
 }
 
 ssize_t MPUDPTunnel::SendToAllDevices(uint16_t data_len) {
-	TUN_HEADER	*phead = (TUN_HEADER*)tun_buf.get();
-	ssize_t		nwrite = 0;
-
-	phead->length = data_len;
-	phead->seq_all = this->seq;
-	phead->mode = MODE_STABLE;
+	ssize_t		nwrite;
 
 	if (socks.size() == 0) { return 0; }
 
+	// 落ちている経路には流さない（全部落ちているときは全部に流す）
+	const bool	any_up = std::any_of(socks.begin(), socks.end(), [](const SOCKET_PACK& s) { return s.path_up; });
+
+	fanout.clear();
 	for (auto& s : socks) {
-		phead->device_id = s.sock_fd;
-		nwrite = this->_sendto(s, data_len);
+		if (s.sock_fd == -1 || (any_up && !s.path_up)) { continue; }
+		fanout.push_back(&s);
 	}
-	this->seq++;
+	nwrite = this->_SendFrames(fanout.data(), fanout.size(), MODE_STABLE | mode_flags, this->seq, this->GetTxDataPtr(), data_len);
+	this->_TxSent(data_len);
 	return nwrite;
 }
 
-ssize_t MPUDPTunnel::RecvFrom(SOCKET_PACK& s, sockaddr_in *addr_from) {
-	TUN_HEADER	*phead = (TUN_HEADER*)tun_buf.get();
-	sockaddr_in	addr;
-	socklen_t	addr_len = sizeof(addr);
-	ssize_t		nread = -1;
+// 指定した経路にだけ同じパケットを流す（MODE_STABLE なので受信側で重複は捨てられる）
+ssize_t MPUDPTunnel::SendToDevices(SOCKET_PACK* const *paths, int n, uint16_t data_len) {
+	ssize_t		nwrite;
 
-	nread = recvfrom(
-		s.sock_fd, tun_buf.get(), sizeof(TUN_HEADER),
-		MSG_PEEK, (sockaddr*)&addr, &addr_len
-	);
-	if (nread < 0) {
-		throw std::runtime_error("recvfrom returned an invalid value");
-	}
+	nwrite = this->_SendFrames(paths, n, MODE_STABLE | mode_flags, this->seq, this->GetTxDataPtr(), data_len);
+	this->_TxSent(data_len);
+	return nwrite;
+}
 
-	// パケット分割に備え、対向側が TUN_HEADER に書き込んだデータ長を読み切るまで待機
-	nread = recvfrom(
-		s.sock_fd, tun_buf.get(), sizeof(TUN_HEADER) + phead->length,
-		MSG_WAITALL, (sockaddr*)&addr, &addr_len
-	);
-	if (nread < 0) {
-		throw std::runtime_error("recvfrom returned an invalid value");
-	}
-	if (addr_from != nullptr) {
-		*addr_from = addr;
+// 送ったパケットの場所は TX_RING_SLOTS 個あとの seq_all が TUN から読むまで残る
+// 今の場所（まだ送っていない seq_all）と、分割して送ったものは返さない
+const uint8_t* MPUDPTunnel::GetSentData(uint32_t seq_all, uint16_t& data_len) const {
+	const TX_SLOT&	t = tx_slots[seq_all % TX_RING_SLOTS];
+
+	if (this->seq - seq_all - 1 >= TX_RING_SLOTS - 1 || t.seq_all != seq_all || t.length == 0) { return nullptr; }
+	data_len = t.length;
+	return this->_TxSlot(seq_all);
+}
+
+// seq_all は振り直さず、MODE_STABLE として流す（元のパケットが届いていれば受信側で捨てられる）
+ssize_t MPUDPTunnel::Resend(SOCKET_PACK& s, uint32_t seq_all, const uint8_t *data, uint16_t data_len) {
+	SOCKET_PACK	*path = &s;
+	return this->_SendFrames(&path, 1, MODE_STABLE, seq_all, data, data_len);
+}
+
+// TUN から読んだ data_len バイトを先頭から lens[i] バイトずつに分け、STRIPE_HEADER を付けて paths[i] に流す
+// 断片はどれも同じ seq_all を持つ。経路ごとにペイロードが違うので１断片ずつ送る（STRIPE_HEADER と断片は別の iovec で、コピーしない）
+// lens の合計が data_len になるごとに別の組（サーバーはクライアントごと）として、先頭から数え直す
+ssize_t MPUDPTunnel::SendStriped(SOCKET_PACK* const *paths, const uint16_t *lens, int n, uint16_t data_len) {
+	STRIPE_HEADER	h = { data_len, 0, 0, 0, 0 };
+	ssize_t			nwrite = (n > 0) ? -1 : 0;
+	int				first = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (i == first) {
+			uint32_t	sum = 0;
+			int			k = i;
+
+			while (k < n && sum < data_len) { sum += lens[k++]; }
+			h.offset = 0;
+			h.count = k - first;
+			first = k;
+		}
+		h.index = i - (first - h.count);
+		const ssize_t	w = this->_SendFrames(&paths[i], 1, MODE_STRIPE | mode_flags, this->seq, this->GetTxDataPtr() + h.offset, lens[i], &h, sizeof(h));
+
+		if (w > nwrite) { nwrite = w; }
+		h.offset += lens[i];
 	}
-	return nread;
+	this->_TxSent(0);	// 送り直しには使わない
+	return nwrite;
+}
+
+// payload を MODE_CONTROL のフレームとして送る（seq_all は消費しない）
+ssize_t MPUDPTunnel::SendControl(SOCKET_PACK& s, const void *payload, uint16_t len) {
+	SOCKET_PACK	*path = &s;
+	return this->_SendFrames(&path, 1, MODE_CONTROL, 0, (const uint8_t*)payload, len);
 }
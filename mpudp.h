@@ -3,37 +3,207 @@
 #define	__MPUDP_H__
 
 #include <vector>
+#include <array>
+#include <unordered_map>
 #include <string>
 #include <memory>
 #include <thread>
 #include <mutex>
 #include <chrono>
 
+#include <signal.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <unistd.h>
 
 #include "mpudpdef.h"
 #include "print.h"
+#include "trace.h"
+#include "capture.h"
 #include "network.h"
 #include "ringbuf.h"
+#include "seqwindow.h"
+#include "ippacket.h"
+#include "flowtable.h"
+#include "arq.h"
+#include "netlink.h"
+#include "pipeline.h"
+#include "lowlat.h"
+#include "scheduler.h"
+#include "pathtrace.h"
+#include "qos.h"
+#include "downlink.h"
+#include "stripe.h"
+#include "upgrade.h"
 
 // RAIIを装備したほうが良い気がする
 class MPUDPTunnel {
 private:
+	/*
+	 * TX スレッド（MainLoop）専用
+	 */
 	uint32_t	seq;
-	std::unique_ptr<uint8_t>	tun_buf;	// 操作時 MUTEX 必須！
-	uint8_t	*data_buf;						// 操作時 MUTEX 必須！
 
-	ssize_t _sendto(SOCKET_PACK& s, uint16_t data_len);
+	// TUN から読んだペイロードだけを置く。送信中は書き換えない
+	// TUN_HEADER は経路ごとに別に組み立て、iovec でペイロードと繋げて送る（複製してもペイロードはコピーしない）
+	// TX_RING_SLOTS 個の場所を seq_all の順に使い回すので、送ったものは TX_RING_SLOTS 個あとまで残る。
+	// 経路断の送り直し（RESCUE_RING）はここを seq_all で引く
+	typedef struct _TX_SLOT {
+		uint32_t	seq_all;	// 最後にこの場所から送ったパケット
+		uint16_t	length;
+	} TX_SLOT;
+	uint32_t	tx_slot_size;					// 場所１つの大きさ（_StartPipeline で _TunReadSize() に合わせる）
+	std::unique_ptr<uint8_t[]>	tx_ring;		// tx_slot_size * TX_RING_SLOTS バイト
+	std::unique_ptr<TX_SLOT[]>	tx_slots;
+	inline uint8_t* _TxSlot(uint32_t seq_all) const { return tx_ring.get() + (size_t)(seq_all % TX_RING_SLOTS) * tx_slot_size; }
+	inline void _TxSent(uint16_t data_len) {		// 今の場所から送ったら seq_all を進める
+		tx_slots[this->seq % TX_RING_SLOTS] = { this->seq, data_len };
+		this->seq++;
+	}
+	std::vector<SOCKET_PACK*>	fanout;		// SendToAllDevices で使う経路の一覧（毎回確保しないように持っておく）
+
+	ssize_t _SendFrames(SOCKET_PACK* const *paths, int n, uint8_t mode, uint32_t seq_all, const uint8_t *payload, uint16_t len,
+		const void *prefix = nullptr, uint16_t prefix_len = 0);
+
+	// 選択的再送（-R）の送信側
+	ARQ_CONFIG	arq_conf;
+	uint8_t		mode_flags;		// 次に送るパケットの TUN_HEADER::mode に付けるフラグ
+	std::unique_ptr<arq_store>	arq_tx;
+
+	// 付け替えで外したソケット（と XSK）。RX 側が読まなくなってから閉じる
+	typedef struct _RETIRED_FD {
+		int			source;
+		int			fd;
+		uint32_t	gen;
+		std::unique_ptr<xdp_port>	xdp;
+	} RETIRED_FD;
+	std::vector<RETIRED_FD>	retired;
+
+	// 無停止の入れ替え（-U）
+	std::string	upgrade_path;
+	int			upgrade_listen_fd;	// 旧として次のプロセスを待つ（-1 = 待たない）
+	int			upgrade_conn;		// 新：引き継いだ旧との接続（ACK を返すまで）
+	uint64_t	upgrade_polled_ns;	// -L spin のときに最後に依頼を見た時刻
+	std::vector<int>	taken_fds;	// 新：受け取った fd（使ったものは -1 にする）
+	std::vector<int>	received_fds;	// 新：受け取った fd すべて（ACK を返せなかったら使ったものも閉じる）
+
+	/*
+	 * RX スレッド専用
+	 */
+	std::unique_ptr<RX_FRAME[]>	rx_frames;	// 受信スレッドを使わないときの受信バッファ（RX_BATCH 個）
+	std::vector<std::unique_ptr<RX_SESSION>>	rx_sessions;	// 先頭は client_id 0（クライアントはこれだけを使う）
+
+	void _RxLoop();
+	void _RxLoopDirect();					// RX スレッドが経路のソケットを直接読む
+	void _RxLoopThreads();					// -P：受信スレッドが読んだフレームを受け取る
+	void _RxSourceLoop(int source);			// -P：経路ごとの受信スレッド
+	void _RxFrame(RX_FRAME& f, int source);
+	bool _RxDrainSources();
+	void _RxPark();							// -U：入れ替えの間、TX が rx_hold を戻すまで止まる
+	void _RxPathError(int source, int err);
+	void _PrintRxStats();
+
+	void _ArqOnRecv(RX_SESSION& ss, const TUN_HEADER *head, uint64_t now);	// 重複でないパケットを受け取ったら
+	void _ArqPoll(uint64_t now);							// NACK を送る（相手ごとに、その相手の経路へ）
+	uint64_t _ArqWait(uint64_t now) const;					// 次に _ArqPoll を呼ぶべき時刻までの待ち時間（なければ UINT64_MAX）
+	void _OwdOnRecv(RX_PATH& path, const TUN_HEADER *head, uint64_t now);	// データのフレームを受け取ったら（必要なら報告を送り返す）
+	void _FeedbackOnRecv(RX_PATH& path, const TUN_HEADER *head, uint32_t len, uint64_t now);	// 制御フレームも含めて受け取ったら
+
+	// RX 側：相手ごとの状態（RX_PATH::session が nullptr なら先頭）
+	inline RX_SESSION& _RxSessionOf(const RX_PATH *path) { return (path != nullptr && path->session != nullptr) ? *path->session : *rx_sessions[0]; }
+
+	/*
+	 * スレッド間
+	 */
+	bool		rx_threads;		// -P
+	std::unique_ptr<handoff<PIPE_MSG, PIPE_SLOTS>>	to_tx;	// RX → TX
+	pipe_waker	tx_wake;
+	pipe_waker	rx_wake;		// -P の受信スレッドからのフレーム、fd の付け替え、統計表示の依頼
+	std::atomic<bool>		rx_dump;	// RX 側の統計を表示してほしい
+	std::atomic<uint64_t>	pipe_dropped;	// TX が詰まっていて渡せなかった依頼の数
+	std::atomic<int>		rx_hold;	// -U：0 = 動く、1 = TX が止めたい、2 = RX が止まった（_RxPark）
+	inline bool _RxQuiet() const { return rx_hold.load(std::memory_order_acquire) == 2; }
+	std::unique_ptr<std::thread>	th_rx;
 
 protected:
-	std::mutex	buf_mtx;
-	std::vector<SOCKET_PACK>	socks;
+	std::vector<SOCKET_PACK>	socks;		// TX スレッド専用
 	int	sock_tun;
 
+	std::vector<RX_PATH>	rx_paths;		// RX スレッド専用（クライアントは socks と同じ並びで起動時に作る）
+	std::vector<std::unique_ptr<RX_SOURCE>>	rx_sources;	// RX が読むソケット（起動後に数を変えない）
+
 	std::unique_ptr<std::thread>	th_echo;
 
+	LOWLAT_CONFIG	lowlat;		// -L
+	STRIPE_CONFIG	stripe;		// -S
+
+	// TUN から読む長さと、読んだパケットを分割して送るか
+	inline uint32_t _TunReadSize() const { return stripe.enable ? TUN_BUFSIZE : BUFSIZE; }
+	inline bool _Striping(uint32_t data_len) const { return stripe.enable && (data_len > stripe.min || data_len > BUFSIZE); }
+
+	// 内部処理のレイテンシ（ナノ秒）
+	// TUN 読み込み完了 → SendTo 完了（TX）、受信完了 → tun_ewrite 完了（RX） まで
+	latency_histogram	hist_tx;
+	latency_histogram	hist_rx;
+
+	static void _BlockSignals();	// 統計表示のシグナルをメインループのスレッドに届けるため、他スレッドではブロックする
+	static int _DrainErrors(int sock_fd, const std::string& name);	// IP_RECVERR のエラーキューを空にする。経路断を示すエラーがあればその errno
+
+	// パイプライン。Start の最後に、socks・rx_paths・rx_sources を揃えてから呼ぶ
+	bool _StartPipeline();
+	inline int _TxWakeFd() const { return tx_wake.get(); }
+	// TX の select の前後で呼ぶ。前で true が返ったら RX からの依頼が既に来ているので待たない
+	inline bool _TxSleepBegin() { tx_wake.sleep_begin(); return !to_tx->empty(); }
+	inline void _TxSleepEnd(bool fired) { tx_wake.sleep_end(fired); }
+	void _TxDrainPipe();							// RX からの依頼を処理し、読まれなくなったソケットを閉じる
+	void _SetSourceFd(int source, int fd, xdp_port *xdp);				// 経路のソケット（と XSK）を付け替えた
+	void _RetireFd(int source, int fd, std::unique_ptr<xdp_port> xdp);	// 外したソケットを、RX が読まなくなってから閉じる
+	bool _Post(uint8_t type, int path, const sockaddr_in *addr, int32_t arg, const void *data, uint16_t len);	// RX から TX への依頼
+
+	// 無停止の入れ替え（-U）
+	// 新：taken は旧から受け取った状態（Start の間だけ。nullptr なら普通に起動した）
+	std::unique_ptr<UPGRADE_STATE>	taken;
+	bool _TakeOver(const std::string& tun_name, bool server);	// 旧がいれば TUN と状態を引き継ぎ、いなければ TUN を開く
+	int _TakeFd(int index);			// 受け取った fd を使う（なければ -1）
+	bool _UpgradeReady();			// パイプラインを動かす前に：旧に ACK を返し、次のプロセスを待ち始める。ACK を返せなければ false
+	// 旧：次のプロセスからの依頼を受ける。TX スレッドで、待ち受けが読めるときに呼ぶ
+	inline int _UpgradeFd() const { return upgrade_listen_fd; }
+	void _OnUpgradeRequest();
+	inline void _PollUpgrade(uint64_t now) {	// -L spin：select で待たないので LOWLAT_SPIN_CHECK_NS ごとに見る
+		if (upgrade_listen_fd == -1 || now - upgrade_polled_ns < LOWLAT_SPIN_CHECK_NS) { return; }
+		upgrade_polled_ns = now;
+		this->_OnUpgradeRequest();
+	}
+	// 渡す経路と fd（TUN の後ろに足す）。渡せない経路があれば false
+	virtual bool _Snapshot(UPGRADE_STATE& st, std::vector<int>& fds) { return true; }
+
+	// RX 側：受信したフレームがどの経路から来たか（クライアントは読んだソケット、サーバーは送信元アドレス）
+	virtual RX_PATH* _RxPath(int source, const RX_FRAME& f) = 0;
+	RX_SESSION* _RxSession(uint32_t client_id);	// サーバー：クライアントの状態（なければ作る）
+	void _RxExpireSessions(uint64_t now);			// サーバー：どの経路からも使われず、しばらく受信していないものを捨てる
+
+	// TX 側：RX からの依頼を処理するときの経路の引き方と、経路ごとの後始末
+	virtual SOCKET_PACK* _FindPath(const sockaddr_in& addr) { return nullptr; }
+	virtual void _OnPathError(SOCKET_PACK& s, int err) {}
+	virtual void _OnPeer(const sockaddr_in& addr, const PIPE_PEER_INFO& info, int32_t device_id) {}
+
+	// 選択的再送の送信側。TX スレッドで呼ぶ
+	void _ArqOnTunRead(uint64_t now, uint16_t data_len);	// TUN から読んだパケットを送る前に
+	void _ArqOnNack(SOCKET_PACK *from, const TUN_HEADER *head, const uint8_t *payload, uint64_t now);
+
+	// MODE_CONTROL のフレームを受け取ったら（from は届いた経路）。TX スレッドで呼ぶ
+	void _OnControl(SOCKET_PACK *from, const TUN_HEADER *head, const uint8_t *payload, uint64_t now);
+
+	// 送信方向の片道遅延の報告が届いたあとの処理（輻輳制御など）
+	virtual void _OnOwdReport(SOCKET_PACK& s, uint64_t now) {}
+
+	// 受信報告で区間の値（SOCKET_PACK::fb）が更新されたあとの処理（輻輳制御など）
+	virtual void _OnFeedback(SOCKET_PACK& s, uint64_t now) {}
+
+	// 送り直しに使う経路（既定では NACK の届いた経路）と、送ったあとの後始末（輻輳制御など）
+	virtual SOCKET_PACK* _RepairPath(SOCKET_PACK *from) { return from; }
+	virtual void _OnRepairSent(SOCKET_PACK& s, uint64_t now, uint32_t wire_len) {}
+
 public:
 	explicit MPUDPTunnel(uint32_t szbuf);
 	~MPUDPTunnel();
@@ -42,12 +212,25 @@ public:
 
 	ssize_t SendTo(SOCKET_PACK& s, uint16_t data_len);	// for MODE_SPEED
 	ssize_t SendToAllDevices(uint16_t data_len);				// for MODE_STABLE
-	ssize_t RecvFrom(SOCKET_PACK& s, sockaddr_in *addr_from);
-
-	inline TUN_HEADER* const GetHeader() const { return (TUN_HEADER*)tun_buf.get(); }
-	inline uint8_t* const GetDataPtr() const { return data_buf; }
+	ssize_t SendToDevices(SOCKET_PACK* const *paths, int n, uint16_t data_len);	// for MODE_ADAPTIVE
+	ssize_t Resend(SOCKET_PACK& s, uint32_t seq_all, const uint8_t *data, uint16_t data_len);	// 送信済みパケットを別経路で送り直す
+	ssize_t SendControl(SOCKET_PACK& s, const void *payload, uint16_t len);
+	ssize_t SendStriped(SOCKET_PACK* const *paths, const uint16_t *lens, int n, uint16_t data_len);	// for MODE_STRIPE（stripe_plan で分けたもの）
+
+	void SetArq(const ARQ_CONFIG& conf);
+	inline void SetRxThreads(bool enable) { rx_threads = enable; }	// 経路のソケットごとに受信スレッドを立てる（Start の前に）
+	inline void SetLowLatency(const LOWLAT_CONFIG& conf) { lowlat = conf; }	// Start の前に
+	inline void SetStripe(const STRIPE_CONFIG& conf) { stripe = conf; }
+	inline void SetUpgrade(const std::string& path) { upgrade_path = path; }	// Start の前に
+
+	// TUN から読んだパケットを置く場所（SendTo などはここを送る）。送って seq_all が進むと次の場所に変わる
+	inline uint8_t* const GetTxDataPtr() const { return this->_TxSlot(this->seq); }
+	const uint8_t* GetSentData(uint32_t seq_all, uint16_t& data_len) const;	// 送ったパケットがまだ残っていればその場所（なければ nullptr）
 	inline const uint32_t GetSeq() const { return seq; }
 
+	virtual void PrintStats();	// SIGUSR1 を受けたときにメインループから呼ばれる（TX 側の統計）
+	void DumpStats();			// PrintStats に加えて、RX スレッドにも RX 側の統計を表示させる
+
 	// MainLoop を純粋仮想関数として宣言してしまっているので下２つの関数はここで宣言する意味は特にない、呼ばれないし。
 	// 引数は違っていいので同じ名前の関数を実装しておいてね、という意味で残してある。
 	// virtual にしてあるので 子クラスで using しても使えない。
@@ -64,66 +247,225 @@ typedef struct _CONNECTIONS {
 	system_clock::time_point	connected_time;
 	sockaddr_in		addr;
 	int32_t		device_id;
+	bool		probed;		// この経路のプローブを受け取ったことがある
 } CONNECTIONS;
 
+// 管理プレーンの送信元（アドレスとポートごと）
+typedef struct _ECHO_PEER {
+	sockaddr_in	addr;
+	in_addr		local;		// プローブが届いた自アドレス（応答はここから返す）
+	uint32_t	client_id;	// ECHO_PACKET::client_id（0 = 古いクライアント。送信元にだけ返す）
+	int32_t		device_id;
+	uint64_t	seen_ns;	// 最後にプローブを受け取った時刻（monotonic_ns）
+} ECHO_PEER;
+
+// プローブの送信元（アドレスとデバイスID）。データの経路と同じアドレス・デバイスIDから届く
+typedef struct _PROBE_SOURCE {
+	uint32_t	client_id;	// ECHO_PACKET::client_id
+	uint64_t	seen_ns;
+} PROBE_SOURCE;
+
 class MPUDPTunnelServer : public MPUDPTunnel {
 private:
 	std::vector<CONNECTIONS>	connection_list;
 	int sock_recv;
+	int sock_manage;	// 管理プレーン（PORT_PING）。エコースレッドが読む
+
+	// 管理プレーンの統計（エコースレッドが書く）
+	std::atomic<uint64_t>	mgmt_probes;
+	std::atomic<uint64_t>	mgmt_replies;
+	std::atomic<uint64_t>	mgmt_invalid;
+	std::atomic<uint64_t>	mgmt_peers;		// 今覚えている送信元の数
+	std::atomic<uint64_t>	mgmt_expired;
+	std::atomic<uint64_t>	mgmt_queries;	// 接続先の問い合わせ
+
+	uint64_t	paths_checked_ns;
+
+	// プローブの送信元ごとの client_id と最後に受け取った時刻（エコースレッドが書く）
+	// RX はデータの経路をクライアントごとにまとめるのに、TX はプローブが途絶えた経路にパケットを流さないために引く
+	// デバイスIDはクライアントのソケットの番号なので、クライアントが違えば重なる。送信元のアドレスと組にして見分ける
+	std::mutex	probe_mtx;
+	std::unordered_map<uint64_t, PROBE_SOURCE>	probe_sources;	// probe_source_key → 。probe_mtx で保護
+	uint32_t _ProbeClient(const in_addr& addr, int32_t device_id);	// わからなければ 0
+
+	// クライアントに知らせる待ち受けアドレス（-e）。エコースレッドが問い合わせに答える
+	std::vector<std::string>	endpoint_opts;	// 指定されたもの（auto = TUN とループバック以外の全 IPv4 アドレス）
+	std::vector<in_addr>		endpoints;		// Start で解決したもの（エコースレッドを起こした後は変えない）
+
+	downlink_scheduler			downlink;		// -D：下りの経路選択（mode=dup なら使わずに全経路へ複製）
+	std::vector<SOCKET_PACK*>	dl_paths;		// Select や Stripe に渡す場所（socks.size() 個分、STRIPE_MAX_CHUNKS * クライアント数分）
+	std::vector<uint16_t>		dl_lens;		// Stripe に渡す断片の長さ
 
 	bool Start(const std::string& tun_name, const int port);
+	bool _ResolveEndpoints(const std::string& tun_name);
 	bool _SetupSocket(int& sock_fd, int listen_port);
-	void _RefreshConnection(sockaddr_in& addr_from);
+	bool _SetupManageSocket();
+	void _RestoreSession();		// -U：旧から受け取った待ち受けソケットと接続リストで始める
+	bool _Snapshot(UPGRADE_STATE& st, std::vector<int>& fds) override;
+	void _RefreshConnection(const sockaddr_in& addr_from, const in_addr& local, int32_t device_id, uint32_t client_id);
+	void _RefreshPathState(uint64_t now);
+	SOCKET_PACK* _FindPath(const sockaddr_in& addr) override;
+	void _OnPeer(const sockaddr_in& addr, const PIPE_PEER_INFO& info, int32_t device_id) override {
+		this->_RefreshConnection(addr, info.local, device_id, info.client_id);
+	}
+	void _OnOwdReport(SOCKET_PACK& s, uint64_t now) override { downlink.OnOwdReport(s, now); }
+	void _OnFeedback(SOCKET_PACK& s, uint64_t now) override { downlink.OnFeedback(s, now); }
+	RX_PATH* _RxPath(int source, const RX_FRAME& f) override;
+	ssize_t _SendDownlink(uint64_t now, uint16_t data_len);
 
 	std::unique_ptr<std::thread> _StartEchoThread();
 
 public:
-	MPUDPTunnelServer(uint32_t szbuf) : MPUDPTunnel(szbuf) {}
+	MPUDPTunnelServer(uint32_t szbuf) :
+		MPUDPTunnel(szbuf), sock_recv(-1), sock_manage(-1), mgmt_probes(0), mgmt_replies(0), mgmt_invalid(0), mgmt_peers(0), mgmt_expired(0),
+		mgmt_queries(0), paths_checked_ns(0), downlink(socks) {
+	}
 	~MPUDPTunnelServer() {}
 
-	ssize_t RecvFrom(sockaddr_in *addr_from);
 	bool MainLoop() override;
+	void PrintStats() override;
 
+	inline void AddEndpoint(const std::string& addr) { endpoint_opts.push_back(addr); }	// Listen の前に
+	inline void SetDownlink(const DOWNLINK_CONFIG& conf) { downlink.Setup(conf); }
 	inline bool Listen(const std::string& tun_name, const int port) { return Start(tun_name, port); }
 };
 
 
 
+// カーネルのタイムスタンプ（CLOCK_REALTIME、0 = 取れていない）
+typedef struct _PROBE_TS {
+	uint64_t	sw_ns;
+	uint64_t	hw_ns;
+} PROBE_TS;
+
 typedef struct _CONNECT_STATUS {
-	system_clock::time_point	ping_sent_time;
+	uint64_t	sent_ns;	// monotonic_ns
 	int64_t	seq;
+	PROBE_TS	tx_ts;		// エラーキューから読んだ送信タイムスタンプ
 	//_CONNECT_STATUS() : device_id(-1), seq(-1) {}
 } CONNECT_STATUS;
 
 typedef struct _ECHO_SOCKETS {
 	int		device_id;
 	int		echo_sock;
-	double		score;
-	uint64_t	recvd_count;
-	std::chrono::microseconds	rtt_max;
-	std::chrono::microseconds	rtt_avg;
-	ringbuf<CONNECT_STATUS,32>	status;
+	bool	kernel_ts;		// SO_TIMESTAMPING が使えるか
+	ringbuf<CONNECT_STATUS,64>	status;	// 速い間隔でも PING_TIMEOUT_MSEC の間の分は覚えておけるように
+	std::shared_ptr<PATH_METRICS>	metrics;	// SOCKET_PACK と共有
+	std::shared_ptr<PATH_BUDGET>	budget;		// 　　　〃　　　　（-C がなければ nullptr）
+	uint64_t	next_probe;		// 次にプローブを送る時刻（monotonic_ns、経路ごとに間隔が変わる）
+	uint32_t	lost_in_row;	// 連続して失ったプローブの数
+	std::string	eth_name;
+	sockaddr_in	server;			// プローブの送り先（経路の接続先の PORT_PING）
 } ECHO_SOCKETS;
 
+// メインループからエコースレッドへの、経路の出し入れの通知
+typedef struct _ECHO_UPDATE {
+	std::string	eth_name;	// 経路の名前（SOCKET_PACK::eth_name）
+	std::string	dev_name;
+	sockaddr_in	server;		// 経路の接続先
+	int			device_id;	// 経路のデバイスID（SOCKET_PACK::DeviceId）。-1 なら外す
+	std::shared_ptr<PATH_METRICS>	metrics;
+	std::shared_ptr<PATH_BUDGET>	budget;
+} ECHO_UPDATE;
+
 class MPUDPTunnelClient : public MPUDPTunnel {
 private:
 	bool _GetAddressInfo(const std::string& dst_addr, const int dst_port, addrinfo **result);
 	bool _SetupSocket(int& sock_fd, const addrinfo& ai, const std::string& eth_name);
 
-	std::unique_ptr<std::thread> _StartEchoThread(const std::string& dst_addr);// dst_addr はコピーの方がよい
+	std::unique_ptr<std::thread> _StartEchoThread();
 
 	bool Start(const std::string& tun_name, const std::string& addr, const int port);
+	void _QueryEndpoints(const sockaddr_in& primary, std::vector<sockaddr_in>& endpoints);	// サーバーの待ち受けアドレス（先頭は primary）
+
+	path_scheduler	sched;		// socks から送る経路を選ぶ
+
+	// 経路断と送り直し
+	uint64_t	rescued;		// 経路断で別経路に送り直したパケット数
+
+	void _OnPathError(SOCKET_PACK& s, int err) override;
+	void _CheckSendErrors();
+	void _RescuePath(SOCKET_PACK& failed);
+
+	// rtnetlink による経路の出し入れ
+	// socks の要素数は起動後に変えない（フロー表などが位置で覚えているので）。外した経路は sock_fd を -1 にしておく
+	int			sock_nl;		// リンク監視（-1 なら監視しない）
+	uint64_t	attached;		// 経路を付け直した回数
+	uint64_t	detached;		// 経路を外した回数
+	std::mutex	echo_mtx;
+	std::vector<ECHO_UPDATE>	echo_updates;	// echo_mtx で保護
+	int			echo_wake;		// eventfd。echo_updates を積んだらエコースレッドを起こす
+
+	XDP_CONFIG	xdp_conf;		// -X
+	QOS_CONFIG	qos_conf;		// -Q
+	qos_queues	qos;			// 　〃（Connect で TUN から読む大きさに合わせて用意する）
+	std::vector<BUDGET_CONFIG>	budget_confs;				// -C
+	std::vector<std::shared_ptr<PATH_BUDGET>>	budgets;	// 経路に割り当てたもの（統計用）
+	path_trace_writer	ptrace;	// -T：エコースレッドの計測を経路トレースに記録する
+
+	inline int _PathIndex(const SOCKET_PACK& s) const { return &s - socks.data(); }
+	bool _OpenPath(SOCKET_PACK& s);
+	bool _TakePath(SOCKET_PACK& s);		// -U：旧から受け取った同じ経路のソケットを使う
+	bool _Snapshot(UPGRADE_STATE& st, std::vector<int>& fds) override;
+	void _AttachPath(SOCKET_PACK& s);
+	void _DetachPath(SOCKET_PACK& s, const char *reason);
+	void _NotifyEcho(const SOCKET_PACK& s);
+	void _OnLinkEvents();
+
+	SOCKET_PACK* _RepairPath(SOCKET_PACK *from) override;
+	void _OnRepairSent(SOCKET_PACK& s, uint64_t now, uint32_t wire_len) override;
+	void _OnOwdReport(SOCKET_PACK& s, uint64_t now) override;
+	void _OnFeedback(SOCKET_PACK& s, uint64_t now) override;
+	RX_PATH* _RxPath(int source, const RX_FRAME& f) override;
+
+	/*
+	 * -M：全経路で１つの、接続しないソケットを使う（経路ごとのソケットを作らない）
+	 * 送るデバイスと送信元アドレスはフレームごとに IP_PKTINFO で指定し、届いたデバイスは IP_PKTINFO で知る。
+	 * RX は１つのソケットを recvmmsg １回で読むので、経路が多くても起きる回数が増えない。
+	 * 経路は共有ソケットをそのまま sock_fd に持つ（閉じるのは共有ソケットの持ち主だけ）。デバイスIDは _NewDeviceId で
+	 * 1..SHARED_DEVICE_ID_MAX から振り（データのフレームに８ビットで載る）、エコー用のソケット（経路ごと）も同じIDでプローブを送る。
+	 * サーバーは送信元のアドレスとポートで経路を見分けるので、デバイスごとに１経路（サーバーの接続先は１つ）にする。
+	 * 非同期のエラー（ICMP）はどの経路のものかわからず、次に送った別の経路のエラーになってしまうので受け取らない
+	 * （IP_RECVERR を付けない。接続しない UDP ソケットには届かない）。経路断は送ったときのエラーとプローブで見る。
+	 */
+	bool		shared;			// -M
+	int			sock_shared;	// 共有ソケット（-1 = 経路ごとにソケットを作る）
+	int32_t		next_device_id;	// -M：次に試すデバイスID（他のクライアントと重なりにくいように、乱数から始める）
+	uint64_t	rx_ifindex_ns;	// RX 専用：最後にデバイスの番号を引き直した時刻
+	bool _OpenSharedSocket();
+	int32_t _NewDeviceId(const SOCKET_PACK& self);
+	RX_PATH* _RxSharedPath(const RX_FRAME& f);
+
+	void _PollMetrics(uint64_t now);
 
 public:
-	explicit MPUDPTunnelClient(uint32_t szbuf) : MPUDPTunnel(szbuf) {};
-	~MPUDPTunnelClient() {}
+	explicit MPUDPTunnelClient(uint32_t szbuf) :
+		MPUDPTunnel(szbuf), sched(socks), rescued(0), sock_nl(-1), attached(0), detached(0), echo_wake(-1),
+		shared(false), sock_shared(-1), next_device_id(1), rx_ifindex_ns(0) {};
+	~MPUDPTunnelClient() {
+		if (sock_nl != -1) { close(sock_nl); }
+		if (sock_shared != -1) {
+			for (auto& s : socks) { if (s.sock_fd == sock_shared) { s.sock_fd = -1; } }	// 経路は借りているだけ
+			close(sock_shared);
+		}
+	}
 
 	void AddDevice(const std::string& device_name);
+	inline void SetTransmitMode(TRANSMIT_MODE mode) { sched.mode = mode; }
+	inline void SetFlowPinning(bool enable) { sched.flow_pinning = enable; }
+	inline void SetXdp(const XDP_CONFIG& conf) { xdp_conf = conf; }	// Connect の前に
+	inline void SetSharedSocket(bool enable) { shared = enable; }	// Connect の前に
+	inline void SetPathBudget(const BUDGET_CONFIG& conf) { budget_confs.push_back(conf); }	// Connect の前に
+	inline void SetQos(const QOS_CONFIG& conf) { qos_conf = conf; }	// Connect の前に
+	inline bool SetPathTrace(const std::string& file) { return ptrace.open(file); }	// Connect の前に
 	bool MainLoop() override;
+	void PrintStats() override;
 
 	inline bool Connect(const std::string& tun_name, const std::string& addr, const int port) {
 		return Start(tun_name, addr, port);
 	}
 };
 
+extern volatile sig_atomic_t	_global_fDumpStats;	// SIGUSR1 で立つ
+
 #endif
@@ -2,10 +2,145 @@
 #define	__MPUDPDEF_H__
 
 #define	BUFSIZE		2048
+#define	TUN_BUFSIZE	16384	// -S：TUN から読む内側のパケットの上限（１フレームに収まらないものは分割して送る）
 
 #define	PORT_MAIN	45555
 #define	PORT_PING	(PORT_MAIN + 1)	// 45556
 
 #define	PING_TIMEOUT_MSEC	950
 
+// 経路の障害検知と送り直し
+#define	PROBE_INTERVAL_MSEC			250	// データを受信している経路のプローブ間隔
+#define	PROBE_IDLE_INTERVAL_MSEC	50		// データが流れていない経路のプローブ間隔
+#define	PROBE_FAST_INTERVAL_MSEC	20		// 損失を検知した、落ちている、劣化している経路のプローブ間隔
+#define	PROBE_DATA_SIGNAL_NS		(100ULL * 1000 * 1000)	// これより最近データを受信していればプローブを減らす
+#define	PROBE_DEGRADED_LOSS_PERMILLE	10	// これ以上のプローブ損失率なら劣化とみなす
+#define	PROBE_JITTER_US				1000	// RTTVAR がこれ以上かつ SRTT の半分を超えたら劣化とみなす
+#define	PROBE_TIMEOUT_MIN_MSEC		100		// プローブのタイムアウト（srtt + 4 * rttvar）の下限
+#define	PATH_DOWN_LOST_PROBES		3		// 連続してこれだけプローブを失ったら経路断とみなす
+#define	RESCUE_RING_SIZE			256		// 経路ごとに控えておく送信済みパケットの数
+#define	TX_RING_SLOTS				1024	// TUN から読んだパケットを置いておく数（送り直しはここから読む。RESCUE_RING_SIZE 以上）
+#define	SEQ_WINDOW_SIZE				4096	// 受信側の重複排除で覚えておく seq_all の数
+#define	SEQ_WINDOW_IDLE_NS			(1000ULL * 1000 * 1000)	// これだけ受信が途切れたら重複排除の記録を捨てる
+#define	SERVER_PATH_STALE_NS		(800ULL * 1000 * 1000)	// サーバー側：これだけプローブが来なければその経路には送らない
+#define	SERVER_PATH_CHECK_NS		(10ULL * 1000 * 1000)	// サーバー側：経路の状態を見直す間隔
+#define	SERVER_SNDBUF				(4 * 1024 * 1024)
+#define	DOWNLINK_SWITCH_PERCENT		75		// サーバー側（-D mode=single）：今の経路の評価のこれ未満で、
+#define	DOWNLINK_SWITCH_MIN_US		2000	// 　　　　　　　　　　　　　　　　これ以上良い経路が現れたら移す
+#define	RESCUE_WINDOW_NS			(1000ULL * 1000 * 1000)	// これより前に送ったものは送り直さない
+#define	SEND_BATCH_MAX				16		// １回の sendmmsg にまとめるフレーム数の上限
+
+// サーバー側の管理プレーン（プローブへの応答）
+#define	ECHO_BATCH				64		// recvmmsg １回で読むプローブの数
+#define	ECHO_REPLY_FANOUT		3		// 送ってきた経路のほかに、同じクライアントの経路へも返す数の上限
+#define	ECHO_MAX_CLIENT_PATHS	16		// クライアントごとに覚えておく経路の数
+#define	ECHO_MAX_PEERS			65536	// 覚えておく送信元の数の上限（超えた分は送信元にだけ返す）
+#define	ECHO_PEER_EXPIRE_NS		(60ULL * 1000 * 1000 * 1000)	// これだけプローブが来なければ忘れる（データの接続と同じ１分）
+#define	ECHO_SWEEP_NS			(1000ULL * 1000 * 1000)		// 古い送信元を探す間隔
+#define	ECHO_RCVBUF				(4 * 1024 * 1024)
+
+// サーバーの複数の接続先（-e）
+#define	MAX_SERVER_ENDPOINTS		8		// 知らせる待ち受けアドレスの数の上限
+#define	ENDPOINT_QUERY_TIMEOUT_MSEC	300		// クライアント：問い合わせの返事を待つ時間
+#define	ENDPOINT_QUERY_TRIES		3		// 　　　　〃　　　　　　　　　回数（返事がなければ -a のアドレスだけを使う）
+
+// 選択的再送（-R）
+#define	ARQ_DEADLINE_MSEC		200		// 既定の再送期限
+#define	ARQ_STORE_SIZE			1024	// 送信側で控えておくパケット数（２の冪）
+#define	ARQ_ACTIVE_NS			(1000ULL * 1000 * 1000)	// ARQ 付きのパケットが途絶えたら抜けの監視をやめる
+#define	ARQ_MAX_GAP				1024	// これ以上 seq_all が飛んだら相手の再起動などとみなして監視し直す
+#define	ARQ_MAX_TRACKED			4096	// 受信側で同時に監視する抜けの数
+#define	ARQ_REORDER_MIN_NS		(1000 * 1000)			// 順序入れ替わりの待ち時間の下限
+#define	ARQ_REORDER_MAX_NS		(50ULL * 1000 * 1000)	// 　　　　〃　　　　　　　　　上限
+#define	ARQ_NACK_INTERVAL_NS	(20ULL * 1000 * 1000)	// 同じ抜けを再び NACK するまでの間隔
+#define	ARQ_MAX_NACKS			4		// 同じ抜けを NACK する回数の上限
+#define	ARQ_POLL_NS				(1000 * 1000)			// NACK をまとめて送る間隔
+
+// 片道遅延の計測（TUN_HEADER::tx_us）
+#define	OWD_BASE_WINDOW_NS		(10ULL * 1000 * 1000 * 1000)	// 基準（最小値）を取り直す区間
+#define	OWD_SHORT_GAIN			4		// 短期平均の重み 1/4
+#define	OWD_LONG_GAIN			32		// 長期平均の重み 1/32
+#define	OWD_REPORT_NS			(5ULL * 1000 * 1000)	// 受信側が送信側へ報告する間隔
+#define	OWD_STALE_NS			(500ULL * 1000 * 1000)	// これより古い報告は使わない
+
+// 受信報告（seq_dev から数えた経路ごとの損失・揺らぎ・配送レート）
+#define	FEEDBACK_REPORT_NS		(50ULL * 1000 * 1000)	// 受信側が送信側へ報告する間隔
+#define	FEEDBACK_STALE_NS		(1000ULL * 1000 * 1000)	// これより古い報告は使わない
+#define	FEEDBACK_RESET_GAP		(1 << 20)				// seq_dev がこれ以上飛んだら数え直す
+
+// キャプチャ（-w / -W）の既定値
+#define	CAPTURE_SAMPLE		1
+#define	CAPTURE_RING_SLOTS	4096
+#define	CAPTURE_SNAPLEN		(BUFSIZE + 16)	// TUN_HEADER 込みでパケット全体
+#define	CAPTURE_FILE_LIMIT	(256ULL * 1024 * 1024)
+
+// 経路ごとの輻輳制御とペーシング
+#define	CC_INIT_RATE		(1250 * 1000)			// 初期推定帯域 bytes/s（10Mbps）
+#define	CC_MIN_RATE			(64 * 1000)				// これ以下には絞らない
+#define	CC_MAX_RATE			(1250ULL * 1000 * 1000)	// 10Gbps
+#define	CC_MIN_CWND			(16 * 1500)				// bytes
+#define	CC_QDELAY_TARGET_US	5000					// これ以上キューイング遅延が伸びたら混雑とみなす
+#define	CC_LOSS_PERMILLE	20						// 受信報告の区間の損失率がこれ以上なら混雑とみなす（‰）
+#define	CC_MINRTT_WINDOW_NS	(10ULL * 1000 * 1000 * 1000)
+#define	CC_PACING_BURST_NS	(1000 * 1000)			// ペーシングで許すバースト（1ms 分）
+#define	PATH_NOMINAL_PACKET	1500					// TUN から読む前の送信可否判定に使うパケット長
+#define	PATH_UDP_OVERHEAD	28						// 経路上の IP / UDP ヘッダ（-C の上限にはこれも数える）
+
+// MODE_ADAPTIVE で複製する条件
+#define	DUP_LOSS_PERMILLE	10		// 主経路のプローブ損失率（‰）
+#define	DUP_RTTVAR_US		10000	// 主経路の RTTVAR
+#define	DUP_SMALL_UDP_BYTES	200		// これ以下の UDP パケットは常に複製
+
+// 経路ごとの費用と上限（-C）
+#define	BUDGET_BURST_NS		(10ULL * 1000 * 1000)	// レートの上限で許すバースト（10ms 分）
+#define	BUDGET_MIN_BURST	(2 * 1500)				// 　　　〃　　　　の下限（bytes）
+
+// 内側のパケットの優先制御（-Q）
+#define	QOS_DEFAULT_DEPTH	128			// クラスごとのキューの長さ（パケット数）
+#define	QOS_MAX_DEPTH		4096
+#define	QOS_DRR_QUANTUM		BUFSIZE		// DRR の重み１あたりのバイト数（１巡で必ず１つ出せるように BUFSIZE 以上）
+#define	QOS_DRAIN_BATCH		32			// メインループ１回でキューから送る上限
+
+// 大きなパケットの分割送信（-S）
+#define	STRIPE_WIRE_MTU		1500		// 既定の経路の MTU（断片は IP・UDP・TUN_HEADER 込みでこれに収める）
+#define	STRIPE_MIN_MTU		576
+#define	STRIPE_MIN_BYTES	3000		// 既定でこれより大きなパケットを分割する
+#define	STRIPE_MIN_CHUNK	256			// 経路の取り分がこれより小さければその経路は使わない
+#define	STRIPE_MAX_CHUNKS	32			// １パケットの断片数の上限（受信側はビットマスクで数える）
+#define	STRIPE_SLOTS		64			// 受信側で同時に組み立てるパケット数
+#define	STRIPE_TIMEOUT_NS	(200ULL * 1000 * 1000)	// これだけ待って揃わなければ捨てる
+
+// 無停止の入れ替え（-U）
+#define	UPGRADE_MAX_PATHS			32		// 引き継ぐ経路の数の上限
+#define	UPGRADE_MAX_FDS				(3 + UPGRADE_MAX_PATHS)	// TUN、サーバーの待ち受けと管理プレーン、経路
+#define	UPGRADE_MAX_SESSIONS		32		// 引き継ぐ受信側の重複排除の数の上限（サーバーはクライアントごとにある）
+#define	UPGRADE_RECV_TIMEOUT_MSEC	2000	// 新：旧から状態が届くまで待つ時間
+#define	UPGRADE_ACK_TIMEOUT_MSEC	2000	// 旧：新が動き始めるまで待つ時間（過ぎたら旧が動き続ける）
+#define	UPGRADE_QUIESCE_NS			(200ULL * 1000 * 1000)	// 旧：RX が止まるまで待つ時間
+
+// 全経路で１つのソケット（-M）
+#define	SHARED_IFINDEX_REFRESH_NS	(1000ULL * 1000 * 1000)	// どの経路でもないデバイスに届いたら、これに１回デバイスの番号を引き直す
+#define	SHARED_DEVICE_ID_MAX		255		// 経路に振るデバイスIDの上限（TUN_HEADER::device_id は８ビット）
+
+// フロー単位の経路固定（-F）
+#define	FLOW_TABLE_SIZE		4096
+#define	FLOW_EXPIRE_NS		(10ULL * 1000 * 1000 * 1000)	// これだけ通信のないフローは忘れる
+#define	FLOWLET_MARGIN_NS	(500 * 1000)					// 経路間の RTT 差に足す余裕
+
+// 送受信のパイプライン
+#define	PIPE_SLOTS			256		// RX → TX の依頼（制御フレーム）のスロット数
+#define	RX_SOURCE_SLOTS		1024	// -P：経路ごとの受信スレッドから RX スレッドへ渡すフレームのスロット数
+#define	RX_BATCH			32		// １回の recvmmsg で読むフレーム数
+#define	RX_STARVED_NS		(1000 * 1000)	// -P：空きスロットがないときに待つ時間
+#define	SERVER_PEER_REFRESH_NS	(1000ULL * 1000 * 1000)	// サーバー側：RX が TX に送信元を知らせ直す間隔
+#define	SERVER_PEER_EXPIRE_NS	(60ULL * 1000 * 1000 * 1000)	// サーバー側：RX がこれだけ受信していない送信元を忘れる
+#define	LOWLAT_SPIN_CHECK_NS	(1000 * 1000)	// -L spin：眠らない間もエラーキューやリンクの監視はこの間隔で見る
+
+// AF_XDP（-X）
+#define	XDP_FRAME_SIZE		4096	// UMEM のフレーム１つ分（ヘッダ込みで TUN_HEADER + BUFSIZE が入ること）
+#define	XDP_FRAMES			2048	// UMEM のフレーム数（半分ずつ受信と送信に使う）
+#define	XDP_RING_SIZE		1024	// 各リングの大きさ（２の冪、XDP_FRAMES / 2 以上）
+#define	XDP_NEIGH_REFRESH_NS	(1000ULL * 1000 * 1000)	// 宛先の MAC アドレスを近隣キャッシュで見直す間隔
+#define	XDP_NEIGH_RETRY_NS		(10 * 1000 * 1000)		// 　　　〃　　　　わからなかったとき（その間は UDP ソケットで送る）
+
 #endif
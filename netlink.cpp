@@ -0,0 +1,140 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "netlink.h"
+#include "print.h"
+
+int nl_open_link_monitor() {
+	sockaddr_nl	addr;
+	int			fd;
+
+	if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+		perror("socket(AF_NETLINK)");
+		print_error("errno = %d\n", errno);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR;
+
+	if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("bind(AF_NETLINK)");
+		print_error("errno = %d\n", errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void _parse_link(const nlmsghdr *nh, std::vector<LINK_EVENT>& events) {
+	const ifinfomsg	*ifi = (const ifinfomsg*)NLMSG_DATA(nh);
+	int				len = IFLA_PAYLOAD(nh);
+	LINK_EVENT		ev;
+
+	memset(&ev.addr, 0, sizeof(ev.addr));
+	ev.ifindex = ifi->ifi_index;
+
+	for (const rtattr *rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME) { ev.ifname = (const char*)RTA_DATA(rta); }
+	}
+	if (ev.ifname.empty()) { return; }
+
+	// IFF_RUNNING はキャリアがあることを示す（USB モデムの抜き差しやケーブル断はここに出る）
+	const bool	running = (ifi->ifi_flags & IFF_UP) && (ifi->ifi_flags & IFF_RUNNING);
+	ev.type = (nh->nlmsg_type == RTM_NEWLINK && running) ? LINK_EV_UP : LINK_EV_DOWN;
+	events.push_back(ev);
+}
+
+static void _parse_addr(const nlmsghdr *nh, std::vector<LINK_EVENT>& events) {
+	const ifaddrmsg	*ifa = (const ifaddrmsg*)NLMSG_DATA(nh);
+	int				len = IFA_PAYLOAD(nh);
+	char			name[IF_NAMESIZE];
+	LINK_EVENT		ev;
+	bool			found = false;
+
+	if (ifa->ifa_family != AF_INET) { return; }
+
+	for (const rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		// ポイントツーポイントのリンクでは IFA_ADDRESS が相手側なので IFA_LOCAL を優先する
+		if (rta->rta_type == IFA_LOCAL || (rta->rta_type == IFA_ADDRESS && !found)) {
+			memcpy(&ev.addr, RTA_DATA(rta), sizeof(ev.addr));
+			found = true;
+		}
+	}
+	if (!found || if_indextoname(ifa->ifa_index, name) == NULL) { return; }
+
+	ev.type = (nh->nlmsg_type == RTM_NEWADDR) ? LINK_EV_ADDR_ADD : LINK_EV_ADDR_DEL;
+	ev.ifindex = ifa->ifa_index;
+	ev.ifname = name;
+	events.push_back(ev);
+}
+
+int nl_read_events(int fd, std::vector<LINK_EVENT>& events) {
+	alignas(nlmsghdr) uint8_t	buf[8192];
+	const size_t	before = events.size();
+	ssize_t			n;
+
+	while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		for (nlmsghdr *nh = (nlmsghdr*)buf; NLMSG_OK(nh, (size_t)n); nh = NLMSG_NEXT(nh, n)) {
+			switch (nh->nlmsg_type) {
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+				_parse_link(nh, events);
+				break;
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+				_parse_addr(nh, events);
+				break;
+			}
+		}
+	}
+	// 取りこぼし（ENOBUFS）は呼び出し側が今の状態を見直すことで補う
+	if (n < 0 && errno == ENOBUFS) {
+		print_error("netlink: receive buffer overrun, some link events were lost\n");
+		return -1;
+	}
+	return events.size() - before;
+}
+
+bool nl_link_ready(const std::string& ifname) {
+	ifreq	ifr;
+	int		fd;
+	bool	ready = false;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) { return false; }
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname.c_str(), IFNAMSIZ - 1);
+	if (ioctl(fd, SIOCGIFFLAGS, &ifr) == 0) {
+		ready = (ifr.ifr_flags & IFF_UP) && (ifr.ifr_flags & IFF_RUNNING);
+	}
+	// アドレスがまだ付いていなければ、ソケットを作っても connect で失敗する
+	if (ready) { ready = (ioctl(fd, SIOCGIFADDR, &ifr) == 0); }
+	close(fd);
+	return ready;
+}
+
+bool nl_link_addr(const std::string& ifname, in_addr& addr, int& ifindex) {
+	ifreq	ifr;
+	int		fd;
+	bool	found = false;
+
+	if ((fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) { return false; }
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname.c_str(), IFNAMSIZ - 1);
+	if (ioctl(fd, SIOCGIFADDR, &ifr) == 0) {
+		addr = ((const sockaddr_in*)&ifr.ifr_addr)->sin_addr;
+		found = (ioctl(fd, SIOCGIFINDEX, &ifr) == 0);
+		ifindex = ifr.ifr_ifindex;
+	}
+	close(fd);
+	return found;
+}
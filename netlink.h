@@ -0,0 +1,34 @@
+#ifndef	__NETLINK_H__
+#define	__NETLINK_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <netinet/in.h>
+
+/*
+ * rtnetlink によるインターフェースの監視
+ * リンクの up / down（キャリアの有無）と IPv4 アドレスの追加・削除を受け取る。
+ * クライアントはこれを見て、経路のソケットを作り直したり外したりする（再起動なしで経路を出し入れする）。
+ */
+typedef enum _LINK_EVENT_TYPE {
+	LINK_EV_UP,			// リンクが up かつキャリアあり
+	LINK_EV_DOWN,		// リンクが down、キャリアなし、または消えた
+	LINK_EV_ADDR_ADD,	// IPv4 アドレスが付いた
+	LINK_EV_ADDR_DEL	// IPv4 アドレスが外れた
+} LINK_EVENT_TYPE;
+
+typedef struct _LINK_EVENT {
+	LINK_EVENT_TYPE	type;
+	int				ifindex;
+	std::string		ifname;
+	in_addr			addr;	// LINK_EV_ADDR_* のみ
+} LINK_EVENT;
+
+int nl_open_link_monitor();		// 失敗したら -1
+int nl_read_events(int fd, std::vector<LINK_EVENT>& events);	// 溜まっているメッセージを全部読んで events に足す。読んだイベント数（取りこぼしがあれば -1）
+bool nl_link_ready(const std::string& ifname);	// 今その名前のリンクが up かつキャリアありで、IPv4 アドレスが付いているか
+bool nl_link_addr(const std::string& ifname, in_addr& addr, int& ifindex);	// その名前のリンクの IPv4 アドレスとインデックス（なければ false）
+
+#endif
@@ -1,3 +1,5 @@
+#include <errno.h>
+
 #include "network.h"
 #include "print.h"
 
@@ -7,6 +9,119 @@ bool is_same_addr(const sockaddr_in& a, const sockaddr_in& b) {
 			a.sin_family == b.sin_family;
 }
 
+// 送信元のアドレスを指定する（待ち受けアドレスが複数あるとき、届いた側のアドレスから返すため）
+// buf は CMSG_SPACE(sizeof(in_pktinfo)) 以上
+// ifindex を指定すると、そのデバイスから送る（SO_BINDTODEVICE と同じく経路表をそのデバイスに限って引く）
+void set_pktinfo(msghdr& msg, void *buf, size_t len, const in_addr& src, int ifindex) {
+	memset(buf, 0, len);
+	msg.msg_control		= buf;
+	msg.msg_controllen	= CMSG_SPACE(sizeof(in_pktinfo));
+
+	cmsghdr		*c = CMSG_FIRSTHDR(&msg);
+	in_pktinfo	pi;
+
+	memset(&pi, 0, sizeof(pi));
+	pi.ipi_ifindex = ifindex;
+	pi.ipi_spec_dst = src;
+	c->cmsg_level	= IPPROTO_IP;
+	c->cmsg_type	= IP_PKTINFO;
+	c->cmsg_len		= CMSG_LEN(sizeof(pi));
+	memcpy(CMSG_DATA(c), &pi, sizeof(pi));
+}
+
+// IP_PKTINFO を付けたソケットで受信したメッセージが届いた自アドレス（なければ INADDR_ANY）と、届いたデバイス（なければ 0）
+in_addr get_pktinfo(msghdr& msg, int *ifindex) {
+	in_addr	dst = { htonl(INADDR_ANY) };
+
+	for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != IPPROTO_IP || c->cmsg_type != IP_PKTINFO) { continue; }
+
+		in_pktinfo	pi;
+		memcpy(&pi, CMSG_DATA(c), sizeof(pi));
+		dst = pi.ipi_addr;
+		if (ifindex != nullptr) { *ifindex = pi.ipi_ifindex; }
+	}
+	return dst;
+}
+
+void _PATH_METRICS::OnRttSample(uint32_t r) {
+	const uint32_t	srtt = srtt_us.load(std::memory_order_relaxed);
+	const uint32_t	var  = rttvar_us.load(std::memory_order_relaxed);
+	const uint32_t	loss = loss_permille.load(std::memory_order_relaxed);
+
+	if (srtt == 0) {
+		srtt_us.store(r, std::memory_order_relaxed);
+		rttvar_us.store(r / 2, std::memory_order_relaxed);
+	}
+	else {
+		const uint32_t	diff = (srtt > r) ? srtt - r : r - srtt;
+		rttvar_us.store((var * 3 + diff) / 4, std::memory_order_relaxed);
+		srtt_us.store((srtt * 7 + r) / 8, std::memory_order_relaxed);
+	}
+	loss_permille.store(loss * 7 / 8, std::memory_order_relaxed);
+	rtt.record(r);
+	rtt_last_us.store(r, std::memory_order_relaxed);
+	rtt_samples.store(rtt_samples.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void _PATH_METRICS::OnProbeLost() {
+	const uint32_t	loss = loss_permille.load(std::memory_order_relaxed);
+	loss_permille.store((loss * 7 + 1000) / 8, std::memory_order_relaxed);
+}
+
+// RTO と同じく srtt + 4 * rttvar（計測前は PING_TIMEOUT_MSEC）
+uint64_t _PATH_METRICS::ProbeTimeout() const {
+	const uint32_t	srtt = srtt_us.load(std::memory_order_relaxed);
+	const uint32_t	var  = rttvar_us.load(std::memory_order_relaxed);
+	int64_t			ms = (srtt == 0) ? PING_TIMEOUT_MSEC : (srtt + 4LL * var) / 1000;
+
+	if (ms < PROBE_TIMEOUT_MIN_MSEC) { ms = PROBE_TIMEOUT_MIN_MSEC; }
+	if (ms > PING_TIMEOUT_MSEC) { ms = PING_TIMEOUT_MSEC; }
+	return (uint64_t)ms * 1000 * 1000;
+}
+
+// プローブを失った、落ちている、損失や RTT の揺らぎが大きい経路は速く、データを受信している経路は遅く
+uint32_t _PATH_METRICS::ProbeInterval(uint64_t now, uint32_t lost_in_row) const {
+	const uint32_t	srtt = srtt_us.load(std::memory_order_relaxed);
+	const uint32_t	var  = rttvar_us.load(std::memory_order_relaxed);
+
+	if (lost_in_row > 0 || !this->IsUp()) { return PROBE_FAST_INTERVAL_MSEC; }
+	if (loss_permille.load(std::memory_order_relaxed) >= PROBE_DEGRADED_LOSS_PERMILLE) { return PROBE_FAST_INTERVAL_MSEC; }
+	if (var >= PROBE_JITTER_US && var > srtt / 2) { return PROBE_FAST_INTERVAL_MSEC; }
+	if (now - last_data_ns.load(std::memory_order_relaxed) > PROBE_DATA_SIGNAL_NS) { return PROBE_IDLE_INTERVAL_MSEC; }
+	return PROBE_INTERVAL_MSEC;
+}
+
+bool _PATH_METRICS::MarkDown() {
+	uint8_t	expected = PATH_UP;
+
+	if (!state.compare_exchange_strong(expected, PATH_DOWN)) { return false; }
+	down_count.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+bool _PATH_METRICS::MarkUp() {
+	uint8_t	expected = PATH_DOWN;
+	return state.compare_exchange_strong(expected, PATH_UP);
+}
+
+// 経路そのものが使えなくなったことを示すエラーか
+// （EMSGSIZE や ENOBUFS のように、そのパケットだけの問題は含めない）
+bool is_path_error(int err) {
+	switch (err) {
+	case ENETUNREACH:
+	case EHOSTUNREACH:
+	case ENETDOWN:
+	case EHOSTDOWN:
+	case ECONNREFUSED:
+	case ENODEV:
+	case ENXIO:
+	case EADDRNOTAVAIL:
+		return true;
+	}
+	return false;
+}
+
 int tun_alloc(const char *device_name) {
 	struct ifreq	ifr;
 	const char		*clone_device = "/dev/net/tun";
@@ -49,6 +164,19 @@ int tun_eread(int fd, void *buf, int n) {
 	return nread;
 }
 
+// 非ブロッキングの fd から読む（-L spin）。読めるものがなければ 0
+int tun_nbread(int fd, void *buf, int n) {
+	int nread;
+
+	if ((nread = read(fd, buf, n)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { return 0; }
+	if (nread <= 0) {
+		perror("Reading from socket");
+		print_error("errno = %d\n", errno);
+		throw std::runtime_error("nread returned below or equal to zero");
+	}
+	return nread;
+}
+
 int tun_ewrite(int fd, void *buf, int n) {
 	int nwrite;
 
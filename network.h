@@ -19,14 +19,40 @@
 #include <stdexcept>
 #include <vector>
 #include <chrono>
+#include <memory>
+#include <atomic>
+#include <deque>
+#include <unordered_map>
+
+#include "mpudpdef.h"
+#include "histogram.h"
+#include "congestion.h"
+#include "owd.h"
+#include "feedback.h"
+#include "xdp.h"
+#include "budget.h"
 
 #define	max(a, b)	(((a) > (b)) ? (a) : (b))
 
+// 単調増加クロック（steady_clock）の現在時刻。レイテンシ計測用
+inline uint64_t monotonic_ns() {
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()
+	).count();
+}
+
 typedef enum _TRANSMIT_MODE {
 	MODE_SPEED,
-	MODE_STABLE
+	MODE_STABLE,
+	MODE_ADAPTIVE,	// 送信側の方針としてだけ使う（実際のパケットは MODE_SPEED か MODE_STABLE で流れる）
+	MODE_CONTROL,	// トンネル自身の制御フレーム（ペイロードは CONTROL_HEADER から始まる。seq_all は使わない）
+	MODE_STRIPE		// 分割したパケットの断片（ペイロードは STRIPE_HEADER から始まる。断片はどれも同じ seq_all、stripe.h）
 } TRANSMIT_MODE;
 
+// TUN_HEADER::mode の上位ビットはフラグ
+#define	TUN_MODE_MASK	0x0F
+#define	TUN_FLAG_ARQ	0x80	// 選択的再送の対象（受信側は抜けを NACK する）
+
 // パケット転送に関わる情報（16バイト）
 // 転送される各パケットの前に付加される
 typedef struct {
@@ -36,7 +62,7 @@ typedef struct {
 	uint32_t	seq_all;	// 全体シーケンス：同じ番号は同じパケットであることを示す
 
 	uint32_t	seq_dev;	// デバイスシーケンス：同じデバイス上でパケットの連続性を示す
-	uint32_t	reserved;
+	uint32_t	tx_us;		// 送信時刻（送信側の monotonic、マイクロ秒の下位 32 ビット）。片道遅延の計測用（owd.h）
 } TUN_HEADER;
 
 
@@ -60,29 +86,134 @@ typedef struct _MANAGEMENT_PACKET {
 
 typedef struct _ECHO_PACKET {
 	MANAGEMENT_PAKCET	header;
-	std::chrono::system_clock::time_point	tm_start;
-	uint8_t		rsvd[4];
+	uint64_t	tx_ns;		// 送った側の monotonic_ns（相手はそのまま返すだけで、中身は見ない）
+	uint32_t	client_id;	// クライアントが起動時に決める乱数。サーバーは同じクライアントの経路をこれでまとめる
 	char		signature[4];
 
-	_ECHO_PACKET() {
+	_ECHO_PACKET() : tx_ns(0), client_id(0) {
 		for (size_t i = 0; i < strlen(SIGNATURE_ECHO); i++) {
 			signature[i] = SIGNATURE_ECHO[i];
 		}
 	}
 } ECHO_PACKET;
 
+#define	SIGNATURE_ENDPOINTS	"Endp"
+
+// サーバーの接続先（待ち受けアドレス）の問い合わせと返答（管理プレーン、PORT_PING）
+// クライアントはセッションの開始時に count = 0 で送り、サーバーは同じ形で一覧を返す（-e を付けていなければ count = 0）
+typedef struct _ENDPOINT_PACKET {
+	MANAGEMENT_PAKCET	header;
+	uint32_t	count;
+	uint32_t	addrs[MAX_SERVER_ENDPOINTS];	// ネットワークバイトオーダー。ポートはどれも PORT_MAIN / PORT_PING
+	char		signature[4];
+
+	_ENDPOINT_PACKET() : count(0) {
+		memset(addrs, 0, sizeof(addrs));
+		for (size_t i = 0; i < strlen(SIGNATURE_ENDPOINTS); i++) {
+			signature[i] = SIGNATURE_ENDPOINTS[i];
+		}
+	}
+} ENDPOINT_PACKET;
+
+typedef enum _PATH_STATE {
+	PATH_UP,
+	PATH_DOWN	// 送信エラー、ICMP 到達不能、プローブの連続損失のどれかで落ちたと判断した
+} PATH_STATE;
+
+// 経路ごとの計測値
+// エコースレッドが書き込み、メインループや統計表示から参照されるので SOCKET_PACK とは別に共有する
+// 計測値を書き込むのはエコースレッドだけ（OnRttSample / OnProbeLost）
+// state だけはメインループ（データパスのエラー）とエコースレッド（プローブ）の両方が書く
+typedef struct _PATH_METRICS {
+	latency_histogram	rtt;	// プローブ RTT（マイクロ秒）
+	std::atomic<uint32_t>	rtt_last_us;	// 最新の RTT サンプル
+	std::atomic<uint32_t>	rtt_samples;	// RTT サンプルの通し番号（増えていたら新しいサンプルがある）
+	std::atomic<uint32_t>	srtt_us;		// RFC 6298 の SRTT / RTTVAR
+	std::atomic<uint32_t>	rttvar_us;
+	std::atomic<uint32_t>	loss_permille;	// プローブ損失率の EWMA（‰）
+	std::atomic<uint8_t>	state;			// PATH_STATE
+	std::atomic<uint32_t>	down_count;		// 落ちたと判断した回数
+	std::atomic<uint64_t>	last_ok_ns;		// 最後にプローブの応答を受け取った時刻（monotonic_ns）
+	std::atomic<uint64_t>	last_data_ns;	// 最後にこの経路でデータを受信した時刻（RX スレッドが書く）
+	std::atomic<uint32_t>	probe_interval_ms;		// 今のプローブ間隔（統計表示用）
+	std::atomic<uint32_t>	rtt_kernel_samples;		// カーネルのタイムスタンプで測れた RTT サンプルの数
+	std::atomic<uint32_t>	rate_kbps;		// 輻輳制御が見積もった帯域（メインループが書く。経路トレースの記録用）
+
+	_PATH_METRICS() :
+		rtt_last_us(0), rtt_samples(0), srtt_us(0), rttvar_us(0), loss_permille(0),
+		state(PATH_UP), down_count(0), last_ok_ns(0), last_data_ns(0),
+		probe_interval_ms(0), rtt_kernel_samples(0), rate_kbps(0) {}
+
+	void OnRttSample(uint32_t rtt_us);
+	void OnProbeLost();
+
+	// エコースレッドのプローブの決め方（シミュレータも同じものを使う）
+	uint64_t ProbeTimeout() const;								// 応答を待つ時間（ナノ秒）
+	uint32_t ProbeInterval(uint64_t now, uint32_t lost_in_row) const;	// 次のプローブまでの間隔（ミリ秒）
+
+	inline bool IsUp() const { return state.load(std::memory_order_relaxed) == PATH_UP; }
+	// 状態が変わったときだけ true
+	bool MarkDown();
+	bool MarkUp();
+} PATH_METRICS;
+
+// 送信済みパケットの控え
+// 経路が落ちたとき、直近に送ったものを生き残った経路で送り直すために使う
+// ペイロードは持たず、seq_all で送信側の置き場所（MPUDPTunnel の tx_ring）から引く（経路ごとにコピーしない）
+typedef struct _RESCUE_ENTRY {
+	uint64_t	sent_ns;	// 0 なら空き
+	uint32_t	seq_all;
+} RESCUE_ENTRY;
+
+typedef struct _RESCUE_RING {
+	RESCUE_ENTRY	entries[RESCUE_RING_SIZE];
+	uint32_t		head;
+
+	_RESCUE_RING() : head(0) { clear(); }
+
+	inline void push(uint64_t now, uint32_t seq_all) {
+		RESCUE_ENTRY&	e = entries[head++ % RESCUE_RING_SIZE];
+
+		e.sent_ns = now;
+		e.seq_all = seq_all;
+	}
+	inline void clear() {
+		for (auto& e : entries) { e.sent_ns = 0; }
+	}
+} RESCUE_RING;
+
 typedef struct _SOCKET_PACK {
 	int			sock_fd;		// == device_id
 	sockaddr_in	remote_addr;
 	sockaddr_in	local_addr;
-	std::string	eth_name;
+	std::string	eth_name;		// 経路の名前（サーバーの接続先が複数なら "eth0>192.0.2.1"、１つならデバイス名）
+	std::string	dev_name;		// 経路が使うデバイス（クライアントのみ）
+	bool		pin_src;		// local_addr を送信元に指定して送る（IP_PKTINFO。サーバーは全経路で待ち受けソケットを共有するので）
+	int			ifindex;		// 送り出すデバイスも IP_PKTINFO で指定する（クライアントの -M。0 = ソケットが決める）
 	uint32_t	seq_dev;
+	std::shared_ptr<PATH_METRICS>	metrics;
+	PATH_CC		cc;			// 送信側の輻輳制御（メインループ専用）
+	std::unique_ptr<RESCUE_RING>	rescue;	// 送信済みパケットの控え（クライアントのみ）
+	bool		path_up;	// メインループが最後に見た経路の状態
+	int			send_errno;	// 直近の送信エラー（0 = なし）
+	uint64_t	send_dropped;	// 送信バッファが一杯で捨てたフレームの数（MSG_DONTWAIT の EAGAIN）
+	OWD_REPORT	owd_tx;			// 相手から報告された、この経路の送信方向の片道遅延
+	uint64_t	owd_tx_ns;		// その報告を受け取った時刻（0 = まだない）
+	PATH_FEEDBACK	fb;			// 相手から報告された、この経路で届いたもの（CTRL_FEEDBACK）
+	std::unique_ptr<xdp_port>	xdp;	// -X：経路の XSK（クライアントのみ。なければ sock_fd で送る）
+	std::shared_ptr<PATH_BUDGET>	budget;	// -C：費用と上限（nullptr = 定額で上限なし。同じデバイスの経路で共有する）
+	uint32_t	client_id;	// サーバー：この経路のクライアント（ECHO_PACKET::client_id、0 = わからない。クライアントは 0）
+	int32_t		device_id;	// TUN_HEADER::device_id（-1 = sock_fd の番号。-M のクライアントは sock_fd を共有するので経路ごとに振る）
 
-	explicit _SOCKET_PACK() : sock_fd(-1), seq_dev(0) {}
+	explicit _SOCKET_PACK() :
+		sock_fd(-1), pin_src(false), ifindex(0), seq_dev(0), metrics(std::make_shared<PATH_METRICS>()), path_up(true), send_errno(0), send_dropped(0),
+		owd_tx({ 0, 0, 0 }), owd_tx_ns(0), client_id(0), device_id(-1) {}
 	~_SOCKET_PACK() {
 		if (sock_fd != -1) { close(sock_fd); }
 	}
 
+	inline int32_t DeviceId() const { return (device_id != -1) ? device_id : sock_fd; }
+
 	// デストラクタが呼ばれることによる意図せぬクローズを防ぐため、コピーを禁止
 	_SOCKET_PACK(const _SOCKET_PACK&) = delete;
 	_SOCKET_PACK& operator=(const _SOCKET_PACK&) = delete;
@@ -92,8 +223,24 @@ typedef struct _SOCKET_PACK {
 		remote_addr	= old.remote_addr;
 		local_addr	= old.local_addr;
 		eth_name	= old.eth_name;
+		dev_name	= old.dev_name;
+		pin_src		= old.pin_src;
 		sock_fd		= old.sock_fd;
+		ifindex		= old.ifindex;
 		seq_dev		= old.seq_dev;
+		metrics		= std::move(old.metrics);
+		cc			= old.cc;
+		rescue		= std::move(old.rescue);
+		path_up		= old.path_up;
+		send_errno	= old.send_errno;
+		send_dropped	= old.send_dropped;
+		owd_tx		= old.owd_tx;
+		owd_tx_ns	= old.owd_tx_ns;
+		fb			= old.fb;
+		xdp			= std::move(old.xdp);
+		budget		= std::move(old.budget);
+		client_id	= old.client_id;
+		device_id	= old.device_id;
 		old.sock_fd = -1;
 	}
 
@@ -104,8 +251,24 @@ typedef struct _SOCKET_PACK {
 			remote_addr	= old.remote_addr;
 			local_addr	= old.local_addr;
 			eth_name	= old.eth_name;
+			dev_name	= old.dev_name;
+			pin_src		= old.pin_src;
 			sock_fd		= old.sock_fd;
+			ifindex		= old.ifindex;
 			seq_dev		= old.seq_dev;
+			metrics		= std::move(old.metrics);
+			cc			= old.cc;
+			rescue		= std::move(old.rescue);
+			path_up		= old.path_up;
+			send_errno	= old.send_errno;
+			send_dropped	= old.send_dropped;
+			owd_tx		= old.owd_tx;
+			owd_tx_ns	= old.owd_tx_ns;
+			fb			= old.fb;
+			xdp			= std::move(old.xdp);
+			budget		= std::move(old.budget);
+			client_id	= old.client_id;
+			device_id	= old.device_id;
 			old.sock_fd = -1;
 		}
 		return *this;
@@ -113,8 +276,12 @@ typedef struct _SOCKET_PACK {
 } SOCKET_PACK;
 
 bool is_same_addr(const sockaddr_in& a, const sockaddr_in& b);
+bool is_path_error(int err);
+void set_pktinfo(msghdr& msg, void *buf, size_t len, const in_addr& src, int ifindex = 0);
+in_addr get_pktinfo(msghdr& msg, int *ifindex = nullptr);
 int tun_alloc(const char *device_name);
 int tun_eread(int fd, void *buf, int n);
+int tun_nbread(int fd, void *buf, int n);
 int tun_ewrite(int fd, void *buf, int n);
 int tun_readn(int fd, void *buf, int n);
 
@@ -0,0 +1,74 @@
+#ifndef	__OWD_H__
+#define	__OWD_H__
+
+#include <stdint.h>
+
+#include "mpudpdef.h"
+
+/*
+ * 片道遅延（OWD）の相対計測
+ * 送信側は TUN_HEADER::tx_us に自分の monotonic 時刻（マイクロ秒の下位 32 ビット）を書く。
+ * 受信側は「受信時刻 - tx_us」を取るが、両端の時計は合わせていないのでこの値には未知のオフセットが乗っている。
+ * そこで経路ごとの最小値を基準にし、そこからの伸び（= その経路のキューイング遅延）だけを見る。
+ * 時計のずれ（ドリフト）で基準が古くならないよう、最小値は OWD_BASE_WINDOW_NS ごとの区間２つ分で取る。
+ * 値は 32 ビットで一周するが、差を int32_t で取る限り問題ない。
+ */
+
+// 受信側が送り返す報告（CTRL_OWD の本体）
+typedef struct _OWD_REPORT {
+	int32_t		qdelay_us;	// 基準からの伸びの短期平均
+	int32_t		trend_us;	// 短期平均 - 長期平均（正ならキューが伸びている）
+	uint32_t	samples;	// これまでのサンプル数
+} OWD_REPORT;
+
+typedef struct _OWD_ESTIMATOR {
+	uint32_t	base_cur;		// 今の区間の最小値
+	uint32_t	base_prev;		// 前の区間の最小値
+	uint64_t	epoch_ns;		// 今の区間の開始時刻（0 = サンプルなし）
+	int32_t		qdelay_us;		// EWMA 1/OWD_SHORT_GAIN（数パケットで追従する）
+	int32_t		long_us;		// EWMA 1/OWD_LONG_GAIN
+	uint32_t	samples;
+
+	// 報告の送信（受信側）
+	uint32_t	reported;		// 最後に報告したときの samples
+	uint64_t	reported_ns;
+
+	_OWD_ESTIMATOR() :
+		base_cur(0), base_prev(0), epoch_ns(0), qdelay_us(0), long_us(0), samples(0),
+		reported(0), reported_ns(0) {}
+
+	inline void OnSample(uint32_t raw_us, uint64_t now_ns) {
+		if (epoch_ns == 0 || now_ns - epoch_ns > OWD_BASE_WINDOW_NS) {
+			base_prev = (epoch_ns == 0) ? raw_us : base_cur;
+			base_cur = raw_us;
+			epoch_ns = now_ns;
+		}
+		if ((int32_t)(raw_us - base_cur) < 0) { base_cur = raw_us; }
+
+		const uint32_t	base = ((int32_t)(base_prev - base_cur) < 0) ? base_prev : base_cur;
+		int32_t			q = (int32_t)(raw_us - base);
+
+		if (q < 0) { q = 0; }
+		if (samples == 0) {
+			qdelay_us = long_us = q;
+		}
+		else {
+			qdelay_us += (q - qdelay_us) / OWD_SHORT_GAIN;
+			long_us   += (q - long_us) / OWD_LONG_GAIN;
+		}
+		samples++;
+	}
+
+	inline int32_t Trend() const { return qdelay_us - long_us; }
+
+	// 新しいサンプルがあり、前の報告から OWD_REPORT_NS 経っていれば報告を作る
+	inline bool TakeReport(uint64_t now_ns, OWD_REPORT& r) {
+		if (samples == reported || now_ns - reported_ns < OWD_REPORT_NS) { return false; }
+		reported = samples;
+		reported_ns = now_ns;
+		r = { qdelay_us, this->Trend(), samples };
+		return true;
+	}
+} OWD_ESTIMATOR;
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <algorithm>
+
+#include "print.h"
+#include "network.h"
+#include "pathtrace.h"
+
+// - なら PATH_TRACE_KEEP
+static bool parse_field(const char *s, int64_t max_value, int64_t& value) {
+	char	*end;
+
+	if (strcmp(s, "-") == 0) {
+		value = PATH_TRACE_KEEP;
+		return true;
+	}
+	errno = 0;
+	value = strtoll(s, &end, 10);
+	return errno == 0 && *end == '\0' && value >= 0 && value <= max_value;
+}
+
+bool path_trace_load(const std::string& file, PATH_TRACE& trace) {
+	FILE	*fp = fopen(file.c_str(), "r");
+	char	line[512], name[64], rtt[32], loss[32], rate[32];
+	double	t_ms;
+	int		lineno = 0;
+
+	if (fp == NULL) {
+		perror("fopen()");
+		print_error("Couldn't open path trace - %s\n", file.c_str());
+		return false;
+	}
+	trace.names.clear();
+	trace.points.clear();
+	trace.duration_ns = 0;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		const char	*p = line + strspn(line, " \t");
+		TRACE_POINT	pt;
+		int64_t		v;
+
+		lineno++;
+		if (*p == '#' || *p == '\n' || *p == '\0') { continue; }
+
+		if (sscanf(p, "%lf %63s %31s %31s %31s", &t_ms, name, rtt, loss, rate) != 5 || t_ms < 0 ||
+			!parse_field(rtt, UINT32_MAX, pt.rtt_us) || !parse_field(loss, 1000, v) || !parse_field(rate, UINT32_MAX, pt.rate_kbps)) {
+			print_error("%s:%d: invalid path trace line\n", file.c_str(), lineno);
+			fclose(fp);
+			return false;
+		}
+		auto	it = std::find(trace.names.begin(), trace.names.end(), name);
+		if (it == trace.names.end()) { it = trace.names.insert(it, name); }
+
+		pt.t_ns = (uint64_t)(t_ms * 1000 * 1000);
+		pt.path = it - trace.names.begin();
+		pt.loss_permille = (int32_t)v;
+		trace.points.push_back(pt);
+		trace.duration_ns = max(trace.duration_ns, pt.t_ns);
+	}
+	fclose(fp);
+
+	// 記録したものは時刻順に並んでいるが、手で書いたもの（順不同）も受け付ける
+	std::stable_sort(trace.points.begin(), trace.points.end(),
+		[](const TRACE_POINT& a, const TRACE_POINT& b) { return a.t_ns < b.t_ns; }
+	);
+	if (trace.names.size() == 0) {
+		print_error("%s: path trace is empty\n", file.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool path_trace_writer::open(const std::string& file) {
+	if ((fp = fopen(file.c_str(), "w")) == NULL) {
+		perror("fopen()");
+		print_error("Couldn't open path trace - %s\n", file.c_str());
+		return false;
+	}
+	setvbuf(fp, NULL, _IOLBF, 0);	// 途中で止めても行単位で残るように
+	start_ns = monotonic_ns();
+	fprintf(fp, "# mpudp path trace\n# t_ms path rtt_us loss_permille rate_kbps\n");
+	return true;
+}
+
+void path_trace_writer::record(uint64_t now_ns, const std::string& path, int64_t rtt_us, int32_t loss_permille, int64_t rate_kbps) {
+	char	rtt[24] = "-", loss[24] = "-", rate[24] = "-";
+
+	if (fp == NULL) { return; }
+	if (rtt_us != PATH_TRACE_KEEP) { snprintf(rtt, sizeof(rtt), "%lld", (long long)rtt_us); }
+	if (loss_permille != PATH_TRACE_KEEP) { snprintf(loss, sizeof(loss), "%d", loss_permille); }
+	if (rate_kbps != PATH_TRACE_KEEP) { snprintf(rate, sizeof(rate), "%lld", (long long)rate_kbps); }
+
+	fprintf(fp, "%.3f %s %s %s %s\n", (now_ns - start_ns) / 1e6, path.c_str(), rtt, loss, rate);
+}
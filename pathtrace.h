@@ -0,0 +1,55 @@
+#ifndef	__PATHTRACE_H__
+#define	__PATHTRACE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+/*
+ * 経路トレース：経路ごとの RTT・損失率・帯域の時間変化
+ * クライアントはエコースレッドの計測から記録し（-T file）、シミュレータ（mpsim.out）はこれを再生する。
+ * テキストで１行に１つの変化点を書く。# から始まる行と空行は読み飛ばす。
+ *   t_ms path rtt_us loss_permille rate_kbps
+ *   例）1250.0 eth0 23000 5 48000
+ * 値が - の欄は前の値のまま。loss_permille = 1000 は経路断（何も届かない）。
+ * 記録する帯域は輻輳制御の見積もりなので、トンネルが帯域を使い切っていなければ実際の容量より小さい。
+ */
+#define	PATH_TRACE_KEEP	(-1)	// 前の値のまま
+
+typedef struct _TRACE_POINT {
+	uint64_t	t_ns;			// トレースの先頭からの時刻
+	uint32_t	path;			// PATH_TRACE::names の添字
+	int64_t		rtt_us;			// PATH_TRACE_KEEP なら前の値のまま
+	int32_t		loss_permille;
+	int64_t		rate_kbps;
+} TRACE_POINT;
+
+typedef struct _PATH_TRACE {
+	std::vector<std::string>	names;		// 経路の名前（最初に現れた順）
+	std::vector<TRACE_POINT>	points;		// 時刻順
+	uint64_t	duration_ns;				// 最後の変化点の時刻
+} PATH_TRACE;
+
+bool path_trace_load(const std::string& file, PATH_TRACE& trace);
+
+// 記録する側。呼ぶのは１つのスレッド（エコースレッド）だけ
+class path_trace_writer {
+private:
+	FILE		*fp;
+	uint64_t	start_ns;
+
+public:
+	path_trace_writer() : fp(NULL), start_ns(0) {}
+	~path_trace_writer() { if (fp != NULL) { fclose(fp); } }
+	path_trace_writer(const path_trace_writer&) = delete;
+	path_trace_writer& operator=(const path_trace_writer&) = delete;
+
+	bool open(const std::string& file);
+	inline bool is_open() const { return fp != NULL; }
+
+	// now_ns は monotonic_ns。値が PATH_TRACE_KEEP の欄は - で書く
+	void record(uint64_t now_ns, const std::string& path, int64_t rtt_us, int32_t loss_permille, int64_t rate_kbps);
+};
+
+#endif
@@ -0,0 +1,589 @@
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/select.h>
+
+#include "mpudp.h"
+
+// UDP なのでフレームは１回で丸ごと読める。TUN_HEADER より短いもの、length が合わないもの、切り詰められたものは壊れている
+int rx_recv_frames(int fd, RX_FRAME* const *frames, int n) {
+	iovec		iov[RX_BATCH];
+	mmsghdr		msgs[RX_BATCH];
+	alignas(cmsghdr) uint8_t	ctrls[RX_BATCH][CMSG_SPACE(sizeof(in_pktinfo))];
+
+	if (n > RX_BATCH) { n = RX_BATCH; }
+	for (int i = 0; i < n; i++) {
+		iov[i] = { frames[i]->data, sizeof(frames[i]->data) };
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_name	= &frames[i]->addr;
+		msgs[i].msg_hdr.msg_namelen	= sizeof(sockaddr_in);
+		msgs[i].msg_hdr.msg_iov		= &iov[i];
+		msgs[i].msg_hdr.msg_iovlen	= 1;
+		msgs[i].msg_hdr.msg_control		= ctrls[i];
+		msgs[i].msg_hdr.msg_controllen	= sizeof(ctrls[i]);
+	}
+	const int	nread = recvmmsg(fd, msgs, n, MSG_DONTWAIT, NULL);
+
+	if (nread < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) { return 0; }
+		perror("recvmmsg");
+		print_error("errno = %d\n", errno);
+		return 0;
+	}
+	const uint64_t	now = monotonic_ns();
+
+	for (int i = 0; i < nread; i++) {
+		frames[i]->rx_ns = now;
+		frames[i]->ifindex = 0;
+		frames[i]->path_err = 0;
+		frames[i]->local = get_pktinfo(msgs[i].msg_hdr, &frames[i]->ifindex);
+		rx_check_frame(*frames[i], msgs[i].msg_len, (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0);
+	}
+	return nread;
+}
+
+void rx_check_frame(RX_FRAME& f, uint32_t len, bool truncated) {
+	const TUN_HEADER	*phead = (const TUN_HEADER*)f.data;
+
+	f.length = len;
+	if (truncated || len < sizeof(TUN_HEADER) || phead->length > len - sizeof(TUN_HEADER)) {
+		pdebug("malformed frame (%u bytes) from %s:%d - discarded\n",
+			len, inet_ntoa(f.addr.sin_addr), ntohs(f.addr.sin_port));
+		f.length = 0;
+	}
+}
+
+/*
+ * 起動
+ * 呼ぶ前に socks・rx_paths・rx_sources を揃えておくこと（rx_sources の数は以降変えない）
+ */
+bool MPUDPTunnel::_StartPipeline() {
+	// 呼ぶのはメインループのスレッド（TX）。以降に確保するバッファは固定先のノードのメモリに取られる
+	lowlat_pin_thread(lowlat, THREAD_TX, "tx");
+
+	// -L spin：TX は TUN を非ブロッキングで読み続ける
+	if (lowlat.spin && fcntl(sock_tun, F_SETFL, fcntl(sock_tun, F_GETFL) | O_NONBLOCK) < 0) {
+		perror("fcntl(O_NONBLOCK)");
+		print_error("errno = %d\n", errno);
+		return false;
+	}
+	if (!tx_wake.open() || !rx_wake.open()) {
+		perror("eventfd()");
+		print_error("errno = %d\n", errno);
+		return false;
+	}
+	to_tx.reset(new handoff<PIPE_MSG, PIPE_SLOTS>);
+
+	// TUN から読む場所（-S なら大きなパケットも入るように）
+	if (this->_TunReadSize() < tx_slot_size) { tx_slot_size = this->_TunReadSize(); }
+	tx_ring.reset(new uint8_t[(size_t)tx_slot_size * TX_RING_SLOTS]);
+	tx_slots.reset(new TX_SLOT[TX_RING_SLOTS]());
+
+	if (!rx_threads) {
+		rx_frames.reset(new RX_FRAME[RX_BATCH]);
+	}
+	else {
+		for (auto& src : rx_sources) {
+			src->frames.reset(new handoff<RX_FRAME, RX_SOURCE_SLOTS>);
+			if (!src->wake.open()) {
+				perror("eventfd()");
+				print_error("errno = %d\n", errno);
+				return false;
+			}
+		}
+		for (size_t i = 0; i < rx_sources.size(); i++) {
+			rx_sources[i]->th.reset(new std::thread([this, i](){ this->_RxSourceLoop(i); }));
+		}
+	}
+	th_rx.reset(new std::thread([this](){ this->_RxLoop(); }));
+	pdebug("pipeline started : %zu sources, %s%s\n", rx_sources.size(),
+		rx_threads ? "receiver thread per path" : "direct", lowlat.spin ? ", spin" : "");
+	return true;
+}
+
+/*
+ * TX 側
+ */
+// RX からの依頼を処理する。経路は socks の位置か、送信元のアドレスで引く（サーバーの socks は TX しか触らない）
+void MPUDPTunnel::_TxDrainPipe() {
+	PIPE_MSG	*m;
+	uint32_t	h;
+
+	while ((m = to_tx->take(h)) != nullptr) {
+		const uint64_t	now = monotonic_ns();
+		SOCKET_PACK		*path = nullptr;
+
+		if (m->path >= 0 && m->path < (int32_t)socks.size()) { path = &socks[m->path]; }
+		else if (m->path < 0 && m->type != PIPE_SEND_ALL && m->type != PIPE_PEER) { path = this->_FindPath(m->addr); }
+
+		switch (m->type) {
+		case PIPE_CONTROL:
+			this->_OnControl(path, (const TUN_HEADER*)m->data, m->data + sizeof(TUN_HEADER), now);
+			break;
+
+		case PIPE_SEND:
+			if (path != nullptr && path->sock_fd != -1) { this->SendControl(*path, m->data, m->length); }
+			break;
+
+		case PIPE_SEND_ALL: {
+			// サーバーは全クライアントの経路が socks に並んでいるので、その相手の経路だけに送る（クライアントは全部 0）
+			auto mine = [m](const SOCKET_PACK& s) { return s.client_id == (uint32_t)m->arg; };
+			const bool	any_up = std::any_of(socks.begin(), socks.end(), [&mine](const SOCKET_PACK& s) { return mine(s) && s.path_up; });
+			for (auto& s : socks) {
+				if (s.sock_fd == -1 || !mine(s) || (any_up && !s.path_up)) { continue; }
+				this->SendControl(s, m->data, m->length);
+			}
+			break;
+		}
+		case PIPE_PATH_ERROR:
+			if (path != nullptr && path->sock_fd != -1) { this->_OnPathError(*path, m->arg); }
+			break;
+
+		case PIPE_PEER:
+			if (m->length == sizeof(PIPE_PEER_INFO)) { this->_OnPeer(m->addr, *(const PIPE_PEER_INFO*)m->data, m->arg); }
+			break;
+		}
+		to_tx->release(h);
+	}
+
+	// RX が読まなくなった（付け替えを見た）ソケットを閉じる（XSK は xdp を捨てると閉じる）
+	for (auto it = retired.begin(); it != retired.end(); ) {
+		if ((int32_t)(rx_sources[it->source]->seen.load(std::memory_order_acquire) - it->gen) < 0) { ++it; continue; }
+		close(it->fd);
+		it = retired.erase(it);
+	}
+}
+
+void MPUDPTunnel::_SetSourceFd(int source, int fd, xdp_port *xdp) {
+	RX_SOURCE&	src = *rx_sources[source];
+
+	src.fd.store(fd, std::memory_order_relaxed);
+	src.xdp.store(xdp, std::memory_order_relaxed);
+	src.gen.fetch_add(1, std::memory_order_release);
+	if (rx_threads) { src.wake.kick(); }
+	else { rx_wake.kick(); }
+}
+
+// 閉じるのは RX が新しい gen を見てから。select の途中で閉じられた番号が別のソケットに使い回されないように
+void MPUDPTunnel::_RetireFd(int source, int fd, std::unique_ptr<xdp_port> xdp) {
+	this->_SetSourceFd(source, -1, nullptr);
+	retired.push_back({ source, fd, rx_sources[source]->gen.load(std::memory_order_relaxed), std::move(xdp) });
+}
+
+void MPUDPTunnel::DumpStats() {
+	this->PrintStats();
+	rx_dump.store(true, std::memory_order_relaxed);
+	rx_wake.kick();
+}
+
+/*
+ * RX 側
+ */
+// TX への依頼を積む。スロットが空いていなければ捨てる（制御フレームは失っても次の報告・NACK で取り戻せる）
+bool MPUDPTunnel::_Post(uint8_t type, int path, const sockaddr_in *addr, int32_t arg, const void *data, uint16_t len) {
+	uint32_t	h;
+	PIPE_MSG	*m = to_tx->acquire(h);
+
+	if (m == nullptr) {
+		pipe_dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+	m->type		= type;
+	m->path		= path;
+	m->arg		= arg;
+	m->length	= len;
+	if (addr != nullptr) { m->addr = *addr; }
+	if (len > 0) { memcpy(m->data, data, len); }
+	to_tx->publish(h);
+	tx_wake.wake();
+	return true;
+}
+
+void MPUDPTunnel::_RxPathError(int source, int err) {
+	const RX_SOURCE&	src = *rx_sources[source];
+
+	if (src.path >= 0) { this->_Post(PIPE_PATH_ERROR, src.path, nullptr, err, nullptr, 0); }
+}
+
+// 受信したフレーム１つ分。制御フレームは TX に回し、データは重複を捨てて TUN に書く
+// 分割されたパケットの断片は、揃ったときに元のパケットとして同じように扱う
+void MPUDPTunnel::_RxFrame(RX_FRAME& f, int source) {
+	const TUN_HEADER	*phead = (const TUN_HEADER*)f.data;
+	const uint8_t		*pdata = f.data + sizeof(TUN_HEADER);
+	uint16_t			length = phead->length;
+	const uint64_t		t_start = f.rx_ns;
+	int					nwrite;
+
+	if (f.length == 0) { return; }
+	capture_tap(CAPTURE_IF_MPUDP, CAPTURE_DIR_IN, phead, f.length, phead->device_id, phead->seq_all, phead->seq_dev);
+
+	RX_PATH		*path = this->_RxPath(source, f);
+
+	if (path != nullptr) {
+		path->seen_ns = t_start;
+		if (path->metrics) { path->metrics->last_data_ns.store(t_start, std::memory_order_relaxed); }	// 受信できている経路はプローブを減らす
+		this->_FeedbackOnRecv(*path, phead, f.length, t_start);	// seq_dev は制御フレームにも振られる
+	}
+	if ((phead->mode & TUN_MODE_MASK) == MODE_CONTROL) {
+		this->_Post(PIPE_CONTROL, path ? path->path : -1, &f.addr, 0, f.data, sizeof(TUN_HEADER) + phead->length);
+		return;
+	}
+	if (path != nullptr) { this->_OwdOnRecv(*path, phead, t_start); }	// 重複も含めて、この経路の遅延のサンプルになる
+
+	trace_debug(TEV_ETH_RECV, phead->seq_all, f.length,
+		f.addr.sin_addr.s_addr, ntohs(f.addr.sin_port), 0, 0, phead, sizeof(TUN_HEADER)
+	);
+	RX_SESSION&	ss = this->_RxSessionOf(path);
+
+	if ((phead->mode & TUN_MODE_MASK) == MODE_STRIPE) {
+		if ((pdata = ss.stripe_rx.Add(phead->seq_all, pdata, phead->length, t_start, length)) == nullptr) { return; }
+	}
+
+	/*
+	 * MODE_STABLE で送信されたパケットは全部の経路に同じものが流れてくるので、すでに受信したものは捨てる。
+	 * 経路断で送り直されたパケットは元のパケットとモードが違うことがあるので、モードによらず記録する。
+	 */
+	if (t_start - ss.last_rx_ns > SEQ_WINDOW_IDLE_NS) { ss.seq_rec.reset(); }
+	ss.last_rx_ns = t_start;
+	if (!ss.seq_rec.check_and_set(phead->seq_all)) {
+		trace_debug(TEV_DUP_SKIP, phead->seq_all);
+		return;
+	}
+	this->_ArqOnRecv(ss, phead, t_start);
+	try {
+		nwrite = tun_ewrite(sock_tun, (void*)pdata, length);
+		hist_rx.record(monotonic_ns() - t_start);
+		capture_tap(CAPTURE_IF_TUN, CAPTURE_DIR_IN, pdata, length, phead->device_id, phead->seq_all, phead->seq_dev);
+		trace_debug(TEV_TUN_SEND, phead->seq_all, nwrite);
+	}
+	catch (std::exception &e) {
+		perror("ewrite");
+		pdebug("errno = %d\n", errno);
+		print_error("%s - the data will be discarded. Continue.\n", e.what());
+	}
+}
+
+RX_SESSION* MPUDPTunnel::_RxSession(uint32_t client_id) {
+	for (auto& ss : rx_sessions) {
+		if (ss->client_id == client_id) { return ss.get(); }
+	}
+	rx_sessions.emplace_back(new RX_SESSION(client_id));
+	pdebug("new receive session : client_id = %08x\n", client_id);
+	return rx_sessions.back().get();
+}
+
+// 先頭（client_id 0）は残す
+void MPUDPTunnel::_RxExpireSessions(uint64_t now) {
+	for (auto it = rx_sessions.begin() + 1; it != rx_sessions.end(); ) {
+		RX_SESSION	*ss = it->get();
+		const bool	used = std::any_of(rx_paths.begin(), rx_paths.end(), [ss](const RX_PATH& p) { return p.session == ss; });
+
+		if (used || now - ss->last_rx_ns < SERVER_PEER_EXPIRE_NS) { ++it; continue; }
+		pdebug("receive session expired : client_id = %08x\n", ss->client_id);
+		it = rx_sessions.erase(it);
+	}
+}
+
+void MPUDPTunnel::_RxLoop() {
+	this->_BlockSignals();
+	lowlat_pin_thread(lowlat, THREAD_RX, "rx");
+	if (rx_threads) { this->_RxLoopThreads(); }
+	else { this->_RxLoopDirect(); }
+}
+
+// 全経路のソケットを select で待ち、読めたものから RX_BATCH フレームずつ読む
+// -L spin のときは select で眠らず、全部のソケットを読みに行き続ける（エラーキューは LOWLAT_SPIN_CHECK_NS ごと）
+void MPUDPTunnel::_RxLoopDirect() {
+	std::vector<uint32_t>	gens(rx_sources.size(), 0);
+	std::vector<int>		fds(rx_sources.size(), -1);
+	std::vector<xdp_port*>	xdps(rx_sources.size(), nullptr);
+	RX_FRAME				*frames[RX_BATCH];
+	fd_set		rfds;
+	timeval		tv;
+	uint64_t	now, wait_ns, checked_ns = 0;
+	int			max_fd;
+	bool		check_err = true;
+
+	for (int i = 0; i < RX_BATCH; i++) { frames[i] = &rx_frames[i]; }
+	for (size_t i = 0; i < rx_sources.size(); i++) {
+		gens[i] = rx_sources[i]->gen.load(std::memory_order_acquire);
+		fds[i] = rx_sources[i]->fd.load(std::memory_order_relaxed);
+		xdps[i] = rx_sources[i]->xdp.load(std::memory_order_relaxed);
+	}
+
+	while (true) {
+		if (rx_dump.exchange(false, std::memory_order_relaxed)) { this->_PrintRxStats(); }
+		if (rx_hold.load(std::memory_order_acquire) == 1) { this->_RxPark(); }
+
+		now = monotonic_ns();
+		this->_ArqPoll(now);
+
+		FD_ZERO(&rfds);
+		FD_SET(rx_wake.get(), &rfds);
+		max_fd = rx_wake.get();
+		for (size_t i = 0; i < rx_sources.size(); i++) {
+			if (rx_source_refresh(*rx_sources[i], gens[i], fds[i], xdps[i])) { tx_wake.kick(); }
+			if (fds[i] == -1) { continue; }
+			FD_SET(fds[i], &rfds);
+			max_fd = max(max_fd, fds[i]);
+			if (xdps[i] != nullptr) {
+				FD_SET(xdps[i]->fd(), &rfds);
+				max_fd = max(max_fd, xdps[i]->fd());
+			}
+		}
+
+		if (lowlat.spin) {
+			check_err = (now - checked_ns >= LOWLAT_SPIN_CHECK_NS);
+			if (check_err) { checked_ns = now; }
+		}
+		else {
+			// データを受信するまで待機（NACK を待っている抜けがあればその時刻まで）
+			wait_ns = this->_ArqWait(now);
+			tv.tv_sec  = wait_ns / 1000000000ULL;
+			tv.tv_usec = (wait_ns % 1000000000ULL) / 1000;
+			if (select(max_fd + 1, &rfds, NULL, NULL, (wait_ns == UINT64_MAX) ? NULL : &tv) < 0) {
+				if (errno == EINTR) continue;
+
+				perror("[RX] select()");
+				print_error("errno = %d\n", errno);
+				return;
+			}
+			if (FD_ISSET(rx_wake.get(), &rfds)) { rx_wake.drain(); }
+		}
+		bool	got = false;
+
+		for (size_t i = 0; i < rx_sources.size(); i++) {
+			if (fds[i] == -1) { continue; }
+
+			// -X：経路のデータはほとんど XSK に届く（ソケットに来るのはエラーとフラグメントなど）
+			if (xdps[i] != nullptr && (lowlat.spin || FD_ISSET(xdps[i]->fd(), &rfds))) {
+				while (true) {
+					const int	n = xdps[i]->recv(frames, RX_BATCH);
+
+					for (int k = 0; k < n; k++) { this->_RxFrame(*frames[k], i); }
+					got |= (n > 0);
+					if (n < RX_BATCH) { break; }
+				}
+			}
+			if (!lowlat.spin && !FD_ISSET(fds[i], &rfds)) { continue; }
+
+			if (check_err) {
+				const int	err = this->_DrainErrors(fds[i], rx_sources[i]->name);
+				if (err != 0) { this->_RxPathError(i, err); }
+			}
+			while (true) {
+				const int	n = rx_recv_frames(fds[i], frames, RX_BATCH);
+
+				for (int k = 0; k < n; k++) { this->_RxFrame(*frames[k], i); }
+				got |= (n > 0);
+				if (n < RX_BATCH) { break; }
+			}
+		}
+		if (lowlat.spin && !got) { cpu_relax(); }
+	}
+}
+
+// 受信スレッドが渡してきたフレームを処理する。１つでもあれば true
+bool MPUDPTunnel::_RxDrainSources() {
+	bool	got = false;
+
+	for (size_t i = 0; i < rx_sources.size(); i++) {
+		auto&		frames = *rx_sources[i]->frames;
+		RX_FRAME	*f;
+		uint32_t	h;
+
+		// 経路ごとに RX_BATCH ずつ回して、１つの経路が他を待たせないようにする
+		for (int k = 0; k < RX_BATCH && (f = frames.take(h)) != nullptr; k++) {
+			if (f->path_err != 0) { this->_RxPathError(i, f->path_err); }
+			this->_RxFrame(*f, i);
+			frames.release(h);
+			got = true;
+		}
+	}
+	return got;
+}
+
+/*
+ * -U：TX が経路のソケットを外してから rx_hold を 1 にする。受信スレッドが渡してきた残りを処理してから止まり、
+ * TX が 0 に戻したら（入れ替えに失敗した）続ける。成功すればプロセスごと終わるので戻らない
+ * TX が待ちきれずに先に 0 に戻していたら止まらない
+ */
+void MPUDPTunnel::_RxPark() {
+	int		expected = 1;
+
+	if (rx_threads) {
+		while (this->_RxDrainSources()) {}
+	}
+	if (!rx_hold.compare_exchange_strong(expected, 2, std::memory_order_acq_rel)) { return; }
+	while (rx_hold.load(std::memory_order_acquire) != 0) { usleep(1000); }
+}
+
+void MPUDPTunnel::_RxLoopThreads() {
+	fd_set		rfds;
+	timeval		tv;
+	uint64_t	now, wait_ns;
+
+	while (true) {
+		if (rx_dump.exchange(false, std::memory_order_relaxed)) { this->_PrintRxStats(); }
+		if (rx_hold.load(std::memory_order_acquire) == 1) { this->_RxPark(); }
+
+		now = monotonic_ns();
+		this->_ArqPoll(now);
+		if (this->_RxDrainSources()) { continue; }
+
+		// -L spin：眠らない（受信スレッドは sleeping を見て eventfd を書かずに済む）
+		if (lowlat.spin) {
+			cpu_relax();
+			continue;
+		}
+		// 眠る前にもう一度見る（pipe_waker の約束）
+		rx_wake.sleep_begin();
+		if (this->_RxDrainSources()) {
+			rx_wake.sleep_end(false);
+			continue;
+		}
+		FD_ZERO(&rfds);
+		FD_SET(rx_wake.get(), &rfds);
+		wait_ns = this->_ArqWait(now);
+		tv.tv_sec  = wait_ns / 1000000000ULL;
+		tv.tv_usec = (wait_ns % 1000000000ULL) / 1000;
+		if (select(rx_wake.get() + 1, &rfds, NULL, NULL, (wait_ns == UINT64_MAX) ? NULL : &tv) < 0) {
+			rx_wake.sleep_end(false);
+			if (errno == EINTR) continue;
+
+			perror("[RX] select()");
+			print_error("errno = %d\n", errno);
+			return;
+		}
+		rx_wake.sleep_end(FD_ISSET(rx_wake.get(), &rfds));
+	}
+}
+
+/*
+ * -P：経路のソケット１つを読み続け、受信したフレームをスロットごと RX スレッドに渡す
+ * スロットは先に RX_BATCH 個まで確保しておき、recvmmsg で直接読み込む（コピーしない）
+ */
+void MPUDPTunnel::_RxSourceLoop(int source) {
+	RX_SOURCE&	src = *rx_sources[source];
+	auto&		frames = *src.frames;
+	uint32_t	held[RX_BATCH];
+	RX_FRAME	*slots[RX_BATCH];
+	int			nheld = 0;
+	uint32_t	gen = src.gen.load(std::memory_order_acquire);
+	int			fd = src.fd.load(std::memory_order_relaxed);
+	xdp_port	*xdp = src.xdp.load(std::memory_order_relaxed);
+	uint64_t	checked_ns = 0;
+	fd_set		rfds;
+	timeval		tv;
+
+	this->_BlockSignals();
+	lowlat_pin_thread(lowlat, THREAD_RX_SOURCE + source, ("rx " + src.name).c_str());
+
+	while (true) {
+		if (rx_source_refresh(src, gen, fd, xdp)) { tx_wake.kick(); }
+
+		while (nheld < RX_BATCH && (slots[nheld] = frames.acquire(held[nheld])) != nullptr) { nheld++; }
+
+		bool	check_err = true;
+		bool	sock_ready = true, xsk_ready = (xdp != nullptr);
+
+		if (lowlat.spin) {
+			// -L spin：眠らずに読みに行く（エラーキューは時々見る）
+			const uint64_t	now = monotonic_ns();
+
+			if (nheld == 0) { src.starved.fetch_add(1, std::memory_order_relaxed); }
+			if (nheld == 0 || fd == -1) { cpu_relax(); continue; }
+			check_err = (now - checked_ns >= LOWLAT_SPIN_CHECK_NS);
+			if (check_err) { checked_ns = now; }
+		}
+		else {
+			FD_ZERO(&rfds);
+			FD_SET(src.wake.get(), &rfds);
+			if (nheld > 0 && fd != -1) {
+				FD_SET(fd, &rfds);
+				if (xdp != nullptr) { FD_SET(xdp->fd(), &rfds); }
+			}
+
+			// スロットが全部 RX スレッドに渡っている間は読まない（パケットはソケットの受信バッファに溜まる）
+			if (nheld == 0) {
+				src.starved.fetch_add(1, std::memory_order_relaxed);
+				tv.tv_sec  = 0;
+				tv.tv_usec = RX_STARVED_NS / 1000;
+			}
+			const int	max_fd = max(max(fd, src.wake.get()), (xdp != nullptr) ? xdp->fd() : -1);
+
+			if (select(max_fd + 1, &rfds, NULL, NULL, (nheld == 0) ? &tv : NULL) < 0) {
+				if (errno == EINTR) continue;
+
+				perror("[RX_SOURCE] select()");
+				print_error("errno = %d\n", errno);
+				return;
+			}
+			if (FD_ISSET(src.wake.get(), &rfds)) { src.wake.drain(); }
+			if (nheld == 0 || fd == -1) { continue; }
+
+			sock_ready = FD_ISSET(fd, &rfds);
+			xsk_ready = (xdp != nullptr && FD_ISSET(xdp->fd(), &rfds));
+			if (!sock_ready && !xsk_ready) { continue; }
+		}
+		// -X：XSK を先に読む（ソケットに来るのはエラーとフラグメントなど）
+		int	n = xsk_ready ? xdp->recv(slots, nheld) : 0;
+
+		if (n == 0 && sock_ready) {
+			const int	err = check_err ? this->_DrainErrors(fd, src.name) : 0;
+
+			if (err != 0) {
+				slots[0]->length = 0;
+				slots[0]->path_err = err;
+				n = 1;
+			}
+			else {
+				n = rx_recv_frames(fd, slots, nheld);
+			}
+		}
+		if (n == 0) {
+			if (lowlat.spin) { cpu_relax(); }
+			continue;
+		}
+
+		for (int i = 0; i < n; i++) { frames.publish(held[i]); }
+		nheld -= n;
+		std::copy(held + n, held + n + nheld, held);
+		std::copy(slots + n, slots + n + nheld, slots);
+		src.received.fetch_add(n, std::memory_order_relaxed);
+		rx_wake.wake();
+	}
+}
+
+void MPUDPTunnel::_PrintRxStats() {
+	print_histogram("RecvFrom -> tun write", hist_rx.snapshot(), "ns");
+
+	for (const auto& ss : rx_sessions) {
+		const arq_tracker&	a = ss->arq_rx;
+
+		if (a.detected == 0) { continue; }
+		print_info("ARQ receiver [%08x]: gaps %llu, nacked %llu, repaired %llu, given up %llu, reorder wait %lluus\n",
+			ss->client_id, (unsigned long long)a.detected, (unsigned long long)a.nacked,
+			(unsigned long long)a.repaired, (unsigned long long)a.given_up, (unsigned long long)a.ReorderWait() / 1000);
+	}
+	// rx はこちらが受けた方向の片道遅延
+	for (const auto& p : rx_paths) {
+		if (p.owd.samples == 0) { continue; }
+		print_info("OWD [%s]: rx qdelay %dus, trend %+dus (%u samples)\n",
+			p.name.c_str(), p.owd.qdelay_us, p.owd.Trend(), p.owd.samples);
+	}
+	for (const auto& p : rx_paths) {
+		if (p.fb.received == 0) { continue; }
+		print_info("FB  [%s]: rx %u frames, lost %u, reordered %u, jitter %uus, %.2fMB\n",
+			p.name.c_str(), p.fb.received, p.fb.Lost(), p.fb.reordered, p.fb.jitter16 / 16, p.fb.bytes / 1e6);
+	}
+	for (const auto& ss : rx_sessions) { ss->stripe_rx.PrintStats(ss->client_id); }
+	print_info("pipeline: %s, %llu requests to TX dropped, %zu receive sessions\n",
+		rx_threads ? "receiver thread per path" : "direct", (unsigned long long)pipe_dropped.load(), rx_sessions.size());
+	if (rx_threads) {
+		for (const auto& src : rx_sources) {
+			print_info("receiver [%s]: %llu frames, starved %llu times\n", src->name.c_str(),
+				(unsigned long long)src->received.load(), (unsigned long long)src->starved.load());
+		}
+	}
+}
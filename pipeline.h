@@ -0,0 +1,224 @@
+#ifndef	__PIPELINE_H__
+#define	__PIPELINE_H__
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include <stdint.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+
+#include "mpudpdef.h"
+#include "spscring.h"
+#include "network.h"
+#include "seqwindow.h"
+#include "arq.h"
+#include "stripe.h"
+
+/*
+ * 送受信のパイプライン
+ * TUN → ネットワーク（TX スレッド = MainLoop を回すスレッド）と ネットワーク → TUN（RX スレッド）を分け、
+ * 互いの状態には触らずにリングでやり取りする。片方向の遅いシステムコールがもう片方向を止めない。
+ *   TX が持つもの：TUN からの読み込み、送信バッファと seq、経路（socks）の選択・輻輳制御・送信済みの控え
+ *   RX が持つもの：受信バッファ、重複排除、抜けの監視（NACK）、片道遅延の計測（rx_paths）、TUN への書き込み
+ * RX が受け取った制御フレームや RX が送りたい制御フレーム（NACK・片道遅延の報告）は PIPE_MSG に詰めて TX に渡す。
+ * -P を付けると経路のソケットごとに受信スレッドを立て、RX スレッドはそのリングから受信済みのフレームを受け取る。
+ */
+
+/*
+ * N 個のスロットを、生産者 → 消費者（full）と 消費者 → 生産者（free）の２本の SPSC リングで行き来させる
+ * やり取りするのはスロットの番号（ハンドル）だけで、中身はコピーしない。
+ * ハンドルは全部で N 個しかないので、どちらのリングも push で溢れることはない。
+ */
+template<class T, std::size_t N>
+class handoff {
+private:
+	std::unique_ptr<T[]>	slots;
+	spsc_ring<uint32_t, N>	full;
+	spsc_ring<uint32_t, N>	free_;
+
+public:
+	// スレッドを起こす前に作ること（free への初期投入は生産者側の操作なので）
+	handoff() : slots(new T[N]) {
+		for (uint32_t i = 0; i < N; i++) { free_.push(i); }
+	}
+	handoff(const handoff&) = delete;
+	handoff& operator=(const handoff&) = delete;
+
+	// 生産者：空きスロットを取って書き、publish で渡す。空きがなければ nullptr
+	inline T* acquire(uint32_t& h) { return free_.pop(h) ? &slots[h] : nullptr; }
+	inline void publish(uint32_t h) { full.push(h); }
+
+	// 消費者：受け取って使い、release で返す
+	inline T* take(uint32_t& h) { return full.pop(h) ? &slots[h] : nullptr; }
+	inline void release(uint32_t h) { free_.push(h); }
+
+	inline bool empty() const { return full.empty(); }
+};
+
+/*
+ * 眠っている相手だけを eventfd で起こす（相手が起きている間は write(2) を省く）
+ * 寝る側：sleep_begin → リングを見直して空なら fd を select で待つ → sleep_end
+ * 起こす側：リングに積んでから wake
+ * 両側の seq_cst フェンスで「寝る側がリングを空と見た後に積まれたのに起こされない」ことを防ぐ。
+ */
+class pipe_waker {
+private:
+	int		fd;
+	std::atomic<bool>	sleeping;
+
+public:
+	pipe_waker() : fd(-1), sleeping(false) {}
+	~pipe_waker() { if (fd != -1) { close(fd); } }
+	pipe_waker(const pipe_waker&) = delete;
+	pipe_waker& operator=(const pipe_waker&) = delete;
+
+	inline bool open() {
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		return fd != -1;
+	}
+	inline int get() const { return fd; }
+
+	inline void sleep_begin() {
+		sleeping.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+	inline void sleep_end(bool fired) {
+		sleeping.store(false, std::memory_order_relaxed);
+		if (fired) { this->drain(); }
+	}
+	inline void drain() {
+		uint64_t	v;
+		while (read(fd, &v, sizeof(v)) > 0) {}
+	}
+	inline void wake() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false)) { this->kick(); }
+	}
+	// 寝ているかどうかによらず起こす（リング以外の変化を知らせるとき）
+	inline void kick() {
+		const uint64_t	one = 1;
+		if (write(fd, &one, sizeof(one)) < 0) {}
+	}
+};
+
+// 受信したフレーム（-P のときは受信スレッドから RX スレッドへ、このままハンドルで渡す）
+typedef struct _RX_FRAME {
+	uint64_t	rx_ns;
+	sockaddr_in	addr;
+	in_addr		local;		// 届いた自アドレス（IP_PKTINFO を付けたソケット = サーバーの待ち受けとクライアントの -M のみ。なければ INADDR_ANY）
+	int32_t		ifindex;	// 届いたデバイス（同上。なければ 0）
+	int32_t		length;		// 受信したバイト数（TUN_HEADER 込み）。0 なら path_err を知らせるだけ
+	int32_t		path_err;	// エラーキューにあった経路断を示す errno（0 = なし）
+	alignas(8) uint8_t	data[sizeof(TUN_HEADER) + BUFSIZE];
+} RX_FRAME;
+
+// RX スレッドから TX スレッドへの依頼
+typedef enum _PIPE_MSG_TYPE {
+	PIPE_CONTROL,		// MODE_CONTROL のフレームを受け取った（data は TUN_HEADER から）
+	PIPE_SEND,			// data を制御フレームとしてこの経路に送ってほしい
+	PIPE_SEND_ALL,		// data を制御フレームとして、相手（arg = client_id）の落ちていない全経路に送ってほしい
+	PIPE_PATH_ERROR,	// 経路のソケットのエラーキューに経路断を示すエラーがあった（arg = errno）
+	PIPE_PEER			// サーバー：この送信元からデータが届いている（arg = device_id、data = PIPE_PEER_INFO）
+} PIPE_MSG_TYPE;
+
+// PIPE_PEER の data
+typedef struct _PIPE_PEER_INFO {
+	in_addr		local;		// 届いた自アドレス
+	uint32_t	client_id;	// RX がプローブから引いたクライアント（0 = わからない）
+} PIPE_PEER_INFO;
+
+typedef struct _PIPE_MSG {
+	uint8_t		type;		// PIPE_MSG_TYPE
+	int32_t		path;		// socks の位置（-1 なら addr で引く）
+	int32_t		arg;
+	sockaddr_in	addr;
+	uint16_t	length;
+	alignas(8) uint8_t	data[sizeof(TUN_HEADER) + BUFSIZE];
+} PIPE_MSG;
+
+/*
+ * RX 側の、相手ごとの状態（RX スレッドだけが触る）
+ * seq_all は相手ごとに振られるので、重複排除と抜けの監視は相手ごとに分ける
+ * （別のクライアントの同じ番号を重複や抜けと取り違えないように）。NACK もその相手の経路にだけ送る。
+ * クライアントは相手がサーバー１つなので１つだけ。サーバーは経路をプローブの client_id でクライアントにまとめる
+ * （client_id がわからない経路は client_id 0 の分を使う）
+ */
+typedef struct _RX_SESSION {
+	uint32_t	client_id;
+	seq_window<SEQ_WINDOW_SIZE>	seq_rec;	// 重複排除（MODE_STABLE の複製や、経路断・NACK で送り直されたパケット）
+	uint64_t	last_rx_ns;					// しばらく受信がなければ相手の再起動に備えて seq_rec を作り直す
+	arq_tracker	arq_rx;						// 選択的再送の受信側
+	uint64_t	arq_polled_ns;
+	stripe_table	stripe_rx;				// 分割されたパケットの組み立て（seq_all は相手ごとの番号なので相手ごとに持つ）
+
+	explicit _RX_SESSION(uint32_t id) : client_id(id), last_rx_ns(0), arq_polled_ns(0) {}
+} RX_SESSION;
+
+// RX 側から見た経路（受信方向の計測値は RX スレッドだけが触る）
+typedef struct _RX_PATH {
+	std::string	name;		// 統計表示用
+	int			path;		// socks の位置（-1 ならサーバー側で、addr で引く）
+	sockaddr_in	addr;		// 送信元
+	int32_t		device_id;
+	int32_t		ifindex;	// クライアントの -M：この経路のデバイス（届いたデバイスで経路を引く）
+	std::shared_ptr<PATH_METRICS>	metrics;	// クライアントのみ（データを受信した時刻を書く）
+	OWD_ESTIMATOR	owd;	// この経路で受け取ったフレームの片道遅延
+	FEEDBACK_ESTIMATOR	fb;	// この経路で受け取ったフレームの損失・順序・揺らぎ
+	uint64_t	seen_ns;
+	uint64_t	posted_ns;	// サーバー：最後に PIPE_PEER を送った時刻
+	RX_SESSION	*session;	// サーバー：この経路のクライアント（nullptr = わからない）
+	uint64_t	looked_ns;	// サーバー：最後にクライアントを引いた時刻
+
+	_RX_PATH(const std::string& n, int p, const sockaddr_in& a, int32_t d) :
+		name(n), path(p), addr(a), device_id(d), ifindex(0), seen_ns(0), posted_ns(0), session(nullptr), looked_ns(0) {}
+} RX_PATH;
+
+/*
+ * RX が読むソケット（経路）１つ分
+ * 経路のソケットは TX（クライアントのリンク監視）が付け替える。読む側は gen が変わったら fd を読み直して seen に書き、
+ * TX は seen が追いつくまで古い fd を閉じない（select の途中で閉じられて、番号が別のソケットに使い回されないように）。
+ * -X のときは経路の XSK（xdp）も同じ約束で付け替える。RX はソケットと XSK の両方を読む。
+ */
+typedef struct _RX_SOURCE {
+	std::string	name;
+	int			path;		// 経路のエラーを知らせる先（socks の位置、-1 = なし）
+	std::atomic<int>		fd;		// -1 = 外れている
+	std::atomic<xdp_port*>	xdp;	// nullptr = AF_XDP を使っていない（持ち主は SOCKET_PACK）
+	std::atomic<uint32_t>	gen;	// fd を変えるたびに TX が増やす
+	std::atomic<uint32_t>	seen;	// 読む側が切り替えを終えた gen
+
+	// -P のときの受信スレッド
+	std::unique_ptr<handoff<RX_FRAME, RX_SOURCE_SLOTS>>	frames;
+	pipe_waker	wake;		// fd が変わったことを受信スレッドに知らせる
+	std::unique_ptr<std::thread>	th;
+	std::atomic<uint64_t>	received;
+	std::atomic<uint64_t>	starved;	// 空きスロットがなく、読むのを待った回数
+
+	_RX_SOURCE(const std::string& n, int p, int f, xdp_port *x) :
+		name(n), path(p), fd(f), xdp(x), gen(0), seen(0), received(0), starved(0) {}
+} RX_SOURCE;
+
+// 読む側が fd の切り替えを見て、終わったことを TX に知らせる。local_gen と fd・xdp は読む側で持つ
+// 切り替わったら true（TX を起こして古い fd を閉じさせる）
+inline bool rx_source_refresh(RX_SOURCE& src, uint32_t& local_gen, int& fd, xdp_port*& xdp) {
+	const uint32_t	g = src.gen.load(std::memory_order_acquire);
+
+	if (g == local_gen) { return false; }
+	local_gen = g;
+	fd = src.fd.load(std::memory_order_relaxed);
+	xdp = src.xdp.load(std::memory_order_relaxed);
+	src.seen.store(g, std::memory_order_release);
+	return true;
+}
+
+// fd から最大 n フレームを recvmmsg で読み、読めた数を返す（なければ 0）。壊れたフレームは length = 0 にする
+int rx_recv_frames(int fd, RX_FRAME* const *frames, int n);
+
+// data に len バイト読んだフレームの length を決める（切り詰められたもの、TUN_HEADER と長さが合わないものは 0）
+void rx_check_frame(RX_FRAME& f, uint32_t len, bool truncated);
+
+#endif
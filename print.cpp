@@ -21,38 +21,37 @@ void print_debug(const char *format, ...) {
 	return;
 }
 
-void pdebug_tunrecv(const int seq, const int nread, const uint8_t* buf) {
-	pdebug("from tun seq=%d : read %lu bytes\n", seq, nread);
-	pdebug("IP header says: packet length = %lu\n", ntohs(((unsigned short*)buf)[1]));
-	pdebug("Head 8 bytes of buffer = %02X %02X %02X %02X %02X %02X %02X %02X\n",
-		buf[0], buf[1], buf[2], buf[3], buf[4], buf[5], buf[6], buf[7]
+void print_info(const char *format, ...) {
+	va_list	arg;
+
+	va_start(arg, format);
+	vfprintf(stderr, format, arg);
+	va_end(arg);
+
+	return;
+}
+
+void print_histogram(const char *label, const HISTOGRAM_SNAPSHOT& snap, const char *unit) {
+	print_info(
+		"%-24s n=%-10llu p50=%llu%s p90=%llu%s p99=%llu%s p99.9=%llu%s max=%llu%s\n",
+		label, (unsigned long long)snap.count,
+		(unsigned long long)snap.p50,  unit,
+		(unsigned long long)snap.p90,  unit,
+		(unsigned long long)snap.p99,  unit,
+		(unsigned long long)snap.p999, unit,
+		(unsigned long long)snap.max,  unit
 	);
 	return;
 }
 
 const char* const mode2str(uint8_t mode) {
-	switch (mode) {
+	switch (mode & TUN_MODE_MASK) {
 	case MODE_SPEED:  return "MODE_SPEED";
 	case MODE_STABLE: return "MODE_STABLE";
+	case MODE_ADAPTIVE: return "MODE_ADAPTIVE";
+	case MODE_CONTROL: return "MODE_CONTROL";
+	case MODE_STRIPE: return "MODE_STRIPE";
 	default: return "?";
 	}
 	return "?";
 }
-
-void pdebug_ethrecv(const int seq, const int nread, const uint8_t* buf, sockaddr_in& addr_from) {
-	const TUN_HEADER* hdr = (TUN_HEADER*)buf;
-
-	pdebug("from eth seq=%d : read %lu bytes\n", seq, nread);
-	pdebug("sender addr: %s, port: %d\n", inet_ntoa(addr_from.sin_addr), ntohs(addr_from.sin_port));
-
-	pdebug(
-		"TUN_HEADER info:\n"
-		"  mode = %s\n"
-		"  device_id = %d\n"
-		"  length = %d\n"
-		"  seq_all = %d\n"
-		"  seq_dev = %d\n",
-		mode2str(hdr->mode), hdr->device_id, hdr->length, hdr->seq_all, hdr->seq_dev
-	);
-	return;
-}
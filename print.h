@@ -7,9 +7,10 @@
 
 void print_error(const char *format, ...);
 void print_debug(const char *format, ...);
+void print_info(const char *format, ...);
+void print_histogram(const char *label, const HISTOGRAM_SNAPSHOT& snap, const char *unit);
 
-void pdebug_tunrecv(const int seq, const int nread, const uint8_t* buf);
-void pdebug_ethrecv(const int seq, const int nread, const uint8_t* buf, sockaddr_in& addr_from);
+const char* const mode2str(uint8_t mode);
 
 #define pdebug(format, ...)	do{if(_global_fDebug){print_debug((format), ## __VA_ARGS__);}}while(0)
 
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <string>
+
+#include "print.h"
+#include "ippacket.h"
+#include "qos.h"
+
+// DSCP（RFC 4594 の区分）
+#define	DSCP_CS1	8
+#define	DSCP_LE		1
+#define	DSCP_CS2	16
+#define	DSCP_CS5	40
+
+static const char	*class_names[QOS_CLASSES] = { "rt", "interactive", "default", "bulk" };
+static const uint32_t	drr_weights[QOS_CLASSES] = { 0, 4, 2, 1 };	// QOS_RT は DRR に入らない
+
+const char* qos_class_name(uint8_t cls) {
+	return (cls < QOS_CLASSES) ? class_names[cls] : "?";
+}
+
+// rt=5060 / bulk=873 / interactive=8000-8100 のようなポートの指定
+static bool parse_port_rule(QOS_CONFIG& conf, uint8_t cls, const char *value) {
+	QOS_PORT_RULE	r;
+	unsigned long	lo, hi;
+	char			*end;
+
+	// uint16_t に切り詰める前に範囲を確かめる（70000 が 4464 にならないように）
+	lo = hi = strtoul(value, &end, 10);
+	if (end != value && *end == '-') {
+		const char	*p = end + 1;
+
+		hi = strtoul(p, &end, 10);
+		if (end == p) { hi = 0; }
+	}
+	if (end == value || *end != '\0' || lo == 0 || lo > 65535 || hi > 65535 || hi < lo) {
+		print_error("invalid QoS port rule : %s=%s\n", class_names[cls], value);
+		return false;
+	}
+	r.cls = cls;
+	r.lo = (uint16_t)lo;
+	r.hi = (uint16_t)hi;
+	conf.rules.push_back(r);
+	return true;
+}
+
+bool qos_parse_option(QOS_CONFIG& conf, char *subopts) {
+	enum { OPT_SCHED, OPT_DEPTH, OPT_RT, OPT_INTERACTIVE, OPT_DEFAULT, OPT_BULK };
+	char *const	tokens[] = {
+		(char*)"sched", (char*)"depth", (char*)"rt", (char*)"interactive", (char*)"default", (char*)"bulk", NULL
+	};
+	char	*value;
+
+	conf.enable = true;
+	while (*subopts != '\0') {
+		const int	opt = getsubopt(&subopts, tokens, &value);
+
+		if (opt < 0 || value == NULL) {
+			print_error("invalid QoS option : %s\n", value ? value : "(null)");
+			return false;
+		}
+		switch (opt) {
+		case OPT_SCHED:
+			if      (strcmp(value, "drr") == 0)    { conf.drr = true; }
+			else if (strcmp(value, "strict") == 0) { conf.drr = false; }
+			else {
+				print_error("invalid QoS scheduler : %s\n", value);
+				return false;
+			}
+			break;
+
+		case OPT_DEPTH:
+			conf.depth = strtoul(value, NULL, 10);
+			if (conf.depth == 0 || conf.depth > QOS_MAX_DEPTH) {
+				print_error("QoS queue depth must be 1 - %u\n", QOS_MAX_DEPTH);
+				return false;
+			}
+			break;
+
+		case OPT_RT:			if (!parse_port_rule(conf, QOS_RT, value)) { return false; } break;
+		case OPT_INTERACTIVE:	if (!parse_port_rule(conf, QOS_INTERACTIVE, value)) { return false; } break;
+		case OPT_DEFAULT:		if (!parse_port_rule(conf, QOS_DEFAULT, value)) { return false; } break;
+		case OPT_BULK:			if (!parse_port_rule(conf, QOS_BULK, value)) { return false; } break;
+		}
+	}
+	return true;
+}
+
+uint8_t qos_classify(const QOS_CONFIG& conf, const uint8_t *pkt, uint32_t len) {
+	IP_INFO	info;
+
+	if (!ip_parse(pkt, len, info)) { return QOS_DEFAULT; }
+
+	if ((info.proto == IPPROTO_TCP || info.proto == IPPROTO_UDP) && !info.fragment) {
+		for (const auto& r : conf.rules) {
+			if ((info.sport >= r.lo && info.sport <= r.hi) || (info.dport >= r.lo && info.dport <= r.hi)) { return r.cls; }
+		}
+	}
+	if (info.dscp >= DSCP_CS5) { return QOS_RT; }	// CS5 / VOICE-ADMIT / EF とネットワーク制御
+	if (info.dscp >= DSCP_CS2) { return QOS_INTERACTIVE; }
+	if (info.dscp == DSCP_CS1 || info.dscp == DSCP_LE) { return QOS_BULK; }
+
+	return ip_is_critical(info) ? QOS_INTERACTIVE : QOS_DEFAULT;
+}
+
+void qos_queues::Setup(const QOS_CONFIG& c, uint32_t size) {
+	conf = c;
+	slot_size = size;
+	if (!conf.enable) { return; }
+
+	for (auto& q : queues) {
+		q.slots.reset(new QOS_SLOT[conf.depth]);
+		q.data.reset(new uint8_t[(size_t)conf.depth * slot_size]);
+	}
+}
+
+bool qos_queues::Push(uint64_t now, const uint8_t *pkt, uint16_t len) {
+	QOS_QUEUE&	q = queues[qos_classify(conf, pkt, len)];
+
+	if (q.count >= conf.depth || len > slot_size) {
+		q.dropped++;
+		return false;
+	}
+	const uint32_t	i = (q.head + q.count) % conf.depth;
+	QOS_SLOT&		slot = q.slots[i];
+
+	slot.enq_ns = now;
+	slot.len = len;
+	memcpy(&q.data[(size_t)i * slot_size], pkt, len);
+
+	q.count++;
+	q.enqueued++;
+	if (q.count > q.depth_max) { q.depth_max = q.count; }
+	backlog++;
+	return true;
+}
+
+// 順番が回ってきたクラスに quantum を足し、足りる間はそのクラスから出す
+// quantum は BUFSIZE 以上なので、空でないクラスは１巡で必ず出せる（-S の大きなパケットは数巡かかる）
+uint8_t qos_queues::_NextDrr() {
+	while (true) {
+		QOS_QUEUE&	q = queues[drr_cur];
+
+		if (q.count > 0 && q.deficit >= q.slots[q.head].len) { return drr_cur; }
+		if (q.count == 0) { q.deficit = 0; }	// 空のクラスには貯めない
+
+		drr_cur = (drr_cur + 1 < QOS_CLASSES) ? drr_cur + 1 : QOS_INTERACTIVE;
+		if (queues[drr_cur].count > 0) { queues[drr_cur].deficit += drr_weights[drr_cur] * QOS_DRR_QUANTUM; }
+	}
+}
+
+uint16_t qos_queues::Pop(uint64_t now, uint8_t *dst, uint8_t& cls) {
+	if (backlog == 0) { return 0; }
+
+	cls = QOS_CLASSES;
+	for (uint8_t c = 0; c < QOS_CLASSES; c++) {
+		if (queues[c].count == 0) { continue; }
+		cls = (conf.drr && c != QOS_RT) ? this->_NextDrr() : c;
+		break;
+	}
+	QOS_QUEUE&		q = queues[cls];
+	const QOS_SLOT&	slot = q.slots[q.head];
+
+	memcpy(dst, &q.data[(size_t)q.head * slot_size], slot.len);
+	if (conf.drr && cls != QOS_RT) { q.deficit -= slot.len; }
+	q.wait.record((now - slot.enq_ns) / 1000);
+	q.head = (q.head + 1) % conf.depth;
+	q.count--;
+	q.dequeued++;
+	backlog--;
+	return slot.len;
+}
+
+void qos_queues::PrintStats() const {
+	print_info("QoS: %s, depth %u per class\n", conf.drr ? "rt strict + DRR 4:2:1" : "strict priority", conf.depth);
+	for (uint8_t c = 0; c < QOS_CLASSES; c++) {
+		const QOS_QUEUE&	q = queues[c];
+		const std::string	label = std::string("QoS wait [") + class_names[c] + "]";
+
+		print_histogram(label.c_str(), q.wait.snapshot(), "us");
+		print_info("QoS [%s] queued %llu, sent %llu, dropped %llu, depth now %u, max %u\n",
+			class_names[c], (unsigned long long)q.enqueued, (unsigned long long)q.dequeued,
+			(unsigned long long)q.dropped, q.count, q.depth_max);
+	}
+}
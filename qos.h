@@ -0,0 +1,98 @@
+#ifndef	__QOS_H__
+#define	__QOS_H__
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include "mpudpdef.h"
+#include "histogram.h"
+
+/*
+ * 内側のパケットの優先制御（-Q、クライアントのみ）
+ * TUN から読んだパケットを DSCP（とポートの指定）でクラスに分けてクラスごとのキューに入れ、
+ * 送れる経路ができたら優先度の高いクラスから出す。上りが埋まっていても、音声が一括転送の後ろに並ばない。
+ *   QOS_RT          : EF / VOICE-ADMIT / CS5 / CS6 / CS7。常に最優先（strict）で、最も遅延の小さい経路に送る
+ *   QOS_INTERACTIVE : AF2x〜AF4x / CS2〜CS4、DSCP のない接続の確立・純粋な ACK・DNS など（ip_is_critical）
+ *   QOS_DEFAULT     : それ以外
+ *   QOS_BULK        : CS1 / LE
+ * sched=drr なら QOS_RT 以外は重み 4:2:1 の DRR、sched=strict なら全クラスを優先度順に出す。
+ * キューはクラスごとに depth 個で、溢れたら新しいパケットを捨てる（カーネルの TUN のキューに溜めると区別できない）。
+ * どの経路に送るかはキューから出すときに決めるので、キューは経路ごとではなくトンネルに１組。
+ */
+typedef enum _QOS_CLASS_ID {
+	QOS_RT = 0,
+	QOS_INTERACTIVE,
+	QOS_DEFAULT,
+	QOS_BULK,
+	QOS_CLASSES
+} QOS_CLASS_ID;
+
+typedef struct _QOS_PORT_RULE {
+	uint16_t	lo, hi;			// 送信元か宛先のポートがこの範囲の TCP / UDP
+	uint8_t		cls;
+} QOS_PORT_RULE;
+
+typedef struct _QOS_CONFIG {
+	bool		enable;
+	bool		drr;			// false なら全クラス strict priority
+	uint32_t	depth;			// クラスごとのキューの長さ（パケット数）
+	std::vector<QOS_PORT_RULE>	rules;	// DSCP より優先する。先に書いたものから見る
+
+	_QOS_CONFIG() : enable(false), drr(true), depth(QOS_DEFAULT_DEPTH) {}
+} QOS_CONFIG;
+
+bool qos_parse_option(QOS_CONFIG& conf, char *subopts);
+uint8_t qos_classify(const QOS_CONFIG& conf, const uint8_t *pkt, uint32_t len);
+const char* qos_class_name(uint8_t cls);
+
+typedef struct _QOS_SLOT {
+	uint64_t	enq_ns;
+	uint16_t	len;
+} QOS_SLOT;
+
+typedef struct _QOS_QUEUE {
+	std::unique_ptr<QOS_SLOT[]>	slots;
+	std::unique_ptr<uint8_t[]>	data;	// slot_size バイトずつ、slots と同じ並び
+	uint32_t	head, count;
+	uint32_t	deficit;		// DRR
+
+	// 統計
+	uint64_t	enqueued, dequeued, dropped;
+	uint32_t	depth_max;
+	latency_histogram	wait;	// キューで待った時間（us）
+
+	_QOS_QUEUE() : head(0), count(0), deficit(0), enqueued(0), dequeued(0), dropped(0), depth_max(0) {}
+} QOS_QUEUE;
+
+// メインループのスレッドだけが触ること（統計の wait だけは別スレッドから読める）
+class qos_queues {
+private:
+	QOS_CONFIG	conf;
+	uint32_t	slot_size;		// 入れられるパケットの長さ（TUN から読む大きさ。-S なら BUFSIZE より大きい）
+	QOS_QUEUE	queues[QOS_CLASSES];
+	uint32_t	backlog;		// 全クラスのパケット数
+	uint8_t		drr_cur;
+
+	uint8_t _NextDrr();
+
+public:
+	qos_queues() : slot_size(0), backlog(0), drr_cur(QOS_INTERACTIVE) {}
+	qos_queues(const qos_queues&) = delete;
+	qos_queues& operator=(const qos_queues&) = delete;
+
+	// slot_size は TUN から読む大きさ（_TunReadSize）
+	void Setup(const QOS_CONFIG& c, uint32_t slot_size);
+	inline bool Enabled() const { return conf.enable; }
+	inline bool Empty() const { return backlog == 0; }
+
+	// 溢れたら（入らない長さなら）捨てて false
+	bool Push(uint64_t now, const uint8_t *pkt, uint16_t len);
+
+	// 次に送るパケットを dst にコピーして長さを返す（空なら 0）
+	uint16_t Pop(uint64_t now, uint8_t *dst, uint8_t& cls);
+
+	void PrintStats() const;
+};
+
+#endif
@@ -0,0 +1,296 @@
+#include "print.h"
+#include "ippacket.h"
+#include "scheduler.h"
+
+bool path_scheduler::SetPathUp(SOCKET_PACK& s, bool up) {
+	if (s.path_up == up) { return false; }
+
+	s.path_up = up;
+	if (up) { paths_up++; } else { paths_up--; }
+	return true;
+}
+
+// エコースレッドが計測した RTT を各経路の輻輳制御に反映する
+// フローレットの間隔（経路間の RTT 差）もここで更新する
+void path_scheduler::OnMetrics(uint64_t now) {
+	uint32_t	srtt_min = UINT32_MAX, srtt_max = 0;
+
+	has_costs = false;
+	for (auto& s : this->socks) {
+		if (path_cost(s) > 0) { has_costs = true; }
+
+		const uint32_t	n = s.metrics->rtt_samples.load(std::memory_order_acquire);
+		const uint32_t	srtt = s.metrics->srtt_us.load(std::memory_order_relaxed);
+
+		// 片道遅延の報告が途絶えた（その経路に送っていない）なら、古い値で経路を避けたり増速を止めたりしない
+		if (s.owd_tx_ns != 0 && now - s.owd_tx_ns > OWD_STALE_NS) {
+			s.owd_tx = { 0, 0, 0 };
+			s.owd_tx_ns = 0;
+			s.cc.owd_qdelay_us = 0;
+		}
+		if (s.fb.last_ns != 0 && now - s.fb.last_ns > FEEDBACK_STALE_NS) { s.fb.Expire(); }	// 受信報告も同じ
+
+		if (n != s.cc.rtt_seen) {
+			s.cc.rtt_seen = n;
+			s.cc.OnRttSample(now, s.metrics->rtt_last_us.load(std::memory_order_relaxed));
+		}
+		if (srtt == 0) { continue; }
+		srtt_min = (srtt < srtt_min) ? srtt : srtt_min;
+		srtt_max = max(srtt_max, srtt);
+	}
+	flowlet_ns = FLOWLET_MARGIN_NS + ((srtt_max > srtt_min) ? (uint64_t)(srtt_max - srtt_min) * 1000 : 0);
+}
+
+bool path_scheduler::Ready(uint64_t now, uint64_t& wait_ns, uint32_t len) {
+	uint64_t	ready = UINT64_MAX;
+	bool		any = false;
+
+	for (auto& s : this->socks) {
+		if (!this->Usable(s)) { continue; }
+		if (this->_CanSend(now, s, len)) { return true; }
+
+		// 輻輳制御とレートの上限の両方が許すまで
+		uint64_t	t = s.cc.ReadyTime(now, len);
+		if (s.budget) { t = max(t, s.budget->ReadyTime(now, len)); }
+		if (t < ready) { ready = t; }
+		any = true;
+	}
+	// 使える経路が１つもない（全部外れている）ときは、リンクが戻るまで待つ
+	if (!any) {
+		wait_ns = UINT64_MAX;
+		return false;
+	}
+	// 輻輳制御で止まっている経路は帯域を使い切っている（レートの上限で止まっている経路は違う）
+	for (auto& s : this->socks) {
+		if (!s.cc.CanSend(now, len)) { s.cc.SetLimited(); }
+	}
+	if (ready == UINT64_MAX) { ready = now; }
+
+	wait_ns = (ready > now) ? ready - now : 0;
+	return false;
+}
+
+// 送信可能な経路のうち、ペーシング上もっとも余裕のある（次の送信予定時刻が早い）経路を選ぶ
+// 各経路のペーシングレートに比例してパケットが配分される（費用が違えば安い経路が先）
+SOCKET_PACK* path_scheduler::_SelectPath(uint64_t now, uint32_t len) {
+	SOCKET_PACK	*best = nullptr;
+
+	for (auto& s : this->socks) {
+		if (!this->_CanSend(now, s, len)) { continue; }
+		if (best == nullptr ||
+			path_cost(s) < path_cost(*best) ||
+			(path_cost(s) == path_cost(*best) && s.cc.next_send_ns < best->cc.next_send_ns)) {
+			best = &s;
+		}
+	}
+	return best;
+}
+
+/*
+ * パケットを流す（主）経路を決める
+ * フロー固定が有効なら、同じフローは前回と同じ経路に流す。
+ * 前のパケットから flowlet_ns 以上空いていれば（＝フローレットの切れ目なので、経路を変えても
+ * 先に送ったパケットを追い越さない）、送信方針に従って経路を選び直す。
+ */
+SOCKET_PACK* path_scheduler::_SelectPrimary(uint64_t now, const uint8_t *pkt, uint16_t data_len, bool urgent) {
+	const uint32_t	wire_len = sizeof(TUN_HEADER) + data_len;
+	SOCKET_PACK		*path = nullptr;
+	IP_INFO			info;
+
+	const bool		parsed = (flow_pinning || (has_costs && !urgent)) && ip_parse(pkt, data_len, info);
+
+	auto by_policy = [&]() {
+		SOCKET_PACK	*p = (mode == MODE_ADAPTIVE || urgent) ?
+			this->SelectBest(now, wire_len, nullptr) : this->_SelectPath(now, wire_len);
+		if (p == nullptr) { return this->_Fallback(now, wire_len); }	// 送る前に同じ長さと時刻で確認しているので通常はありえない
+
+		// 安い経路がキューイングしているなら、遅延に効くパケットだけは費用によらず速い経路へ
+		if (has_costs && path_queueing(*p) && (urgent || (parsed && ip_is_critical(info)))) {
+			SOCKET_PACK	*fast = this->_Best(now, wire_len, nullptr, false);
+			if (fast != nullptr) { p = fast; }
+		}
+		return p;
+	};
+	if (!flow_pinning || !parsed) { return by_policy(); }
+
+	const uint32_t	hash = flow_hash(info);
+	FLOW_ENTRY&		e = flows.lookup(hash, now, FLOW_EXPIRE_NS);
+
+	if (e.hash != 0 && e.path < socks.size() && now - e.last_ns <= flowlet_ns && this->Usable(socks[e.path])) {
+		// フローレットの途中ではペーシングの多少の前倒しは許す（経路を変えて順序が入れ替わるよりはまし）。レートの上限は守る
+		SOCKET_PACK&	pinned = socks[e.path];
+
+		if (pinned.cc.WithinCwnd(now, wire_len) && (!pinned.budget || pinned.budget->Allow(now, wire_len))) {
+			path = &socks[e.path];
+		}
+		else {
+			flow_forced++;
+		}
+	}
+	if (path == nullptr) {
+		if ((path = by_policy()) == nullptr) { return nullptr; }
+		if (e.hash != 0 && &socks[e.path] != path) { flow_switches++; }
+	}
+	e.hash = hash;
+	e.path = (uint16_t)(path - &socks.front());
+	e.last_ns = now;
+	return path;
+}
+
+// 輻輳制御が許す経路がないとき：レートの上限の許す経路のうち最も安く、その中で最も速い経路（なければ nullptr）
+SOCKET_PACK* path_scheduler::_Fallback(uint64_t now, uint32_t len) {
+	SOCKET_PACK	*best = nullptr;
+
+	for (auto& s : this->socks) {
+		if (!this->Usable(s) || (s.budget && !s.budget->Allow(now, len))) { continue; }
+		if (best == nullptr || path_cost(s) < path_cost(*best) ||
+			(path_cost(s) == path_cost(*best) && path_score(s) < path_score(*best))) {
+			best = &s;
+		}
+	}
+	return best;
+}
+
+// 複製して２本目の経路にも流す価値があるか
+// 主経路の損失率か RTT の揺らぎが閾値を超えているとき、または落ちると高くつく小さなパケット（critical）のとき
+bool path_scheduler::_NeedDuplicate(const SOCKET_PACK& primary, const uint8_t *pkt, uint32_t len, bool& critical) {
+	IP_INFO	info;
+
+	critical = ip_parse(pkt, len, info) && ip_is_critical(info);
+	if (critical) { return true; }
+	if (primary.metrics->loss_permille.load(std::memory_order_relaxed) >= DUP_LOSS_PERMILLE) { return true; }
+	return primary.metrics->rttvar_us.load(std::memory_order_relaxed) >= DUP_RTTVAR_US;
+}
+
+/*
+ * MODE_STABLE   : 使える経路すべてに複製（費用が違えば最も安い経路すべて）
+ * MODE_ADAPTIVE : 基本は最も速い経路１本で送り、必要なときだけ次点の経路にも複製する
+ * MODE_SPEED    : 輻輳制御とペーシングの許す経路に送る
+ */
+int path_scheduler::Select(uint64_t now, const uint8_t *pkt, uint16_t data_len, SOCKET_PACK **paths, bool urgent) {
+	int		n = 0;
+
+	switch (mode) {
+	case MODE_STABLE: {
+		const uint32_t	wire_len = sizeof(TUN_HEADER) + data_len;
+		uint32_t		tier = UINT32_MAX;
+
+		for (auto& s : this->socks) {
+			if (this->Usable(s) && (!s.budget || s.budget->Allow(now, wire_len))) {
+				tier = (path_cost(s) < tier) ? path_cost(s) : tier;
+			}
+		}
+		for (auto& s : this->socks) {
+			if (this->Usable(s) && path_cost(s) == tier && (!s.budget || s.budget->Allow(now, wire_len))) { paths[n++] = &s; }
+		}
+		if (n == 0 && (paths[n] = this->_SelectPrimary(now, pkt, data_len, urgent)) != nullptr) { n++; }
+		break;
+	}
+
+	case MODE_ADAPTIVE: {
+		bool	critical;
+
+		if ((paths[n] = this->_SelectPrimary(now, pkt, data_len, urgent)) == nullptr) { break; }
+		n++;
+		if (this->_NeedDuplicate(*paths[0], pkt, data_len, critical)) {
+			// 損失や揺らぎ対策の複製は主経路より高い経路には流さない（遅延に効くパケットだけは費用によらず）
+			paths[n] = this->SelectBest(now, sizeof(TUN_HEADER) + data_len, paths[0]);
+			if (paths[n] != nullptr && (critical || path_cost(*paths[n]) <= path_cost(*paths[0]))) { n++; }
+		}
+		break;
+	}
+
+	default:
+		if ((paths[n] = this->_SelectPrimary(now, pkt, data_len, urgent)) != nullptr) { n++; }
+		break;
+	}
+	return n;
+}
+
+void path_scheduler::OnSent(uint64_t now, SOCKET_PACK* const *paths, int n, uint16_t data_len) {
+	bool	paid = false;
+
+	for (int i = 0; i < n; i++) {
+		this->Charge(*paths[i], now, sizeof(TUN_HEADER) + data_len);
+		if (path_cost(*paths[i]) > 0) { paid = true; }
+	}
+	packets++;
+	if (n > 1 || mode == MODE_STABLE) { duplicated++; }
+	if (paid) { metered++; }
+}
+
+// 分割したパケットは１つのパケットとしてまとめて送るので、ペーシングの前倒しは許す（cwnd だけ見る）
+int path_scheduler::Stripe(uint64_t now, const STRIPE_CONFIG& conf, uint16_t data_len, SOCKET_PACK **paths, uint16_t *lens) {
+	const uint32_t	chunk = sizeof(TUN_HEADER) + sizeof(STRIPE_HEADER) + conf.ChunkMax();
+	SOCKET_PACK		*cands[STRIPE_MAX_CHUNKS];
+	uint32_t		tier = UINT32_MAX;
+	int				n = 0;
+
+	auto eligible = [&](SOCKET_PACK& s) {
+		return this->Usable(s) && s.cc.WithinCwnd(now, chunk) && (!s.budget || s.budget->Allow(now, chunk));
+	};
+	for (auto& s : this->socks) {
+		if (eligible(s)) { tier = (path_cost(s) < tier) ? path_cost(s) : tier; }
+	}
+	for (auto& s : this->socks) {
+		if (n < STRIPE_MAX_CHUNKS && path_cost(s) == tier && eligible(s)) { cands[n++] = &s; }
+	}
+	// 断片を載せられる経路がなければ、断片の大きさで送れる経路のうち最も安く速い１本に全部流す（それもなければ送らない）
+	if (n == 0 && (cands[n] = this->_Best(now, chunk, nullptr, true)) != nullptr) { n++; }
+	if (n == 0) { return 0; }
+	return stripe_plan(conf, cands, n, data_len, paths, lens);
+}
+
+void path_scheduler::OnStriped(uint64_t now, SOCKET_PACK* const *paths, const uint16_t *lens, int n) {
+	bool	paid = false;
+
+	for (int i = 0; i < n; i++) {
+		this->Charge(*paths[i], now, sizeof(TUN_HEADER) + sizeof(STRIPE_HEADER) + lens[i]);
+		if (path_cost(*paths[i]) > 0) { paid = true; }
+	}
+	packets++;
+	striped++;
+	if (paid) { metered++; }
+}
+
+void path_scheduler::Charge(SOCKET_PACK& s, uint64_t now, uint32_t wire_len) {
+	s.cc.OnSend(now, wire_len);
+	if (s.budget && s.budget->OnSend(now, wire_len)) {
+		print_info("eth[%s]: quota exhausted (%llu MB), path is no longer used\n",
+			s.budget->conf.dev.c_str(), (unsigned long long)(s.budget->conf.quota / 1000 / 1000));
+	}
+}
+
+// by_cost なら費用の小さい経路が先。同じ費用の中では path_score の小さい（速い）経路
+SOCKET_PACK* path_scheduler::_Best(uint64_t now, uint32_t len, const SOCKET_PACK *exclude, bool by_cost) {
+	SOCKET_PACK	*best = nullptr;
+
+	for (auto& s : this->socks) {
+		if (&s == exclude || !this->_CanSend(now, s, len)) { continue; }
+		if (best != nullptr && by_cost && path_cost(s) != path_cost(*best)) {
+			if (path_cost(s) < path_cost(*best)) { best = &s; }
+			continue;
+		}
+		if (best == nullptr ||
+			path_score(s) < path_score(*best) ||
+			(path_score(s) == path_score(*best) && s.cc.next_send_ns < best->cc.next_send_ns)) {
+			best = &s;
+		}
+	}
+	return best;
+}
+
+SOCKET_PACK* path_scheduler::RepairPath(SOCKET_PACK *from) {
+	SOCKET_PACK	*best = nullptr, *cheap = nullptr;
+
+	for (auto& s : this->socks) {
+		if (!this->Usable(s)) { continue; }
+		if (best == nullptr || path_score(s) < path_score(*best)) { best = &s; }
+		if (cheap == nullptr || path_cost(s) < path_cost(*cheap) ||
+			(path_cost(s) == path_cost(*cheap) && path_score(s) < path_score(*cheap))) {
+			cheap = &s;
+		}
+	}
+	if (cheap != nullptr && !path_queueing(*cheap)) { return cheap; }
+	return (best != nullptr) ? best : from;
+}
@@ -0,0 +1,117 @@
+#ifndef	__SCHEDULER_H__
+#define	__SCHEDULER_H__
+
+#include <stdint.h>
+#include <vector>
+
+#include "mpudpdef.h"
+#include "network.h"
+#include "flowtable.h"
+#include "stripe.h"
+
+/*
+ * 送信側の経路選択（クライアントの TX スレッド）
+ * 送信方針（-m）とフロー単位の経路固定（-F）に従って、TUN から読んだパケットをどの経路に流すかを決める。
+ * 経路の輻輳制御と計測値を見て選ぶだけで、送信はしない。時刻はすべて引数で受け取るので、
+ * シミュレータ（sim.cpp）も仮想時刻で同じものを動かす。
+ * 経路に費用（-C、budget.h）があれば、送れる経路のうち費用の小さいものから使う（高い経路は安い経路のあふれ分）。
+ * 遅延に効くパケットと送り直しだけは、安い経路がキューイングしていれば費用によらず速い経路に送る。
+ * 大きなパケット（-S）は、最も安い経路のうち cwnd に余裕のある経路すべてに分けて流す（stripe.h）。
+ */
+
+// 経路の良さ（小さいほど良い）：RTO と同じ考え方で、遅延の揺らぎも込みで最悪どのくらい待たされるか
+// プローブの RTT は数十ミリ秒おきにしか更新されないので、送信方向の片道遅延の報告（キューの伸び）も足す
+// 揺らぎは、受信報告でデータの到着間隔の方が大きく揺れていればそちらを使う
+static inline uint64_t path_score(const SOCKET_PACK& s) {
+	const uint32_t	srtt = s.metrics->srtt_us.load(std::memory_order_relaxed);
+	const uint32_t	var  = max(s.metrics->rttvar_us.load(std::memory_order_relaxed), s.fb.jitter_us);
+	const int32_t	owd  = s.owd_tx.qdelay_us + ((s.owd_tx.trend_us > 0) ? s.owd_tx.trend_us : 0);
+
+	if (srtt == 0) { return UINT32_MAX; }	// まだ計測できていない経路は後回し
+	return (uint64_t)srtt + 4ULL * var + ((owd > 0) ? owd : 0);
+}
+
+static inline uint32_t path_cost(const SOCKET_PACK& s) { return s.budget ? s.budget->conf.cost : 0; }
+
+// 送信方向にキューが溜まっている（片道遅延の報告が目標を超えている）
+static inline bool path_queueing(const SOCKET_PACK& s) { return s.owd_tx.qdelay_us >= CC_QDELAY_TARGET_US; }
+
+class path_scheduler {
+private:
+	std::vector<SOCKET_PACK>&	socks;
+
+	bool		has_costs;		// 費用のある経路がある
+
+	inline bool _CanSend(uint64_t now, SOCKET_PACK& s, uint32_t len) {
+		return this->Usable(s) && s.cc.CanSend(now, len) && (!s.budget || s.budget->Allow(now, len));
+	}
+	SOCKET_PACK* _SelectPath(uint64_t now, uint32_t len);
+	SOCKET_PACK* _SelectPrimary(uint64_t now, const uint8_t *pkt, uint16_t data_len, bool urgent);
+	SOCKET_PACK* _Best(uint64_t now, uint32_t len, const SOCKET_PACK *exclude, bool by_cost);
+	SOCKET_PACK* _Fallback(uint64_t now, uint32_t len);
+	bool _NeedDuplicate(const SOCKET_PACK& primary, const uint8_t *pkt, uint32_t len, bool& critical);
+
+public:
+	TRANSMIT_MODE	mode;
+	uint64_t	packets;		// 送ったパケット数
+	uint64_t	duplicated;		// 複数の経路に流したパケット数
+	uint64_t	metered;		// 費用のある経路（cost > 0）に流したパケット数
+	uint64_t	striped;		// 分割して流したパケット数
+
+	// フロー単位の経路固定（-F）
+	bool		flow_pinning;
+	uint64_t	flowlet_ns;		// これ以上間が空いたら別の経路に移してよい（経路間の RTT 差）
+	uint64_t	flow_switches;	// フローレットの切れ目で経路を移した回数
+	uint64_t	flow_forced;	// 固定先の経路が送れず、フローレットの途中で移した回数
+	flow_table<FLOW_TABLE_SIZE>	flows;
+
+	uint32_t	paths_up;		// 生きている経路の数（0 のときは全経路を使う）
+
+	// socks の要素数は後から変えない（フロー表が位置で覚えているので）
+	explicit path_scheduler(std::vector<SOCKET_PACK>& s) :
+		socks(s), has_costs(false), mode(MODE_SPEED), packets(0), duplicated(0), metered(0), striped(0),
+		flow_pinning(false), flowlet_ns(0), flow_switches(0), flow_forced(0), paths_up(0) {}
+
+	// 外した（ソケットのない）経路と、送信量の上限を使い切った経路は使えない
+	inline bool Usable(const SOCKET_PACK& s) const {
+		return s.sock_fd != -1 && (s.path_up || paths_up == 0) && !(s.budget && s.budget->Exhausted());
+	}
+
+	// 経路の状態を変える。変わったときだけ true
+	bool SetPathUp(SOCKET_PACK& s, bool up);
+
+	// 計測値（RTT、片道遅延の報告）を輻輳制御とフローレットの間隔に反映する
+	void OnMetrics(uint64_t now);
+
+	// どれか１つでも len バイトのフレームを送信可能な経路があるか。なければ、送信可能になるまでの待ち時間を wait_ns に返す
+	// TUN から読む前は長さがわからないので PATH_NOMINAL_PACKET で見る。読んだら実際のフレーム長で見直し、
+	// true なら Select（分割するなら Stripe）に渡したときに送れる経路が必ずある
+	bool Ready(uint64_t now, uint64_t& wait_ns, uint32_t len = PATH_NOMINAL_PACKET);
+
+	// pkt（TUN から読んだ data_len バイト）を流す経路を paths に並べ、その数を返す
+	// paths には socks.size() 個（最低２個）分の場所が要る。２個以上なら複製して流す。使える経路がなければ 0
+	// urgent（-Q の QOS_RT）なら送信方針によらず最も遅延の小さい経路を主経路にする
+	int Select(uint64_t now, const uint8_t *pkt, uint16_t data_len, SOCKET_PACK **paths, bool urgent);
+
+	// Select で選んだ経路に送ったあとで
+	void OnSent(uint64_t now, SOCKET_PACK* const *paths, int n, uint16_t data_len);
+
+	// data_len バイトのパケットを分割して流す断片ごとの経路と長さを paths、lens（STRIPE_MAX_CHUNKS 個分）に並べ、断片の数を返す
+	// 分けられる経路がなければ、断片の大きさで送れる経路のうち最も安く速い１本に断片を全部流す（なければ 0）
+	int Stripe(uint64_t now, const STRIPE_CONFIG& conf, uint16_t data_len, SOCKET_PACK **paths, uint16_t *lens);
+
+	// Stripe で分けた断片を送ったあとで
+	void OnStriped(uint64_t now, SOCKET_PACK* const *paths, const uint16_t *lens, int n);
+
+	// Select を通さずに送ったもの（送り直し）も、輻輳制御と上限に数える
+	void Charge(SOCKET_PACK& s, uint64_t now, uint32_t wire_len);
+
+	// 送信可能な経路のうち最も安く、その中で最も速い経路（exclude は除く）
+	inline SOCKET_PACK* SelectBest(uint64_t now, uint32_t len, const SOCKET_PACK *exclude) { return this->_Best(now, len, exclude, true); }
+
+	// 選択的再送は、NACK がどこから来たかによらず、その時点で最も安い経路のうち最も速い経路で送る
+	// （その経路がキューイングしていれば費用によらず最も速い経路）
+	SOCKET_PACK* RepairPath(SOCKET_PACK *from);
+};
+
+#endif
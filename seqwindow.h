@@ -0,0 +1,69 @@
+#ifndef	__SEQWINDOW_H__
+#define	__SEQWINDOW_H__
+
+#include <array>
+#include <cstdint>
+
+/*
+ * seq_all の受信済みビットマップ（重複排除用のスライディングウィンドウ）
+ * 最新から N 個前までのシーケンスについて、受信済みかどうかを O(1) で判定する。
+ * ウィンドウより古いシーケンスが来たら、相手が再起動して番号が振り直されたとみなして作り直す。
+ */
+template<std::size_t N>
+class seq_window {
+	static_assert(N % 64 == 0 && (N & (N - 1)) == 0, "N must be a power of two and a multiple of 64");
+
+private:
+	std::array<uint64_t, N / 64>	bits;
+	uint32_t	top;	// 受信済みの最大シーケンス + 1
+	bool		empty;
+
+	inline void _clear(uint32_t seq) { bits[(seq % N) / 64] &= ~(1ULL << (seq % 64)); }
+	inline bool _test_and_set(uint32_t seq) {
+		uint64_t&		w = bits[(seq % N) / 64];
+		const uint64_t	m = 1ULL << (seq % 64);
+		const bool		was = (w & m) != 0;
+		w |= m;
+		return was;
+	}
+
+public:
+	seq_window() : top(0), empty(true) { bits.fill(0); }
+
+	inline void reset() { bits.fill(0); empty = true; }
+
+	// 初めて見るシーケンスなら true（受信済みにする）
+	bool check_and_set(uint32_t seq) {
+		const int32_t	d = (int32_t)(seq - top);
+
+		if (empty || -d > (int32_t)N) {
+			bits.fill(0);
+			top = seq + 1;
+			empty = false;
+			_test_and_set(seq);
+			return true;
+		}
+		if (d >= 0) {
+			// ウィンドウを進める。間のシーケンスは未受信にしておく
+			if (d >= (int32_t)N) {
+				bits.fill(0);
+			}
+			else {
+				for (uint32_t s = top; s != seq; s++) { _clear(s); }
+			}
+			top = seq + 1;
+			_test_and_set(seq);
+			return true;
+		}
+		return !_test_and_set(seq);
+	}
+
+	inline uint32_t highest() const { return top - 1; }
+	inline bool contains(uint32_t seq) const {
+		const int32_t	d = (int32_t)(seq - top);
+		if (empty || d >= 0 || -d > (int32_t)N) { return false; }
+		return (bits[(seq % N) / 64] >> (seq % 64)) & 1;
+	}
+};
+
+#endif
@@ -1,4 +1,7 @@
 #include <algorithm>
+#include <unordered_map>
+
+#include <ifaddrs.h>
 
 #include "mpudp.h"
 
@@ -24,6 +27,20 @@ bool MPUDPTunnelServer::_SetupSocket(int& sock_fd, int listen_port) {
 	listen_addr.sin_addr.s_addr	= htonl(INADDR_ANY);
 	listen_addr.sin_port		= htons(listen_port);
 
+	// 全経路への送信で１つのソケットを共有するので、落ちた経路（ARP の解決待ち）に溜まったパケットが
+	// 送信バッファを食いつぶして他の経路への送信まで止めないよう、大きめに取る
+	optval = SERVER_SNDBUF;
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUFFORCE, &optval, sizeof(optval)) < 0 &&
+		setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &optval, sizeof(optval)) < 0) {
+		perror("setsockopt()");
+		print_error("Couldn't set value of SO_SNDBUF\n");
+	}
+	// 待ち受けアドレスが複数あるとき、どのアドレスに届いたかを知り、同じアドレスから返すため
+	optval = 1;
+	if (setsockopt(sock_fd, IPPROTO_IP, IP_PKTINFO, &optval, sizeof(optval)) < 0) {
+		perror("setsockopt()");
+		print_error("Couldn't set value of IP_PKTINFO\n");
+	}
 	if (bind(sock_fd, (sockaddr*)&listen_addr, sizeof(listen_addr)) < 0) {
 		perror("bind()");
 		print_error("errno = %d\n", errno);
@@ -37,90 +54,370 @@ bool MPUDPTunnelServer::_SetupSocket(int& sock_fd, int listen_port) {
 	return true;
 }
 
+/*
+ * -e で指定された待ち受けアドレスを解決する
+ * auto は、TUN とループバック以外の、今付いている全 IPv4 アドレス（起動後に付いたものは知らせない）
+ */
+bool MPUDPTunnelServer::_ResolveEndpoints(const std::string& tun_name) {
+	auto add = [this](const in_addr& a) {
+		if (std::any_of(endpoints.begin(), endpoints.end(), [&a](const in_addr& e) { return e.s_addr == a.s_addr; })) { return; }
+		if (endpoints.size() >= MAX_SERVER_ENDPOINTS) {
+			print_error("too many endpoints - %s is not advertised\n", inet_ntoa(a));
+			return;
+		}
+		endpoints.push_back(a);
+	};
+	for (const auto& opt : endpoint_opts) {
+		in_addr	a;
+
+		if (opt != "auto") {
+			if (inet_aton(opt.c_str(), &a) == 0) {
+				print_error("invalid endpoint address - %s\n", opt.c_str());
+				return false;
+			}
+			add(a);
+			continue;
+		}
+		ifaddrs	*ifa;
+
+		if (getifaddrs(&ifa) < 0) {
+			perror("getifaddrs()");
+			print_error("errno = %d\n", errno);
+			return false;
+		}
+		for (ifaddrs *p = ifa; p != NULL; p = p->ifa_next) {
+			if (p->ifa_addr == NULL || p->ifa_addr->sa_family != AF_INET) { continue; }
+			if ((p->ifa_flags & IFF_LOOPBACK) || !(p->ifa_flags & IFF_UP) || tun_name == p->ifa_name) { continue; }
+			add(((const sockaddr_in*)p->ifa_addr)->sin_addr);
+		}
+		freeifaddrs(ifa);
+	}
+	for (const auto& a : endpoints) { print_info("endpoint: %s\n", inet_ntoa(a)); }
+	return true;
+}
+
+bool MPUDPTunnelServer::_SetupManageSocket() {
+	if (!this->_SetupSocket(this->sock_manage, PORT_PING)) { return false; }
+
+	// 多数のクライアントのプローブが重なっても取りこぼさないよう、受信バッファも大きめに取る
+	const int	rcvbuf = ECHO_RCVBUF;
+	if (setsockopt(sock_manage, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) < 0 &&
+		setsockopt(sock_manage, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0) {
+		perror("setsockopt(SO_RCVBUF)");
+	}
+	return true;
+}
+
+// -U：fd は TUN、待ち受けソケット、管理プレーンのソケットの順。経路は待ち受けソケットを共有する
+bool MPUDPTunnelServer::_Snapshot(UPGRADE_STATE& st, std::vector<int>& fds) {
+	st.server = 1;
+	fds.push_back(this->sock_recv);
+	fds.push_back(this->sock_manage);
+	for (const auto& c : connection_list) {
+		const auto	s = std::find_if(socks.begin(), socks.end(),
+			[&c](const SOCKET_PACK& s) { return is_same_addr(c.addr, s.remote_addr); }
+		);
+		if (s == socks.end()) { continue; }
+		if (st.npaths >= UPGRADE_MAX_PATHS) {
+			print_error("upgrade: too many connections - %d and later are not handed over\n", c.device_id);
+			break;
+		}
+		UPGRADE_PATH&	p = st.paths[st.npaths++];
+
+		upgrade_save_path(p, *s);
+		p.device_id = c.device_id;
+	}
+	return true;
+}
+
+void MPUDPTunnelServer::_RestoreSession() {
+	const uint64_t	now = monotonic_ns();
+
+	this->sock_recv = this->_TakeFd(1);
+	this->sock_manage = this->_TakeFd(2);
+	for (uint32_t i = 0; i < taken->npaths; i++) {
+		const UPGRADE_PATH&	p = taken->paths[i];
+		CONNECTIONS	c;
+		SOCKET_PACK	s;
+
+		s.sock_fd = this->sock_recv;
+		upgrade_restore_path(s, p, now);
+		this->socks.emplace_back(std::move(s));
+
+		c.addr = p.remote_addr;
+		c.device_id = p.device_id;
+		c.probed = false;
+		c.connected_time = system_clock::now();
+		this->connection_list.emplace_back(c);
+	}
+	downlink.OnPathsChanged();
+}
+
 // addrは無視される
 bool MPUDPTunnelServer::Start(const std::string& tun_name, const int port) {
-	if (!this->SetTunDevice(tun_name.c_str())) { return false; }
-
+	if (!lowlat_resolve_cpus(lowlat, "")) { return false; }
+	if (!this->_ResolveEndpoints(tun_name)) { return false; }
+
+	// -U：動いているプロセスがあれば、TUN とソケット、接続リストを引き継ぐ
+	if (!this->_TakeOver(tun_name, true)) { return false; }
+	if (taken) {
+		this->_RestoreSession();
+		if (this->sock_recv == -1 || this->sock_manage == -1) {
+			print_error("upgrade: sockets are missing\n");
+			return false;
+		}
+	}
 	// ソケットの作成とオプションの設定
-	if (!this->_SetupSocket(this->sock_recv, port)) { return false; }
-	
+	else if (!this->_SetupSocket(this->sock_recv, port) || !this->_SetupManageSocket()) {
+		return false;
+	}
+	lowlat_busy_poll(lowlat, this->sock_recv, "listen");
+
+	// 全経路が待ち受けソケット１つに届くので、RX は送信元のアドレスで経路を引く（_RxPath）
+	this->rx_sources.emplace_back(new RX_SOURCE("listen", -1, this->sock_recv, nullptr));
+	if (!this->_UpgradeReady()) { return false; }
+	if (!this->_StartPipeline()) { return false; }
+
 	this->th_echo = this->_StartEchoThread();
 	return true;
 }
 
+/*
+ * 管理プレーン（プローブへの応答）
+ * 送信元（アドレスとポート）をハッシュ表で引き、返信は送ってきた経路と、同じクライアント（ECHO_PACKET::client_id）の
+ * 最近プローブが届いている経路 ECHO_REPLY_FANOUT 本までに限る（行きと帰りで経路が違っても応答が届くように）。
+ * 以前は全接続に返していたので、プローブの量がクライアント数と経路数の２乗で増えていた。
+ * recvmmsg / sendmmsg でまとめて処理し、他のスレッドとは probe_sources（probe_mtx）以外何も共有しない。
+ * 応答は、プローブが届いた自アドレスから返す（-e で待ち受けアドレスが複数あるとき、クライアントの経路の接続先から返るように）。
+ * クライアントがセッションの開始時に送ってくる接続先の問い合わせ（ENDPOINT_PACKET）にもここで答える。
+ */
+static inline uint64_t echo_peer_key(const sockaddr_in& addr) {
+	return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+// プローブとデータはポートが違うので、アドレスとデバイスIDで突き合わせる
+// データのフレームの TUN_HEADER::device_id は８ビットなので、プローブの device_id も下位８ビットで引く
+static inline uint64_t probe_source_key(const in_addr& addr, int32_t device_id) {
+	return ((uint64_t)addr.s_addr << 32) | (uint8_t)device_id;
+}
+
+// 管理プレーンで受け取るもの（プローブか、接続先の問い合わせ）
+typedef union _MGMT_SLOT {
+	ECHO_PACKET		echo;
+	ENDPOINT_PACKET	endpoints;
+
+	_MGMT_SLOT() {}
+} MGMT_SLOT;
+
+static constexpr size_t	PKTINFO_SPACE = CMSG_SPACE(sizeof(in_pktinfo));
+
 std::unique_ptr<std::thread> MPUDPTunnelServer::_StartEchoThread() {
 #define	perror_th(s)				perror("[ECHO_THREAD] " s)
 #define	print_error_th(format, ...)	print_error(("[ECHO_THREAD] " format), ## __VA_ARGS__)
 #define	pdebug_th(format, ...)		pdebug(("[ECHO_THREAD] " format), ## __VA_ARGS__)
 
 	return std::unique_ptr<std::thread>(new std::thread([this](){
-		sockaddr_in	addr_from;
-		socklen_t	addr_len = sizeof(addr_from);
-		ssize_t		n;
+		static constexpr int	TX_MAX = ECHO_BATCH * (1 + ECHO_REPLY_FANOUT);
+
 		fd_set		rfds;
-		int			sock_manage;
+		timeval		tv;
+		uint64_t	now_ns, swept_ns = 0;
+
+		std::unique_ptr<MGMT_SLOT[]>	rx(new MGMT_SLOT[ECHO_BATCH]);
+		sockaddr_in	rx_addr[ECHO_BATCH];
+		iovec		rx_iov[ECHO_BATCH];
+		mmsghdr		rx_msgs[ECHO_BATCH];
+		alignas(cmsghdr) uint8_t	rx_ctrl[ECHO_BATCH][PKTINFO_SPACE];
+		std::unique_ptr<iovec[]>	tx_iov(new iovec[TX_MAX]);
+		std::unique_ptr<mmsghdr[]>	tx_msgs(new mmsghdr[TX_MAX]);
+		std::unique_ptr<uint8_t[]>	tx_ctrl(new uint8_t[TX_MAX * PKTINFO_SPACE]);	// PKTINFO_SPACE は CMSG_ALIGN 済み
+
+		std::unordered_map<uint64_t, ECHO_PEER>	peers;						// echo_peer_key → 送信元
+		std::unordered_map<uint32_t, std::vector<uint64_t>>	client_paths;	// client_id → その経路の echo_peer_key
+
+		auto unlink = [&](uint32_t client_id, uint64_t key) {
+			auto c = client_paths.find(client_id);
+			if (c == client_paths.end()) { return; }
+
+			auto& v = c->second;
+			v.erase(std::remove(v.begin(), v.end(), key), v.end());
+			if (v.empty()) { client_paths.erase(c); }
+		};
+		// 送信元を覚える（上限に達していたら覚えずに nullptr）
+		auto learn = [&](const sockaddr_in& addr, const in_addr& local, const ECHO_PACKET& p) -> ECHO_PEER* {
+			const uint64_t	key = echo_peer_key(addr);
+			auto			it = peers.find(key);
+
+			if (it == peers.end()) {
+				if (peers.size() >= ECHO_MAX_PEERS) { return nullptr; }
+				it = peers.emplace(key, ECHO_PEER{ addr, local, 0, p.header.device_id, now_ns }).first;
+				pdebug_th("new peer : %s:%d, device_id = %d, client_id = %08x\n",
+					inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), p.header.device_id, p.client_id);
+			}
+			ECHO_PEER&	e = it->second;
+
+			// 初めての送信元か、同じアドレスとポートでクライアントが入れ替わった
+			if (e.client_id != p.client_id || (p.client_id != 0 && client_paths.count(p.client_id) == 0)) {
+				if (e.client_id != 0) { unlink(e.client_id, key); }
+				e.client_id = p.client_id;
+				if (p.client_id != 0) {
+					auto&	v = client_paths[p.client_id];
+					if (v.size() < ECHO_MAX_CLIENT_PATHS) { v.push_back(key); }
+				}
+			}
+			e.local = local;
+			e.device_id = p.header.device_id;
+			e.seen_ns = now_ns;
+			return &e;
+		};
+		auto sweep = [&]() {
+			{
+				std::lock_guard<std::mutex>	lock(probe_mtx);
+				for (auto it = probe_sources.begin(); it != probe_sources.end(); ) {
+					if (now_ns - it->second.seen_ns < ECHO_PEER_EXPIRE_NS) { ++it; continue; }
+					it = probe_sources.erase(it);
+				}
+			}
+			for (auto it = peers.begin(); it != peers.end(); ) {
+				if (now_ns - it->second.seen_ns < ECHO_PEER_EXPIRE_NS) { ++it; continue; }
 
-		std::unique_ptr<ECHO_PACKET>	buf(new ECHO_PACKET);
-		std::vector<CONNECTIONS>		conns;
+				pdebug_th("peer expired : %s:%d\n", inet_ntoa(it->second.addr.sin_addr), ntohs(it->second.addr.sin_port));
+				if (it->second.client_id != 0) { unlink(it->second.client_id, it->first); }
+				it = peers.erase(it);
+				mgmt_expired.fetch_add(1, std::memory_order_relaxed);
+			}
+			mgmt_peers.store(peers.size(), std::memory_order_relaxed);
+		};
+		auto add_reply = [&](int& ntx, void *p, size_t len, const sockaddr_in *to, const in_addr& from) {
+			tx_iov[ntx] = { p, len };
+			memset(&tx_msgs[ntx], 0, sizeof(mmsghdr));
+			tx_msgs[ntx].msg_hdr.msg_name		= (void*)to;
+			tx_msgs[ntx].msg_hdr.msg_namelen	= sizeof(sockaddr_in);
+			tx_msgs[ntx].msg_hdr.msg_iov		= &tx_iov[ntx];
+			tx_msgs[ntx].msg_hdr.msg_iovlen		= 1;
+			if (from.s_addr != htonl(INADDR_ANY)) {
+				set_pktinfo(tx_msgs[ntx].msg_hdr, &tx_ctrl[ntx * PKTINFO_SPACE], PKTINFO_SPACE, from);
+			}
+			ntx++;
+		};
+		// 接続先の問い合わせには、受け取ったものに一覧を入れてそのまま返す
+		auto answer_endpoints = [&](ENDPOINT_PACKET *p) {
+			p->count = endpoints.size();
+			for (size_t i = 0; i < endpoints.size(); i++) { p->addrs[i] = endpoints[i].s_addr; }
+			mgmt_queries.fetch_add(1, std::memory_order_relaxed);
+		};
+		// 落ちた経路への送信で止まらないよう、待たずに捨てる。失敗したものは飛ばして続ける
+		auto flush = [&](int ntx) {
+			for (int i = 0; i < ntx; ) {
+				const int	sent = sendmmsg(sock_manage, &tx_msgs[i], ntx - i, MSG_DONTWAIT);
+
+				if (sent > 0) {
+					mgmt_replies.fetch_add(sent, std::memory_order_relaxed);
+					i += sent;
+					continue;
+				}
+				const sockaddr_in	*to = (const sockaddr_in*)tx_msgs[i].msg_hdr.msg_name;
+				perror_th("sendmmsg");
+				print_error_th("FAILED reply echo : %s:%d\n", inet_ntoa(to->sin_addr), ntohs(to->sin_port));
+				i++;
+			}
+		};
 
-		// TODO エラー処理
-		this->_SetupSocket(sock_manage, PORT_PING);
+		this->_BlockSignals();
+		lowlat_pin_thread(lowlat, THREAD_ECHO, "echo");
 
 		while (true) {
 			FD_ZERO(&rfds);
 			FD_SET(sock_manage, &rfds);
+			tv.tv_sec  = ECHO_SWEEP_NS / 1000000000ULL;
+			tv.tv_usec = 0;
 
-			// データ到着まで待機
-			if (select(sock_manage + 1, &rfds, NULL, NULL, NULL) < 0) {
+			// データ到着まで待機（来なくても時々は古い送信元を忘れる）
+			if (select(sock_manage + 1, &rfds, NULL, NULL, &tv) < 0) {
 				if (errno == EINTR) continue;
 
 				perror_th("select()");
 				print_error_th("errno = %d\n", errno);
 				return false;
 			}
-			if (FD_ISSET(sock_manage, &rfds)) {
-				n = recvfrom(
-						sock_manage, buf.get(), sizeof(ECHO_PACKET),
-						MSG_WAITALL, (sockaddr*)&addr_from, &addr_len
-					);
-				if (n < 0) {
-					perror_th("recvfrom returned error");
-					continue;
-				}
-				if (strncmp(buf->header.signature, SIGNATURE_MANAGEMENT, sizeof(buf->header.signature)) != 0) {
-					pdebug_th("signature is not valid\n");
-					continue;
-				}
-				if (strncmp(buf->signature, SIGNATURE_ECHO, sizeof(buf->signature)) != 0) {
-					pdebug_th("signature is not valid\n");
-					continue;
-				}
-				const auto it = std::find_if(conns.begin(), conns.end(),
-					[&](const CONNECTIONS& c){ return buf->header.device_id == c.device_id; }
-				);
-				if (it != conns.end()) {
-					// 前に同じデバイスIDから接続されたことがあるので情報を更新
-					it->addr = addr_from;
-					it->connected_time = system_clock::now();
+			now_ns = monotonic_ns();
+			if (now_ns - swept_ns >= ECHO_SWEEP_NS) {
+				swept_ns = now_ns;
+				sweep();
+			}
+			if (!FD_ISSET(sock_manage, &rfds)) { continue; }
+
+			while (true) {
+				for (int i = 0; i < ECHO_BATCH; i++) {
+					rx_iov[i] = { &rx[i], sizeof(MGMT_SLOT) };
+					memset(&rx_msgs[i], 0, sizeof(mmsghdr));
+					rx_msgs[i].msg_hdr.msg_name		= &rx_addr[i];
+					rx_msgs[i].msg_hdr.msg_namelen	= sizeof(sockaddr_in);
+					rx_msgs[i].msg_hdr.msg_iov		= &rx_iov[i];
+					rx_msgs[i].msg_hdr.msg_iovlen	= 1;
+					rx_msgs[i].msg_hdr.msg_control		= rx_ctrl[i];
+					rx_msgs[i].msg_hdr.msg_controllen	= sizeof(rx_ctrl[i]);
 				}
-				else {
-					// 初めてのデバイスIDからなので情報を追加
-					CONNECTIONS	c = { system_clock::now(), addr_from, buf->header.device_id };
-					conns.emplace_back(std::move(c));
+				const int	n = recvmmsg(sock_manage, rx_msgs, ECHO_BATCH, MSG_DONTWAIT, NULL);
+				int			ntx = 0;
+
+				if (n < 0) {
+					if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) { perror_th("recvmmsg"); }
+					break;
 				}
-				for (const auto& c : conns) {
-					n = sendto(
-						sock_manage, buf.get(), sizeof(ECHO_PACKET), 0,
-						(sockaddr*)&c.addr, sizeof(c.addr)
-					);
-					if (n < 0) {
-						perror_th("sendto");
-						print_error_th(
-							"FAILED reply echo : %s:%d\n",
-							inet_ntoa(c.addr.sin_addr), ntohs(c.addr.sin_port)
-						);
+				now_ns = monotonic_ns();
+
+				for (int i = 0; i < n; i++) {
+					ECHO_PACKET		*p = &rx[i].echo;
+					const in_addr	local = get_pktinfo(rx_msgs[i].msg_hdr);
+
+					if (rx_msgs[i].msg_len == sizeof(ENDPOINT_PACKET) &&
+						strncmp(rx[i].endpoints.header.signature, SIGNATURE_MANAGEMENT, sizeof(p->header.signature)) == 0 &&
+						strncmp(rx[i].endpoints.signature, SIGNATURE_ENDPOINTS, sizeof(rx[i].endpoints.signature)) == 0) {
+						answer_endpoints(&rx[i].endpoints);
+						add_reply(ntx, &rx[i], sizeof(ENDPOINT_PACKET), &rx_addr[i], local);
+						continue;
+					}
+					if (rx_msgs[i].msg_len != sizeof(ECHO_PACKET) ||
+						strncmp(p->header.signature, SIGNATURE_MANAGEMENT, sizeof(p->header.signature)) != 0 ||
+						strncmp(p->signature, SIGNATURE_ECHO, sizeof(p->signature)) != 0) {
+						pdebug_th("signature is not valid\n");
+						mgmt_invalid.fetch_add(1, std::memory_order_relaxed);
+						continue;
+					}
+					mgmt_probes.fetch_add(1, std::memory_order_relaxed);
+					{
+						std::lock_guard<std::mutex>	lock(probe_mtx);
+						const uint64_t	key = probe_source_key(rx_addr[i].sin_addr, p->header.device_id);
+
+						if (probe_sources.size() < ECHO_MAX_PEERS || probe_sources.count(key) > 0) {
+							probe_sources[key] = { p->client_id, now_ns };
+						}
+					}
+
+					const ECHO_PEER	*from = learn(rx_addr[i], local, *p);
+
+					add_reply(ntx, p, sizeof(ECHO_PACKET), &rx_addr[i], local);
+					if (from == nullptr || from->client_id == 0) { continue; }
+
+					// 同じクライアントの、最近プローブが届いている他の経路にも返す
+					const auto	c = client_paths.find(from->client_id);
+					int			fanout = 0;
+
+					if (c == client_paths.end()) { continue; }
+					for (const uint64_t key : c->second) {
+						if (fanout >= ECHO_REPLY_FANOUT) { break; }
+
+						const auto	e = peers.find(key);
+						if (e == peers.end() || &e->second == from || now_ns - e->second.seen_ns >= SERVER_PATH_STALE_NS) { continue; }
+						add_reply(ntx, p, sizeof(ECHO_PACKET), &e->second.addr, e->second.local);
+						fanout++;
 					}
 				}
+				flush(ntx);
+				mgmt_peers.store(peers.size(), std::memory_order_relaxed);
+
+				if (n < ECHO_BATCH) { break; }
 			}
 		}
 	}));
@@ -129,45 +426,93 @@ std::unique_ptr<std::thread> MPUDPTunnelServer::_StartEchoThread() {
 #undef	pdebug_th
 }
 
-ssize_t MPUDPTunnelServer::RecvFrom(sockaddr_in *addr_from) {
-	TUN_HEADER	*phead = (TUN_HEADER*)this->GetHeader();
-	sockaddr_in	addr;
-	socklen_t	addr_len = sizeof(addr);
-	ssize_t		nread = -1;
+void MPUDPTunnelServer::PrintStats() {
+	MPUDPTunnel::PrintStats();
+	print_info("management: %llu probes, %llu replies, %llu invalid, %llu peers (%llu expired), %llu endpoint queries\n",
+		(unsigned long long)mgmt_probes.load(), (unsigned long long)mgmt_replies.load(),
+		(unsigned long long)mgmt_invalid.load(), (unsigned long long)mgmt_peers.load(),
+		(unsigned long long)mgmt_expired.load(), (unsigned long long)mgmt_queries.load());
+	if (!downlink.Duplicating() || downlink.striped > 0) { downlink.PrintStats(); }
+}
 
-	nread = recvfrom(
-		sock_recv, phead, sizeof(TUN_HEADER),
-		MSG_PEEK, (sockaddr*)&addr, &addr_len
-	);
-	if (nread < 0) {
-		throw std::runtime_error("recvfrom returned an invalid value");
-	}
+/*
+ * RX 側：送信元のアドレスとポートで経路を引く（RX スレッドだけが持つ rx_paths）
+ * 新しい送信元、デバイスIDが変わった送信元、SERVER_PEER_REFRESH_NS ぶり の送信元は TX に知らせて
+ * 返信リスト（connection_list と socks）を更新させる。以前は受信したフレームごとに返信リストを更新していた
+ */
+RX_PATH* MPUDPTunnelServer::_RxPath(int source, const RX_FRAME& f) {
+	const TUN_HEADER	*phead = (const TUN_HEADER*)f.data;
+	const uint64_t		now = f.rx_ns;
 
-	// パケット分割に備え、対向側が TUN_HEADER に書き込んだデータ長を読み切るまで待機
-	nread = recvfrom(
-		sock_recv, phead, sizeof(TUN_HEADER) + phead->length,
-		MSG_WAITALL, (sockaddr*)&addr, &addr_len
+	auto	it = std::find_if(rx_paths.begin(), rx_paths.end(),
+		[&f](const RX_PATH& p) { return is_same_addr(p.addr, f.addr); }
 	);
-	if (nread < 0) {
-		throw std::runtime_error("recvfrom returned an invalid value");
+	if (it == rx_paths.end()) {
+		// しばらく受信していない送信元は忘れる（TX 側の返信リストも同じくらいで消える）
+		rx_paths.erase(std::remove_if(rx_paths.begin(), rx_paths.end(),
+			[now](const RX_PATH& p) { return now - p.seen_ns >= SERVER_PEER_EXPIRE_NS; }), rx_paths.end()
+		);
+		this->_RxExpireSessions(now);
+
+		char	name[32];
+		snprintf(name, sizeof(name), "%s:%d", inet_ntoa(f.addr.sin_addr), ntohs(f.addr.sin_port));
+		rx_paths.emplace_back(name, -1, f.addr, phead->device_id);
+		it = rx_paths.end() - 1;
 	}
-	if (addr_from != nullptr) {
-		*addr_from = addr;
+	// どのクライアントの経路か（重複排除をクライアントごとに分ける）。わかるまでは SERVER_PATH_CHECK_NS ごとに引き直す
+	if (now - it->looked_ns >= ((it->session == nullptr) ? SERVER_PATH_CHECK_NS : SERVER_PEER_REFRESH_NS)) {
+		const uint32_t	client_id = this->_ProbeClient(f.addr.sin_addr, phead->device_id);
+
+		it->looked_ns = now;
+		if (client_id != 0 && (it->session == nullptr || it->session->client_id != client_id)) {
+			it->session = this->_RxSession(client_id);
+			it->posted_ns = 0;	// TX にもすぐ知らせる（NACK をこの経路に送るように）
+		}
+	}
+	if (it->device_id == phead->device_id && now - it->posted_ns < SERVER_PEER_REFRESH_NS) {
+		return &*it;
 	}
-	return nread;
+	const PIPE_PEER_INFO	info = { f.local, (it->session != nullptr) ? it->session->client_id : 0 };
+
+	it->device_id = phead->device_id;
+	if (this->_Post(PIPE_PEER, -1, &f.addr, phead->device_id, &info, sizeof(info))) { it->posted_ns = now; }
+	return &*it;
+}
+
+uint32_t MPUDPTunnelServer::_ProbeClient(const in_addr& addr, int32_t device_id) {
+	std::lock_guard<std::mutex>	lock(probe_mtx);
+	const auto	it = probe_sources.find(probe_source_key(addr, device_id));
+
+	return (it == probe_sources.end()) ? 0 : it->second.client_id;
 }
 
 // 今までにない経路からの通信なら返信リストに登録
 // デバイスIDが同じでも、ポート番号などアドレス情報が変わっていれば更新
-void MPUDPTunnelServer::_RefreshConnection(sockaddr_in& addr_from) {
+// 返信は届いた側の自アドレス（local）から送る（待ち受けアドレスが複数あっても、クライアントの経路の接続先から返るように）
+void MPUDPTunnelServer::_RefreshConnection(const sockaddr_in& addr_from, const in_addr& local, int32_t device_id, uint32_t client_id) {
 	using namespace std::chrono;
 
-	TUN_HEADER	*phead = this->GetHeader();
-
-	// 接続リストに今回の接続のデバイスIDで検索をかける
+	// 同じ送信元からの接続は、デバイスIDが変わっても同じ経路（クライアントが -U で入れ替わると、
+	// ソケットの番号＝デバイスIDが変わり、別の経路の古いデバイスIDと重なることもある）
 	auto conn_it = std::find_if(connection_list.begin(), connection_list.end(),
-		[phead](const CONNECTIONS& c) { return phead->device_id == c.device_id; }
+		[&addr_from](const CONNECTIONS& c) { return is_same_addr(c.addr, addr_from); }
 	);
+	if (conn_it != connection_list.end() && conn_it->device_id != device_id) {
+		pdebug("device_id changed : %d -> %d\n", conn_it->device_id, device_id);
+		conn_it->device_id = device_id;
+		conn_it->probed = false;	// プローブも新しいデバイスIDで届く
+	}
+	// 接続リストに今回の接続のデバイスIDで検索をかける（別のクライアントとわかっている経路は同じデバイスIDでも別の経路）
+	if (conn_it == connection_list.end()) {
+		conn_it = std::find_if(connection_list.begin(), connection_list.end(),
+			[this, device_id, client_id](const CONNECTIONS& c) {
+				if (device_id != c.device_id) { return false; }
+
+				const SOCKET_PACK	*s = this->_FindPath(c.addr);
+				return client_id == 0 || s == nullptr || s->client_id == 0 || s->client_id == client_id;
+			}
+		);
+	}
 	// 過去に接続されたデバイスからのデータか？
 	if (conn_it == connection_list.end()) {
 		pdebug("new routes\n");
@@ -176,12 +521,17 @@ void MPUDPTunnelServer::_RefreshConnection(sockaddr_in& addr_from) {
 
 		s.sock_fd = this->sock_recv;
 		s.remote_addr = addr_from;
+		s.local_addr = { AF_INET, 0, local, {} };
+		s.pin_src = (local.s_addr != htonl(INADDR_ANY));
+		s.client_id = client_id;
 		this->socks.emplace_back(std::move(s));
 
 		c.addr = addr_from;
-		c.device_id = phead->device_id;
+		c.device_id = device_id;
+		c.probed = false;
 		c.connected_time = system_clock::now();
 		this->connection_list.emplace_back(c);
+		downlink.OnPathsChanged();
 	}
 	else {
 		// 同じデバイスIDからの接続
@@ -196,6 +546,16 @@ void MPUDPTunnelServer::_RefreshConnection(sockaddr_in& addr_from) {
 			);
 			if (sock_it != socks.end()) {
 				sock_it->remote_addr = addr_from;
+				sock_it->local_addr.sin_addr = local;
+				sock_it->pin_src = (local.s_addr != htonl(INADDR_ANY));
+			}
+		}
+		// RX がクライアントを引けた（NACK はそのクライアントの経路にだけ送る）
+		if (client_id != 0) {
+			SOCKET_PACK	*s = this->_FindPath(addr_from);
+			if (s != nullptr && s->client_id != client_id) {
+				s->client_id = client_id;
+				downlink.OnPathsChanged();	// 下りの経路選択はクライアントごと
 			}
 		}
 		// 接続時間の更新
@@ -237,15 +597,81 @@ void MPUDPTunnelServer::_RefreshConnection(sockaddr_in& addr_from) {
 	if (sock_end != socks.end()) {
 		std::for_each(sock_end, socks.end(), [](SOCKET_PACK& s){ s.sock_fd = -1; });
 		socks.erase(sock_end, socks.end());
+		downlink.OnPathsChanged();
 	}
 	return;
 }
 
+// 送信元のアドレスとポートから経路を引く（全経路が同じソケットなので device_id では区別できない）
+SOCKET_PACK* MPUDPTunnelServer::_FindPath(const sockaddr_in& addr) {
+	for (auto& s : socks) {
+		if (s.remote_addr.sin_addr.s_addr == addr.sin_addr.s_addr && s.remote_addr.sin_port == addr.sin_port) {
+			return &s;
+		}
+	}
+	return nullptr;
+}
+
+// クライアントからのプローブが途絶えた経路を送信先から外す（プローブが戻れば再び使う）
+// 一度もプローブを受け取っていない経路はそのまま使う
+void MPUDPTunnelServer::_RefreshPathState(uint64_t now) {
+	if (now - paths_checked_ns < SERVER_PATH_CHECK_NS) { return; }
+	paths_checked_ns = now;
+
+	std::lock_guard<std::mutex>	lock(probe_mtx);
+
+	for (auto& c : connection_list) {
+		const auto	p = probe_sources.find(probe_source_key(c.addr.sin_addr, c.device_id));
+		const bool	up = (p != probe_sources.end()) ? (now - p->second.seen_ns < SERVER_PATH_STALE_NS) : !c.probed;
+
+		c.probed |= (p != probe_sources.end());
+
+		auto sock_it = std::find_if(socks.begin(), socks.end(),
+			[&c](const SOCKET_PACK& s) { return is_same_addr(c.addr, s.remote_addr); }
+		);
+		if (sock_it == socks.end() || sock_it->path_up == up) { continue; }
+
+		sock_it->path_up = up;
+		print_info("path to %s:%d (device_id = %d) is %s\n",
+			inet_ntoa(c.addr.sin_addr), ntohs(c.addr.sin_port), c.device_id, up ? "back" : "down");
+	}
+}
+
+// 下りの経路選択（-D）に従って送る。１本なら MODE_SPEED、複製するなら MODE_STABLE
+ssize_t MPUDPTunnelServer::_SendDownlink(uint64_t now, uint16_t data_len) {
+	if (this->_Striping(data_len)) {
+		const size_t	chunks = (size_t)STRIPE_MAX_CHUNKS * downlink.Clients();
+
+		if (dl_paths.size() < chunks) { dl_paths.resize(chunks); }
+		if (dl_lens.size() < chunks) { dl_lens.resize(chunks); }
+
+		const int	n = downlink.Stripe(now, stripe, data_len, dl_paths.data(), dl_lens.data());
+		ssize_t		nwrite;
+
+		if (n == 0) { return 0; }
+		nwrite = this->SendStriped(dl_paths.data(), dl_lens.data(), n, data_len);
+		downlink.OnStriped(now, dl_paths.data(), dl_lens.data(), n);
+		return nwrite;
+	}
+	if (downlink.Duplicating()) { return this->SendToAllDevices(data_len); }
+
+	if (dl_paths.size() < socks.size()) { dl_paths.resize(socks.size()); }
+
+	const int	n = downlink.Select(now, this->GetTxDataPtr(), data_len, dl_paths.data());
+	ssize_t		nwrite;
+
+	if (n == 0) { return 0; }
+	nwrite = (n == 1) ? this->SendTo(*dl_paths[0], data_len) : this->SendToDevices(dl_paths.data(), n, data_len);
+	downlink.OnSent(now, dl_paths.data(), n, data_len);
+	return nwrite;
+}
+
 /*
- * サーバーモード
+ * サーバーモード送信ループ（TX スレッド）
  * サーバーモードでは、ソケットリストは経路情報だけを格納するものとして用い、
  * データの送受信には用いない（代わりに待ち受けソケットを用いる）
- * 転送モードはSTABLE、受信側で stable_id を確認して重複したものは破棄する
+ * 転送モードは既定では STABLE、受信側で stable_id を確認して重複したものは破棄する（-D で経路を選んで送れる）
+ * 受信は RX スレッド（pipeline.cpp）が行い、新しい送信元や制御フレームは RX からの依頼として受け取る
  */
 bool MPUDPTunnelServer::MainLoop() {
 	fd_set	rfds;
@@ -253,36 +679,69 @@ bool MPUDPTunnelServer::MainLoop() {
 
 	int		nread, nwrite;
 	int		tun_seq = 0;
+	uint64_t	t_start, wait_ns = 0;
+	timeval		tv;
+	bool		tun_ready;
 
-	auto	phead = this->GetHeader();
-	auto	pdata = this->GetDataPtr();
-
-	max_fd = max(sock_tun, sock_recv);
+	uint8_t	*ptx;	// TUN から読んだパケット（送るたびに次の場所に変わる）
 
 	while (true) {
+		if (_global_fDumpStats) {
+			_global_fDumpStats = 0;
+			this->DumpStats();
+		}
+		this->_TxDrainPipe();
+
+		// -D weighted / latency：送れる経路がない間は TUN から読まない（パケットは TUN のキューに溜まる）
+		tun_ready = downlink.Ready(monotonic_ns(), wait_ns);
+		if (tun_ready) { wait_ns = UINT64_MAX; }
+
 		FD_ZERO(&rfds);
-		FD_SET(sock_tun,  &rfds);
-		FD_SET(sock_recv, &rfds);
+		if (tun_ready) { FD_SET(sock_tun, &rfds); }
+		FD_SET(this->_TxWakeFd(), &rfds);
+		max_fd = max(sock_tun, this->_TxWakeFd());
+		if (this->_UpgradeFd() != -1) {
+			FD_SET(this->_UpgradeFd(), &rfds);
+			max_fd = max(max_fd, this->_UpgradeFd());
+		}
 
-		// データ到着まで待機
-		if (select(max_fd + 1, &rfds, NULL, NULL, NULL) < 0) {
-			if (errno == EINTR) continue;
+		// データ到着まで待機（RX からの依頼が来ていれば待たない。-L spin なら眠らずに読みに行く）
+		if (!lowlat.spin) {
+			if (this->_TxSleepBegin()) { wait_ns = 0; }
+			tv.tv_sec  = wait_ns / 1000000000ULL;
+			tv.tv_usec = (wait_ns % 1000000000ULL) / 1000;
+			if (select(max_fd + 1, &rfds, NULL, NULL, (wait_ns == UINT64_MAX) ? NULL : &tv) < 0) {
+				this->_TxSleepEnd(false);
+				if (errno == EINTR) continue;
 
-			perror("select()");
-			print_error("errno = %d\n", errno);
-			return false;
+				perror("select()");
+				print_error("errno = %d\n", errno);
+				return false;
+			}
+			this->_TxSleepEnd(FD_ISSET(this->_TxWakeFd(), &rfds));
+			if (this->_UpgradeFd() != -1 && FD_ISSET(this->_UpgradeFd(), &rfds)) { this->_OnUpgradeRequest(); }
 		}
-		if (FD_ISSET(sock_tun, &rfds)) {
+		else {
+			this->_PollUpgrade(monotonic_ns());
+		}
+		if (tun_ready && (lowlat.spin || FD_ISSET(sock_tun, &rfds))) {
 			try {
-				pdebug("\n===== TUN DEVICE RECEIVED DATA =====\n");
-				std::lock_guard<std::mutex>	lock(buf_mtx);
-
-				nread = tun_eread(this->sock_tun, (void*)pdata, BUFSIZE);
-				pdebug_tunrecv(tun_seq, nread, pdata);
+				ptx = this->GetTxDataPtr();
+				nread = lowlat.spin ? tun_nbread(this->sock_tun, (void*)ptx, this->_TunReadSize()) : tun_eread(this->sock_tun, (void*)ptx, this->_TunReadSize());
+				if (nread == 0) {
+					cpu_relax();
+					continue;
+				}
+				t_start = monotonic_ns();
+				trace_debug(TEV_TUN_RECV, tun_seq, nread, 0, 0, 0, 0, ptx, nread);
+				capture_tap(CAPTURE_IF_TUN, CAPTURE_DIR_OUT, ptx, nread, -1, this->GetSeq(), 0);
 				tun_seq++;
 
 				// それぞれのソケットリストに書かれたアドレスへパケットを送信
-				nwrite = this->SendToAllDevices(nread);
+				this->_ArqOnTunRead(t_start, nread);
+				this->_RefreshPathState(t_start);
+				nwrite = this->_SendDownlink(t_start, nread);
+				hist_tx.record(monotonic_ns() - t_start);
 				if (nwrite == 0) {
 					pdebug("No connection exists\n");
 				}
@@ -292,29 +751,9 @@ bool MPUDPTunnelServer::MainLoop() {
 				print_error("%s: %s - the data will be discarded. Continue.\n", e.what());
 			}
 		}
-		if (FD_ISSET(sock_recv, &rfds)) {
-			/*
-			 * 待受中のソケットにデータが入った
-			 */
-			try {
-				pdebug("\n===== ETH DEVICE RECEIVED DATA =====\n");
-				std::lock_guard<std::mutex>		lock(buf_mtx);
-				sockaddr_in	addr_from;
-
-				nread = this->RecvFrom(&addr_from);
-				this->_RefreshConnection(addr_from);
-
-				pdebug_ethrecv(phead->seq_all, nread, (uint8_t*)phead, addr_from);
-
-				nwrite = tun_ewrite(sock_tun, pdata, phead->length);
-				pdebug("packet was sent to tun seq=%d : write %lu bytes\n", phead->seq_all, nwrite);
-			}
-			catch (std::exception &e) {
-				perror("recvfrom / ewrite");
-				pdebug("errno = %d\n", errno);
-				print_error("%s - the data will be discarded. Continue.\n", e.what());
-			}
+		else if (lowlat.spin) {
+			cpu_relax();
 		}
 	}
 	return true;
-}
\ No newline at end of file
+}
@@ -0,0 +1,677 @@
+/*
+ * 経路トレースを再生するシミュレータ
+ * 経路ごとの RTT・損失率・帯域の時間変化（pathtrace.h、クライアントの -T で記録できる）を仮想時刻で再生し、
+ * トンネル本体と同じ送信側の経路選択（path_scheduler）と輻輳制御（PATH_CC）、経路の計測（PATH_METRICS）、
+ * 受信側の重複排除（seq_window）と抜け・順序入れ替わりの監視（arq_tracker）、片道遅延の報告（OWD_ESTIMATOR）、
+ * 受信報告（FEEDBACK_ESTIMATOR）を通す。
+ * 送信方針ごとに同じトレース・同じ乱数で走らせ、goodput、遅延の百分位点、帯域のオーバーヘッドを並べる。
+ *   mpsim.out -t trace [-m policy,...] [-r mbps] [-f flows] [-l bytes] [-b kbps] [-q ms] [-d sec] [-s seed] [-C budget]... [-v]
+ *   policy : speed / stable / adaptive。+flow でフロー単位の経路固定（-F）、+arq で選択的再送（-R proto=all）
+ *            既定は speed,stable,adaptive,adaptive+flow
+ *   budget : 経路の費用と上限（クライアントの -C と同じ。dev はトレースの経路の名前）
+ * 経路のモデル
+ *   行き（クライアント → サーバー）：帯域 rate_kbps のボトルネックと深さ -q のキュー（超えたら捨てる）、
+ *   損失率 loss_permille のランダム損失、RTT の半分の伝搬遅延。経路の中で順序は入れ替わらない。
+ *   帰り（プローブの応答、片道遅延の報告、受信報告、NACK）：RTT の半分の伝搬遅延とランダム損失だけ。
+ *   プローブはエコースレッドと同じ間隔・タイムアウト・経路断の判定で送る（RTT にはボトルネックのキューも乗る）。
+ * 送信元は -f 本の UDP フローで、合わせて -r Mbps を一定間隔で TUN に書く（TUN のキューが溢れたら捨てる）。
+ * 経路断のときに送信済みパケットを送り直す処理（_RescuePath）と rtnetlink による経路の出し入れは再現しない。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <queue>
+#include <deque>
+#include <random>
+
+#include "print.h"
+#include "network.h"
+#include "seqwindow.h"
+#include "ippacket.h"
+#include "arq.h"
+#include "owd.h"
+#include "feedback.h"
+#include "pathtrace.h"
+#include "scheduler.h"
+
+// トンネル本体の main.cpp のかわり（リンクするモジュールが参照する）
+bool _global_fDebug;
+volatile sig_atomic_t	_global_fDumpStats;
+
+#define	SIM_START_NS		(1000ULL * 1000 * 1000)	// 仮想時刻の起点（0 を「まだない」に使っている計測値があるので）
+#define	SIM_DRAIN_NS		(2000ULL * 1000 * 1000)	// 送信元を止めてから、届きかけのパケットを待つ時間
+#define	SIM_TUN_QUEUE		500		// TUN のキュー（txqueuelen の既定値）
+#define	SIM_DEFAULT_RTT_US	20000	// トレースに RTT がない経路
+#define	SIM_DEFAULT_SECONDS	10		// トレースが１時点だけのとき
+#define	SIM_BORN_SLOTS		65536	// 送信時刻を覚えておくパケットの数（これより遅れて届いたものは遅延を数えない）
+
+typedef enum _SIM_EVENT_TYPE {
+	EV_TRACE,		// seq = トレースの変化点の添字
+	EV_SOURCE,		// seq = フロー
+	EV_TX_WAKE,		// 輻輳制御の待ちが明けた
+	EV_ARRIVE,		// データのフレームがサーバーに届いた（a = seq_dev）
+	EV_PROBE,		// seq = プローブの世代（古ければ捨てる）
+	EV_PROBE_REPLY,	// a = RTT（マイクロ秒）
+	EV_PROBE_LOST,
+	EV_OWD_REPORT,	// a, b = qdelay_us, trend_us、seq = samples
+	EV_FEEDBACK,	// seq = path_sim::reports の添字
+	EV_NACK_POLL,
+	EV_NACK			// seq, len = NACK_RANGE
+} SIM_EVENT_TYPE;
+
+typedef struct _SIM_EVENT {
+	uint64_t	t;
+	uint64_t	order;		// 同じ時刻のイベントは起きた順に
+	uint8_t		type;
+	uint32_t	path;
+	uint32_t	seq;
+	uint32_t	len;
+	uint32_t	tx_us;		// EV_ARRIVE：TUN_HEADER::tx_us
+	int32_t		a, b;
+
+	inline bool operator>(const _SIM_EVENT& o) const { return (t != o.t) ? t > o.t : order > o.order; }
+} SIM_EVENT;
+
+typedef struct _SIM_POLICY {
+	std::string		name;
+	TRANSMIT_MODE	mode;
+	bool			flow_pinning;
+	bool			arq;
+} SIM_POLICY;
+
+typedef struct _SIM_CONFIG {
+	PATH_TRACE	trace;
+	uint64_t	duration_ns;
+	double		offered_mbps;
+	uint32_t	flows;
+	uint32_t	packet_len;		// 内側の IP パケット長
+	uint32_t	default_kbps;	// トレースに帯域がない経路
+	uint64_t	queue_ns;		// ボトルネックのキューの深さ（時間）
+	uint64_t	seed;
+	std::vector<BUDGET_CONFIG>	budgets;	// -C
+	bool		verbose;
+} SIM_CONFIG;
+
+// 経路１本分の回線と、エコースレッドがその経路について持っている状態
+typedef struct _SIM_LINK {
+	uint64_t	rtt_ns;
+	uint32_t	loss_permille;
+	uint64_t	rate_kbps;
+	uint64_t	busy_until;		// ボトルネックが空く時刻
+	uint64_t	last_arrival;	// 経路の中で追い越さないように
+
+	uint32_t	probe_gen;
+	uint32_t	lost_in_row;
+	OWD_ESTIMATOR	owd;		// 受信側
+	FEEDBACK_ESTIMATOR	fb;		// 　〃
+
+	uint64_t	sent, lost, dropped;
+} SIM_LINK;
+
+typedef struct _SIM_QUEUED {
+	uint32_t	flow;
+	uint64_t	born_ns;
+} SIM_QUEUED;
+
+typedef struct _SIM_BORN {
+	uint32_t	seq;
+	uint64_t	born_ns;
+} SIM_BORN;
+
+typedef struct _SIM_RESULT {
+	uint64_t	offered, delivered, delivered_bytes, tun_dropped;
+	uint64_t	wire_bytes, duplicates, reordered, resent;
+	uint64_t	flow_switches;
+	uint64_t	reorder_wait_ns;
+	HISTOGRAM_SNAPSHOT	latency;
+} SIM_RESULT;
+
+class path_sim {
+private:
+	const SIM_CONFIG&	conf;
+	const SIM_POLICY&	policy;
+
+	uint64_t	now;
+	uint64_t	order;
+	uint64_t	end_ns;			// 送信元を止める時刻
+	std::priority_queue<SIM_EVENT, std::vector<SIM_EVENT>, std::greater<SIM_EVENT>>	events;
+	std::mt19937_64		rng;
+
+	// クライアント（送信側）
+	std::vector<SOCKET_PACK>	socks;
+	path_scheduler				sched;
+	std::vector<SOCKET_PACK*>	paths;
+	std::deque<SIM_QUEUED>		tunq;
+	std::vector<SIM_BORN>		born;	// アプリの送信時刻（seq_all % SIM_BORN_SLOTS に置く）
+	uint32_t	seq;
+	uint64_t	tx_wake_ns;		// 予約済みの EV_TX_WAKE（0 = なし）
+	std::unique_ptr<arq_store>	arq_tx;
+	uint8_t		pkt[BUFSIZE];
+
+	// サーバー（受信側）
+	std::vector<SIM_LINK>		links;
+	seq_window<SEQ_WINDOW_SIZE>	seq_rec;
+	uint64_t	last_rx_ns;
+	arq_tracker	arq_rx;
+	uint64_t	nack_poll_ns;	// 予約済みの EV_NACK_POLL（0 = なし）
+	uint32_t	highest;		// 届いた最大の seq_all
+	std::vector<FEEDBACK_REPORT>	reports;	// 送った受信報告（イベントには添字だけ載せる）
+	bool		any_delivered;
+	latency_histogram	latency;
+
+	SIM_RESULT	res;
+
+	inline void _Push(uint64_t t, uint8_t type, uint32_t path, uint32_t seq = 0, uint32_t len = 0, int32_t a = 0, int32_t b = 0) {
+		events.push({ t, order++, type, path, seq, len, (uint32_t)(now / 1000), a, b });
+	}
+	inline bool _Lost(uint32_t loss_permille) { return loss_permille >= 1000 || rng() % 1000 < loss_permille; }
+
+	void _ApplyTrace(const TRACE_POINT& pt);
+	void _BuildPacket(uint32_t flow, uint32_t len);
+	void _Transmit(uint32_t path, uint32_t seq_all, uint16_t data_len);
+	void _TxRun();
+	void _WakeTx(uint64_t t);
+	void _Probe(uint32_t path);
+	void _OnProbeReply(uint32_t path, uint32_t rtt_us);
+	void _OnProbeLost(uint32_t path);
+	void _OnArrive(const SIM_EVENT& ev);
+	void _SendBack(uint32_t path, uint8_t type, uint32_t seq, uint32_t len, int32_t a, int32_t b);
+	void _OnNackPoll();
+	void _OnNack(uint32_t path, uint32_t start, uint32_t count);
+
+public:
+	path_sim(const SIM_CONFIG& c, const SIM_POLICY& p);
+	~path_sim();
+
+	void Run(SIM_RESULT& result);
+	void PrintPaths() const;
+};
+
+path_sim::path_sim(const SIM_CONFIG& c, const SIM_POLICY& p) :
+	conf(c), policy(p), now(SIM_START_NS), order(0), end_ns(SIM_START_NS + c.duration_ns), rng(c.seed),
+	sched(socks), seq(0), tx_wake_ns(0), last_rx_ns(0), nack_poll_ns(0), highest(0), any_delivered(false) {
+	const size_t	n = conf.trace.names.size();
+
+	res = SIM_RESULT();
+	born.resize(SIM_BORN_SLOTS);
+	socks.resize(n);
+	links.resize(n);	// 値初期化なので計数は 0 から
+	for (size_t i = 0; i < n; i++) {
+		SOCKET_PACK&	s = socks[i];
+		SIM_LINK&		l = links[i];
+
+		s.eth_name = conf.trace.names[i];
+		s.sock_fd = 1000 + i;	// 使える経路の印（本物の fd ではないので、終わる前に -1 に戻す）
+
+		l.rtt_ns = (uint64_t)SIM_DEFAULT_RTT_US * 1000;
+		l.rate_kbps = conf.default_kbps;
+
+		// 経路の最初の変化点より前は、その値で始める
+		for (const auto& pt : conf.trace.points) {
+			if (pt.path != i) { continue; }
+			this->_ApplyTrace(pt);
+			break;
+		}
+	}
+	// 上限は方針ごとに 0 から数える
+	for (const auto& b : conf.budgets) {
+		for (auto& s : socks) {
+			if (s.eth_name == b.dev) { s.budget = std::make_shared<PATH_BUDGET>(b); }
+		}
+	}
+	paths.resize(max(n, (size_t)2));
+	sched.mode = policy.mode;
+	sched.flow_pinning = policy.flow_pinning;
+	sched.paths_up = n;
+	if (policy.arq) { arq_tx.reset(new arq_store); }
+}
+
+path_sim::~path_sim() {
+	for (auto& s : socks) { s.sock_fd = -1; }
+}
+
+void path_sim::_ApplyTrace(const TRACE_POINT& pt) {
+	SIM_LINK&	l = links[pt.path];
+
+	if (pt.rtt_us != PATH_TRACE_KEEP) { l.rtt_ns = pt.rtt_us * 1000; }
+	if (pt.loss_permille != PATH_TRACE_KEEP) { l.loss_permille = pt.loss_permille; }
+	if (pt.rate_kbps != PATH_TRACE_KEEP && pt.rate_kbps > 0) { l.rate_kbps = pt.rate_kbps; }
+}
+
+// フローごとの IPv4 / UDP パケット（経路選択が覗くのはヘッダだけ）
+void path_sim::_BuildPacket(uint32_t flow, uint32_t len) {
+	const uint16_t	sport = 40000 + flow, dport = 5001, udp_len = len - 20;
+
+	memset(pkt, 0, 28);
+	pkt[0] = 0x45;
+	pkt[2] = len >> 8;				pkt[3] = len & 0xFF;
+	pkt[8] = 64;
+	pkt[9] = IPPROTO_UDP;
+	pkt[12] = 10; pkt[13] = 255; pkt[14] = 0; pkt[15] = 2;
+	pkt[16] = 10; pkt[17] = 255; pkt[18] = 0; pkt[19] = 1;
+	const uint16_t	check = ip_checksum(pkt, 20);
+	memcpy(pkt + 10, &check, sizeof(check));
+	pkt[20] = sport >> 8;			pkt[21] = sport & 0xFF;
+	pkt[22] = dport >> 8;			pkt[23] = dport & 0xFF;
+	pkt[24] = udp_len >> 8;			pkt[25] = udp_len & 0xFF;
+}
+
+// 経路に１フレーム流す：ランダム損失、ボトルネックのキュー（溢れたら捨てる）、伝搬遅延
+void path_sim::_Transmit(uint32_t path, uint32_t seq_all, uint16_t data_len) {
+	SIM_LINK&		l = links[path];
+	const uint32_t	wire = sizeof(TUN_HEADER) + data_len + PATH_UDP_OVERHEAD;
+
+	const uint32_t	seq_dev = socks[path].seq_dev++;	// 途中で落ちても番号は使う
+
+	l.sent++;
+	res.wire_bytes += wire;
+	if (_Lost(l.loss_permille)) {
+		l.lost++;
+		return;
+	}
+	const uint64_t	start = max(now, l.busy_until);
+
+	if (start - now > conf.queue_ns) {
+		l.dropped++;
+		return;
+	}
+	l.busy_until = start + (uint64_t)wire * 8 * 1000 * 1000 / l.rate_kbps;
+	l.last_arrival = max(l.busy_until + l.rtt_ns / 2, l.last_arrival);
+	this->_Push(l.last_arrival, EV_ARRIVE, path, seq_all, data_len, (int32_t)seq_dev);
+}
+
+void path_sim::_WakeTx(uint64_t t) {
+	if (tx_wake_ns != 0 && tx_wake_ns <= t) { return; }
+	tx_wake_ns = t;
+	this->_Push(t, EV_TX_WAKE, 0);
+}
+
+// クライアントの MainLoop の送信部分：経路の状態と計測値を拾い、送れる間は TUN から読んで送る
+void path_sim::_TxRun() {
+	uint64_t	wait_ns;
+
+	while (!tunq.empty()) {
+		for (auto& s : socks) { sched.SetPathUp(s, s.metrics->IsUp()); }
+		sched.OnMetrics(now);
+
+		if (!sched.Ready(now, wait_ns)) {
+			// 使える経路がなければ、プローブで戻るのを待つ
+			if (wait_ns != UINT64_MAX) { this->_WakeTx(now + max(wait_ns, (uint64_t)1000)); }
+			return;
+		}
+		const SIM_QUEUED	q = tunq.front();
+		const uint32_t		len = conf.packet_len;
+
+		tunq.pop_front();
+		this->_BuildPacket(q.flow, len);
+		born[seq % SIM_BORN_SLOTS] = { seq, q.born_ns };
+		if (arq_tx) { arq_tx->push(seq, pkt, len, now, now + (uint64_t)ARQ_DEADLINE_MSEC * 1000 * 1000); }
+
+		const int	n = sched.Select(now, pkt, len, paths.data(), false);
+		for (int i = 0; i < n; i++) { this->_Transmit(paths[i] - socks.data(), seq, len); }
+		sched.OnSent(now, paths.data(), n, len);
+		seq++;
+	}
+}
+
+// エコースレッドのプローブ１回分（間隔とタイムアウトはエコースレッドと同じ PATH_METRICS::ProbeInterval / ProbeTimeout）
+void path_sim::_Probe(uint32_t path) {
+	SIM_LINK&			l = links[path];
+	const PATH_METRICS&	m = *socks[path].metrics;
+	const uint64_t		timeout = m.ProbeTimeout();
+	const uint64_t		rtt = l.rtt_ns + ((l.busy_until > now) ? l.busy_until - now : 0);
+
+	if (socks[path].budget) { socks[path].budget->OnProbe(sizeof(ECHO_PACKET)); }
+	if (_Lost(l.loss_permille) || _Lost(l.loss_permille) || rtt >= timeout) {
+		this->_Push(now + timeout, EV_PROBE_LOST, path);
+	}
+	else {
+		this->_Push(now + rtt, EV_PROBE_REPLY, path, 0, 0, (int32_t)(rtt / 1000));
+	}
+	this->_Push(now + (uint64_t)m.ProbeInterval(now, l.lost_in_row) * 1000 * 1000, EV_PROBE, path, l.probe_gen);
+}
+
+void path_sim::_OnProbeReply(uint32_t path, uint32_t rtt_us) {
+	PATH_METRICS&	m = *socks[path].metrics;
+
+	m.OnRttSample(rtt_us);
+	m.last_ok_ns.store(now, std::memory_order_relaxed);
+	links[path].lost_in_row = 0;
+	m.MarkUp();
+	this->_TxRun();
+}
+
+void path_sim::_OnProbeLost(uint32_t path) {
+	SIM_LINK&		l = links[path];
+	PATH_METRICS&	m = *socks[path].metrics;
+
+	m.OnProbeLost();
+	if (++l.lost_in_row >= PATH_DOWN_LOST_PROBES) { m.MarkDown(); }
+
+	// すぐに次のプローブで確かめる
+	l.probe_gen++;
+	this->_Push(now, EV_PROBE, path, l.probe_gen);
+	this->_TxRun();
+}
+
+// サーバーからクライアントへ（伝搬遅延と損失だけ）
+void path_sim::_SendBack(uint32_t path, uint8_t type, uint32_t seq, uint32_t len, int32_t a, int32_t b) {
+	const SIM_LINK&	l = links[path];
+
+	if (_Lost(l.loss_permille)) { return; }
+	this->_Push(now + l.rtt_ns / 2, type, path, seq, len, a, b);
+}
+
+// サーバーの _RxFrame：受信報告と片道遅延のサンプル、重複排除、抜けの監視
+void path_sim::_OnArrive(const SIM_EVENT& ev) {
+	SIM_LINK&		l = links[ev.path];
+	OWD_REPORT		r;
+	FEEDBACK_REPORT	fr;
+
+	socks[ev.path].metrics->last_data_ns.store(now, std::memory_order_relaxed);
+	l.fb.OnFrame((uint32_t)ev.a, sizeof(TUN_HEADER) + ev.len, ev.tx_us, now);
+	if (l.fb.TakeReport(now, fr)) {
+		reports.push_back(fr);
+		this->_SendBack(ev.path, EV_FEEDBACK, reports.size() - 1, 0, 0, 0);
+	}
+	l.owd.OnSample((uint32_t)(now / 1000) - ev.tx_us, now);
+	if (l.owd.TakeReport(now, r)) { this->_SendBack(ev.path, EV_OWD_REPORT, r.samples, 0, r.qdelay_us, r.trend_us); }
+
+	if (now - last_rx_ns > SEQ_WINDOW_IDLE_NS) { seq_rec.reset(); }
+	last_rx_ns = now;
+	if (!seq_rec.check_and_set(ev.seq)) {
+		res.duplicates++;
+		return;
+	}
+	arq_rx.OnRecv(ev.seq, true, now);	// 抜けと順序入れ替わりの監視は、ARQ を使わなくても回しておく
+
+	res.delivered++;
+	res.delivered_bytes += ev.len;
+	const SIM_BORN&	b = born[ev.seq % SIM_BORN_SLOTS];
+	if (b.seq == ev.seq) { latency.record(now - b.born_ns); }
+	if (any_delivered && (int32_t)(ev.seq - highest) < 0) {
+		res.reordered++;
+	}
+	else {
+		highest = ev.seq;
+		any_delivered = true;
+	}
+	if (arq_tx && arq_rx.Pending() && nack_poll_ns == 0) {
+		nack_poll_ns = now + ARQ_POLL_NS;
+		this->_Push(nack_poll_ns, EV_NACK_POLL, 0);
+	}
+}
+
+// サーバーの _ArqPoll：抜けをまとめて、落ちていない全経路で NACK する
+void path_sim::_OnNackPoll() {
+	NACK_RANGE	ranges[ARQ_MAX_RANGES];
+
+	nack_poll_ns = 0;
+	const int	n = arq_rx.CollectNacks(now, ranges, ARQ_MAX_RANGES);
+
+	for (uint32_t p = 0; p < links.size(); p++) {
+		if (!socks[p].metrics->IsUp()) { continue; }
+		for (int i = 0; i < n; i++) { this->_SendBack(p, EV_NACK, ranges[i].start, ranges[i].count, 0, 0); }
+	}
+	if (arq_rx.Pending()) {
+		nack_poll_ns = now + ARQ_POLL_NS;
+		this->_Push(nack_poll_ns, EV_NACK_POLL, 0);
+	}
+}
+
+// クライアントの _ArqOnNack
+void path_sim::_OnNack(uint32_t path, uint32_t start, uint32_t count) {
+	for (uint32_t k = 0; k < count && k < ARQ_STORE_SIZE; k++) {
+		ARQ_ENTRY	*e = arq_tx->find(start + k);
+
+		if (e == nullptr) { arq_tx->unknown++; continue; }
+		if (now > e->deadline_ns) { arq_tx->expired++; continue; }
+		if (e->resent_ns != 0 && now - e->resent_ns < ARQ_NACK_INTERVAL_NS / 2) { continue; }
+
+		SOCKET_PACK	*s = sched.RepairPath(&socks[path]);
+
+		this->_Transmit(s - socks.data(), e->seq_all, e->length);
+		sched.Charge(*s, now, sizeof(TUN_HEADER) + e->length);
+		e->resent_ns = now;
+		arq_tx->resent++;
+		res.resent++;
+	}
+}
+
+void path_sim::Run(SIM_RESULT& result) {
+	const double	pps = conf.offered_mbps * 1e6 / 8 / conf.packet_len;
+	const uint64_t	interval = (uint64_t)(1e9 * conf.flows / pps);		// フロー１本あたりの送信間隔
+
+	for (uint32_t i = 0; i < conf.trace.points.size(); i++) {
+		this->_Push(SIM_START_NS + conf.trace.points[i].t_ns, EV_TRACE, conf.trace.points[i].path, i);
+	}
+	for (uint32_t f = 0; f < conf.flows; f++) {
+		this->_Push(SIM_START_NS + interval * f / conf.flows, EV_SOURCE, 0, f);
+	}
+	for (uint32_t p = 0; p < links.size(); p++) {
+		this->_Push(SIM_START_NS, EV_PROBE, p, 0);
+	}
+
+	while (!events.empty()) {
+		const SIM_EVENT	ev = events.top();
+
+		events.pop();
+		if (ev.t > end_ns + SIM_DRAIN_NS) { break; }
+		now = ev.t;
+
+		switch (ev.type) {
+		case EV_TRACE:
+			this->_ApplyTrace(conf.trace.points[ev.seq]);
+			break;
+
+		case EV_SOURCE:
+			if (now >= end_ns) { break; }
+			res.offered++;
+			if (tunq.size() >= SIM_TUN_QUEUE) {
+				res.tun_dropped++;
+			}
+			else {
+				tunq.push_back({ ev.seq, now });
+				this->_TxRun();
+			}
+			this->_Push(now + interval, EV_SOURCE, 0, ev.seq);
+			break;
+
+		case EV_TX_WAKE:
+			if (now == tx_wake_ns) { tx_wake_ns = 0; }
+			this->_TxRun();
+			break;
+
+		case EV_ARRIVE:
+			this->_OnArrive(ev);
+			break;
+
+		case EV_PROBE:
+			if (ev.seq == links[ev.path].probe_gen) { this->_Probe(ev.path); }
+			break;
+
+		case EV_PROBE_REPLY:
+			this->_OnProbeReply(ev.path, ev.a);
+			break;
+
+		case EV_PROBE_LOST:
+			this->_OnProbeLost(ev.path);
+			break;
+
+		case EV_OWD_REPORT: {
+			// クライアントの _OnControl（CTRL_OWD）と _OnOwdReport
+			SOCKET_PACK&	s = socks[ev.path];
+
+			s.owd_tx = { ev.a, ev.b, ev.seq };
+			s.owd_tx_ns = now;
+			s.cc.OnOwdReport(now, s.owd_tx.qdelay_us, s.owd_tx.trend_us);
+			break;
+		}
+		case EV_FEEDBACK: {
+			// クライアントの _OnControl（CTRL_FEEDBACK）と _OnFeedback
+			SOCKET_PACK&	s = socks[ev.path];
+
+			if (s.fb.OnReport(reports[ev.seq], now)) { s.cc.OnFeedback(now, s.fb.interval_loss, s.fb.delivery_rate); }
+			break;
+		}
+		case EV_NACK_POLL:
+			this->_OnNackPoll();
+			break;
+
+		case EV_NACK:
+			this->_OnNack(ev.path, ev.seq, ev.len);
+			break;
+		}
+	}
+	res.flow_switches = sched.flow_switches + sched.flow_forced;
+	res.reorder_wait_ns = arq_rx.ReorderWait();
+	res.latency = latency.snapshot();
+	result = res;
+}
+
+void path_sim::PrintPaths() const {
+	for (size_t i = 0; i < socks.size(); i++) {
+		const SIM_LINK&		l = links[i];
+		const PATH_METRICS&	m = *socks[i].metrics;
+
+		printf("    %-10s sent %llu, lost %llu, queue drop %llu, srtt %uus, probe loss %u.%u%%, down %u times, btl_bw %.2fMbps\n",
+			socks[i].eth_name.c_str(), (unsigned long long)l.sent, (unsigned long long)l.lost, (unsigned long long)l.dropped,
+			m.srtt_us.load(), m.loss_permille.load() / 10, m.loss_permille.load() % 10, m.down_count.load(),
+			socks[i].cc.btl_bw * 8 / 1e6);
+		if (socks[i].budget) {
+			printf("    %-10s cost %u, used %.2fMB%s\n", "", socks[i].budget->conf.cost,
+				socks[i].budget->Used() / 1e6, socks[i].budget->Exhausted() ? " (quota exhausted)" : "");
+		}
+	}
+}
+
+static bool parse_policies(const char *arg, std::vector<SIM_POLICY>& policies) {
+	std::string	list(arg);
+	size_t		pos = 0;
+
+	policies.clear();
+	while (pos <= list.size()) {
+		const size_t	end = list.find(',', pos);
+		const std::string	name = list.substr(pos, (end == std::string::npos) ? std::string::npos : end - pos);
+		SIM_POLICY	p = { name, MODE_SPEED, false, false };
+		size_t		k = 0;
+
+		while (k <= name.size()) {
+			const size_t	plus = name.find('+', k);
+			const std::string	tok = name.substr(k, (plus == std::string::npos) ? std::string::npos : plus - k);
+
+			if (k == 0 && tok == "speed") { p.mode = MODE_SPEED; }
+			else if (k == 0 && tok == "stable") { p.mode = MODE_STABLE; }
+			else if (k == 0 && tok == "adaptive") { p.mode = MODE_ADAPTIVE; }
+			else if (k > 0 && tok == "flow") { p.flow_pinning = true; }
+			else if (k > 0 && tok == "arq") { p.arq = true; }
+			else {
+				print_error("unknown policy - %s\n", name.c_str());
+				return false;
+			}
+			if (plus == std::string::npos) { break; }
+			k = plus + 1;
+		}
+		policies.push_back(p);
+		if (end == std::string::npos) { break; }
+		pos = end + 1;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	SIM_CONFIG	conf;
+	std::vector<SIM_POLICY>	policies;
+	const char	*trace_file = NULL;
+	double		seconds = 0;
+	int			option;
+
+	_global_fDebug = false;
+	_global_fDumpStats = 0;
+
+	conf.offered_mbps	= 20;
+	conf.flows			= 4;
+	conf.packet_len		= 1200;
+	conf.default_kbps	= 100000;
+	conf.queue_ns		= 50ULL * 1000 * 1000;
+	conf.seed			= 1;
+	conf.verbose		= false;
+	parse_policies("speed,stable,adaptive,adaptive+flow", policies);
+
+	while ((option = getopt(argc, argv, "t:m:r:f:l:b:q:d:s:C:v")) > 0) {
+		BUDGET_CONFIG	b;
+
+		switch (option) {
+		case 't': trace_file = optarg; break;
+		case 'm': if (!parse_policies(optarg, policies)) { return 1; } break;
+		case 'r': conf.offered_mbps = atof(optarg); break;
+		case 'f': conf.flows = atoi(optarg); break;
+		case 'l': conf.packet_len = atoi(optarg); break;
+		case 'b': conf.default_kbps = atoi(optarg); break;
+		case 'q': conf.queue_ns = strtoull(optarg, NULL, 10) * 1000 * 1000; break;
+		case 'd': seconds = atof(optarg); break;
+		case 's': conf.seed = strtoull(optarg, NULL, 10); break;
+		case 'C': if (!budget_parse_option(b, optarg)) { return 1; } conf.budgets.push_back(b); break;
+		case 'v': conf.verbose = true; break;
+		default:
+			fprintf(stderr, "usage: %s -t trace [-m policy,...] [-r mbps] [-f flows] [-l bytes] [-b kbps] [-q ms] [-d sec] [-s seed] [-C budget]... [-v]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (trace_file == NULL) {
+		print_error("path trace not specified\n");
+		return 1;
+	}
+	if (conf.offered_mbps <= 0 || conf.flows == 0 || conf.default_kbps == 0 ||
+		conf.packet_len < 28 || conf.packet_len > BUFSIZE - sizeof(TUN_HEADER)) {
+		print_error("invalid traffic parameters\n");
+		return 1;
+	}
+	if (!path_trace_load(trace_file, conf.trace)) { return 1; }
+	for (const auto& b : conf.budgets) {
+		if (std::find(conf.trace.names.begin(), conf.trace.names.end(), b.dev) == conf.trace.names.end()) {
+			print_error("path cost: no such path in the trace - %s\n", b.dev.c_str());
+			return 1;
+		}
+	}
+
+	conf.duration_ns = (seconds > 0) ? (uint64_t)(seconds * 1e9) :
+		(conf.trace.duration_ns > 0) ? conf.trace.duration_ns : SIM_DEFAULT_SECONDS * 1000ULL * 1000 * 1000;
+
+	printf("trace %s: %zu paths, %zu points, %.1fs / offered %.1fMbps (%u flows x %u bytes), queue %llums, seed %llu\n",
+		trace_file, conf.trace.names.size(), conf.trace.points.size(), conf.duration_ns / 1e9,
+		conf.offered_mbps, conf.flows, conf.packet_len, (unsigned long long)conf.queue_ns / 1000000, (unsigned long long)conf.seed);
+	printf("%-22s %10s %7s %8s %8s %8s %9s %7s %8s %8s %8s\n",
+		"policy", "goodput", "loss", "p50", "p99", "p99.9", "overhead", "dup", "reorder", "ro-wait", "flow-sw");
+
+	for (const auto& p : policies) {
+		std::unique_ptr<path_sim>	sim(new path_sim(conf, p));
+		SIM_RESULT	r;
+
+		sim->Run(r);
+
+		const double	goodput = r.delivered_bytes * 8 / (conf.duration_ns / 1e9) / 1e6;
+		const double	payload = (double)r.delivered * conf.packet_len;
+
+		printf("%-22s %6.2fMbps %6.2f%% %6.1fms %6.1fms %6.1fms %8.1f%% %6.2f%% %7.2f%% %6.1fms %8llu\n",
+			p.name.c_str(), goodput,
+			(r.offered > 0) ? 100.0 * (r.offered - r.delivered) / r.offered : 0.0,
+			r.latency.p50 / 1e6, r.latency.p99 / 1e6, r.latency.p999 / 1e6,
+			(payload > 0) ? 100.0 * (r.wire_bytes - payload) / payload : 0.0,
+			(r.delivered > 0) ? 100.0 * r.duplicates / r.delivered : 0.0,
+			(r.delivered > 0) ? 100.0 * r.reordered / r.delivered : 0.0,
+			r.reorder_wait_ns / 1e6, (unsigned long long)r.flow_switches);
+		if (conf.verbose) {
+			printf("    offered %llu, delivered %llu, TUN queue drop %llu, resent %llu\n",
+				(unsigned long long)r.offered, (unsigned long long)r.delivered,
+				(unsigned long long)r.tun_dropped, (unsigned long long)r.resent);
+			sim->PrintPaths();
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef	__SPSCRING_H__
+#define	__SPSCRING_H__
+
+#include <atomic>
+#include <array>
+#include <cstddef>
+
+#define	CACHE_LINE_SIZE	64
+
+/*
+ * 単一生産者・単一消費者（SPSC）のロックフリーリングバッファ
+ * push は生産者スレッドだけ、pop は消費者スレッドだけが呼ぶこと。
+ * head（生産者が書く）と tail（消費者が書く）は別のキャッシュラインに置いて false sharing を避ける。
+ * 相手側のインデックスは各自キャッシュしておき、満杯／空に見えたときだけ読み直す。
+ * N は２の冪であること。
+ */
+template<class T, std::size_t N>
+class spsc_ring {
+	static_assert(N >= 2 && (N & (N - 1)) == 0, "N must be a power of two");
+
+private:
+	alignas(CACHE_LINE_SIZE) std::atomic<std::size_t>	_head;	// 次に書き込む位置
+	std::size_t	_tail_cache;	// 生産者側から見た tail
+	alignas(CACHE_LINE_SIZE) std::atomic<std::size_t>	_tail;	// 次に読み出す位置
+	std::size_t	_head_cache;	// 消費者側から見た head
+	alignas(CACHE_LINE_SIZE) std::array<T, N>	_buf;
+
+public:
+	spsc_ring() : _head(0), _tail_cache(0), _tail(0), _head_cache(0) {}
+	spsc_ring(const spsc_ring&) = delete;
+	spsc_ring& operator=(const spsc_ring&) = delete;
+
+	// 満杯なら false（書き込まない）
+	bool push(const T& v) {
+		const std::size_t	h = _head.load(std::memory_order_relaxed);
+
+		if (h - _tail_cache >= N) {
+			_tail_cache = _tail.load(std::memory_order_acquire);
+			if (h - _tail_cache >= N) { return false; }
+		}
+		_buf[h & (N - 1)] = v;
+		_head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	// 空なら false
+	bool pop(T& v) {
+		const std::size_t	t = _tail.load(std::memory_order_relaxed);
+
+		if (t == _head_cache) {
+			_head_cache = _head.load(std::memory_order_acquire);
+			if (t == _head_cache) { return false; }
+		}
+		v = _buf[t & (N - 1)];
+		_tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	// どちらのスレッドから呼んでもよいが、結果は呼んだ瞬間の目安でしかない
+	inline std::size_t size() const {
+		return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+	}
+	inline bool empty() const { return size() == 0; }
+	static constexpr std::size_t capacity() { return N; }
+};
+
+#endif
@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "print.h"
+#include "stripe.h"
+
+bool stripe_parse_option(STRIPE_CONFIG& conf, char *subopts) {
+	enum { OPT_MTU, OPT_MIN };
+	char *const	tokens[] = {
+		(char*)"mtu", (char*)"min", NULL
+	};
+	char	*value;
+
+	conf.enable = true;
+	while (*subopts != '\0') {
+		const int	opt = getsubopt(&subopts, tokens, &value);
+
+		if (opt < 0 || value == NULL) {
+			print_error("invalid stripe option : %s\n", value ? value : "(null)");
+			return false;
+		}
+		const unsigned long	n = strtoul(value, NULL, 10);
+
+		switch (opt) {
+		case OPT_MTU:
+			// 断片は受信バッファ（BUFSIZE）に収まり、TUN_BUFSIZE のパケットが STRIPE_MAX_CHUNKS 個に収まること
+			if (n < STRIPE_MIN_MTU || n > BUFSIZE) {
+				print_error("stripe mtu must be between %d and %d : %s\n", STRIPE_MIN_MTU, BUFSIZE, value);
+				return false;
+			}
+			conf.mtu = (uint16_t)n;
+			break;
+
+		case OPT_MIN:
+			if (n > TUN_BUFSIZE) {
+				print_error("stripe min must be %d or less : %s\n", TUN_BUFSIZE, value);
+				return false;
+			}
+			conf.min = (uint16_t)n;
+			break;
+		}
+	}
+	return true;
+}
+
+/*
+ * 経路 i の滞留を排出し終える時刻 d_i（inflight / btl_bw）のあとに取り分 x_i を送るとして、
+ * 送り終える時刻 T = d_i + x_i / btl_bw がどの経路でも同じになるように x_i を決める（水位合わせ）。
+ * T より前に滞留を排出できない経路は使わない。取り分が小さすぎる経路や断片が多すぎるときは
+ * 最も取り分の小さい経路を外して決め直す。
+ */
+int stripe_plan(const STRIPE_CONFIG& conf, SOCKET_PACK* const *cands, int n, uint32_t data_len, SOCKET_PACK **paths, uint16_t *lens) {
+	const uint32_t	chunk_max = conf.ChunkMax();
+	bool			use[STRIPE_MAX_CHUNKS];
+	double			drain[STRIPE_MAX_CHUNKS], share[STRIPE_MAX_CHUNKS];
+	int				nchunks = 0;
+
+	if (n <= 0) { return 0; }
+	if (n > STRIPE_MAX_CHUNKS) { n = STRIPE_MAX_CHUNKS; }
+	for (int i = 0; i < n; i++) {
+		use[i] = true;
+		drain[i] = cands[i]->cc.inflight / cands[i]->cc.btl_bw;
+	}
+	while (true) {
+		double	level = 0;
+		int		used = 0;
+
+		// 滞留の少ない経路から水位に加えていく
+		while (true) {
+			double	bytes = data_len, bw = 0;
+			bool	changed = false;
+
+			for (int i = 0; i < n; i++) {
+				if (!use[i]) { continue; }
+				bytes += cands[i]->cc.inflight;
+				bw += cands[i]->cc.btl_bw;
+			}
+			level = bytes / bw;
+			for (int i = 0; i < n; i++) {
+				if (use[i] && drain[i] >= level) {
+					use[i] = false;
+					changed = true;
+				}
+			}
+			if (!changed) { break; }
+		}
+		int		smallest = -1;
+
+		for (int i = 0; i < n; i++) {
+			share[i] = use[i] ? (level - drain[i]) * cands[i]->cc.btl_bw : 0;
+			if (!use[i]) { continue; }
+			used++;
+			if (smallest < 0 || share[i] < share[smallest]) { smallest = i; }
+		}
+		if (smallest < 0) {
+			// 全部の経路が外れることはないはずだが、念のため先頭の経路に全部載せる
+			use[0] = true;
+			share[0] = data_len;
+			smallest = 0;
+			used = 1;
+		}
+
+		// 小数点以下の端数は最も取り分の大きい経路に寄せる
+		uint32_t	assigned = 0;
+		int			largest = smallest;
+
+		for (int i = 0; i < n; i++) {
+			if (!use[i]) { continue; }
+			share[i] = (uint32_t)share[i];
+			assigned += (uint32_t)share[i];
+			if (share[i] > share[largest]) { largest = i; }
+		}
+		share[largest] += data_len - assigned;
+
+		nchunks = 0;
+		for (int i = 0; i < n; i++) {
+			if (use[i] && share[i] > 0) { nchunks += ((uint32_t)share[i] + chunk_max - 1) / chunk_max; }
+		}
+		if (used == 1 || (share[smallest] >= STRIPE_MIN_CHUNK && nchunks <= STRIPE_MAX_CHUNKS)) { break; }
+		use[smallest] = false;
+	}
+
+	// 経路ごとの取り分を、ほぼ同じ長さの断片に分ける
+	nchunks = 0;
+	for (int i = 0; i < n; i++) {
+		const uint32_t	bytes = (uint32_t)share[i];
+		if (!use[i] || bytes == 0) { continue; }
+
+		const uint32_t	k = (bytes + chunk_max - 1) / chunk_max;
+
+		for (uint32_t j = 0; j < k && nchunks < STRIPE_MAX_CHUNKS; j++) {
+			paths[nchunks] = cands[i];
+			lens[nchunks] = bytes / k + ((j < bytes % k) ? 1 : 0);
+			nchunks++;
+		}
+	}
+	return nchunks;
+}
+
+const uint8_t* stripe_table::Add(uint32_t seq_all, const uint8_t *payload, uint16_t len, uint64_t now, uint16_t& total) {
+	STRIPE_HEADER	h;
+
+	if (len < sizeof(h)) {
+		invalid++;
+		return nullptr;
+	}
+	memcpy(&h, payload, sizeof(h));
+
+	const uint16_t	chunk = len - sizeof(h);
+
+	if (h.count == 0 || h.count > STRIPE_MAX_CHUNKS || h.index >= h.count ||
+		h.total > TUN_BUFSIZE || (uint32_t)h.offset + chunk > h.total) {
+		invalid++;
+		return nullptr;
+	}
+	if (!slots) { slots.reset(new STRIPE_SLOT[STRIPE_SLOTS]()); }
+
+	STRIPE_SLOT&	s = slots[seq_all % STRIPE_SLOTS];
+
+	// 揃わないまま残っている別のパケット（か、待ちすぎた同じパケット）は捨てて、この断片から組み立て直す
+	if (s.first_ns != 0 && (s.seq_all != seq_all || (!s.done && now - s.first_ns > STRIPE_TIMEOUT_NS))) {
+		if (!s.done) {
+			if (now - s.first_ns > STRIPE_TIMEOUT_NS) { timeouts++; }
+			else { evicted++; }
+		}
+		s.first_ns = 0;
+	}
+	if (s.first_ns == 0) {
+		s.first_ns	= now;
+		s.seq_all	= seq_all;
+		s.got		= 0;
+		s.total		= h.total;
+		s.bytes		= 0;
+		s.count		= h.count;
+		s.done		= false;
+	}
+	else if (s.total != h.total || s.count != h.count) {
+		invalid++;
+		return nullptr;
+	}
+	if (s.done || (s.got & (1U << h.index)) != 0) {
+		duplicates++;
+		return nullptr;
+	}
+	memcpy(s.data + h.offset, payload + sizeof(h), chunk);
+	s.got |= 1U << h.index;
+	s.bytes += chunk;
+
+	const uint32_t	all = (s.count == 32) ? UINT32_MAX : (1U << s.count) - 1;
+
+	if (s.got != all) { return nullptr; }
+	s.done = true;
+	if (s.bytes != s.total) {
+		invalid++;
+		return nullptr;
+	}
+	completed++;
+	total = s.total;
+	return s.data;
+}
+
+void stripe_table::PrintStats(uint32_t client_id) const {
+	if (completed + timeouts + evicted + invalid == 0) { return; }
+	print_info("stripe receiver [%08x]: reassembled %llu, timed out %llu, evicted %llu, invalid %llu, duplicate chunks %llu\n",
+		client_id, (unsigned long long)completed, (unsigned long long)timeouts, (unsigned long long)evicted,
+		(unsigned long long)invalid, (unsigned long long)duplicates);
+}
@@ -0,0 +1,83 @@
+#ifndef	__STRIPE_H__
+#define	__STRIPE_H__
+
+#include <stdint.h>
+#include <memory>
+
+#include "mpudpdef.h"
+#include "network.h"
+
+/*
+ * 大きなパケットの分割送信（-S）
+ * TUN の MTU を大きくすると、9000 バイトのパケット１つが遅い経路１本に丸ごと載り、届くまでが長くなる。
+ * min= より大きなパケットは、経路の MTU（mtu=）に収まる断片に分けて複数の経路に同時に流す。
+ * 各経路の取り分は、推定帯域で今の滞留（inflight）を排出し終えてから断片を送り終えるまでの時間が
+ * どの経路でも同じになるように決める（滞留がなければ推定帯域に比例する）。
+ * 断片は MODE_STRIPE のフレームで、どれも元のパケットと同じ seq_all を持つ。
+ * 受信側は STRIPE_SLOTS 個の組み立て場所（seq_all で引く）で揃うのを待ち、揃ったら重複排除を通して TUN に書く。
+ * STRIPE_TIMEOUT_NS 待っても揃わないものは捨てる（内側の TCP などが送り直す）。
+ * 受信側は -S によらず組み立てる。-S を付けなければ BUFSIZE までしか読まないので分割はしない。
+ * 例）-S mtu=1400,min=4000
+ */
+
+// MODE_STRIPE のフレームのペイロードの先頭（8バイト）
+typedef struct _STRIPE_HEADER {
+	uint16_t	total;		// 元のパケットの長さ
+	uint16_t	offset;		// この断片の位置
+	uint8_t		index;
+	uint8_t		count;		// 断片の数
+	uint16_t	reserved;
+} STRIPE_HEADER;
+
+typedef struct _STRIPE_CONFIG {
+	bool		enable;
+	uint16_t	mtu;		// 経路の MTU
+	uint16_t	min;		// これより大きなパケットを分割する
+
+	_STRIPE_CONFIG() : enable(false), mtu(STRIPE_WIRE_MTU), min(STRIPE_MIN_BYTES) {}
+
+	// 断片１つに載せるデータの長さ（IP・UDP・TUN_HEADER・STRIPE_HEADER を引いた分）
+	inline uint16_t ChunkMax() const { return mtu - 20 - 8 - sizeof(TUN_HEADER) - sizeof(STRIPE_HEADER); }
+} STRIPE_CONFIG;
+
+bool stripe_parse_option(STRIPE_CONFIG& conf, char *subopts);
+
+/*
+ * data_len バイトを cands（n 個）の経路に割り振り、断片ごとの経路を paths に、長さを lens に並べて断片の数を返す
+ * paths と lens には STRIPE_MAX_CHUNKS 個分の場所が要る。取り分が STRIPE_MIN_CHUNK に満たない経路は使わない
+ * 経路の滞留は輻輳制御の見積もり（cc.inflight）をそのまま使うので、先に CanSend などで排出を進めておくこと
+ */
+int stripe_plan(const STRIPE_CONFIG& conf, SOCKET_PACK* const *cands, int n, uint32_t data_len, SOCKET_PACK **paths, uint16_t *lens);
+
+typedef struct _STRIPE_SLOT {
+	uint64_t	first_ns;	// 最初の断片を受け取った時刻（0 = 空き）
+	uint32_t	seq_all;
+	uint32_t	got;		// 受け取った断片（index のビット）
+	uint16_t	total;
+	uint16_t	bytes;		// 受け取ったデータの長さ
+	uint8_t		count;
+	bool		done;		// 揃って TUN に書いた
+	uint8_t		data[TUN_BUFSIZE];
+} STRIPE_SLOT;
+
+// 受信側の組み立て（RX スレッドだけが触る）
+class stripe_table {
+private:
+	std::unique_ptr<STRIPE_SLOT[]>	slots;	// 最初の断片が届くまで確保しない
+
+public:
+	uint64_t	completed;	// 揃ったパケット数
+	uint64_t	timeouts;	// STRIPE_TIMEOUT_NS 待っても揃わず捨てたパケット数
+	uint64_t	evicted;	// 揃う前に別のパケットに場所を取られたパケット数
+	uint64_t	invalid;	// 壊れた断片（長さや位置が合わない）
+	uint64_t	duplicates;	// 同じ断片がもう一度届いた
+
+	stripe_table() : completed(0), timeouts(0), evicted(0), invalid(0), duplicates(0) {}
+
+	// 断片（STRIPE_HEADER から始まる len バイト）を入れる。パケットが揃ったらその先頭を返し、total に長さを入れる
+	const uint8_t* Add(uint32_t seq_all, const uint8_t *payload, uint16_t len, uint64_t now, uint16_t& total);
+
+	void PrintStats(uint32_t client_id) const;	// client_id は表示用（RX_SESSION ごとにある）
+};
+
+#endif
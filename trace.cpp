@@ -0,0 +1,175 @@
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+
+#include <signal.h>
+#include <time.h>
+
+#include "spscring.h"
+#include "trace.h"
+#include "print.h"
+#include "network.h"
+
+typedef spsc_ring<TRACE_RECORD, TRACE_RING_SIZE>	TRACE_RING;
+
+typedef struct _TRACE_THREAD {
+	TRACE_RING	ring;
+	uint16_t	tid;
+	std::atomic<uint64_t>	dropped;
+} TRACE_THREAD;
+
+// 登録はスレッドごとに１回だけなのでここは mutex で構わない
+// スレッドは終了まで生き続ける前提なので、登録したリングは解放しない
+static std::mutex					_trace_mtx;
+static std::vector<TRACE_THREAD*>	_trace_threads;
+static thread_local TRACE_THREAD	*_trace_self = nullptr;
+
+static std::atomic<bool>	_trace_running(false);
+static double	_trace_ns_per_tick = 1.0;
+static uint64_t	_trace_tick_base = 0;
+
+static TRACE_THREAD* _trace_register() {
+	std::lock_guard<std::mutex>	lock(_trace_mtx);
+	TRACE_THREAD	*t = new TRACE_THREAD;
+
+	t->tid = (uint16_t)_trace_threads.size();
+	t->dropped.store(0, std::memory_order_relaxed);
+	_trace_threads.push_back(t);
+	return t;
+}
+
+void trace_emit(const TRACE_RECORD& rec) {
+	if (!_trace_running.load(std::memory_order_relaxed)) { return; }
+	if (_trace_self == nullptr) { _trace_self = _trace_register(); }
+
+	TRACE_RECORD	r = rec;
+	r.tid = _trace_self->tid;
+	if (!_trace_self->ring.push(r)) {
+		auto& d = _trace_self->dropped;
+		d.store(d.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+}
+
+static void _trace_format(const TRACE_RECORD& r) {
+	const double	t = (double)(r.ts - _trace_tick_base) * _trace_ns_per_tick / 1e9;
+	in_addr		addr;
+
+	switch (r.event) {
+	case TEV_TUN_RECV:
+		print_debug(
+			"[%12.6f T%u] from tun seq=%u : read %u bytes, IP header says: packet length = %u, "
+			"head = %02X %02X %02X %02X %02X %02X %02X %02X\n",
+			t, r.tid, r.arg[0], r.arg[1], ntohs(((uint16_t*)r.data)[1]),
+			r.data[0], r.data[1], r.data[2], r.data[3], r.data[4], r.data[5], r.data[6], r.data[7]
+		);
+		break;
+
+	case TEV_ETH_RECV: {
+		const TUN_HEADER	*hdr = (const TUN_HEADER*)r.data;
+
+		addr.s_addr = r.arg[2];
+		print_debug(
+			"[%12.6f T%u] from eth seq=%u : read %u bytes, sender %s:%u, "
+			"mode = %s, device_id = %u, length = %u, seq_all = %u, seq_dev = %u\n",
+			t, r.tid, r.arg[0], r.arg[1], inet_ntoa(addr), r.arg[3],
+			mode2str(hdr->mode), hdr->device_id, hdr->length, hdr->seq_all, hdr->seq_dev
+		);
+		break;
+	}
+	case TEV_ETH_SEND:
+		addr.s_addr = r.arg[2];
+		print_debug(
+			"[%12.6f T%u] packet was sent to : %s:%u (fd = %u), %u bytes, seq_all = %u, seq_dev = %u\n",
+			t, r.tid, inet_ntoa(addr), r.arg[3], r.arg[0], r.arg[1], r.arg[4], r.arg[5]
+		);
+		break;
+
+	case TEV_TUN_SEND:
+		print_debug("[%12.6f T%u] packet was sent to tun seq=%u : write %u bytes\n", t, r.tid, r.arg[0], r.arg[1]);
+		break;
+
+	case TEV_DUP_SKIP:
+		print_debug("[%12.6f T%u] seq = %u : packet was already received: skip.\n", t, r.tid, r.arg[0]);
+		break;
+
+	case TEV_ARQ_NACK:
+		print_debug("[%12.6f T%u] NACK received : seq = %u - %u\n", t, r.tid, r.arg[0], r.arg[0] + r.arg[1] - 1);
+		break;
+
+	case TEV_ARQ_RESEND:
+		print_debug("[%12.6f T%u] seq = %u : resent via fd = %u\n", t, r.tid, r.arg[0], r.arg[1]);
+		break;
+
+	case TEV_OWD_REPORT:
+		print_debug("[%12.6f T%u] OWD report via fd = %u : qdelay = %dus, trend = %dus, samples = %u\n",
+			t, r.tid, r.arg[0], (int32_t)r.arg[1], (int32_t)r.arg[2], r.arg[3]);
+		break;
+
+	default:
+		print_debug("[%12.6f T%u] unknown trace event %u\n", t, r.tid, r.event);
+		break;
+	}
+}
+
+// TSC とナノ秒の対応を取る（TSC を使わない環境では 1 tick = 1 ns）
+static void _trace_calibrate() {
+	timespec	ts0, ts1;
+	timespec	wait = { 0, 20 * 1000 * 1000 };
+
+	clock_gettime(CLOCK_MONOTONIC, &ts0);
+	const uint64_t	c0 = trace_clock();
+	nanosleep(&wait, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &ts1);
+	const uint64_t	c1 = trace_clock();
+
+	const double	ns = (ts1.tv_sec - ts0.tv_sec) * 1e9 + (ts1.tv_nsec - ts0.tv_nsec);
+	_trace_ns_per_tick = (c1 > c0) ? ns / (double)(c1 - c0) : 1.0;
+	_trace_tick_base = c0;
+}
+
+// 各スレッドのリングを回収し、時刻順に並べてから書き出す
+void trace_start() {
+	if (_trace_running.exchange(true)) { return; }
+	_trace_calibrate();
+
+	std::thread([](){
+		std::vector<TRACE_RECORD>	batch;
+		std::vector<uint64_t>		reported;
+		timespec	idle = { 0, 1000 * 1000 };
+		sigset_t	set;
+
+		sigemptyset(&set);
+		sigaddset(&set, SIGUSR1);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+		batch.reserve(TRACE_RING_SIZE);
+		while (true) {
+			std::vector<TRACE_THREAD*>	threads;
+			TRACE_RECORD	r;
+			{
+				std::lock_guard<std::mutex>	lock(_trace_mtx);
+				threads = _trace_threads;
+			}
+			reported.resize(threads.size(), 0);
+
+			batch.clear();
+			for (auto t : threads) {
+				while (t->ring.pop(r)) { batch.push_back(r); }
+			}
+			std::sort(batch.begin(), batch.end(),
+				[](const TRACE_RECORD& a, const TRACE_RECORD& b) { return a.ts < b.ts; }
+			);
+			for (const auto& b : batch) { _trace_format(b); }
+
+			for (size_t i = 0; i < threads.size(); i++) {
+				const uint64_t	d = threads[i]->dropped.load(std::memory_order_relaxed);
+				if (d != reported[i]) {
+					print_debug("[TRACE] T%u: %llu records dropped\n", threads[i]->tid, (unsigned long long)(d - reported[i]));
+					reported[i] = d;
+				}
+			}
+			if (batch.empty()) { nanosleep(&idle, NULL); }
+		}
+	}).detach();
+}
@@ -0,0 +1,90 @@
+#ifndef	__TRACE_H__
+#define	__TRACE_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+ * 非同期バイナリトレース
+ * データパス上では固定長のバイナリレコードをスレッドごとの SPSC リングに積むだけにして、
+ * 文字列への整形と stderr への書き出しはバックグラウンドのスレッド（trace_start で起動）に任せる。
+ * TRACE_LEVEL 未満のトレースはコンパイル時に消える。実行時は -d（_global_fDebug）で有効になる。
+ * リングが溢れた場合はレコードを捨て、捨てた数を後で報告する。
+ */
+#define	TRACE_LV_NONE	0
+#define	TRACE_LV_ERROR	1
+#define	TRACE_LV_INFO	2
+#define	TRACE_LV_DEBUG	3
+
+#ifndef	TRACE_LEVEL
+#define	TRACE_LEVEL		TRACE_LV_DEBUG
+#endif
+
+#define	TRACE_RING_SIZE	4096	// スレッドあたりのレコード数
+
+typedef enum _TRACE_EVENT {
+	TEV_TUN_RECV,	// arg = { tun_seq, nread },                  data = IP パケット先頭
+	TEV_ETH_RECV,	// arg = { seq_all, nread, addr, port },      data = TUN_HEADER
+	TEV_ETH_SEND,	// arg = { sock_fd, nwrite, addr, port, seq_all, seq_dev }
+	TEV_TUN_SEND,	// arg = { seq_all, nwrite }
+	TEV_DUP_SKIP,	// arg = { seq_all }
+	TEV_ARQ_NACK,	// arg = { start, count }                     受け取った NACK
+	TEV_ARQ_RESEND,	// arg = { seq_all, sock_fd }
+	TEV_OWD_REPORT,	// arg = { sock_fd, qdelay_us, trend_us, samples }  受け取った片道遅延の報告
+	TEV_MAX
+} TRACE_EVENT;
+
+// 64 バイト（キャッシュライン１本分）
+typedef struct _TRACE_RECORD {
+	uint64_t	ts;			// trace_clock() の値
+	uint16_t	event;		// TRACE_EVENT
+	uint16_t	tid;		// trace_start 以降にスレッドへ振られる番号
+	uint32_t	arg[6];
+	uint8_t		data[28];
+} TRACE_RECORD;
+
+static_assert(sizeof(TRACE_RECORD) == 64, "TRACE_RECORD must be 64 bytes");
+
+// x86 では TSC を直接読む（ナノ秒への換算は整形スレッドで行う）
+inline uint64_t trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec	ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+void trace_start();
+void trace_emit(const TRACE_RECORD& rec);
+
+inline void trace_record(uint16_t event,
+	uint32_t a0 = 0, uint32_t a1 = 0, uint32_t a2 = 0,
+	uint32_t a3 = 0, uint32_t a4 = 0, uint32_t a5 = 0,
+	const void *data = nullptr, size_t len = 0) {
+	TRACE_RECORD	rec;
+
+	rec.ts = trace_clock();
+	rec.event = event;
+	rec.arg[0] = a0; rec.arg[1] = a1; rec.arg[2] = a2;
+	rec.arg[3] = a3; rec.arg[4] = a4; rec.arg[5] = a5;
+	// 使わない末尾も埋めておく（前のレコードやスタックの中身を出さない）
+	const size_t	n = (data == nullptr) ? 0 : (len < sizeof(rec.data)) ? len : sizeof(rec.data);
+
+	if (n > 0) { memcpy(rec.data, data, n); }
+	memset(rec.data + n, 0, sizeof(rec.data) - n);
+	trace_emit(rec);
+}
+
+extern bool _global_fDebug;
+
+#define	trace_at(level, event, ...)	do{if((level)<=TRACE_LEVEL&&_global_fDebug){trace_record((event), ## __VA_ARGS__);}}while(0)
+#define	trace_debug(event, ...)		trace_at(TRACE_LV_DEBUG, (event), ## __VA_ARGS__)
+
+#endif
@@ -0,0 +1,171 @@
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "print.h"
+#include "upgrade.h"
+
+static bool upgrade_addr(const std::string& path, sockaddr_un& addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path.length() >= sizeof(addr.sun_path)) {
+		print_error("upgrade socket path is too long - %s\n", path.c_str());
+		return false;
+	}
+	strcpy(addr.sun_path, path.c_str());
+	return true;
+}
+
+// conn が読めるようになるまで待つ（timeout_ms を過ぎたら false）
+static bool upgrade_poll(int conn, int timeout_ms) {
+	pollfd	p = { conn, POLLIN, 0 };
+	int		r;
+
+	while ((r = poll(&p, 1, timeout_ms)) < 0 && errno == EINTR) {}
+	return r > 0;
+}
+
+void upgrade_save_path(UPGRADE_PATH& p, const SOCKET_PACK& s) {
+	memset(&p, 0, sizeof(p));
+	strncpy(p.name, s.eth_name.c_str(), sizeof(p.name) - 1);
+	p.remote_addr	= s.remote_addr;
+	p.local_addr	= s.local_addr;
+	p.device_id		= -1;
+	p.fd_index		= -1;
+	p.seq_dev		= s.seq_dev;
+	p.min_rtt_us	= s.cc.min_rtt_us;
+	p.btl_bw		= s.cc.btl_bw;
+	p.cc_state		= s.cc.state;
+	p.path_up		= s.path_up;
+	p.pin_src		= s.pin_src;
+	p.ifindex		= s.ifindex;
+}
+
+void upgrade_restore_path(SOCKET_PACK& s, const UPGRADE_PATH& p, uint64_t now) {
+	s.remote_addr	= p.remote_addr;
+	s.local_addr	= p.local_addr;
+	s.seq_dev		= p.seq_dev;
+	s.path_up		= p.path_up;
+	s.pin_src		= p.pin_src;
+	s.ifindex		= p.ifindex;
+	s.cc.Restore(now, (CC_STATE)p.cc_state, p.btl_bw, p.min_rtt_us);
+}
+
+// 非ブロッキングで待つので、メインループは select で読めるのを待ってから accept すればよい
+int upgrade_listen(const std::string& path) {
+	sockaddr_un	addr;
+	int			fd;
+
+	if (!upgrade_addr(path, addr)) { return -1; }
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket(AF_UNIX)");
+		return -1;
+	}
+	unlink(path.c_str());
+	if (bind(fd, (sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+		perror("bind / listen (upgrade)");
+		print_error("upgrade socket - %s, errno = %d\n", path.c_str(), errno);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int upgrade_connect(const std::string& path) {
+	sockaddr_un	addr;
+	int			fd;
+
+	if (!upgrade_addr(path, addr)) { return -1; }
+	if ((fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket(AF_UNIX)");
+		return -1;
+	}
+	if (connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+		const int	err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+bool upgrade_send(int conn, const UPGRADE_STATE& st, const int *fds, int nfds) {
+	alignas(cmsghdr) uint8_t	ctrl[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+	iovec		iov = { (void*)&st, sizeof(st) };
+	msghdr		msg;
+
+	if (nfds > UPGRADE_MAX_FDS) { return false; }
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov		= &iov;
+	msg.msg_iovlen	= 1;
+	if (nfds > 0) {
+		msg.msg_control		= ctrl;
+		msg.msg_controllen	= CMSG_SPACE(sizeof(int) * nfds);
+
+		cmsghdr	*c = CMSG_FIRSTHDR(&msg);
+		c->cmsg_level	= SOL_SOCKET;
+		c->cmsg_type	= SCM_RIGHTS;
+		c->cmsg_len		= CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(c), fds, sizeof(int) * nfds);
+	}
+	if (sendmsg(conn, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(st)) {
+		perror("sendmsg(upgrade)");
+		return false;
+	}
+	return true;
+}
+
+bool upgrade_recv(int conn, UPGRADE_STATE& st, int *fds, int& nfds) {
+	alignas(cmsghdr) uint8_t	ctrl[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+	iovec		iov = { &st, sizeof(st) };
+	msghdr		msg;
+	ssize_t		n;
+
+	nfds = 0;
+	if (!upgrade_poll(conn, UPGRADE_RECV_TIMEOUT_MSEC)) {
+		print_error("upgrade: no state from the running process\n");
+		return false;
+	}
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov			= &iov;
+	msg.msg_iovlen		= 1;
+	msg.msg_control		= ctrl;
+	msg.msg_controllen	= sizeof(ctrl);
+	if ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+		perror("recvmsg(upgrade)");
+		return false;
+	}
+	for (cmsghdr *c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+		if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) { continue; }
+		nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(c), sizeof(int) * nfds);
+	}
+	// 版が違う（構造体が変わった）ものは使えない。受け取った fd は閉じる
+	if (n != (ssize_t)sizeof(st) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || !st.Valid()) {
+		print_error("upgrade: invalid state from the running process (%zd bytes, expected %zu)\n", n, sizeof(st));
+		for (int i = 0; i < nfds; i++) { close(fds[i]); }
+		nfds = 0;
+		return false;
+	}
+	return true;
+}
+
+bool upgrade_ack(int conn) {
+	const char	ack = 'A';
+
+	if (send(conn, &ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack)) {
+		perror("send(upgrade ack)");
+		return false;
+	}
+	return true;
+}
+
+bool upgrade_wait_ack(int conn) {
+	char	ack = 0;
+
+	if (!upgrade_poll(conn, UPGRADE_ACK_TIMEOUT_MSEC)) { return false; }
+	return recv(conn, &ack, sizeof(ack), 0) == sizeof(ack) && ack == 'A';
+}
@@ -0,0 +1,93 @@
+#ifndef	__UPGRADE_H__
+#define	__UPGRADE_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#include <netinet/in.h>
+#include <net/if.h>
+
+#include "mpudpdef.h"
+#include "seqwindow.h"
+#include "network.h"
+
+/*
+ * 無停止の入れ替え（-U path）
+ * 動いているプロセス（旧）は path に Unix ドメインソケット（SOCK_SEQPACKET）を置いて待つ。
+ * 同じ -U を付けて起動した新しいプロセス（新）は、起動の準備を済ませてから path につなぐ。
+ *   旧：TUN を読むのをやめ（TX スレッドで処理するので自然に止まる）、RX を止めてから、
+ *       TUN と経路のソケットの fd を SCM_RIGHTS で、セッションの状態（UPGRADE_STATE）と一緒に渡す
+ *   新：受け取った fd で RX・TX を動かし始めてから ACK を返す
+ *   旧：ACK を受け取ったら終了する。UPGRADE_ACK_TIMEOUT_MSEC 待っても来なければ（新が落ちた）元どおり動き続ける
+ * fd は同じソケットを指すので、入れ替えの間に届いたパケットはソケットと TUN のキューに残っていて、新が読む。
+ * 渡す状態は、seq_all（相手の重複排除に捨てられないように続きから振る）、受信側の重複排除の記録（サーバーはクライアントごと）、
+ * 経路ごとの seq_dev（相手の受信報告を数え直させない）と輻輳制御の推定帯域・最小 RTT、サーバーの接続リスト。
+ * 選択的再送の控え、組み立て中の断片、片道遅延や受信報告の推定値、管理プレーンの状態は渡さない（新が作り直す）。
+ * path に誰もいなければ（最初の起動）普通に起動し、次の入れ替えのために path で待つ。
+ * 例）-U /run/mpudp.sock
+ */
+#define	SIGNATURE_UPGRADE	"Upgr"
+#define	UPGRADE_VERSION		3
+
+typedef struct _UPGRADE_PATH {
+	char		name[2 * IFNAMSIZ + 16];	// クライアント：経路の名前（SOCKET_PACK::eth_name）
+	sockaddr_in	remote_addr;
+	sockaddr_in	local_addr;
+	int32_t		device_id;		// サーバー：接続リストのデバイスID。クライアント：-M の経路に振ったデバイスID
+	int32_t		fd_index;		// 一緒に渡す fd の位置（-1 = なし。サーバーの経路は待ち受けソケットを共有する）
+	uint32_t	seq_dev;
+	uint32_t	min_rtt_us;
+	uint64_t	btl_bw;
+	uint8_t		cc_state;
+	uint8_t		path_up;
+	uint8_t		pin_src;
+	uint8_t		shared;			// クライアント：-M の共有ソケット（の複製）
+	int32_t		ifindex;
+} UPGRADE_PATH;
+
+// 受信側の重複排除（RX_SESSION ごと）
+typedef struct _UPGRADE_SESSION {
+	uint32_t	client_id;
+	seq_window<SEQ_WINDOW_SIZE>	seq_rec;
+} UPGRADE_SESSION;
+
+typedef struct _UPGRADE_STATE {
+	char		signature[4];
+	uint32_t	version;
+	uint8_t		server;			// サーバーなら 1（クライアントとサーバーの間では入れ替えない）
+	uint32_t	seq;			// 次に振る seq_all
+	uint32_t	nsessions;
+	UPGRADE_SESSION	sessions[UPGRADE_MAX_SESSIONS];
+	uint32_t	npaths;
+	UPGRADE_PATH	paths[UPGRADE_MAX_PATHS];
+	// fd の並びは、TUN、（サーバーは待ち受けソケット、管理プレーンのソケット）、経路のソケット（fd_index）
+
+	_UPGRADE_STATE() : version(UPGRADE_VERSION), server(0), seq(0), nsessions(0), npaths(0) {
+		memcpy(signature, SIGNATURE_UPGRADE, sizeof(signature));
+	}
+	inline bool Valid() const {
+		return memcmp(signature, SIGNATURE_UPGRADE, sizeof(signature)) == 0 && version == UPGRADE_VERSION &&
+			nsessions <= UPGRADE_MAX_SESSIONS && npaths <= UPGRADE_MAX_PATHS;
+	}
+} UPGRADE_STATE;
+
+// 経路の状態を写す / 戻す（fd と、サーバーの device_id・クライアントの名前は呼ぶ側で）
+void upgrade_save_path(UPGRADE_PATH& p, const SOCKET_PACK& s);
+void upgrade_restore_path(SOCKET_PACK& s, const UPGRADE_PATH& p, uint64_t now);
+
+// 旧：path で待つ（あれば消してから作り直す）。失敗したら -1
+int upgrade_listen(const std::string& path);
+
+// 新：path につなぐ。誰も待っていなければ -1（errno はそのまま）
+int upgrade_connect(const std::string& path);
+
+// 状態と fd を送る / 受け取る（受け取った fd の数を nfds に返す。fds は UPGRADE_MAX_FDS 個分）
+bool upgrade_send(int conn, const UPGRADE_STATE& st, const int *fds, int nfds);
+bool upgrade_recv(int conn, UPGRADE_STATE& st, int *fds, int& nfds);
+
+// 新が動き始めたことを知らせる / 旧がそれを待つ
+bool upgrade_ack(int conn);
+bool upgrade_wait_ack(int conn);
+
+#endif
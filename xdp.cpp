@@ -0,0 +1,571 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <net/route.h>
+#include <net/if_arp.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include <fstream>
+#include <sstream>
+
+#include "xdp.h"
+#include "ippacket.h"
+#include "pipeline.h"
+#include "print.h"
+
+// 古いヘッダにはないことがある
+#ifndef	SOL_XDP
+#define	SOL_XDP	283
+#endif
+
+#define	XDP_HEADROOM	(sizeof(ethhdr) + sizeof(iphdr) + sizeof(udphdr))	// IP オプションなし
+
+static_assert(XDP_FRAMES / 2 <= XDP_RING_SIZE, "every frame of a half of the UMEM must fit in a ring");
+static_assert((XDP_RING_SIZE & (XDP_RING_SIZE - 1)) == 0, "XDP_RING_SIZE must be a power of two");
+static_assert(XDP_HEADROOM + sizeof(TUN_HEADER) + BUFSIZE <= XDP_FRAME_SIZE, "XDP_FRAME_SIZE is too small");
+
+_XDP_CONFIG::_XDP_CONFIG() : enable(false), mode(XDP_MODE_AUTO), attach(XDP_ATTACH_AUTO), queue(0) {}
+
+// mode=auto|copy|zerocopy,attach=auto|drv|skb,queue=N
+bool xdp_parse_option(XDP_CONFIG& conf, char *subopts) {
+	enum { OPT_MODE, OPT_ATTACH, OPT_QUEUE };
+	char *const	tokens[] = {
+		(char*)"mode", (char*)"attach", (char*)"queue", NULL
+	};
+	char	*value;
+
+	conf.enable = true;
+	while (*subopts != '\0') {
+		const int	opt = getsubopt(&subopts, tokens, &value);
+
+		if (opt < 0 || value == NULL) {
+			print_error("invalid XDP option : %s\n", value ? value : "(null)");
+			return false;
+		}
+		switch (opt) {
+		case OPT_MODE:
+			if      (strcmp(value, "auto")     == 0) { conf.mode = XDP_MODE_AUTO; }
+			else if (strcmp(value, "copy")     == 0) { conf.mode = XDP_MODE_COPY; }
+			else if (strcmp(value, "zerocopy") == 0) { conf.mode = XDP_MODE_ZEROCOPY; }
+			else {
+				print_error("invalid XDP mode : %s\n", value);
+				return false;
+			}
+			break;
+		case OPT_ATTACH:
+			if      (strcmp(value, "auto") == 0) { conf.attach = XDP_ATTACH_AUTO; }
+			else if (strcmp(value, "drv")  == 0) { conf.attach = XDP_ATTACH_DRV; }
+			else if (strcmp(value, "skb")  == 0) { conf.attach = XDP_ATTACH_SKB; }
+			else {
+				print_error("invalid XDP attach mode : %s\n", value);
+				return false;
+			}
+			break;
+		case OPT_QUEUE:	conf.queue = strtoul(value, NULL, 10); break;
+		}
+	}
+	return true;
+}
+
+static inline int sys_bpf(int cmd, bpf_attr& attr) {
+	return syscall(__NR_bpf, cmd, &attr, sizeof(attr));
+}
+
+static inline uint32_t load_acquire(const uint32_t *p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void store_release(uint32_t *p, uint32_t v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+
+static bool map_ring(int fd, XDP_RING& r, const xdp_ring_offset& off, size_t desc_size, off_t pgoff) {
+	r.map_len = off.desc + XDP_RING_SIZE * desc_size;
+	r.map = mmap(NULL, r.map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+	if (r.map == MAP_FAILED) {
+		r.map = NULL;
+		return false;
+	}
+	r.producer	= (uint32_t*)((uint8_t*)r.map + off.producer);
+	r.consumer	= (uint32_t*)((uint8_t*)r.map + off.consumer);
+	r.flags		= (uint32_t*)((uint8_t*)r.map + off.flags);
+	r.desc		= (uint8_t*)r.map + off.desc;
+	r.mask		= XDP_RING_SIZE - 1;
+	return true;
+}
+
+/*
+ * 経路のデバイスのメインの経路表から dst への次の転送先を探す（ゲートウェイがなければ dst 自身）
+ * /proc/net/route の値はネットワークバイトオーダーのまま 16 進で書かれている。ポリシールーティングは見ない
+ */
+static in_addr route_next_hop(const std::string& ifname, in_addr dst) {
+	std::ifstream	f("/proc/net/route");
+	std::string		line;
+	in_addr			hop = dst;
+	int				best_len = -1;
+	uint32_t		best_metric = UINT32_MAX;
+
+	std::getline(f, line);	// 見出し
+	while (std::getline(f, line)) {
+		std::istringstream	ss(line);
+		std::string	iface;
+		uint32_t	dest, gw, flags, refcnt, use, metric, mask;
+
+		ss >> iface >> std::hex >> dest >> gw >> flags >> std::dec >> refcnt >> use >> metric >> std::hex >> mask;
+		if (!ss || iface != ifname || !(flags & RTF_UP) || (dst.s_addr & mask) != dest) { continue; }
+
+		const int	len = __builtin_popcount(mask);
+		if (len < best_len || (len == best_len && metric >= best_metric)) { continue; }
+		best_len = len;
+		best_metric = metric;
+		hop.s_addr = (flags & RTF_GATEWAY) ? gw : dst.s_addr;
+	}
+	return hop;
+}
+
+// カーネルの近隣キャッシュ（/proc/net/arp）で解決済みの MAC アドレスを引く
+static bool arp_lookup(const std::string& ifname, in_addr ip, uint8_t mac[6]) {
+	std::ifstream	f("/proc/net/arp");
+	std::string		line;
+
+	std::getline(f, line);	// 見出し
+	while (std::getline(f, line)) {
+		std::istringstream	ss(line);
+		std::string	addr, hw_type, flags, hw, mask, dev;
+		in_addr		a;
+		unsigned	m[6];
+
+		ss >> addr >> hw_type >> flags >> hw >> mask >> dev;
+		if (!ss || dev != ifname || inet_pton(AF_INET, addr.c_str(), &a) != 1 || a.s_addr != ip.s_addr) { continue; }
+		if (!(strtoul(flags.c_str(), NULL, 16) & ATF_COM)) { return false; }
+		if (sscanf(hw.c_str(), "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6) { return false; }
+		for (int i = 0; i < 6; i++) { mac[i] = (uint8_t)m[i]; }
+		return true;
+	}
+	return false;
+}
+
+xdp_port::xdp_port() :
+	ifindex(0), xsk(-1), map_fd(-1), prog_fd(-1), link_fd(-1), sock_fd(-1), zerocopy(false), skb_mode(false),
+	umem(NULL), umem_len(0), neigh_ok(false), neigh_check_ns(0), local_port(0), mtu(0), ip_id(0),
+	rx_frames(0), tx_frames(0), tx_via_sock(0), tx_ring_full(0) {
+	memset(&fill, 0, sizeof(fill));
+	memset(&comp, 0, sizeof(comp));
+	memset(&rx, 0, sizeof(rx));
+	memset(&tx, 0, sizeof(tx));
+}
+
+// リンクを閉じると XDP プログラムが外れ、以降のフレームはカーネルの UDP ソケットに届く
+xdp_port::~xdp_port() {
+	if (link_fd != -1) { close(link_fd); }
+	if (prog_fd != -1) { close(prog_fd); }
+	if (map_fd != -1) { close(map_fd); }
+	if (xsk != -1) { close(xsk); }
+	for (XDP_RING *r : { &fill, &comp, &rx, &tx }) {
+		if (r->map != NULL) { munmap(r->map, r->map_len); }
+	}
+	if (umem != NULL) { munmap(umem, umem_len); }
+}
+
+bool xdp_port::open(const XDP_CONFIG& conf, const std::string& eth_name, int sock, const sockaddr_in& local, const sockaddr_in& remote) {
+	ifreq	ifr;
+
+	name		= eth_name;
+	sock_fd		= sock;
+	local_ip	= local.sin_addr;
+	local_port	= local.sin_port;
+
+	if ((ifindex = if_nametoindex(name.c_str())) == 0) {
+		perror("if_nametoindex()");
+		print_error("xdp[%s]: no such device\n", name.c_str());
+		return false;
+	}
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
+	if (ioctl(sock_fd, SIOCGIFHWADDR, &ifr) < 0 || ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER) {
+		print_error("xdp[%s]: not an Ethernet device\n", name.c_str());
+		return false;
+	}
+	memcpy(src_mac, ifr.ifr_hwaddr.sa_data, sizeof(src_mac));
+	if (ioctl(sock_fd, SIOCGIFMTU, &ifr) < 0) {
+		perror("ioctl(SIOCGIFMTU)");
+		print_error("xdp[%s]: couldn't get MTU\n", name.c_str());
+		return false;
+	}
+	mtu = ifr.ifr_mtu;
+
+	// XSK を先に用意してから、フレームを回し始める
+	if (!this->_OpenSocket(conf)) { return false; }
+	if (!this->_LoadProgram(conf)) { return false; }
+
+	next_hop = route_next_hop(name, remote.sin_addr);
+	this->_Resolve(monotonic_ns());
+
+	print_info("xdp[%s]: %s mode, %s XDP, queue %u, port %u, next hop %s%s\n",
+		name.c_str(), zerocopy ? "zero-copy" : "copy", skb_mode ? "generic" : "native", conf.queue,
+		ntohs(local_port), inet_ntoa(next_hop), neigh_ok ? "" : " (not resolved yet)");
+	return true;
+}
+
+bool xdp_port::_OpenSocket(const XDP_CONFIG& conf) {
+	xdp_umem_reg		reg;
+	xdp_mmap_offsets	off;
+	socklen_t			optlen = sizeof(off);
+	const int			ring_size = XDP_RING_SIZE;
+
+	if ((xsk = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket(AF_XDP)");
+		print_error("xdp[%s]: errno = %d\n", name.c_str(), errno);
+		return false;
+	}
+	umem_len = (size_t)XDP_FRAMES * XDP_FRAME_SIZE;
+	umem = (uint8_t*)mmap(NULL, umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (umem == MAP_FAILED) {
+		umem = NULL;
+		perror("mmap(UMEM)");
+		return false;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.addr		= (uintptr_t)umem;
+	reg.len			= umem_len;
+	reg.chunk_size	= XDP_FRAME_SIZE;
+	reg.headroom	= 0;
+	if (setsockopt(xsk, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0
+		|| setsockopt(xsk, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) < 0
+		|| setsockopt(xsk, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) < 0
+		|| setsockopt(xsk, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) < 0
+		|| setsockopt(xsk, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) < 0) {
+		perror("setsockopt(SOL_XDP)");
+		print_error("xdp[%s]: couldn't set up UMEM and rings\n", name.c_str());
+		return false;
+	}
+	if (getsockopt(xsk, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0
+		|| !map_ring(xsk, fill, off.fr, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING)
+		|| !map_ring(xsk, comp, off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING)
+		|| !map_ring(xsk, rx, off.rx, sizeof(xdp_desc), XDP_PGOFF_RX_RING)
+		|| !map_ring(xsk, tx, off.tx, sizeof(xdp_desc), XDP_PGOFF_TX_RING)) {
+		perror("mmap(XDP ring)");
+		print_error("xdp[%s]: couldn't map rings\n", name.c_str());
+		return false;
+	}
+
+	// 前半を受信用に全部 fill リングへ渡し、後半を送信用に取っておく
+	for (uint32_t i = 0; i < XDP_FRAMES / 2; i++) {
+		((uint64_t*)fill.desc)[i] = (uint64_t)i * XDP_FRAME_SIZE;
+	}
+	store_release(fill.producer, XDP_FRAMES / 2);
+	for (uint32_t i = XDP_FRAMES / 2; i < XDP_FRAMES; i++) {
+		tx_free.push_back((uint64_t)i * XDP_FRAME_SIZE);
+	}
+
+	// ゼロコピーはドライバが対応していなければ bind で断られる
+	if (conf.mode != XDP_MODE_COPY && this->_Bind(conf, XDP_ZEROCOPY)) {
+		zerocopy = true;
+		return true;
+	}
+	if (conf.mode == XDP_MODE_ZEROCOPY) {
+		perror("bind(AF_XDP)");
+		print_error("xdp[%s]: zero-copy is not supported by the driver\n", name.c_str());
+		return false;
+	}
+	if (!this->_Bind(conf, XDP_COPY)) {
+		perror("bind(AF_XDP)");
+		print_error("xdp[%s]: couldn't bind to queue %u\n", name.c_str(), conf.queue);
+		return false;
+	}
+	return true;
+}
+
+bool xdp_port::_Bind(const XDP_CONFIG& conf, uint16_t flags) {
+	sockaddr_xdp	addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sxdp_family	= AF_XDP;
+	addr.sxdp_flags		= flags | XDP_USE_NEED_WAKEUP;
+	addr.sxdp_ifindex	= ifindex;
+	addr.sxdp_queue_id	= conf.queue;
+	return bind(xsk, (sockaddr*)&addr, sizeof(addr)) == 0;
+}
+
+/*
+ * 経路の UDP ソケットのポート宛ての IPv4/UDP（IP オプションなし、フラグメントでない）だけを XSK に回すプログラム
+ * 受信キューに XSK がつながっていなければ、bpf_redirect_map の flags に渡した XDP_PASS でカーネルに流す
+ */
+bool xdp_port::_LoadProgram(const XDP_CONFIG& conf) {
+	bpf_attr	attr;
+	char		log[4096];
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type		= BPF_MAP_TYPE_XSKMAP;
+	attr.key_size		= sizeof(uint32_t);
+	attr.value_size		= sizeof(uint32_t);
+	attr.max_entries	= conf.queue + 1;
+	if ((map_fd = sys_bpf(BPF_MAP_CREATE, attr)) < 0) {
+		perror("bpf(BPF_MAP_CREATE)");
+		print_error("xdp[%s]: couldn't create XSKMAP\n", name.c_str());
+		return false;
+	}
+	const uint32_t	key = conf.queue;
+	const uint32_t	value = xsk;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd	= map_fd;
+	attr.key	= (uintptr_t)&key;
+	attr.value	= (uintptr_t)&value;
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, attr) < 0) {
+		perror("bpf(BPF_MAP_UPDATE_ELEM)");
+		print_error("xdp[%s]: couldn't register the socket in XSKMAP\n", name.c_str());
+		return false;
+	}
+
+	auto	ins = [](uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+		bpf_insn	i;
+		i.code = code; i.dst_reg = dst; i.src_reg = src; i.off = off; i.imm = imm;
+		return i;
+	};
+	// 比べる値はパケットから読んだまま（ネットワークバイトオーダー）なので htons しておく
+	const int	PASS = 23;	// 下の「通す」の位置
+	const bpf_insn	prog[] = {
+		/*  0 */ ins(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),							// r6 = ctx
+		/*  1 */ ins(BPF_LDX | BPF_W | BPF_MEM, 2, 6, offsetof(xdp_md, data), 0),		// r2 = data
+		/*  2 */ ins(BPF_LDX | BPF_W | BPF_MEM, 3, 6, offsetof(xdp_md, data_end), 0),	// r3 = data_end
+		/*  3 */ ins(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+		/*  4 */ ins(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, XDP_HEADROOM),
+		/*  5 */ ins(BPF_JMP | BPF_JGT | BPF_X, 4, 3, PASS - 6, 0),						// 短すぎる
+		/*  6 */ ins(BPF_LDX | BPF_H | BPF_MEM, 5, 2, offsetof(ethhdr, h_proto), 0),
+		/*  7 */ ins(BPF_JMP | BPF_JNE | BPF_K, 5, 0, PASS - 8, htons(ETH_P_IP)),
+		/*  8 */ ins(BPF_LDX | BPF_B | BPF_MEM, 5, 2, sizeof(ethhdr), 0),					// version / ihl
+		/*  9 */ ins(BPF_JMP | BPF_JNE | BPF_K, 5, 0, PASS - 10, 0x45),
+		/* 10 */ ins(BPF_LDX | BPF_B | BPF_MEM, 5, 2, sizeof(ethhdr) + offsetof(iphdr, protocol), 0),
+		/* 11 */ ins(BPF_JMP | BPF_JNE | BPF_K, 5, 0, PASS - 12, IPPROTO_UDP),
+		/* 12 */ ins(BPF_LDX | BPF_H | BPF_MEM, 5, 2, sizeof(ethhdr) + offsetof(iphdr, frag_off), 0),
+		/* 13 */ ins(BPF_ALU64 | BPF_AND | BPF_K, 5, 0, 0, htons(0x3FFF)),				// MF またはオフセットあり
+		/* 14 */ ins(BPF_JMP | BPF_JNE | BPF_K, 5, 0, PASS - 15, 0),
+		/* 15 */ ins(BPF_LDX | BPF_H | BPF_MEM, 5, 2, sizeof(ethhdr) + sizeof(iphdr) + offsetof(udphdr, dest), 0),
+		/* 16 */ ins(BPF_JMP | BPF_JNE | BPF_K, 5, 0, PASS - 17, local_port),
+		/* 17 */ ins(BPF_LDX | BPF_W | BPF_MEM, 2, 6, offsetof(xdp_md, rx_queue_index), 0),
+		/* 18 */ ins(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+		/* 19 */ ins(0, 0, 0, 0, 0),
+		/* 20 */ ins(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+		/* 21 */ ins(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+		/* 22 */ ins(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+		/* 23 */ ins(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),					// 通す
+		/* 24 */ ins(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+	};
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type	= BPF_PROG_TYPE_XDP;
+	attr.insns		= (uintptr_t)prog;
+	attr.insn_cnt	= sizeof(prog) / sizeof(prog[0]);
+	attr.license	= (uintptr_t)"GPL";
+	attr.log_buf	= (uintptr_t)log;
+	attr.log_size	= sizeof(log);
+	attr.log_level	= 1;
+	attr.expected_attach_type = BPF_XDP;
+	log[0] = '\0';
+	if ((prog_fd = sys_bpf(BPF_PROG_LOAD, attr)) < 0) {
+		perror("bpf(BPF_PROG_LOAD)");
+		print_error("xdp[%s]: couldn't load the XDP program\n", name.c_str());
+		pdebug("%s\n", log);
+		return false;
+	}
+
+	// auto はドライバの XDP を試し、だめなら汎用 XDP
+	for (const XDP_ATTACH a : { XDP_ATTACH_DRV, XDP_ATTACH_SKB }) {
+		if (conf.attach != XDP_ATTACH_AUTO && conf.attach != a) { continue; }
+
+		memset(&attr, 0, sizeof(attr));
+		attr.link_create.prog_fd		= prog_fd;
+		attr.link_create.target_ifindex	= ifindex;
+		attr.link_create.attach_type	= BPF_XDP;
+		attr.link_create.flags			= (a == XDP_ATTACH_DRV) ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+		if ((link_fd = sys_bpf(BPF_LINK_CREATE, attr)) >= 0) {
+			skb_mode = (a == XDP_ATTACH_SKB);
+			return true;
+		}
+		pdebug("xdp[%s]: %s XDP : %s\n", name.c_str(), (a == XDP_ATTACH_DRV) ? "native" : "generic", strerror(errno));
+	}
+	perror("bpf(BPF_LINK_CREATE)");
+	print_error("xdp[%s]: couldn't attach the XDP program (another program may be attached)\n", name.c_str());
+	return false;
+}
+
+// 次の転送先の MAC アドレスを近隣キャッシュから取り直す
+// わからない間は UDP ソケットで送るので、カーネルが ARP で解決してくれる（プローブも同じ相手に流れている）
+void xdp_port::_Resolve(uint64_t now) {
+	uint8_t		mac[6];
+	const bool	ok = arp_lookup(name, next_hop, mac);
+
+	if (ok) { memcpy(dst_mac, mac, sizeof(dst_mac)); }
+	if (ok != neigh_ok) {
+		pdebug("xdp[%s]: next hop %s %s\n", name.c_str(), inet_ntoa(next_hop), ok ? "resolved" : "is not resolved");
+	}
+	neigh_ok = ok;
+	neigh_check_ns = now + (ok ? XDP_NEIGH_REFRESH_NS : XDP_NEIGH_RETRY_NS);
+}
+
+// 送り終えたフレームを completion リングから回収する
+void xdp_port::_Reclaim() {
+	const uint32_t	prod = load_acquire(comp.producer);
+	uint32_t		cons = *comp.consumer;
+
+	if (cons == prod) { return; }
+	for (; cons != prod; cons++) {
+		tx_free.push_back(((const uint64_t*)comp.desc)[cons & comp.mask]);
+	}
+	store_release(comp.consumer, cons);
+}
+
+// UMEM の addr に Ethernet / IP / UDP のヘッダとペイロードを書く。MTU を超えるなら false（UDP ソケットに任せる）
+bool xdp_port::_Build(uint64_t addr, const msghdr& msg, uint32_t& frame_len, uint32_t& udp_len) {
+	const sockaddr_in	*dst = (const sockaddr_in*)msg.msg_name;
+	size_t	len = 0;
+
+	for (size_t i = 0; i < msg.msg_iovlen; i++) { len += msg.msg_iov[i].iov_len; }
+	if (sizeof(iphdr) + sizeof(udphdr) + len > mtu || XDP_HEADROOM + len > XDP_FRAME_SIZE) { return false; }
+
+	uint8_t	*p = umem + addr;
+	ethhdr	*eth = (ethhdr*)p;
+	iphdr	*ip = (iphdr*)(p + sizeof(ethhdr));
+	udphdr	*udp = (udphdr*)(p + sizeof(ethhdr) + sizeof(iphdr));
+	uint8_t	*payload = p + XDP_HEADROOM;
+
+	memcpy(eth->h_dest, dst_mac, ETH_ALEN);
+	memcpy(eth->h_source, src_mac, ETH_ALEN);
+	eth->h_proto	= htons(ETH_P_IP);
+
+	ip->version		= 4;
+	ip->ihl			= sizeof(iphdr) / 4;
+	ip->tos			= 0;
+	ip->tot_len		= htons(sizeof(iphdr) + sizeof(udphdr) + len);
+	ip->id			= htons(ip_id++);
+	ip->frag_off	= htons(0x4000);	// DF（カーネルの UDP ソケットと同じく経路 MTU 探索に任せる）
+	ip->ttl			= 64;
+	ip->protocol	= IPPROTO_UDP;
+	ip->check		= 0;
+	ip->saddr		= local_ip.s_addr;
+	ip->daddr		= dst->sin_addr.s_addr;
+	ip->check		= ip_checksum(ip, sizeof(iphdr));
+
+	// IPv4 の UDP はチェックサムを省ける（0）
+	udp->source		= local_port;
+	udp->dest		= dst->sin_port;
+	udp->len		= htons(sizeof(udphdr) + len);
+	udp->check		= 0;
+
+	for (size_t i = 0; i < msg.msg_iovlen; i++) {
+		memcpy(payload, msg.msg_iov[i].iov_base, msg.msg_iov[i].iov_len);
+		payload += msg.msg_iov[i].iov_len;
+	}
+	frame_len = XDP_HEADROOM + len;
+	udp_len = len;
+	return true;
+}
+
+int xdp_port::send(mmsghdr *msgs, int n, int& wake_errno) {
+	const uint64_t	now = monotonic_ns();
+	uint32_t		prod = *tx.producer;
+	int				sent = 0;
+	bool			queued = false;
+
+	if (now >= neigh_check_ns) { this->_Resolve(now); }
+	this->_Reclaim();
+
+	for (; sent < n; sent++) {
+		mmsghdr&	m = msgs[sent];
+
+		if (neigh_ok) {
+			if (tx_free.empty()) {
+				tx_ring_full++;
+				errno = ENOBUFS;
+				break;
+			}
+			uint32_t	frame_len;
+
+			if (this->_Build(tx_free.back(), m.msg_hdr, frame_len, m.msg_len)) {
+				xdp_desc&	d = ((xdp_desc*)tx.desc)[prod++ & tx.mask];
+
+				d.addr		= tx_free.back();
+				d.len		= frame_len;
+				d.options	= 0;
+				tx_free.pop_back();
+				tx_frames++;
+				queued = true;
+				continue;
+			}
+		}
+		// 宛先の MAC がまだわからない、または MTU を超える（カーネルならフラグメントにできる）
+		const ssize_t	w = sendmsg(sock_fd, &m.msg_hdr, MSG_DONTWAIT);
+
+		if (w < 0) { break; }
+		m.msg_len = w;
+		tx_via_sock++;
+	}
+	if (queued) {
+		const int	saved = errno;
+
+		store_release(tx.producer, prod);
+		// コピーモードでは sendto でカーネルに送らせる。ゼロコピーでもドライバが求めたときは起こす
+		if ((load_acquire(tx.flags) & XDP_RING_NEED_WAKEUP) && sendto(xsk, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0) {
+			// EAGAIN / EBUSY / ENOBUFS ならリングに残ったものは次に起こしたときに送られる
+			// 経路断でも積んだものは取り消せないので、送れた数は返してエラーは別に知らせる
+			if (is_path_error(errno)) { wake_errno = errno; }
+		}
+		errno = saved;
+	}
+	return (sent > 0) ? sent : -1;
+}
+
+// フレームの中の UDP ペイロード（TUN_HEADER から）を取り出す。XDP プログラムで形は確かめてあるが、長さは読み直す
+static void parse_frame(const uint8_t *p, uint32_t len, RX_FRAME& f) {
+	const iphdr		*ip = (const iphdr*)(p + sizeof(ethhdr));
+	const udphdr	*udp = (const udphdr*)(p + sizeof(ethhdr) + sizeof(iphdr));
+	const uint32_t	ip_len = ntohs(ip->tot_len);
+	const uint32_t	udp_len = ntohs(udp->len);
+
+	f.path_err = 0;
+	f.length = 0;
+	if (len < XDP_HEADROOM || sizeof(ethhdr) + ip_len > len || sizeof(iphdr) + udp_len > ip_len || udp_len < sizeof(udphdr)) {
+		pdebug("malformed XDP frame (%u bytes) - discarded\n", len);
+		return;
+	}
+	const uint32_t	plen = udp_len - sizeof(udphdr);
+
+	f.addr.sin_family		= AF_INET;
+	f.addr.sin_port			= udp->source;
+	f.addr.sin_addr.s_addr	= ip->saddr;
+	f.local.s_addr			= ip->daddr;
+	f.ifindex				= 0;	// XSK は経路ごとにある
+	memcpy(f.data, p + XDP_HEADROOM, (plen < sizeof(f.data)) ? plen : sizeof(f.data));
+	rx_check_frame(f, plen, plen > sizeof(f.data));
+}
+
+int xdp_port::recv(RX_FRAME* const *frames, int n) {
+	const uint32_t	prod = load_acquire(rx.producer);
+	uint32_t		cons = *rx.consumer;
+	uint32_t		fprod = *fill.producer;
+	int				got = 0;
+
+	if (cons != prod) {
+		const uint64_t	now = monotonic_ns();
+
+		// 受け取ったフレームはコピーしたらすぐ fill リングに戻す（受信用のフレームはすべて fill リングに収まる）
+		for (; cons != prod && got < n; cons++, got++) {
+			const xdp_desc&	d = ((const xdp_desc*)rx.desc)[cons & rx.mask];
+
+			frames[got]->rx_ns = now;
+			parse_frame(umem + d.addr, d.len, *frames[got]);
+			((uint64_t*)fill.desc)[fprod++ & fill.mask] = d.addr & ~(uint64_t)(XDP_FRAME_SIZE - 1);
+		}
+		store_release(rx.consumer, cons);
+		store_release(fill.producer, fprod);
+		rx_frames.fetch_add(got, std::memory_order_relaxed);
+	}
+	// fill リングが空になってドライバが止まっていれば起こす
+	if (load_acquire(fill.flags) & XDP_RING_NEED_WAKEUP) { recvfrom(xsk, NULL, 0, MSG_DONTWAIT, NULL, NULL); }
+	return got;
+}
@@ -0,0 +1,130 @@
+#ifndef	__XDP_H__
+#define	__XDP_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "mpudpdef.h"
+
+/*
+ * AF_XDP による経路の送受信（-X、クライアントのみ）
+ * 経路のデバイスに XDP プログラムを付け、経路の UDP ソケットのローカルポート宛ての IPv4/UDP フレームだけを
+ * AF_XDP ソケット（XSK）の UMEM に回す。それ以外（ARP、ICMP、プローブ、IP フラグメント、ほかのキューに来たもの）は
+ * そのままカーネルのスタックに流れる。送信は Ethernet / IP / UDP のヘッダを自分で組み立てて TX リングに積む。
+ * UDP ソケットは開いたままにしておく：ポートの確保、ICMP エラーの受け取り（IP_RECVERR）、
+ * 宛先の MAC アドレスがまだわからないときや MTU を超えるフレームの送信に使う。
+ *   mode   : auto（ゼロコピーを試してだめならコピー）/ copy / zerocopy
+ *   attach : auto / drv（ドライバの XDP）/ skb（汎用 XDP。ドライバが対応していないとき）
+ *   queue  : XSK をつなぐ受信キュー（ほかのキューに来たフレームはカーネル経由で UDP ソケットに届く）
+ * 例）-X mode=copy,attach=drv
+ * XDP プログラムは BPF リンクで付けるので、プロセスが終われば（kill されても）外れる（Linux 5.9 以降）。
+ */
+typedef enum _XDP_MODE {
+	XDP_MODE_AUTO,
+	XDP_MODE_COPY,
+	XDP_MODE_ZEROCOPY
+} XDP_MODE;
+
+typedef enum _XDP_ATTACH {
+	XDP_ATTACH_AUTO,
+	XDP_ATTACH_DRV,
+	XDP_ATTACH_SKB
+} XDP_ATTACH;
+
+typedef struct _XDP_CONFIG {
+	bool		enable;
+	XDP_MODE	mode;
+	XDP_ATTACH	attach;
+	uint32_t	queue;
+
+	_XDP_CONFIG();
+} XDP_CONFIG;
+
+bool xdp_parse_option(XDP_CONFIG& conf, char *subopts);
+
+// カーネルと共有するリング１本（producer / consumer はカーネルと取り合うので atomic に読み書きする）
+typedef struct _XDP_RING {
+	uint32_t	*producer;
+	uint32_t	*consumer;
+	uint32_t	*flags;
+	void		*desc;
+	void		*map;
+	size_t		map_len;
+	uint32_t	mask;
+} XDP_RING;
+
+struct _RX_FRAME;
+
+/*
+ * 経路１つ分の XSK
+ * UMEM の前半を受信（fill / rx リング）、後半を送信（tx / completion リング）に使う。
+ * recv は RX 側、send は TX 側のスレッドからだけ呼ぶ（触るリングが分かれているので、互いにロックは要らない）
+ */
+class xdp_port {
+private:
+	std::string	name;
+	int			ifindex;
+	int			xsk;
+	int			map_fd;
+	int			prog_fd;
+	int			link_fd;
+	int			sock_fd;	// 経路の UDP ソケット（送れないフレームはこちらで送る。閉じるのは持ち主）
+	bool		zerocopy;
+	bool		skb_mode;
+
+	uint8_t		*umem;
+	size_t		umem_len;
+	XDP_RING	fill, comp, rx, tx;
+
+	// 送信（TX スレッド専用）
+	std::vector<uint64_t>	tx_free;	// 空いている送信用フレームの UMEM 上の位置
+	uint8_t		src_mac[6];
+	uint8_t		dst_mac[6];
+	bool		neigh_ok;		// dst_mac がわかっている
+	uint64_t	neigh_check_ns;	// 次に近隣キャッシュを見直す時刻
+	in_addr		local_ip;
+	uint16_t	local_port;		// ネットワークバイトオーダー
+	in_addr		next_hop;
+	uint32_t	mtu;
+	uint16_t	ip_id;
+
+	bool _LoadProgram(const XDP_CONFIG& conf);
+	bool _OpenSocket(const XDP_CONFIG& conf);
+	bool _Bind(const XDP_CONFIG& conf, uint16_t flags);
+	void _Resolve(uint64_t now);
+	void _Reclaim();
+	bool _Build(uint64_t addr, const msghdr& msg, uint32_t& frame_len, uint32_t& udp_len);
+
+public:
+	// 統計
+	std::atomic<uint64_t>	rx_frames;	// XSK で受信したフレーム（RX が書く）
+	uint64_t	tx_frames;		// XSK で送信したフレーム
+	uint64_t	tx_via_sock;	// 宛先の MAC がわからない、MTU を超えるなどで UDP ソケットで送ったフレーム
+	uint64_t	tx_ring_full;	// 送信用のフレームが空いていなかった回数
+
+	xdp_port();
+	~xdp_port();
+	xdp_port(const xdp_port&) = delete;
+	xdp_port& operator=(const xdp_port&) = delete;
+
+	// eth_name に XDP プログラムを付けて XSK を開く。local は sock_fd の（getsockname した）アドレス、remote は相手
+	bool open(const XDP_CONFIG& conf, const std::string& eth_name, int sock_fd, const sockaddr_in& local, const sockaddr_in& remote);
+
+	inline int fd() const { return xsk; }
+	inline bool is_zerocopy() const { return zerocopy; }
+	inline bool is_skb_mode() const { return skb_mode; }
+
+	// RX：受信リングから最大 n フレームを読み、TUN_HEADER 以降を frames にコピーする。rx_recv_frames と同じ約束
+	int recv(struct _RX_FRAME* const *frames, int n);
+
+	// TX：sendmmsg と同じ約束（送れた数を返し、msg_len を埋める。１つも送れなければ -1 と errno）
+	// リングに積んだあとカーネルを起こせず、それが経路断を示すエラーなら wake_errno に入れる（積んだ数はそのまま返す）
+	int send(mmsghdr *msgs, int n, int& wake_errno);
+};
+
+#endif